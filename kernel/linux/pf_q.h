@@ -36,11 +36,13 @@
 #define Q_MAX_CPU               16
 #define Q_MAX_ID                64
 
-#define Q_MAX_DEVICE            256
-#define Q_MAX_DEVICE_MASK       (Q_MAX_DEVICE-1)
 #define Q_MAX_HW_QUEUE          64
 #define Q_MAX_HW_QUEUE_MASK     (Q_MAX_HW_QUEUE-1)
 
+#define Q_MAX_VLAN              4096
+#define Q_MAX_MPLS              256     /* distinct mpls labels */
+#define Q_MAX_CLASS_RULES       64
+
 
 #else  /* __PFQ_MODULE__ */ 
 
@@ -59,6 +61,7 @@ extern gro_result_t pfq_gro_receive(struct napi_struct *napi, struct sk_buff *sk
 #include <sys/time.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <linux/sockios.h>
 
 #endif /* __KERNEL__ */
 
@@ -71,10 +74,11 @@ struct pfq_hdr
     uint16_t    caplen;     /* number of bytes captured */
     uint16_t    len;        /* length of the packet (off wire) */
 
-    uint16_t    mark:15,    /* for future classification */
+    uint16_t    mark:14,    /* class (see pfq_class_rule) */
+                egress:1,   /* transmitted by the host */
                 commit:1;   /* release semantic */
 
-    uint8_t     if_index;   /* 256 devices */    
+    uint8_t     if_index;   /* low 8 bits of the ifindex */
     uint8_t     hw_queue;   /* 256 queues per device */
     union 
     {
@@ -87,18 +91,69 @@ struct pfq_hdr
 
 } __attribute__((packed));
 
+/* version 2 header (SO_HDR_VERSION): slots are cache-line aligned and the 
+   payload starts Q_HDR_V2_PAD bytes after the header, so that the ip header 
+   of an ethernet frame (captured from offset 0) is 4-byte aligned.
+
+   l3_off and l4_off are offsets in the captured payload, Q_HDR_NO_OFFSET 
+   when not available. */
+
+#define Q_HDR_V2_PAD          2
+#define Q_HDR_NO_OFFSET       0xff
+
+#define Q_HDR_F_VLAN          0x01    /* 802.1Q tagged (in frame or accelerated) */
+#define Q_HDR_F_IPV4          0x02
+#define Q_HDR_F_IPV6          0x04
+#define Q_HDR_F_TRUNC         0x08    /* caplen < len */
+#define Q_HDR_F_EGRESS        0x10    /* transmitted by the host */
+
+struct pfq_hdr_v2
+{
+    uint32_t    caplen;     /* number of bytes captured */
+    uint32_t    len;        /* length of the packet (off wire) */
+    uint32_t    if_index;
+    uint32_t    rxhash;     /* 0 if not computed by the device/stack */
+    uint64_t    tstamp;     /* nanoseconds */
+    uint16_t    hw_queue;
+    uint16_t    mark;       /* class (see pfq_class_rule) */
+    uint8_t     l3_off;
+    uint8_t     l4_off;
+    uint8_t     flags;      /* Q_HDR_F_xxx */
+    volatile uint8_t commit;   /* release semantic */
+
+} __attribute__((aligned(8)));
+
 /* 
     [pfq_queue_descr][ ... queue .... ][ ... queue ... ]
  */
 
+/* doorbell: before sleeping in Q_IOC_WAIT the consumer stores in doorbell 
+   the queue length it waits for, then checks the queue once more. The 
+   producer rings (wakes the consumer and resets the doorbell) when the 
+   queue reaches that length. Set by the consumer only, reset by both. */
+
 struct pfq_queue_descr
 {
     volatile int        data;
     volatile int        disabled;
     volatile int        poll_wait;
+    volatile int        doorbell;   /* 0 = consumer awake */
 } __attribute__((aligned(8)));
 
+/* offset of the first slot: version 1 keeps the slots right after the 
+   descriptor, as always; with version 2 it is a cache line, so that the 
+   64-byte slots are cache aligned. */
+
+#define Q_QUEUE_DESCR_SIZE(version) \
+    ((version) == 2 ? ((sizeof(struct pfq_queue_descr) + 63) & ~63UL) : sizeof(struct pfq_queue_descr))
+
+/* ioctl: wait for the doorbell. The argument is the timeout in microseconds
+   (negative = infinite). Returns the queue length, 0 on timeout. */
+
+#define Q_IOC_WAIT              (SIOCPROTOPRIVATE + 0)
+
 #define DBMP_QUEUE_SLOT_SIZE(x)    ALIGN(sizeof(struct pfq_hdr) + x, 8)
+#define DBMP_QUEUE_SLOT_SIZE_V2(x) ALIGN(sizeof(struct pfq_hdr_v2) + Q_HDR_V2_PAD + x, 64)
 #define DBMP_QUEUE_INDEX(data)     (((data) & 0x80000000UL) ? 1 : 0)
 #define DBMP_QUEUE_LEN(data)       ( (data) & 0x7fffffffUL)
 
@@ -112,6 +167,18 @@ struct pfq_queue_descr
 #define SO_CAPLEN               105
 #define SO_SLOTS                106
 #define SO_OFFSET               107
+#define SO_DEDUP                108     /* duplicate window (msec), 0 = disabled */
+#define SO_FLOW_TABLE           109     /* struct pfq_flow_opt */
+#define SO_ADD_VLAN             110     /* struct pfq_vlan_range */
+#define SO_REMOVE_VLAN          111
+#define SO_ADD_MPLS             112     /* int label */
+#define SO_REMOVE_MPLS          113
+#define SO_ADD_CLASS_RULE       114     /* struct pfq_class_rule */
+#define SO_REMOVE_CLASS_RULE    115
+#define SO_ADD_CLASS            116     /* int class */
+#define SO_REMOVE_CLASS         117
+#define SO_HDR_VERSION          118     /* 1 (default) or 2, before enabling the queue */
+#define SO_EGRESS_DEVICE        119     /* struct pfq_egress_dev */
 
 /* get socket options */
 #define SO_GET_ID               120
@@ -123,6 +190,9 @@ struct pfq_queue_descr
 #define SO_GET_CAPLEN           126
 #define SO_GET_SLOTS            127
 #define SO_GET_OFFSET           128
+#define SO_GET_DEDUP            129
+#define SO_GET_FLOW_MEM         130     /* size of the flow table area (bytes) */
+#define SO_GET_HDR_VERSION      131
 
 
 /* struct used for setsockopt */
@@ -139,11 +209,162 @@ struct pfq_dev_queue
     int hw_queue;
 };
 
+/* egress capture: packets transmitted by the host on the device 
+   (Q_ANY_DEVICE for all) are delivered with the egress flag set. */
+
+struct pfq_egress_dev
+{
+    long int if_index;
+    int enable;
+};
+
+/* vlan subscription: once a socket subscribes to a vlan it receives only 
+   the packets of its vlans (Q_VLAN_UNTAG stands for untagged packets). The 
+   same holds for mpls labels (the top label of the stack is matched). */
+
+#define Q_VLAN_UNTAG          0
+
+struct pfq_vlan_range
+{
+    int first;
+    int last;
+};
+
+/* classification: rules are evaluated in order of registration and the
+   first match assigns the class, written into pfq_hdr.mark (0 = no match).
+   A rule is owned by the socket that registered it. Once a socket
+   subscribes to a class it receives only the packets of its classes. */
+
+#define Q_MAX_CLASS           256
+#define Q_CLASS_NONE          0
+#define Q_CLASS_ANY          -1     /* wildcard for proto and ports */
+
+struct pfq_class_rule
+{
+    int class_id;       /* 1 .. Q_MAX_CLASS-1 */
+    int proto;          /* ip protocol (IPPROTO_UDP...) */
+    int port_first;     /* source or destination port in [first,last] */
+    int port_last;
+};
+
 struct pfq_stats
 {
     unsigned long int recv;   // received by the queue    
     unsigned long int lost;   // queue is full, packet lost...
     unsigned long int drop;   // by filter
+    unsigned long int dupl;   // duplicate, suppressed by dedup
 };
 
+
+/* flow accounting 
+
+   The flow table is mapped read-only at offset Q_FLOW_MMAP_OFFSET:
+
+   [pfq_flow_descr][shard 0][shard 1]...[shard n-1]
+
+   shard: [pfq_flow_shard][ table: slots x pfq_flow ][ export ring: ring_slots x pfq_flow ]
+
+   Each shard is updated by a single cpu. A record is stable when its seq
+   is even and did not change while reading it. An exported record at
+   ring position i is valid when its seq equals Q_FLOW_RING_SEQ(i).
+ */
+
+#define Q_FLOW_MMAP_OFFSET      (1ULL << 40)
+
+#define Q_FLOW_RING_SEQ(i)      ((uint32_t)((i) << 1) + 2)
+
+struct pfq_flow_opt
+{
+    unsigned int slots;         /* table slots per shard (power of two) */
+    unsigned int ring_slots;    /* export ring slots per shard (power of two) */
+    unsigned int timeout;       /* idle timeout (msec) */
+    int          capture;       /* 0 = account only, do not copy packets into the queue */
+};
+
+struct pfq_flow
+{
+    volatile uint32_t seq;      /* odd while the record is updated */
+    uint8_t     proto;
+    uint8_t     tcp_flags;      /* OR of the tcp flags seen */
+    uint16_t    version;        /* 4 or 6, 0 = free slot */
+    uint32_t    saddr[4];       /* ipv4 addresses are stored in saddr[0], daddr[0] */
+    uint32_t    daddr[4];
+    uint16_t    sport;          /* network byte order */
+    uint16_t    dport;
+    uint32_t    hash;
+    uint64_t    packets;
+    uint64_t    bytes;
+    uint64_t    first;          /* nanoseconds */
+    uint64_t    last;
+} __attribute__((aligned(8)));
+
+struct pfq_flow_shard
+{
+    volatile uint64_t   head;       /* export ring: records exported so far */
+    volatile uint64_t   evicted;    /* flows exported before their timeout (table full) */
+} __attribute__((aligned(64)));
+
+struct pfq_flow_descr
+{
+    uint32_t    shards;
+    uint32_t    slots;
+    uint32_t    ring_slots;
+    uint32_t    timeout;            /* msec */
+    uint64_t    shard_size;         /* bytes */
+} __attribute__((aligned(64)));
+
+#define Q_FLOW_SHARD(descr, n)      ((struct pfq_flow_shard *)((char *)((descr)+1) + (n) * (descr)->shard_size))
+#define Q_FLOW_TABLE(descr, n)      ((struct pfq_flow *)(Q_FLOW_SHARD(descr, n) + 1))
+#define Q_FLOW_RING(descr, n)       (Q_FLOW_TABLE(descr, n) + (descr)->slots)
+
+/* generic netlink control plane (family Q_GENL_NAME, CAP_NET_ADMIN)
+
+   Q_CMD_APPLY replaces atomically the bindings of the sockets listed in
+   Q_ATTR_SOCKETS: their previous subscriptions are dropped and the ones in
+   Q_ATTR_BINDINGS are installed, so that the receive path sees either the
+   old or the new configuration. Sockets whose bit is set in Q_ATTR_BALANCE
+   join the load balancing, the others leave it.
+
+   Q_CMD_DUMP replies with the sockets in use, the balancing mask and the
+   bindings, one Q_ATTR_BINDING per subscription (Q_BIND_MASK = sockets).
+ */
+
+#define Q_GENL_NAME             "PFQ"
+#define Q_GENL_VERSION          1
+
+enum
+{
+    Q_CMD_UNSPEC,
+    Q_CMD_APPLY,
+    Q_CMD_DUMP,
+    __Q_CMD_MAX
+};
+
+enum
+{
+    Q_ATTR_UNSPEC,
+    Q_ATTR_SOCKETS,             /* u64: bit mask of socket ids */
+    Q_ATTR_BALANCE,             /* u64: bit mask of socket ids */
+    Q_ATTR_BINDINGS,            /* nested: list of Q_ATTR_BINDING */
+    Q_ATTR_BINDING,             /* nested: Q_BIND_* */
+    Q_ATTR_PAD,                 /* alignment of the u64 attributes */
+    __Q_ATTR_MAX
+};
+
+#define Q_ATTR_MAX              (__Q_ATTR_MAX - 1)
+
+enum
+{
+    Q_BIND_UNSPEC,
+    Q_BIND_ID,                  /* u32: socket id (apply) */
+    Q_BIND_IFINDEX,             /* s32: ifindex or Q_ANY_DEVICE */
+    Q_BIND_QUEUE,               /* s32: hw queue or Q_ANY_QUEUE */
+    Q_BIND_EGRESS,              /* flag: egress binding (any queue) */
+    Q_BIND_MASK,                /* u64: bit mask of socket ids (dump) */
+    Q_BIND_PAD,                 /* alignment of the u64 attributes */
+    __Q_BIND_MAX
+};
+
+#define Q_BIND_MAX              (__Q_BIND_MAX - 1)
+
 #endif /* _PF_Q_H_ */
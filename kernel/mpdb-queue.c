@@ -22,6 +22,12 @@
  *
  ****************************************************************/
 
+#include <linux/version.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+
 #include <mpdb-queue.h>
 
 void *
@@ -65,6 +71,93 @@ mpdb_queue_free(struct pfq_opt *pq)
 }    
 
 
+static inline uint32_t
+mpdb_skb_rxhash(const struct sk_buff *skb)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+        return skb->hash;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+        return skb->rxhash;
+#else
+        return 0;
+#endif
+}
+
+
+static inline uint8_t
+mpdb_offset(int off, size_t q_offset)
+{
+        off -= (int)q_offset;
+        return (off >= 0 && off < Q_HDR_NO_OFFSET) ? off : Q_HDR_NO_OFFSET;
+}
+
+
+/* offsets are relative to the mac header */
+
+static void
+mpdb_set_layers(struct pfq_hdr_v2 *hdr, const struct sk_buff *skb, size_t q_offset)
+{
+        int mac = skb_mac_header(skb) - skb->data;
+        int l3  = skb_network_header(skb) - skb_mac_header(skb), l4 = -1;
+        __be16 proto = skb->protocol;
+        uint8_t flags = 0;
+
+        if (vlan_tx_tag_present(skb))
+                flags |= Q_HDR_F_VLAN;
+
+        if (proto == __constant_htons(ETH_P_8021Q))
+        {
+                struct vlan_hdr _vh, *vh;
+                vh = skb_header_pointer(skb, mac + l3, sizeof(_vh), &_vh);
+                if (vh) {
+                        proto  = vh->h_vlan_encapsulated_proto;
+                        l3    += VLAN_HLEN;
+                        flags |= Q_HDR_F_VLAN;
+                }
+        }
+
+        switch(proto)
+        {
+        case __constant_htons(ETH_P_IP): 
+            {
+                    uint8_t _vihl, *vihl;
+                    vihl = skb_header_pointer(skb, mac + l3, sizeof(_vihl), &_vihl);
+                    if (vihl && (*vihl & 0xf) >= 5)
+                            l4 = l3 + ((*vihl & 0xf) << 2);
+                    flags |= Q_HDR_F_IPV4;
+            } break;
+        case __constant_htons(ETH_P_IPV6): 
+            {
+                    l4 = l3 + sizeof(struct ipv6hdr);   /* extension headers are not followed */
+                    flags |= Q_HDR_F_IPV6;
+            } break;
+        default:
+                l3 = -1;
+        }
+
+        hdr->l3_off = l3 < 0 ? Q_HDR_NO_OFFSET : mpdb_offset(l3, q_offset);
+        hdr->l4_off = l4 < 0 ? Q_HDR_NO_OFFSET : mpdb_offset(l4, q_offset);
+        hdr->flags  = flags | (hdr->caplen < hdr->len ? Q_HDR_F_TRUNC : 0);
+}
+
+
+/* wake the consumer waiting for the doorbell: atomic_add_return on data 
+ * is a full barrier, paired with the one of the consumer between its store 
+ * to doorbell and its last check of the queue. */
+
+static inline void
+mpdb_doorbell(struct pfq_opt *pq, struct pfq_queue_descr *queue_descr, int q_len)
+{
+        int door = queue_descr->doorbell;
+
+        if (likely(door == 0) || q_len < door)
+                return;
+
+        if (atomic_cmpxchg((atomic_t *)&queue_descr->doorbell, door, 0) == door)
+                wake_up_interruptible(&pq->q_waitqueue);
+}
+
+
 bool 
 mpdb_enqueue(struct pfq_opt *pq, struct sk_buff *skb)
 {
@@ -72,8 +165,11 @@ mpdb_enqueue(struct pfq_opt *pq, struct sk_buff *skb)
 
         if (!atomic_read((atomic_t *)&queue_descr->disabled))  
         {
-                size_t packet_len = skb->len + skb->mac_len;
+                /* offset of the mac header: negative on receive, 0 on transmit */
+                int    mac = skb_mac_header(skb) - skb->data;
+                size_t packet_len = skb->len - mac;
                 size_t bytes = (packet_len > pq->q_offset) ? min(packet_len - pq->q_offset, pq->q_caplen) : 0;
+                int    hw_queue = PFQ_CB(skb)->egress ? skb_get_queue_mapping(skb) : skb_get_rx_queue(skb);
 
                 int  data    = atomic_add_return(1, (atomic_t *)&queue_descr->data);
                 int  q_len   = DBMP_QUEUE_LEN(data);
@@ -83,37 +179,72 @@ mpdb_enqueue(struct pfq_opt *pq, struct sk_buff *skb)
                 {
                         /* enqueue skb */
 
-                        struct pfq_hdr *p_hdr = (struct pfq_hdr *)((char *)(queue_descr+1) + q_index * pq->q_slot_size * pq->q_slots 
-                                        + (q_len-1) * pq->q_slot_size);
+                        char *p_slot = (char *)queue_descr + Q_QUEUE_DESCR_SIZE(pq->q_hdr_version) + q_index * pq->q_slot_size * pq->q_slots 
+                                        + (q_len-1) * pq->q_slot_size;
+
+                        if (pq->q_hdr_version == 2)
+                        {
+                                struct pfq_hdr_v2 *p_hdr = (struct pfq_hdr_v2 *)p_slot;
 
-                        char *p_pkt = (char *)(p_hdr+1);
+                                char *p_pkt = (char *)(p_hdr+1) + Q_HDR_V2_PAD;
 
-                        /* copy bytes of packet */
+                                if (bytes && skb_copy_bits(skb, pq->q_offset + mac, p_pkt, bytes) != 0)
+                                {    
+                                        return false;
+                                }
 
-                        if (bytes && skb_copy_bits(skb, pq->q_offset - skb->mac_len, p_pkt, bytes) != 0)
-                        {    
-                                return false;
-                        }
+                                p_hdr->len      = packet_len;
+                                p_hdr->caplen   = bytes;
+                                p_hdr->if_index = skb->dev->ifindex;
+                                p_hdr->rxhash   = mpdb_skb_rxhash(skb);
+                                p_hdr->hw_queue = hw_queue;
+                                p_hdr->mark     = PFQ_CB(skb)->mark;
+                                p_hdr->tstamp   = pq->q_tstamp ? ktime_to_ns(skb->tstamp) : 0;
 
-                        /* setup the header */
+                                mpdb_set_layers(p_hdr, skb, pq->q_offset);
 
-                        p_hdr->len      = packet_len;
-                        p_hdr->caplen   = bytes;
-                        p_hdr->if_index = skb->dev->ifindex;
-                        p_hdr->hw_queue = skb_get_rx_queue(skb);                      
+                                if (PFQ_CB(skb)->egress)
+                                        p_hdr->flags |= Q_HDR_F_EGRESS;
 
-                        if (pq->q_tstamp != 0)
-                        {
-                                struct timespec ts;
-                                skb_get_timestampns(skb, &ts); 
-                                p_hdr->tstamp.tv.sec  = ts.tv_sec;
-                                p_hdr->tstamp.tv.nsec = ts.tv_nsec;
+                                smp_wmb();
+
+                                p_hdr->commit = 1;
                         }
+                        else
+                        {
+                                struct pfq_hdr *p_hdr = (struct pfq_hdr *)p_slot;
+
+                                char *p_pkt = (char *)(p_hdr+1);
+
+                                /* copy bytes of packet */
+
+                                if (bytes && skb_copy_bits(skb, pq->q_offset + mac, p_pkt, bytes) != 0)
+                                {    
+                                        return false;
+                                }
+
+                                /* setup the header */
 
-                        /* commit the slot with release semantic */
-                        smp_wmb();
+                                p_hdr->len      = packet_len;
+                                p_hdr->caplen   = bytes;
+                                p_hdr->if_index = skb->dev->ifindex;
+                                p_hdr->hw_queue = hw_queue;
+                                p_hdr->mark     = PFQ_CB(skb)->mark;
+                                p_hdr->egress   = PFQ_CB(skb)->egress;
 
-                        p_hdr->commit = 1;
+                                if (pq->q_tstamp != 0)
+                                {
+                                        struct timespec ts;
+                                        skb_get_timestampns(skb, &ts); 
+                                        p_hdr->tstamp.tv.sec  = ts.tv_sec;
+                                        p_hdr->tstamp.tv.nsec = ts.tv_nsec;
+                                }
+
+                                /* commit the slot with release semantic */
+                                smp_wmb();
+
+                                p_hdr->commit = 1;
+                        }
 
                         /* watermark */
 
@@ -121,6 +252,9 @@ mpdb_enqueue(struct pfq_opt *pq, struct sk_buff *skb)
                                         && queue_descr->poll_wait ) {
                                 wake_up_interruptible(&pq->q_waitqueue);
                         }
+                        else {
+                                mpdb_doorbell(pq, queue_descr, q_len);
+                        }
 
                         return true;
                 }
@@ -128,6 +262,9 @@ mpdb_enqueue(struct pfq_opt *pq, struct sk_buff *skb)
                 {
                         atomic_set((atomic_t *)&queue_descr->disabled,1);
                 }
+
+                /* the queue is full */
+                mpdb_doorbell(pq, queue_descr, q_len);
         }
 
         if ( queue_descr->poll_wait ) {
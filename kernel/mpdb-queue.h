@@ -55,11 +55,20 @@ mpdb_queue_index(struct pfq_opt *p)
 }
 
 
+static inline
+size_t
+mpdb_slot_size(const struct pfq_opt *pq)
+{
+    return pq->q_hdr_version == 2 ? DBMP_QUEUE_SLOT_SIZE_V2(pq->q_caplen) 
+                                  : DBMP_QUEUE_SLOT_SIZE(pq->q_caplen);
+}
+
+
 static inline
 size_t
 mpdb_queue_size(struct pfq_opt *pq)
 {
-    return sizeof(struct pfq_queue_descr) + pq->q_slot_size * pq->q_slots * 2; 
+    return Q_QUEUE_DESCR_SIZE(pq->q_hdr_version) + pq->q_slot_size * pq->q_slots * 2; 
 }
 
 #endif /* _MPDB_QUEUE_H_ */
@@ -28,10 +28,16 @@
 #include <linux/kernel.h>
 #include <linux/skbuff.h>
 
+/* intrusive multi-producer single-consumer queue (D. Vyukov), linked 
+ * through skb->next. Producers are wait-free, the consumer is lock-free: 
+ * pop may return NULL while a producer is in the middle of a push. 
+ */
+
 typedef struct mpsc_queue
 {
-    atomic_long_t       head;
-    struct sk_buff *    tail;
+    atomic_long_t       head;       /* last pushed (producers) */
+    struct sk_buff *    tail;       /* next to pop (consumer)  */
+    struct sk_buff *    stub;
 
 } mpsc_queue_t;
 
@@ -45,29 +51,15 @@ int mpsc_queue_ctor(mpsc_queue_t * self)
         stub->next = 0;
         atomic_long_set(&self->head, (long)stub);
         self->tail = stub;
+        self->stub = stub;
     }
     else {
-        printk(KERN_WARNING "[PFQ] mpsc_skbuff_queue_ctor: memory problem!\n");
+        printk(KERN_WARNING "[PF_Q] mpsc_skbuff_queue_ctor: memory problem!\n");
         return -ENOMEM;
     }   
     return 0;
 };
 
-static inline 
-void mpsc_queue_dtor(mpsc_queue_t *self)
-{
-    struct sk_buff * skb = self->tail;
-    while(skb != NULL)
-    {
-        struct sk_buff * next = skb->next;
-        kfree_skb(skb);
-        skb = next;
-    } 
-
-    atomic_long_set(&self->head, (long)0);
-    self->tail = (struct sk_buff *)0;  
-}
-
 
 static inline 
 void mpsc_queue_push(mpsc_queue_t *self, struct sk_buff *skb)
@@ -77,31 +69,76 @@ void mpsc_queue_push(mpsc_queue_t *self, struct sk_buff *skb)
     skb->next = 0;
     prev = (struct sk_buff *) atomic_long_xchg(&self->head, (long)skb);
     prev->next = skb;
-    
 }
 
+
 static inline 
 struct sk_buff * mpsc_queue_pop(mpsc_queue_t *self)
 {
     struct sk_buff * tail = self->tail;
     struct sk_buff * next = tail->next;
 
+    if (tail == self->stub)
+    {
+        if (next == NULL)
+            return NULL;
+
+        self->tail = next;
+        tail = next;
+        next = next->next;
+    }
+
+    if (next)
+    {
+        self->tail = next;
+        tail->next = NULL;
+        return tail;
+    }
+
+    /* a producer is linking a new skb */
+
+    if (tail != (struct sk_buff *)atomic_long_read(&self->head))
+        return NULL;
+
+    mpsc_queue_push(self, self->stub);
+
+    next = tail->next;
     if (next)
     {
         self->tail = next;
-        tail->prev = next;   // data in this case is the skb itself: tail->data = next->data;
+        tail->next = NULL;
         return tail;
     }
 
     return NULL;
 }
 
+
+/* consumer side: false when a push is in progress */
+
 static inline 
-const struct sk_buff * mpsc_queue_next(mpsc_queue_t *self)
+bool mpsc_queue_empty(mpsc_queue_t *self)
 {
-    if (self->tail)
-        return self->tail->next;
-    return NULL;
+    return self->tail == self->stub && 
+           (struct sk_buff *)atomic_long_read(&self->head) == self->stub;
+}
+
+
+static inline 
+void mpsc_queue_dtor(mpsc_queue_t *self)
+{
+    struct sk_buff * skb;
+
+    while((skb = mpsc_queue_pop(self)) != NULL)
+    {
+        kfree_skb(skb);
+    } 
+
+    kfree_skb(self->stub);
+
+    atomic_long_set(&self->head, (long)0);
+    self->tail = (struct sk_buff *)0;  
+    self->stub = (struct sk_buff *)0;  
 }
 
 
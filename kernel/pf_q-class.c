@@ -0,0 +1,373 @@
+/***************************************************************
+ *                                                
+ * (C) 2011-12 Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/semaphore.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/in.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+
+#include <pf_q-class.h>
+#include <pf_q-devmap.h>
+
+
+MODULE_LICENSE("GPL");
+
+
+/* the rule set is immutable: updates (under global_sem) publish a new copy */
+
+struct pfq_class_rules
+{
+        struct rcu_head         rcu;
+        int                     count;
+        struct 
+        {
+                struct pfq_class_rule rule;
+                unsigned int          owner;
+        } entry[Q_MAX_CLASS_RULES];
+};
+
+
+static struct pfq_class_rules * pfq_rules;
+
+
+static void
+pfq_class_rules_free_rcu(struct rcu_head *head)
+{
+        kfree(container_of(head, struct pfq_class_rules, rcu));
+}
+
+
+static void
+pfq_class_rules_publish(struct pfq_class_rules *rules)
+{
+        struct pfq_class_rules *old = pfq_rules;
+
+        if (rules && rules->count == 0)
+        {
+                kfree(rules);
+                rules = NULL;
+        }
+
+        rcu_assign_pointer(pfq_rules, rules);
+        global.class_rules = rules ? rules->count : 0;
+
+        if (old)
+                call_rcu(&old->rcu, pfq_class_rules_free_rcu);
+}
+
+
+static struct pfq_class_rules *
+pfq_class_rules_copy(void)
+{
+        struct pfq_class_rules *rules = kzalloc(sizeof(struct pfq_class_rules), GFP_KERNEL);
+        if (rules && pfq_rules)
+        {
+                memcpy(rules->entry, pfq_rules->entry, sizeof(rules->entry));
+                rules->count = pfq_rules->count;
+        }
+        return rules;
+}
+
+
+static inline bool
+pfq_class_rule_equal(const struct pfq_class_rule *a, const struct pfq_class_rule *b)
+{
+        return  a->class_id   == b->class_id   &&
+                a->proto      == b->proto      &&
+                a->port_first == b->port_first &&
+                a->port_last  == b->port_last;
+}
+
+
+int 
+pfq_class_rule_add(const struct pfq_class_rule *rule, unsigned int id)
+{
+        struct pfq_class_rules *rules;
+        int n, ret = 0;
+
+        down(&global_sem);
+
+        if (pfq_rules)
+        {
+                for(n = 0; n < pfq_rules->count; n++)
+                {
+                        if (pfq_rules->entry[n].owner == id && 
+                            pfq_class_rule_equal(&pfq_rules->entry[n].rule, rule))
+                        {
+                                ret = -EEXIST;
+                                goto out;
+                        }
+                }
+
+                if (pfq_rules->count == Q_MAX_CLASS_RULES)
+                {
+                        ret = -ENOSPC;
+                        goto out;
+                }
+        }
+
+        rules = pfq_class_rules_copy();
+        if (rules == NULL)
+        {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        rules->entry[rules->count].rule  = *rule;
+        rules->entry[rules->count].owner = id;
+        rules->count++;
+
+        pfq_class_rules_publish(rules);
+out:
+        up(&global_sem);
+        return ret;
+}
+
+
+int 
+pfq_class_rule_remove(const struct pfq_class_rule *rule, unsigned int id)
+{
+        struct pfq_class_rules *rules;
+        int n, i = 0, ret = 0;
+
+        down(&global_sem);
+
+        if (pfq_rules == NULL)
+        {
+                ret = rule ? -ENOENT : 0;
+                goto out;
+        }
+
+        rules = kzalloc(sizeof(struct pfq_class_rules), GFP_KERNEL);
+        if (rules == NULL)
+        {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        /* preserve the order of the remaining rules */
+
+        for(n = 0; n < pfq_rules->count; n++)
+        {
+                if (pfq_rules->entry[n].owner == id && 
+                    (rule == NULL || pfq_class_rule_equal(&pfq_rules->entry[n].rule, rule)))
+                        continue;
+
+                rules->entry[i++] = pfq_rules->entry[n];
+        }
+        rules->count = i;
+
+        if (i == pfq_rules->count)
+        {
+                kfree(rules);
+                ret = rule ? -ENOENT : 0;
+                goto out;
+        }
+
+        pfq_class_rules_publish(rules);
+out:
+        up(&global_sem);
+        return ret;
+}
+
+
+static void 
+pfq_classmap_filter_update(void)
+{
+        unsigned long val = 0;
+        int i;
+        for(i=0; i < Q_MAX_CLASS; ++i)
+        {
+                val |= global.classmap[i];
+        }
+        global.classmap_filter = val;
+}
+
+
+int 
+pfq_classmap_update(int action, int class_id, unsigned int id)
+{
+        int n = 0, c;
+
+        if (unlikely(id >= 64))
+        {
+                printk(KERN_WARNING "[PF_Q] classmap_update: bad id(%u)\n",id);
+                return 0; 
+        }
+
+        down(&global_sem);
+
+        for(c = 0; c < Q_MAX_CLASS; ++c)
+        {
+                if (class_id != Q_CLASS_ANY && class_id != c)
+                        continue;
+
+                if (action == map_set) 
+                {
+                        global.classmap[c] |= (1UL<<id), n++;
+                        continue;
+                }
+
+                if (global.classmap[c] & (1UL<<id))
+                {
+                        global.classmap[c] &= ~(1UL<<id), n++;
+                }
+        }
+
+        pfq_classmap_filter_update();
+
+        up(&global_sem);
+        return n;
+}
+
+
+/* protocol and ports (host byte order), -1 when not available */
+
+static void
+pfq_class_parse(const struct sk_buff *skb, int *proto, int *sport, int *dport)
+{
+        int offset = skb_network_offset(skb);
+        __be16 eth_type = skb->protocol;
+        __be16 _ports[2], *ports;
+
+        *proto = *sport = *dport = -1;
+
+        if (eth_type == __constant_htons(ETH_P_8021Q))
+        {
+                struct vlan_hdr _vh, *vh;
+                vh = skb_header_pointer(skb, offset, sizeof(_vh), &_vh);
+                if (vh == NULL)
+                        return;
+
+                eth_type = vh->h_vlan_encapsulated_proto;
+                offset  += VLAN_HLEN;
+        }
+
+        switch(eth_type)
+        {
+        case __constant_htons(ETH_P_IP): 
+            {
+                    struct iphdr _ip, *ip;
+                    ip = skb_header_pointer(skb, offset, sizeof(_ip), &_ip);
+                    if (ip == NULL || ip->ihl < 5)
+                            return;
+
+                    *proto = ip->protocol;
+
+                    if (ip->frag_off & __constant_htons(IP_OFFSET))
+                            return;
+
+                    offset += ip->ihl << 2;
+            } break;
+
+        case __constant_htons(ETH_P_IPV6): 
+            {
+                    struct ipv6hdr _ip6, *ip6;
+                    ip6 = skb_header_pointer(skb, offset, sizeof(_ip6), &_ip6);
+                    if (ip6 == NULL)
+                            return;
+
+                    *proto  = ip6->nexthdr;     /* extension headers are not followed */
+                    offset += sizeof(struct ipv6hdr);
+            } break;
+
+        default: 
+                return;
+        }
+
+        switch(*proto)
+        {
+        case IPPROTO_TCP: 
+        case IPPROTO_UDP: 
+        case IPPROTO_SCTP: 
+                ports = skb_header_pointer(skb, offset, sizeof(_ports), _ports);
+                if (ports) {
+                        *sport = ntohs(ports[0]);
+                        *dport = ntohs(ports[1]);
+                }
+                break;
+        }
+}
+
+
+static inline bool
+pfq_class_port_match(const struct pfq_class_rule *r, int port)
+{
+        return port >= r->port_first && port <= r->port_last;
+}
+
+
+uint16_t 
+pfq_classify(const struct sk_buff *skb)
+{
+        struct pfq_class_rules *rules;
+        uint16_t class_id = Q_CLASS_NONE;
+        int proto, sport, dport, n;
+
+        pfq_class_parse(skb, &proto, &sport, &dport);
+
+        rcu_read_lock();
+
+        rules = rcu_dereference(pfq_rules);
+        if (rules)
+        {
+                for(n = 0; n < rules->count; n++)
+                {
+                        const struct pfq_class_rule *r = &rules->entry[n].rule;
+
+                        if (r->proto != Q_CLASS_ANY && r->proto != proto)
+                                continue;
+
+                        if (r->port_first != Q_CLASS_ANY && 
+                            !pfq_class_port_match(r, sport) && !pfq_class_port_match(r, dport))
+                                continue;
+
+                        class_id = r->class_id;
+                        break;
+                }
+        }
+
+        rcu_read_unlock();
+        return class_id;
+}
+
+
+void
+pfq_class_free(void)
+{
+        down(&global_sem);
+
+        pfq_class_rules_publish(NULL);
+
+        up(&global_sem);
+
+        rcu_barrier();
+}
@@ -0,0 +1,68 @@
+/***************************************************************
+ *                                                
+ * (C) 2011-12 Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#ifndef _PF_Q_CLASS_H_
+#define _PF_Q_CLASS_H_ 
+
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+
+#define __PFQ_MODULE__
+#include <linux/pf_q.h>
+
+#include <pf_q-global.h>
+
+
+extern int pfq_class_rule_add(const struct pfq_class_rule *rule, unsigned int id);
+extern int pfq_class_rule_remove(const struct pfq_class_rule *rule, unsigned int id);   /* NULL: all the rules of id */
+
+extern int pfq_classmap_update(int action, int class_id, unsigned int id);             /* Q_CLASS_ANY: all the classes */
+
+extern uint16_t pfq_classify(const struct sk_buff *skb);
+
+extern void pfq_class_free(void);
+
+
+static inline
+uint16_t pfq_class_get(const struct sk_buff *skb)
+{
+    if (likely(global.class_rules == 0))
+        return Q_CLASS_NONE;
+    return pfq_classify(skb);
+}
+
+
+/* drop from bm the sockets subscribed to other classes */
+
+static inline
+unsigned long pfq_classmap_filter(unsigned long bm, uint16_t class_id)
+{
+    unsigned long filter = global.classmap_filter;
+    if (likely((bm & filter) == 0))
+        return bm;
+    return (bm & ~filter) | (bm & global.classmap[class_id]);
+}
+
+#endif /* _PF_Q_CLASS_H_ */
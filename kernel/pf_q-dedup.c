@@ -0,0 +1,127 @@
+/***************************************************************
+ *                                                
+ * (C) 2011-12 Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/jhash.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+
+#include <pf_q-dedup.h>
+
+
+MODULE_LICENSE("GPL");
+
+
+/* number of bytes (past the network header) that make the digest */
+
+#define Q_DEDUP_BYTES   96
+
+
+struct pfq_dedup * 
+pfq_dedup_alloc(unsigned int slots)
+{
+        struct pfq_dedup *dd;
+        size_t size;
+
+        slots = roundup_pow_of_two(slots ? slots : 1);
+        size  = sizeof(struct pfq_dedup) + slots * sizeof(uint64_t);
+
+        dd = vmalloc(size);
+        if (dd == NULL)
+        {
+                printk(KERN_WARNING "[PF_Q] dedup: out of memory (%zu bytes)\n", size);
+                return NULL;
+        }
+
+        memset(dd, 0, size);
+        dd->mask = slots - 1;
+        return dd;
+}
+
+
+void
+pfq_dedup_free(struct pfq_dedup *dd)
+{
+        vfree(dd);
+}
+
+
+/* The digest covers the network header and the first bytes of the payload,
+ * ignoring the fields rewritten hop by hop (TTL/hop limit and IPv4 checksum), 
+ * so that copies of the same packet mirrored at different points of the
+ * path are recognized as duplicates. Returns false if the packet is too short.
+ */
+
+bool
+pfq_dedup_digest(const struct sk_buff *skb, uint32_t *digest)
+{
+        uint32_t buff[Q_DEDUP_BYTES/sizeof(uint32_t)];
+        int offset = skb_network_offset(skb);
+        __be16 proto = skb->protocol;
+        int len;
+
+        if (proto == __constant_htons(ETH_P_8021Q))
+        {
+                struct vlan_hdr _vh, *vh;
+                vh = skb_header_pointer(skb, offset, sizeof(_vh), &_vh);
+                if (vh == NULL)
+                        return false;
+
+                proto   = vh->h_vlan_encapsulated_proto;
+                offset += VLAN_HLEN;
+        }
+
+        len = min_t(int, (int)skb->len - offset, sizeof(buff));
+        if (len <= 0 || skb_copy_bits(skb, offset, buff, len) < 0)
+                return false;
+
+        switch(proto)
+        {
+        case __constant_htons(ETH_P_IP): 
+            {
+                    struct iphdr *ip = (struct iphdr *)buff;
+                    if (len < sizeof(struct iphdr))
+                            break;
+                    ip->ttl   = 0;
+                    ip->check = 0;
+            } break;
+
+        case __constant_htons(ETH_P_IPV6): 
+            {
+                    struct ipv6hdr *ip6 = (struct ipv6hdr *)buff;
+                    if (len < sizeof(struct ipv6hdr))
+                            break;
+                    ip6->hop_limit = 0;
+            } break;
+        }
+
+        *digest = jhash(buff, len, skb->len - offset);
+        return true;
+}
@@ -0,0 +1,77 @@
+/***************************************************************
+ *                                                
+ * (C) 2011-12 Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#ifndef _PF_Q_DEDUP_H_
+#define _PF_Q_DEDUP_H_ 
+
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/jiffies.h>
+
+/* duplicate suppression: a time-windowed table of packet digests.
+ *
+ * Each slot holds the 32-bit digest of the last packet hashed into it
+ * along with its arrival time (in jiffies). Slots are read and written
+ * with plain 64-bit accesses: concurrent updates may at worst let a
+ * duplicate through, they never drop a unique packet (unless two distinct
+ * packets share the same digest within the window).
+ */
+
+struct pfq_dedup
+{
+    unsigned long   window;     /* jiffies, 0 = disabled */
+    unsigned int    window_ms;  /* as set with SO_DEDUP, returned by SO_GET_DEDUP */
+    unsigned int    mask;
+    uint64_t        table[0];
+};
+
+
+extern struct pfq_dedup * pfq_dedup_alloc(unsigned int slots);
+extern void pfq_dedup_free(struct pfq_dedup *dd);
+
+extern bool pfq_dedup_digest(const struct sk_buff *skb, uint32_t *digest);
+
+
+static inline 
+bool pfq_dedup_enabled(const struct pfq_dedup *dd)
+{
+    return dd && dd->window;
+}
+
+
+static inline
+bool pfq_dedup_check(struct pfq_dedup *dd, uint32_t digest)
+{
+    volatile uint64_t *slot = &dd->table[digest & dd->mask];
+    uint32_t now = (uint32_t)jiffies;
+    uint64_t old = *slot;
+
+    *slot = ((uint64_t)digest << 32) | now;
+
+    return (uint32_t)(old >> 32) == digest && 
+           (uint32_t)(now - (uint32_t)old) <= dd->window;
+}
+
+#endif /* _PF_Q_DEDUP_H_ */
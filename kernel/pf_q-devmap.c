@@ -25,6 +25,11 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/semaphore.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 
 #include <pf_q-devmap.h>
 #include <pf_q-global.h>
@@ -33,62 +38,742 @@
 MODULE_LICENSE("GPL");
 
 
-void pfq_devmap_monitor_update(void)
+/* a subscription (writer side, under global_sem) */
+
+struct pfq_devmap_entry
+{
+    struct list_head    list;
+    int                 index;      /* Q_ANY_DEVICE or ifindex */
+    int                 queue;      /* Q_ANY_QUEUE or hw queue */
+    unsigned long       mask;
+    unsigned long       undo;       /* sockets just removed (see pfq_devmap_list_reset) */
+};
+
+
+static inline 
+int pfq_devmap_entry_cmp(const struct pfq_devmap_entry *e, int index, int queue)
+{
+    if (e->index != index)
+        return e->index < index ? -1 : 1;
+    if (e->queue != queue)
+        return e->queue < queue ? -1 : 1;
+    return 0;
+}
+
+
+static struct pfq_devmap *
+pfq_devmap_build(struct list_head *entries)
 {
-    int i,j;
-    for(i=0; i < Q_MAX_DEVICE; ++i)
-    {   
-        unsigned long val = 0;
-        for(j=0; j < Q_MAX_HW_QUEUE; ++j)
+    struct pfq_devmap_entry *e;
+    struct pfq_devmap *map;
+    struct pfq_devmap_dev *dev = NULL;
+    size_t size, devsize = 0;
+    unsigned int ndev = 0, buckets;
+    char *ptr;
+
+    if (list_empty(entries))
+        return NULL;
+
+    /* entries are sorted: the last entry of a device has its highest queue */
+
+    list_for_each_entry(e, entries, list)
+    {
+        struct pfq_devmap_entry *next;
+
+        if (e->index == Q_ANY_DEVICE)
+            continue;
+
+        next = list_entry(e->list.next, struct pfq_devmap_entry, list);
+        if (&next->list != entries && next->index == e->index)
+            continue;
+
+        ndev++;
+        devsize += sizeof(struct pfq_devmap_dev) + (e->queue + 1) * sizeof(unsigned long);
+    }
+
+    buckets = roundup_pow_of_two(max(ndev, 16U));
+    size = sizeof(struct pfq_devmap) + buckets * sizeof(struct pfq_devmap_dev *) + devsize;
+
+    if (size <= (PAGE_SIZE << 3))
+        map = kzalloc(size, GFP_KERNEL);
+    else {
+        map = vmalloc(size);
+        if (map) {
+            memset(map, 0, size);
+            map->vmalloced = 1;
+        }
+    }
+
+    if (map == NULL)
+        return ERR_PTR(-ENOMEM);
+
+    map->bits = ilog2(buckets);
+    ptr = (char *)&map->bucket[buckets];
+
+    list_for_each_entry(e, entries, list)
+    {
+        if (e->index == Q_ANY_DEVICE)
         {
-            val |= global.devmap[i][j];
+            if (e->queue == Q_ANY_QUEUE)
+                map->any |= e->mask;
+            else
+                map->any_queue[e->queue] |= e->mask;
+
+            if (e->mask)
+                map->monitor = 1;
+            continue;
         }
 
-        global.devmap_monitor[i] = (val ? 1 : 0);
+        if (dev == NULL || dev->ifindex != e->index)
+        {
+            struct pfq_devmap_entry *last = e;
+            unsigned int h;
+
+            while (last->list.next != entries && 
+                   list_entry(last->list.next, struct pfq_devmap_entry, list)->index == e->index)
+                last = list_entry(last->list.next, struct pfq_devmap_entry, list);
+
+            dev = (struct pfq_devmap_dev *)ptr;
+            dev->ifindex = e->index;
+            dev->queues  = last->queue + 1;
+
+            ptr += sizeof(struct pfq_devmap_dev) + dev->queues * sizeof(unsigned long);
+
+            h = hash_32(dev->ifindex, map->bits);
+            dev->next = map->bucket[h];
+            map->bucket[h] = dev;
+        }
+
+        if (e->queue == Q_ANY_QUEUE)
+            dev->any |= e->mask;
+        else
+            dev->queue[e->queue] |= e->mask;
     }
+
+    return map;
 }
 
 
-int pfq_devmap_update(int action, int index, int queue, unsigned int id)
+static void
+pfq_devmap_release(struct pfq_devmap *map)
 {
-    int n = 0, i,q;
-    
+    if (map == NULL)
+        return;
+    if (map->vmalloced)
+        vfree(map);
+    else
+        kfree(map);
+}
+
+
+static void
+pfq_devmap_release_rcu(struct rcu_head *rcu)
+{
+    pfq_devmap_release(container_of(rcu, struct pfq_devmap, rcu));
+}
+
+
+/* a snapshot replaced is freed once the readers are done with it: the
+ * writer does not wait for the grace period (vfree is safe from the rcu
+ * callback since 3.10; older kernels wait for vmalloc'ed snapshots) */
+
+static void
+pfq_devmap_retire(struct pfq_devmap *map)
+{
+    if (map == NULL)
+        return;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
+    if (map->vmalloced) {
+        synchronize_rcu();
+        pfq_devmap_release(map);
+        return;
+    }
+#endif
+    call_rcu(&map->rcu, pfq_devmap_release_rcu);
+}
+
+
+static int
+pfq_devmap_publish(struct pfq_devmap_table *table)
+{
+    struct pfq_devmap *map = pfq_devmap_build(&table->entries), *old;
+
+    if (IS_ERR(map))
+    {
+        printk(KERN_WARNING "[PF_Q] devmap: out of memory\n");
+        return PTR_ERR(map);
+    }
+
+    old = rcu_dereference_protected(table->map, 1);
+    rcu_assign_pointer(table->map, map);
+
+    pfq_devmap_retire(old);
+    return 0;
+}
+
+
+/* add id to the subscription (index,queue), keeping the list sorted */
+
+static int
+pfq_devmap_list_set(struct list_head *entries, int index, int queue, unsigned int id)
+{
+    struct pfq_devmap_entry *e;
+
+    list_for_each_entry(e, entries, list)
+    {
+        if (pfq_devmap_entry_cmp(e, index, queue) >= 0)
+            break;
+    }
+
+    /* e is either the subscription or the first entry after it */
+
+    if (&e->list == entries || pfq_devmap_entry_cmp(e, index, queue) != 0)
+    {
+        struct pfq_devmap_entry *ne = kzalloc(sizeof(struct pfq_devmap_entry), GFP_KERNEL);
+        if (ne == NULL)
+            return -ENOMEM;
+
+        ne->index = index;
+        ne->queue = queue;
+        list_add_tail(&ne->list, &e->list);
+        e = ne;
+    }
+
+    if (e->mask & (1UL<<id))
+        return 0;
+
+    e->mask |= (1UL<<id);
+    return 1;
+}
+
+
+/* remove the sockets in mask from the subscription (index,queue) only: 
+ * Q_ANY_DEVICE and Q_ANY_QUEUE are bindings of their own, not patterns. 
+ * With all set, from every subscription (the socket is going away). 
+ * Entries left empty stay in the list until pfq_devmap_list_purge, so that 
+ * pfq_devmap_list_undo can restore them if the new snapshot is not published. */
+
+static int
+pfq_devmap_list_reset(struct list_head *entries, int index, int queue, unsigned long mask, bool all)
+{
+    struct pfq_devmap_entry *e;
+    int n = 0;
+
+    list_for_each_entry(e, entries, list)
+    {
+        if ((!all && pfq_devmap_entry_cmp(e, index, queue) != 0) || !(e->mask & mask))
+            continue;
+
+        e->undo |= e->mask & mask;
+        e->mask &= ~mask, n++;
+    }
+
+    return n;
+}
+
+
+static void
+pfq_devmap_list_undo(struct list_head *entries)
+{
+    struct pfq_devmap_entry *e;
+
+    list_for_each_entry(e, entries, list)
+    {
+        e->mask |= e->undo;
+        e->undo = 0;
+    }
+}
+
+
+static void
+pfq_devmap_list_purge(struct list_head *entries)
+{
+    struct pfq_devmap_entry *e, *tmp;
+
+    list_for_each_entry_safe(e, tmp, entries, list)
+    {
+        e->undo = 0;
+
+        if (e->mask == 0)
+        {
+            list_del(&e->list);
+            kfree(e);
+        }
+    }
+}
+
+
+static void
+pfq_devmap_list_free(struct list_head *entries)
+{
+    struct pfq_devmap_entry *e, *tmp;
+
+    list_for_each_entry_safe(e, tmp, entries, list)
+    {
+        list_del(&e->list);
+        kfree(e);
+    }
+}
+
+
+static int 
+pfq_devmap_table_update(struct pfq_devmap_table *table, int action, int index, int queue, unsigned int id)
+{
+    int n, ret;
+
     if (unlikely(id >= 64))
     {
         printk(KERN_WARNING "[PF_Q] devmap_update: bad id(%u)\n",id);
         return 0; 
     }
 
+    if (index < Q_ANY_DEVICE || queue < Q_ANY_QUEUE || queue >= Q_MAX_HW_QUEUE)
+        return -EINVAL;
+
     down(&global_sem);
 
-    for(i=0; i < Q_MAX_DEVICE; ++i)
+    if (action == map_set) 
+        n = pfq_devmap_list_set(&table->entries, index, queue, id);
+    else
+        n = pfq_devmap_list_reset(&table->entries, index, queue, 1UL<<id, false);
+
+    /* the list follows the live snapshot: a change not published is undone */
+
+    if (n > 0 && (ret = pfq_devmap_publish(table)) < 0)
     {
-        for(q=0; q < Q_MAX_HW_QUEUE; ++q)
+        if (action == map_set)
+            pfq_devmap_list_reset(&table->entries, index, queue, 1UL<<id, false);
+        else
+            pfq_devmap_list_undo(&table->entries);
+        n = ret;
+    }
+
+    pfq_devmap_list_purge(&table->entries);
+
+    up(&global_sem);
+    return n;
+}
+
+
+/* removing a binding the socket does not have is an error */
+
+int pfq_devmap_update(int action, int index, int queue, unsigned int id)
+{
+    int n = pfq_devmap_table_update(&global.devmap, action, index, queue, id);
+    return action == map_reset && n == 0 ? -ENOENT : n;
+}
+
+
+static void 
+pfq_devmap_table_free(struct pfq_devmap_table *table)
+{
+    down(&global_sem);
+
+    pfq_devmap_list_free(&table->entries);
+    pfq_devmap_publish(table);
+
+    up(&global_sem);
+}
+
+
+/* egress bindings are per device */
+
+int pfq_devmap_egress_update(int action, int index, unsigned int id)
+{
+    return pfq_devmap_table_update(&global.devmap_egress, action, index, Q_ANY_QUEUE, id);
+}
+
+
+/* drop every binding (rx and egress) of the socket */
+
+int pfq_devmap_drop(unsigned int id)
+{
+    int n, m, ret = 0;
+
+    if (unlikely(id >= 64))
+        return -EINVAL;
+
+    down(&global_sem);
+
+    n = pfq_devmap_list_reset(&global.devmap.entries, 0, 0, 1UL<<id, true);
+    if (n > 0 && (ret = pfq_devmap_publish(&global.devmap)) < 0)
+        pfq_devmap_list_undo(&global.devmap.entries);
+    pfq_devmap_list_purge(&global.devmap.entries);
+
+    m = pfq_devmap_list_reset(&global.devmap_egress.entries, 0, 0, 1UL<<id, true);
+    if (m > 0 && ret == 0 && (ret = pfq_devmap_publish(&global.devmap_egress)) < 0)
+        pfq_devmap_list_undo(&global.devmap_egress.entries);
+    pfq_devmap_list_purge(&global.devmap_egress.entries);
+
+    up(&global_sem);
+    return ret < 0 ? ret : n + m;
+}
+
+
+void pfq_devmap_free(void)
+{
+    pfq_devmap_table_free(&global.devmap);
+    pfq_devmap_table_free(&global.devmap_egress);
+
+    /* the snapshots retired are freed before the module goes */
+    rcu_barrier();
+}
+
+
+/* copy the subscriptions, without the sockets in drop */
+
+static int
+pfq_devmap_list_clone(struct list_head *dst, const struct list_head *src, unsigned long drop)
+{
+    struct pfq_devmap_entry *e;
+
+    list_for_each_entry(e, src, list)
+    {
+        struct pfq_devmap_entry *ne;
+
+        if ((e->mask & ~drop) == 0)
+            continue;
+
+        ne = kmalloc(sizeof(struct pfq_devmap_entry), GFP_KERNEL);
+        if (ne == NULL)
+            return -ENOMEM;
+
+        ne->index = e->index;
+        ne->queue = e->queue;
+        ne->mask  = e->mask & ~drop;
+        ne->undo  = 0;
+        list_add_tail(&ne->list, dst);
+    }
+
+    return 0;
+}
+
+
+/* replace the bindings (rx and egress) of the sockets in mask: the new
+ * subscriptions and snapshots are built aside, then both tables are
+ * switched under a single grace period. On failure nothing changes.
+ *
+ * Called with global_sem held. commit (if any) runs right before the new
+ * snapshots are published, once nothing can fail: the caller updates there
+ * the state that goes along with the bindings (e.g. the load balance mask). */
+
+int pfq_devmap_apply(const struct pfq_devmap_binding *b, int n, unsigned long sockets,
+                     void (*commit)(void *), void *arg)
+{
+    struct pfq_devmap *rx_map = NULL, *tx_map = NULL, *old_rx, *old_tx;
+    LIST_HEAD(rx);
+    LIST_HEAD(tx);
+    int i, ret;
+
+    for(i = 0; i < n; i++)
+    {
+        if (b[i].id >= 64 || !(sockets & (1UL << b[i].id)))
+            return -EINVAL;
+        if (b[i].index < Q_ANY_DEVICE || b[i].queue < Q_ANY_QUEUE || b[i].queue >= Q_MAX_HW_QUEUE)
+            return -EINVAL;
+        if (b[i].egress && b[i].queue != Q_ANY_QUEUE)
+            return -EINVAL;
+    }
+
+    if ((ret = pfq_devmap_list_clone(&rx, &global.devmap.entries, sockets)) < 0 ||
+        (ret = pfq_devmap_list_clone(&tx, &global.devmap_egress.entries, sockets)) < 0)
+        goto out;
+
+    for(i = 0; i < n; i++)
+    {
+        ret = pfq_devmap_list_set(b[i].egress ? &tx : &rx, b[i].index, b[i].queue, b[i].id);
+        if (ret < 0)
+            goto out;
+    }
+
+    rx_map = pfq_devmap_build(&rx);
+    if (IS_ERR(rx_map)) {
+        ret = PTR_ERR(rx_map);
+        rx_map = NULL;
+        goto out;
+    }
+
+    tx_map = pfq_devmap_build(&tx);
+    if (IS_ERR(tx_map)) {
+        ret = PTR_ERR(tx_map);
+        tx_map = NULL;
+        goto out;
+    }
+
+    /* commit */
+
+    pfq_devmap_list_free(&global.devmap.entries);
+    pfq_devmap_list_free(&global.devmap_egress.entries);
+    list_splice_init(&rx, &global.devmap.entries);
+    list_splice_init(&tx, &global.devmap_egress.entries);
+
+    old_rx = rcu_dereference_protected(global.devmap.map, 1);
+    old_tx = rcu_dereference_protected(global.devmap_egress.map, 1);
+
+    if (commit)
+        commit(arg);
+
+    rcu_assign_pointer(global.devmap.map, rx_map);
+    rcu_assign_pointer(global.devmap_egress.map, tx_map);
+
+    pfq_devmap_retire(old_rx);
+    pfq_devmap_retire(old_tx);
+
+    rx_map = NULL;
+    tx_map = NULL;
+    ret = n;
+out:
+    pfq_devmap_list_free(&rx);
+    pfq_devmap_list_free(&tx);
+    pfq_devmap_release(rx_map);
+    pfq_devmap_release(tx_map);
+    return ret;
+}
+
+
+int pfq_devmap_dump(pfq_devmap_dump_t fun, void *arg)
+{
+    struct pfq_devmap_entry *e;
+    int ret = 0;
+
+    down(&global_sem);
+
+    list_for_each_entry(e, &global.devmap.entries, list)
+    {
+        if ((ret = fun(arg, e->index, e->queue, false, e->mask)) < 0)
+            goto out;
+    }
+
+    list_for_each_entry(e, &global.devmap_egress.entries, list)
+    {
+        if ((ret = fun(arg, e->index, e->queue, true, e->mask)) < 0)
+            goto out;
+    }
+out:
+    up(&global_sem);
+    return ret;
+}
+
+
+static void 
+pfq_vlanmap_filter_update(void)
+{
+    unsigned long val = 0;
+    int i;
+    for(i=0; i < Q_MAX_VLAN; ++i)
+    {
+        val |= global.vlanmap[i];
+    }
+    global.vlanmap_filter = val;
+}
+
+
+static void 
+pfq_mplsmap_filter_update(void)
+{
+    unsigned long val = 0;
+    int i;
+    for(i=0; i < Q_MAX_MPLS; ++i)
+    {
+        val |= global.mplsmap[i].mask;
+    }
+    global.mplsmap_filter = val;
+}
+
+
+int pfq_vlanmap_update(int action, int first, int last, unsigned int id)
+{
+    int n = 0, v;
+
+    if (unlikely(id >= 64))
+    {
+        printk(KERN_WARNING "[PF_Q] vlanmap_update: bad id(%u)\n",id);
+        return 0; 
+    }
+
+    first = max(first, 0);
+    last  = min(last,  Q_MAX_VLAN-1);
+
+    down(&global_sem);
+
+    for(v = first; v <= last; ++v)
+    {
+        if (action == map_set) 
         {
-            if ( !pfq_devmap_equal(i,q,index,queue) )
-                continue;
+            global.vlanmap[v] |= (1UL<<id), n++;
+            continue;
+        }
+
+        if (global.vlanmap[v] & (1UL<<id))
+        {
+            global.vlanmap[v] &= ~(1UL<<id), n++;
+        }
+    }
+
+    pfq_vlanmap_filter_update();
+
+    up(&global_sem);
+    return n;
+}
+
+
+static inline 
+unsigned int pfq_mplsmap_hash(uint32_t label)
+{
+    return (label ^ (label >> 8) ^ (label >> 16)) & (Q_MAX_MPLS-1);
+}
+
+
+/* open addressing, lock-free lookup: a label whose mask drops to zero is 
+ * left in place (the probe chains stay intact) and its slot is recycled by 
+ * the next label added along the same chain. The label is switched before 
+ * the mask is set, so that a reader never sees the new mask under the old 
+ * label. */
+
+int pfq_mplsmap_update(int action, int label, unsigned int id)
+{
+    unsigned int h = pfq_mplsmap_hash(label);
+    int n = 0, i, spare = -1;
+
+    if (unlikely(id >= 64))
+    {
+        printk(KERN_WARNING "[PF_Q] mplsmap_update: bad id(%u)\n",id);
+        return 0; 
+    }
+
+    down(&global_sem);
 
-            /* map_set... */
-            if (action == map_set) 
+    if (action == map_set)
+    {
+        for(i=0; i < Q_MAX_MPLS; ++i)
+        {
+            int slot = (h + i) & (Q_MAX_MPLS-1);
+
+            if (global.mplsmap[slot].label == label + 1)
             {
-                global.devmap[i][q] |= (1<<id), n++;
-                continue;
+                global.mplsmap[slot].mask |= (1UL<<id), n++;
+                break;
             }
 
-            /* map_reset */
-            if ( global.devmap[i][q] & (1<<id) )
+            if (global.mplsmap[slot].label == 0)
             {
-                global.devmap[i][q] &= ~(1<<id), n++;
+                if (spare == -1)
+                    spare = slot;
+                break;
+            }
+
+            if (global.mplsmap[slot].mask == 0 && spare == -1)
+                spare = slot;
+        }
+
+        if (n == 0)
+        {
+            if (spare == -1)
+            {
+                printk(KERN_WARNING "[PF_Q] mplsmap_update: table full\n");
+                n = -ENOSPC;
+            }
+            else
+            {
+                global.mplsmap[spare].label = label + 1;
+                smp_wmb();
+                global.mplsmap[spare].mask = (1UL<<id), n++;
+            }
+        }
+    }
+    else
+    {
+        for(i=0; i < Q_MAX_MPLS; ++i)
+        {
+            if (label != -1 && global.mplsmap[i].label != label + 1)
                 continue;
+
+            if (global.mplsmap[i].mask & (1UL<<id))
+            {
+                global.mplsmap[i].mask &= ~(1UL<<id), n++;
             }
         }
     }
-    
-    /* update capture monitor filter... */
-    
-    pfq_devmap_monitor_update();
+
+    pfq_mplsmap_filter_update();
 
     up(&global_sem);
     return n;
 }
 
+
+static inline
+unsigned long pfq_mplsmap_get(uint32_t label)
+{
+    unsigned int h = pfq_mplsmap_hash(label);
+    int i;
+
+    for(i=0; i < Q_MAX_MPLS; ++i)
+    {
+        int slot = (h + i) & (Q_MAX_MPLS-1);
+        uint32_t l = global.mplsmap[slot].label;
+
+        if (l == label + 1) {
+            smp_rmb();
+            return global.mplsmap[slot].mask;
+        }
+        if (l == 0)
+            break;
+    }
+    return 0;
+}
+
+
+unsigned long pfq_devmap_l2_filter(unsigned long bm, const struct sk_buff *skb)
+{
+    int offset = skb_mac_header(skb) - skb->data + 2*ETH_ALEN;
+    unsigned long vlan_filter = global.vlanmap_filter, 
+                  mpls_filter = global.mplsmap_filter;
+    __be16 _proto, *proto, eth_type;
+    int vid = Q_VLAN_UNTAG;
+
+    proto = skb_header_pointer(skb, offset, sizeof(_proto), &_proto);
+    if (proto == NULL)
+        return bm & ~(vlan_filter | mpls_filter);
+
+    eth_type = *proto;
+
+    if (vlan_tx_tag_present(skb)) 
+    {
+        vid = vlan_tx_tag_get(skb) & VLAN_VID_MASK;
+    }
+    else if (eth_type == __constant_htons(ETH_P_8021Q) || 
+             eth_type == __constant_htons(ETH_P_8021AD)) 
+    {
+        __be16 _tag[2], *tag;
+        tag = skb_header_pointer(skb, offset + sizeof(__be16), sizeof(_tag), _tag);
+        if (tag) {
+            vid = ntohs(tag[0]) & VLAN_VID_MASK;
+            eth_type = tag[1];
+            offset += VLAN_HLEN;
+        }
+    }
+
+    if (bm & vlan_filter)
+    {
+        bm = (bm & ~vlan_filter) | (bm & global.vlanmap[vid]);
+    }
+
+    if (bm & mpls_filter)
+    {
+        unsigned long mask = 0;
+
+        if (eth_type == __constant_htons(ETH_P_MPLS_UC) || 
+            eth_type == __constant_htons(ETH_P_MPLS_MC)) 
+        {
+            __be32 _lse, *lse;
+            lse = skb_header_pointer(skb, offset + sizeof(__be16), sizeof(_lse), &_lse);
+            if (lse)
+                mask = pfq_mplsmap_get(ntohl(*lse) >> 12);
+        }
+
+        bm = (bm & ~mpls_filter) | (bm & mask);
+    }
+
+    return bm;
+}
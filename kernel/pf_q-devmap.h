@@ -25,6 +25,12 @@
 #ifndef _PF_Q_DEVMAP_H_
 #define _PF_Q_DEVMAP_H_ 
 
+#include <linux/skbuff.h>
+#include <linux/rcupdate.h>
+#include <linux/hash.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+
 #define __PFQ_MODULE__
 #include <linux/pf_q.h>
 
@@ -36,6 +42,45 @@
 enum { map_reset, map_set };
 
 
+/* devmap snapshot: devices are hashed by their full ifindex, each with a 
+   queue table sized after the highest queue bound. Sockets bound to any 
+   device are kept apart, so that unbound devices cost a single lookup. */
+
+struct pfq_devmap_dev
+{
+    struct pfq_devmap_dev * next;           /* hash chain */
+    int                     ifindex;
+    unsigned int            queues;         /* size of queue[] */
+    unsigned long           any;            /* bound to any queue of the device */
+    unsigned long           queue[0];
+};
+
+
+struct pfq_devmap
+{
+    unsigned long           any;            /* bound to any device, any queue */
+    unsigned long           any_queue[Q_MAX_HW_QUEUE];  /* bound to a queue of any device */
+    int                     monitor;        /* some socket is bound to any device */
+    unsigned int            bits;           /* log2 of the buckets */
+    int                     vmalloced;
+    struct rcu_head         rcu;            /* freed after a grace period */
+    struct pfq_devmap_dev * bucket[0];
+};
+
+
+/* a binding of the control plane (see pfq_devmap_apply) */
+
+struct pfq_devmap_binding
+{
+    unsigned int    id;
+    int             index;
+    int             queue;
+    int             egress;
+};
+
+typedef int (*pfq_devmap_dump_t)(void *arg, int index, int queue, bool egress, unsigned long mask);
+
+
 // called from u-context
 //
 
@@ -43,36 +88,172 @@ extern
 int pfq_devmap_update(int action, int index, int queue, unsigned int id);
 
 extern
-void pfq_devmap_monitor_update(void);
+int pfq_devmap_egress_update(int action, int index, unsigned int id);
+
+extern
+int pfq_devmap_drop(unsigned int id);
+
+extern
+int pfq_devmap_apply(const struct pfq_devmap_binding *b, int n, unsigned long sockets, 
+                     void (*commit)(void *), void *arg);
+
+extern
+int pfq_devmap_dump(pfq_devmap_dump_t fun, void *arg);
+
+extern
+void pfq_devmap_free(void);
+
+extern
+int pfq_vlanmap_update(int action, int first, int last, unsigned int id);
+
+extern
+int pfq_mplsmap_update(int action, int label, unsigned int id);
+
+
+// called from the receive path
+//
+
+extern
+unsigned long pfq_devmap_l2_filter(unsigned long bm, const struct sk_buff *skb);
   
 
+static inline
+const struct pfq_devmap_dev *
+pfq_devmap_dev_get(const struct pfq_devmap *map, int index)
+{
+    const struct pfq_devmap_dev *dev = map->bucket[hash_32(index, map->bits)];
+    for(; dev != NULL; dev = dev->next)
+    {
+        if (dev->ifindex == index)
+            return dev;
+    }
+    return NULL;
+}
+
+
+static inline 
+unsigned long pfq_devmap_lookup(const struct pfq_devmap *map, int index, int queue)
+{
+    const struct pfq_devmap_dev *dev;
+    unsigned long bm;
+
+    if (map == NULL)
+        return 0;
+
+    bm = map->any;
+
+    if ((unsigned int)queue < Q_MAX_HW_QUEUE)
+        bm |= map->any_queue[queue];
+
+    dev = pfq_devmap_dev_get(map, index);
+    if (dev)
+    {
+        bm |= dev->any;
+        if ((unsigned int)queue < dev->queues)
+            bm |= dev->queue[queue];
+    }
+
+    return bm;
+}
+
+
+static inline 
+unsigned long pfq_devmap_get(int index, int queue)
+{
+    unsigned long bm;
+
+    rcu_read_lock();
+    bm = pfq_devmap_lookup(rcu_dereference(global.devmap.map), index, queue);
+    rcu_read_unlock();
+
+    return bm;
+}
+
+
 static inline 
-int pfq_devmap_equal(int i1, int q1, int i2, int q2)
+unsigned long pfq_devmap_egress_get(int index)
 {
-    i1 = i1 > 0 ? i1 & Q_MAX_DEVICE_MASK : i1;
-    i2 = i2 > 0 ? i2 & Q_MAX_DEVICE_MASK : i2;
-    
-    q1 = q1 > 0 ? q1 & Q_MAX_HW_QUEUE_MASK : q1;
-    q2 = q2 > 0 ? q2 & Q_MAX_HW_QUEUE_MASK : q2;
-
-    return  (i1 == i2 && q1 == q2) ||
-            (i1 == i2 && q2 == -1) ||
-            (i2 == -1 && q1 == q2) ||
-            (i2 == -1 && q2 == -1);
+    unsigned long bm;
+
+    rcu_read_lock();
+    bm = pfq_devmap_lookup(rcu_dereference(global.devmap_egress.map), index, Q_ANY_QUEUE);
+    rcu_read_unlock();
+
+    return bm;
 }
 
 
 static inline 
-unsigned long pfq_devmap_get(int d, int q)
+bool pfq_devmap_egress_enabled(void)
+{
+    return rcu_access_pointer(global.devmap_egress.map) != NULL;
+}
+
+
+/* second-level steering: drop from bm the sockets subscribed to other vlans/labels */
+
+static inline
+unsigned long pfq_devmap_filter(unsigned long bm, const struct sk_buff *skb)
+{
+    if (likely((bm & (global.vlanmap_filter | global.mplsmap_filter)) == 0))
+        return bm;
+    return pfq_devmap_l2_filter(bm, skb);
+}
+
+
+/* load balancer among sockets: the candidates are the sockets of bm in mask, 
+   one of them is picked by a hash of the ipv4 addresses (the others are kept) */
+
+static inline
+unsigned long pfq_load_balancer(unsigned long bm, unsigned long mask, const struct sk_buff *skb)
 {
-    return global.devmap[d & Q_MAX_DEVICE_MASK][q & Q_MAX_HW_QUEUE_MASK];
+    int index[sizeof(unsigned long)<<3], i = 0;
+    unsigned long candidates = bm & mask;
+    unsigned long nolb = bm ^ candidates;
+    int mac = skb_mac_header(skb) - skb->data;
+    __be16 _proto, *proto;
+    __be32 _addr[2], *addr;
+    uint32_t hash;
+
+    if (candidates == 0)
+        return nolb;
+
+    /* the skb may be non-linear: headers are read through skb_header_pointer */
+
+    proto = skb_header_pointer(skb, mac + offsetof(struct ethhdr, h_proto), sizeof(_proto), &_proto);
+    if (proto == NULL || *proto != __constant_htons(ETH_P_IP))
+        return nolb;
+
+    addr = skb_header_pointer(skb, mac + ETH_HLEN + offsetof(struct iphdr, saddr), sizeof(_addr), _addr);
+    if (addr == NULL)
+        return nolb;
+
+    while(candidates)
+    {
+        int zn = __builtin_ctzl(candidates);
+        index[i++] = zn;
+        candidates ^= (1UL<<zn);
+    }
+
+    hash = addr[0] ^ addr[1];
+    hash = hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24);
+
+    return nolb | ( 1UL << index[hash % i] );
 }
 
 
 static inline 
-uint8_t pfq_devmap_monitor_get(int index)
+int pfq_devmap_monitor_get(int index)
 {
-    return global.devmap_monitor[index & Q_MAX_DEVICE_MASK];
+    const struct pfq_devmap *map;
+    int ret;
+
+    rcu_read_lock();
+    map = rcu_dereference(global.devmap.map);
+    ret = map && (map->monitor || pfq_devmap_dev_get(map, index));
+    rcu_read_unlock();
+
+    return ret;
 }
 
 
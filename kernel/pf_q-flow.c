@@ -0,0 +1,560 @@
+/***************************************************************
+ *                                                
+ * (C) 2011-12 Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/module.h>
+#include <linux/cpu.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/jhash.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+
+#include <pf_q-flow.h>
+
+
+MODULE_LICENSE("GPL");
+
+
+#define Q_FLOW_PROBE            8           /* slots visited before evicting a flow */
+#define Q_FLOW_SWEEP_STEPS      16          /* a table is swept in 16 steps */
+#define Q_FLOW_SWEEP_PERIOD     (HZ/10)     
+
+
+/* the tables with a sweep: their timers follow the cpus going on/offline */
+
+static LIST_HEAD(pfq_flow_tables);
+static DEFINE_MUTEX(pfq_flow_mutex);
+
+
+static inline uint64_t
+pfq_flow_now(const struct sk_buff *skb)
+{
+        if (skb && skb->tstamp.tv64)
+                return ktime_to_ns(skb->tstamp);
+        return ktime_to_ns(ktime_get_real());
+}
+
+
+static bool
+pfq_flow_parse(const struct sk_buff *skb, struct pfq_flow *key, uint8_t *tcp_flags)
+{
+        int offset = skb_network_offset(skb);
+        __be16 proto = skb->protocol;
+
+        memset(key, 0, sizeof(*key));
+        *tcp_flags = 0;
+
+        if (proto == __constant_htons(ETH_P_8021Q))
+        {
+                struct vlan_hdr _vh, *vh;
+                vh = skb_header_pointer(skb, offset, sizeof(_vh), &_vh);
+                if (vh == NULL)
+                        return false;
+
+                proto   = vh->h_vlan_encapsulated_proto;
+                offset += VLAN_HLEN;
+        }
+
+        switch(proto)
+        {
+        case __constant_htons(ETH_P_IP): 
+            {
+                    struct iphdr _ip, *ip;
+                    ip = skb_header_pointer(skb, offset, sizeof(_ip), &_ip);
+                    if (ip == NULL || ip->ihl < 5)
+                            return false;
+
+                    key->version  = 4;
+                    key->proto    = ip->protocol;
+                    key->saddr[0] = ip->saddr;
+                    key->daddr[0] = ip->daddr;
+
+                    /* non-first fragments carry no ports */
+                    if (ip->frag_off & __constant_htons(IP_OFFSET))
+                            goto hash;
+
+                    offset += ip->ihl << 2;
+            } break;
+
+        case __constant_htons(ETH_P_IPV6): 
+            {
+                    struct ipv6hdr _ip6, *ip6;
+                    ip6 = skb_header_pointer(skb, offset, sizeof(_ip6), &_ip6);
+                    if (ip6 == NULL)
+                            return false;
+
+                    key->version = 6;
+                    key->proto   = ip6->nexthdr;    /* extension headers are not followed */
+                    memcpy(key->saddr, &ip6->saddr, sizeof(key->saddr));
+                    memcpy(key->daddr, &ip6->daddr, sizeof(key->daddr));
+
+                    offset += sizeof(struct ipv6hdr);
+            } break;
+
+        default: 
+                return false;
+        }
+
+        switch(key->proto)
+        {
+        case IPPROTO_TCP: 
+            {
+                    uint8_t _tcp[14], *tcp;
+                    tcp = skb_header_pointer(skb, offset, sizeof(_tcp), _tcp);
+                    if (tcp == NULL)
+                            break;
+                    memcpy(&key->sport, tcp, sizeof(uint16_t) * 2);
+                    *tcp_flags = tcp[13];
+            } break;
+
+        case IPPROTO_UDP: 
+        case IPPROTO_SCTP: 
+            {
+                    __be16 _ports[2], *ports;
+                    ports = skb_header_pointer(skb, offset, sizeof(_ports), _ports);
+                    if (ports == NULL)
+                            break;
+                    key->sport = ports[0];
+                    key->dport = ports[1];
+            } break;
+        }
+
+hash:
+        /* saddr, daddr, sport and dport are contiguous */
+        key->hash = jhash(key->saddr, offsetof(struct pfq_flow, hash) - offsetof(struct pfq_flow, saddr), 
+                          key->proto | (key->version << 8));
+        return true;
+}
+
+
+static inline bool
+pfq_flow_equal(const struct pfq_flow *a, const struct pfq_flow *b)
+{
+        return a->hash    == b->hash    &&
+               a->version == b->version && 
+               a->proto   == b->proto   &&
+               a->sport   == b->sport   &&
+               a->dport   == b->dport   &&
+               memcmp(a->saddr, b->saddr, sizeof(a->saddr)) == 0 &&
+               memcmp(a->daddr, b->daddr, sizeof(a->daddr)) == 0;
+}
+
+
+/* copy the record into the export ring of the shard: user-space detects 
+ * overwritten records by means of the seq field */
+
+static void
+pfq_flow_export(struct pfq_flow_descr *descr, unsigned int n, const struct pfq_flow *flow)
+{
+        struct pfq_flow_shard *shard = Q_FLOW_SHARD(descr, n);
+        uint64_t head = shard->head;
+        struct pfq_flow *rec = Q_FLOW_RING(descr, n) + (head & (descr->ring_slots - 1));
+
+        rec->seq = 1;
+        smp_wmb();
+
+        memcpy((char *)rec + sizeof(rec->seq), (const char *)flow + sizeof(flow->seq), 
+               sizeof(struct pfq_flow) - sizeof(flow->seq));
+
+        smp_wmb();
+        rec->seq = Q_FLOW_RING_SEQ(head);
+
+        smp_wmb();
+        shard->head = head + 1;
+}
+
+
+static inline void
+pfq_flow_release(struct pfq_flow *flow)
+{
+        flow->seq++;
+        smp_wmb();
+
+        flow->version = 0;
+        flow->packets = 0;
+
+        smp_wmb();
+        flow->seq++;
+}
+
+
+void
+pfq_flow_update(struct pfq_flow_table *ft, const struct sk_buff *skb)
+{
+        struct pfq_flow_descr *descr = ft->descr;
+        struct pfq_flow key, *table, *flow, *victim = NULL, *oldest = NULL;
+        unsigned int n, i, mask;
+        uint8_t flags;
+        uint64_t now;
+
+        if (!pfq_flow_parse(skb, &key, &flags))
+                return;
+
+        n     = smp_processor_id() % descr->shards;
+        table = Q_FLOW_TABLE(descr, n);
+        mask  = descr->slots - 1;
+        now   = pfq_flow_now(skb);
+
+        for(i = 0; i < Q_FLOW_PROBE; i++)
+        {
+                flow = &table[(key.hash + i) & mask];
+
+                if (flow->version == 0) 
+                {
+                        if (victim == NULL)
+                                victim = flow;
+                        continue;
+                }
+
+                if (pfq_flow_equal(flow, &key))
+                {
+                        flow->seq++;
+                        smp_wmb();
+
+                        flow->packets++;
+                        flow->bytes += skb->len + skb->mac_len;
+                        flow->last   = now;
+                        flow->tcp_flags |= flags;
+
+                        smp_wmb();
+                        flow->seq++;
+                        return;
+                }
+
+                if (oldest == NULL || flow->last < oldest->last)
+                        oldest = flow;
+        }
+
+        /* new flow: reuse a free slot or evict the least recently seen flow */
+
+        if (victim == NULL)
+        {
+                victim = oldest;
+                if ((int64_t)(now - victim->last) <= (int64_t)ft->timeout)
+                        Q_FLOW_SHARD(descr, n)->evicted++;
+
+                pfq_flow_export(descr, n, victim);
+        }
+
+        victim->seq++;
+        smp_wmb();
+
+        key.seq       = victim->seq;
+        key.packets   = 1;
+        key.bytes     = skb->len + skb->mac_len;
+        key.first     = now;
+        key.last      = now;
+        key.tcp_flags = flags;
+
+        memcpy((char *)victim + sizeof(victim->seq), (char *)&key + sizeof(key.seq), 
+               sizeof(struct pfq_flow) - sizeof(key.seq));
+
+        smp_wmb();
+        victim->seq++;
+}
+
+
+/* the sweep timer of a shard runs on the cpu that owns it, and stops
+ * re-arming once the cpu goes offline */
+
+static void
+pfq_flow_sweep(unsigned long data)
+{
+        struct pfq_flow_sweep *sw   = (struct pfq_flow_sweep *)data;
+        struct pfq_flow_table *ft   = sw->table;
+        struct pfq_flow_descr *descr = ft->descr;
+        struct pfq_flow *table = Q_FLOW_TABLE(descr, sw->shard);
+        unsigned int mask = descr->slots - 1;
+        unsigned int step = max_t(unsigned int, descr->slots / Q_FLOW_SWEEP_STEPS, 1);
+        uint64_t now = pfq_flow_now(NULL);
+        unsigned int i;
+
+        for(i = 0; i < step; i++)
+        {
+                struct pfq_flow *flow = &table[sw->next];
+
+                if (flow->version && (int64_t)(now - flow->last) > (int64_t)ft->timeout)
+                {
+                        pfq_flow_export(descr, sw->shard, flow);
+                        pfq_flow_release(flow);
+                }
+
+                sw->next = (sw->next + 1) & mask;
+        }
+
+        if (ACCESS_ONCE(sw->armed))
+        {
+                sw->timer.expires = jiffies + Q_FLOW_SWEEP_PERIOD;
+                add_timer_on(&sw->timer, sw->shard);
+        }
+}
+
+
+static void
+pfq_flow_sweep_start(struct pfq_flow_table *ft, unsigned int cpu)
+{
+        struct pfq_flow_sweep *sw = &ft->sweep[cpu];
+
+        if (sw->armed)
+                return;
+
+        sw->armed = true;
+        sw->timer.expires = jiffies + Q_FLOW_SWEEP_PERIOD;
+        add_timer_on(&sw->timer, cpu);
+}
+
+
+static void
+pfq_flow_sweep_stop(struct pfq_flow_table *ft, unsigned int cpu)
+{
+        struct pfq_flow_sweep *sw = &ft->sweep[cpu];
+
+        if (!sw->armed)
+                return;
+
+        sw->armed = false;
+        smp_wmb();
+
+        del_timer_sync(&sw->timer);
+}
+
+
+/* cpu hotplug: called with the hotplug lock held, which the tables take 
+ * before pfq_flow_mutex */
+
+static void
+pfq_flow_cpu_up(unsigned int cpu)
+{
+        struct pfq_flow_table *ft;
+
+        mutex_lock(&pfq_flow_mutex);
+        list_for_each_entry(ft, &pfq_flow_tables, list)
+                pfq_flow_sweep_start(ft, cpu);
+        mutex_unlock(&pfq_flow_mutex);
+}
+
+
+static void
+pfq_flow_cpu_down(unsigned int cpu)
+{
+        struct pfq_flow_table *ft;
+
+        mutex_lock(&pfq_flow_mutex);
+        list_for_each_entry(ft, &pfq_flow_tables, list)
+                pfq_flow_sweep_stop(ft, cpu);
+        mutex_unlock(&pfq_flow_mutex);
+}
+
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+
+static enum cpuhp_state pfq_flow_hp_state;
+
+static int
+pfq_flow_cpu_online(unsigned int cpu)
+{
+        pfq_flow_cpu_up(cpu);
+        return 0;
+}
+
+static int
+pfq_flow_cpu_offline(unsigned int cpu)
+{
+        pfq_flow_cpu_down(cpu);
+        return 0;
+}
+
+#else
+
+static int
+pfq_flow_cpu_callback(struct notifier_block *nb, unsigned long action, void *hcpu)
+{
+        unsigned int cpu = (unsigned long)hcpu;
+
+        switch(action & ~CPU_TASKS_FROZEN)
+        {
+        case CPU_ONLINE:
+        case CPU_DOWN_FAILED:
+                pfq_flow_cpu_up(cpu);
+                break;
+        case CPU_DOWN_PREPARE:
+                pfq_flow_cpu_down(cpu);
+                break;
+        }
+
+        return NOTIFY_OK;
+}
+
+static struct notifier_block pfq_flow_cpu_notifier = 
+{
+        .notifier_call = pfq_flow_cpu_callback,
+};
+
+#endif
+
+
+int
+pfq_flow_init(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+        int ret = cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN, "net/pfq:flow", 
+                                            pfq_flow_cpu_online, pfq_flow_cpu_offline);
+        if (ret < 0)
+                return ret;
+        pfq_flow_hp_state = ret;
+        return 0;
+#else
+        return register_hotcpu_notifier(&pfq_flow_cpu_notifier);
+#endif
+}
+
+
+void
+pfq_flow_exit(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+        if (pfq_flow_hp_state > 0)
+                cpuhp_remove_state_nocalls(pfq_flow_hp_state);
+#else
+        unregister_hotcpu_notifier(&pfq_flow_cpu_notifier);
+#endif
+}
+
+
+struct pfq_flow_table *
+pfq_flow_table_alloc(const struct pfq_flow_opt *opt)
+{
+        struct pfq_flow_table *ft;
+        unsigned int shards = nr_cpu_ids;
+        size_t shard_size, mem;
+        unsigned int cpu;
+
+        if (opt->slots == 0 || (opt->slots & (opt->slots-1)) ||
+            opt->ring_slots == 0 || (opt->ring_slots & (opt->ring_slots-1)))
+                return NULL;
+
+        shard_size = sizeof(struct pfq_flow_shard) + 
+                        (size_t)(opt->slots + opt->ring_slots) * sizeof(struct pfq_flow);
+
+        mem = PAGE_ALIGN(sizeof(struct pfq_flow_descr) + shards * shard_size);
+
+        ft = kzalloc(sizeof(struct pfq_flow_table), GFP_KERNEL);
+        if (ft == NULL)
+                return NULL;
+
+        ft->sweep = kzalloc(shards * sizeof(struct pfq_flow_sweep), GFP_KERNEL);
+        if (ft->sweep == NULL)
+                goto err;
+
+        /* memory is already zeroed */
+        ft->descr = vmalloc_user(mem);
+        if (ft->descr == NULL)
+        {
+                printk(KERN_WARNING "[PF_Q] flow table: out of memory (%zu bytes)\n", mem);
+                goto err;
+        }
+
+        ft->mem     = mem;
+        ft->timeout = (uint64_t)opt->timeout * 1000000;
+        ft->capture = opt->capture;
+
+        ft->descr->shards     = shards;
+        ft->descr->slots      = opt->slots;
+        ft->descr->ring_slots = opt->ring_slots;
+        ft->descr->timeout    = opt->timeout;
+        ft->descr->shard_size = shard_size;
+
+        smp_wmb();
+
+        /* every shard gets a timer, armed on the cpus online now and by 
+         * the hotplug callbacks later on */
+
+        if (opt->timeout)
+        {
+                for(cpu = 0; cpu < shards; cpu++)
+                {
+                        struct pfq_flow_sweep *sw = &ft->sweep[cpu];
+
+                        sw->table = ft;
+                        sw->shard = cpu;
+                        setup_timer(&sw->timer, pfq_flow_sweep, (unsigned long)sw);
+                }
+
+                get_online_cpus();
+                mutex_lock(&pfq_flow_mutex);
+
+                for_each_online_cpu(cpu)
+                        pfq_flow_sweep_start(ft, cpu);
+
+                list_add(&ft->list, &pfq_flow_tables);
+
+                mutex_unlock(&pfq_flow_mutex);
+                put_online_cpus();
+        }
+
+        printk(KERN_INFO "[PF_Q] flow table: shards:%u slots:%u ring:%u mem:%zu\n", 
+                        shards, opt->slots, opt->ring_slots, mem);
+        return ft;
+err:
+        kfree(ft->sweep);
+        kfree(ft);
+        return NULL;
+}
+
+
+void
+pfq_flow_table_free(struct pfq_flow_table *ft)
+{
+        unsigned int n;
+
+        if (ft == NULL)
+                return;
+
+        /* stop the sweep timers, out of reach of the hotplug callbacks */
+
+        if (ft->timeout)
+        {
+                get_online_cpus();
+                mutex_lock(&pfq_flow_mutex);
+
+                list_del(&ft->list);
+
+                for(n = 0; n < ft->descr->shards; n++)
+                        pfq_flow_sweep_stop(ft, n);
+
+                mutex_unlock(&pfq_flow_mutex);
+                put_online_cpus();
+        }
+
+        vfree(ft->descr);
+        kfree(ft->sweep);
+        kfree(ft);
+}
@@ -0,0 +1,74 @@
+/***************************************************************
+ *                                                
+ * (C) 2011-12 Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#ifndef _PF_Q_FLOW_H_
+#define _PF_Q_FLOW_H_ 
+
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/timer.h>
+#include <linux/list.h>
+
+#define __PFQ_MODULE__
+#include <linux/pf_q.h>
+
+/* per-cpu sharded flow table: each shard is updated by a single cpu, 
+ * either from the receive path or from its own sweep timer (both run 
+ * in softirq context on that cpu). The sweep timer of a shard is armed 
+ * while its cpu is online.
+ */
+
+struct pfq_flow_sweep
+{
+    struct timer_list       timer;
+    struct pfq_flow_table * table;
+    unsigned int            shard;
+    unsigned int            next;       /* next slot to visit */
+    bool                    armed;      /* the cpu is online: the timer re-arms */
+};
+
+
+struct pfq_flow_table
+{
+    struct pfq_flow_descr * descr;      /* vmalloc_user memory, mapped to user-space */
+    size_t                  mem;
+
+    uint64_t                timeout;    /* nanoseconds */
+    int                     capture;
+
+    struct pfq_flow_sweep * sweep;      /* one per shard */
+    struct list_head        list;       /* tables with a sweep, for cpu hotplug */
+};
+
+
+extern int  pfq_flow_init(void);
+extern void pfq_flow_exit(void);
+
+extern struct pfq_flow_table * pfq_flow_table_alloc(const struct pfq_flow_opt *opt);
+extern void pfq_flow_table_free(struct pfq_flow_table *ft);
+
+extern void pfq_flow_update(struct pfq_flow_table *ft, const struct sk_buff *skb);
+
+#endif /* _PF_Q_FLOW_H_ */
@@ -28,6 +28,10 @@ MODULE_LICENSE("GPL");
 
 DEFINE_SEMAPHORE(global_sem);
 
-struct pfq_global_t global;
+struct pfq_global_t global = 
+{
+    .devmap        = { .entries = LIST_HEAD_INIT(global.devmap.entries) },
+    .devmap_egress = { .entries = LIST_HEAD_INIT(global.devmap_egress.entries) },
+};
 
 
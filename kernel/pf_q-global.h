@@ -28,15 +28,45 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/semaphore.h>
+#include <linux/list.h>
 
 #define __PFQ_MODULE__
 #include <linux/pf_q.h>
 
+/* device registry: the subscriptions are kept (under global_sem) in a list
+   sorted by (ifindex, queue); every update publishes a new immutable
+   snapshot (struct pfq_devmap, see pf_q-devmap.h) read under rcu. */
+
+struct pfq_devmap;
+
+struct pfq_devmap_table
+{
+    struct list_head            entries;
+    struct pfq_devmap __rcu *   map;        /* NULL = no subscription */
+};
+
+
 struct pfq_global_t
 {
     /* devmap */
-    volatile unsigned long devmap  [Q_MAX_DEVICE][Q_MAX_HW_QUEUE];
-    volatile uint8_t devmap_monitor[Q_MAX_DEVICE];
+    struct pfq_devmap_table devmap;
+    struct pfq_devmap_table devmap_egress;  /* transmitted packets, any queue */
+
+    /* vlan and mpls maps (second-level steering) */
+    volatile unsigned long vlanmap [Q_MAX_VLAN];
+    volatile unsigned long vlanmap_filter;          /* sockets subscribed to some vlan */
+
+    struct 
+    {
+        volatile uint32_t       label;              /* label + 1, 0 = empty */
+        volatile unsigned long  mask;
+    } mplsmap[Q_MAX_MPLS];
+    volatile unsigned long mplsmap_filter;          /* sockets subscribed to some label */
+
+    /* classification */
+    volatile int           class_rules;             /* number of rules installed */
+    volatile unsigned long classmap[Q_MAX_CLASS];
+    volatile unsigned long classmap_filter;         /* sockets subscribed to some class */
 
     /* timestamp */
     atomic_t   tstamp;
@@ -0,0 +1,290 @@
+/***************************************************************
+ *                                                
+ * (C) 2011-12 Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <net/genetlink.h>
+
+#define __PFQ_MODULE__
+#include <linux/pf_q.h>
+
+#include <pf_q-netlink.h>
+
+
+MODULE_LICENSE("GPL");
+
+
+#define Q_GENL_MAX_BINDINGS     4096
+#define Q_GENL_MAX_REPLY        (1 << 20)
+
+
+static struct genl_family pfq_genl_family;
+
+
+static struct nla_policy pfq_genl_policy[Q_ATTR_MAX + 1] = 
+{
+    [Q_ATTR_SOCKETS]    = { .type = NLA_U64 },
+    [Q_ATTR_BALANCE]    = { .type = NLA_U64 },
+    [Q_ATTR_BINDINGS]   = { .type = NLA_NESTED },
+    [Q_ATTR_BINDING]    = { .type = NLA_NESTED },
+};
+
+
+static struct nla_policy pfq_genl_bind_policy[Q_BIND_MAX + 1] = 
+{
+    [Q_BIND_ID]         = { .type = NLA_U32 },
+    [Q_BIND_IFINDEX]    = { .type = NLA_S32 },
+    [Q_BIND_QUEUE]      = { .type = NLA_S32 },
+    [Q_BIND_EGRESS]     = { .type = NLA_FLAG },
+    [Q_BIND_MASK]       = { .type = NLA_U64 },
+};
+
+
+static int 
+pfq_genl_parse_binding(const struct nlattr *attr, struct pfq_devmap_binding *b)
+{
+    struct nlattr *tb[Q_BIND_MAX + 1];
+    int err;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0)
+    err = nla_parse_nested(tb, Q_BIND_MAX, attr, pfq_genl_bind_policy);
+#else
+    err = nla_parse_nested(tb, Q_BIND_MAX, attr, pfq_genl_bind_policy, NULL);
+#endif
+    if (err < 0)
+        return err;
+
+    if (tb[Q_BIND_ID] == NULL)
+        return -EINVAL;
+
+    b->id     = nla_get_u32(tb[Q_BIND_ID]);
+    b->index  = tb[Q_BIND_IFINDEX] ? nla_get_s32(tb[Q_BIND_IFINDEX]) : Q_ANY_DEVICE;
+    b->queue  = tb[Q_BIND_QUEUE]   ? nla_get_s32(tb[Q_BIND_QUEUE])   : Q_ANY_QUEUE;
+    b->egress = nla_get_flag(tb[Q_BIND_EGRESS]);
+    return 0;
+}
+
+
+static int 
+pfq_genl_apply(struct sk_buff *skb, struct genl_info *info)
+{
+    struct pfq_devmap_binding *b = NULL;
+    unsigned long sockets, balance = 0;
+    struct nlattr *attr;
+    int n = 0, rem, ret;
+
+    if (info->attrs[Q_ATTR_SOCKETS] == NULL)
+        return -EINVAL;
+
+    sockets = (unsigned long)nla_get_u64(info->attrs[Q_ATTR_SOCKETS]);
+
+    if (info->attrs[Q_ATTR_BALANCE])
+        balance = (unsigned long)nla_get_u64(info->attrs[Q_ATTR_BALANCE]);
+
+    if (balance & ~sockets)
+        return -EINVAL;
+
+    if (info->attrs[Q_ATTR_BINDINGS])
+    {
+        b = vmalloc(Q_GENL_MAX_BINDINGS * sizeof(struct pfq_devmap_binding));
+        if (b == NULL)
+            return -ENOMEM;
+
+        nla_for_each_nested(attr, info->attrs[Q_ATTR_BINDINGS], rem)
+        {
+            if (nla_type(attr) != Q_ATTR_BINDING || n == Q_GENL_MAX_BINDINGS) {
+                ret = -EINVAL;
+                goto out;
+            }
+            if ((ret = pfq_genl_parse_binding(attr, &b[n++])) < 0)
+                goto out;
+        }
+    }
+
+    ret = pfq_ctrl_apply(b, n, sockets, balance);
+out:
+    vfree(b);
+    return ret < 0 ? ret : 0;
+}
+
+
+struct pfq_genl_dump
+{
+    struct sk_buff *skb;
+    struct nlattr  *nest;
+};
+
+
+/* nla_put_u64 is gone since 4.7: the u64 attributes are padded to 8 bytes */
+
+static inline int
+pfq_nla_put_u64(struct sk_buff *skb, int type, u64 value, int pad)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,7,0)
+    return nla_put_u64(skb, type, value);
+#else
+    return nla_put_u64_64bit(skb, type, value, pad);
+#endif
+}
+
+
+static int
+pfq_genl_put_binding(void *arg, int index, int queue, bool egress, unsigned long mask)
+{
+    struct pfq_genl_dump *d = arg;
+    struct nlattr *nest = nla_nest_start(d->skb, Q_ATTR_BINDING);
+
+    if (nest == NULL)
+        return -EMSGSIZE;
+
+    if (nla_put_s32(d->skb, Q_BIND_IFINDEX, index) ||
+        nla_put_s32(d->skb, Q_BIND_QUEUE, queue) ||
+        (egress && nla_put_flag(d->skb, Q_BIND_EGRESS)) ||
+        pfq_nla_put_u64(d->skb, Q_BIND_MASK, mask, Q_BIND_PAD))
+    {
+        nla_nest_cancel(d->skb, nest);
+        return -EMSGSIZE;
+    }
+
+    nla_nest_end(d->skb, nest);
+    return 0;
+}
+
+
+static int 
+pfq_genl_dump(struct sk_buff *skb, struct genl_info *info)
+{
+    size_t size = NLMSG_GOODSIZE;
+    struct pfq_genl_dump d;
+    void *hdr;
+    int ret;
+
+    /* the reply is built in one go: retry with a larger buffer when the bindings do not fit */
+
+    for(;;)
+    {
+        d.skb = genlmsg_new(size, GFP_KERNEL);
+        if (d.skb == NULL)
+            return -ENOMEM;
+
+        hdr = genlmsg_put_reply(d.skb, info, &pfq_genl_family, 0, Q_CMD_DUMP);
+        if (hdr == NULL) {
+            ret = -EMSGSIZE;
+            goto fail;
+        }
+
+        if (pfq_nla_put_u64(d.skb, Q_ATTR_SOCKETS, pfq_ctrl_sockets(), Q_ATTR_PAD) ||
+            pfq_nla_put_u64(d.skb, Q_ATTR_BALANCE, pfq_ctrl_balance(), Q_ATTR_PAD) ||
+            (d.nest = nla_nest_start(d.skb, Q_ATTR_BINDINGS)) == NULL) {
+            ret = -EMSGSIZE;
+            goto fail;
+        }
+
+        ret = pfq_devmap_dump(pfq_genl_put_binding, &d);
+        if (ret == 0)
+            break;
+    fail:
+        nlmsg_free(d.skb);
+        if (ret != -EMSGSIZE || size >= Q_GENL_MAX_REPLY)
+            return ret;
+        size <<= 1;
+    }
+
+    nla_nest_end(d.skb, d.nest);
+    genlmsg_end(d.skb, hdr);
+
+    return genlmsg_reply(d.skb, info);
+}
+
+
+static struct genl_ops pfq_genl_ops[] = 
+{
+    {
+        .cmd    = Q_CMD_APPLY,
+        .flags  = GENL_ADMIN_PERM,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+        .policy = pfq_genl_policy,
+#endif
+        .doit   = pfq_genl_apply,
+    },
+    {
+        .cmd    = Q_CMD_DUMP,
+        .flags  = GENL_ADMIN_PERM,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+        .policy = pfq_genl_policy,
+#endif
+        .doit   = pfq_genl_dump,
+    },
+};
+
+
+static struct genl_family pfq_genl_family = 
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+    .id         = GENL_ID_GENERATE,
+#endif
+    .hdrsize    = 0,
+    .name       = Q_GENL_NAME,
+    .version    = Q_GENL_VERSION,
+    .maxattr    = Q_ATTR_MAX,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+    .module     = THIS_MODULE,
+    .ops        = pfq_genl_ops,
+    .n_ops      = ARRAY_SIZE(pfq_genl_ops),
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+    .policy     = pfq_genl_policy,
+#endif
+};
+
+
+int pfq_netlink_init(void)
+{
+    int err;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+    err = genl_register_family_with_ops(&pfq_genl_family, pfq_genl_ops, ARRAY_SIZE(pfq_genl_ops));
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+    err = genl_register_family_with_ops(&pfq_genl_family, pfq_genl_ops);
+#else
+    err = genl_register_family(&pfq_genl_family);
+#endif
+    if (err < 0) {
+        printk(KERN_WARNING "[PF_Q] netlink: could not register the family (%d)\n", err);
+        return err;
+    }
+
+    printk(KERN_INFO "[PF_Q] netlink: family %s registered\n", Q_GENL_NAME);
+    return 0;
+}
+
+
+void pfq_netlink_exit(void)
+{
+    genl_unregister_family(&pfq_genl_family);
+}
@@ -0,0 +1,46 @@
+/***************************************************************
+ *                                                
+ * (C) 2011-12 Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#ifndef _PF_Q_NETLINK_H_
+#define _PF_Q_NETLINK_H_ 
+
+#include <linux/kernel.h>
+
+#include <pf_q-devmap.h>
+
+/* generic netlink control plane: bulk configuration of the bindings, 
+ * applied as a single transaction (see Q_CMD_APPLY in linux/pf_q.h). 
+ */
+
+extern int  pfq_netlink_init(void);
+extern void pfq_netlink_exit(void);
+
+/* provided by pf_q.c */
+
+extern int  pfq_ctrl_apply(const struct pfq_devmap_binding *b, int n, unsigned long sockets, unsigned long balance);
+extern unsigned long pfq_ctrl_sockets(void);
+extern unsigned long pfq_ctrl_balance(void);
+
+#endif /* _PF_Q_NETLINK_H_ */
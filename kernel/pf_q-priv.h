@@ -32,6 +32,8 @@
 
 #include <mpsc-skbuff.h>
 #include <sparse-counter.h>
+#include <pf_q-dedup.h>
+#include <pf_q-flow.h>
 
 /* sparse_counter_t stats */
 
@@ -40,6 +42,7 @@ typedef struct pfq_kstats
     sparse_counter_t  recv;    // received by the queue    
     sparse_counter_t  lost;    // queue is full, packet is lost
     sparse_counter_t  drop;    // filter
+    sparse_counter_t  dupl;    // duplicate (dedup)
 
 } pfq_kstat_t;
 
@@ -51,22 +54,42 @@ struct pfq_opt
         int             q_tstamp;
         
         void *          q_addr;
-        size_t          q_queue_mem;  /* > sizeof(pfq_queue_descr) + q_slots * sizeof(slots) * 2 */
+        size_t          q_queue_mem;  /* > Q_QUEUE_DESCR_SIZE + q_slots * sizeof(slots) * 2 */
 
         size_t          q_slots;      /* number of slots per queue */
         size_t          q_caplen;
         size_t          q_offset;    
         size_t          q_slot_size;
+        int             q_hdr_version;
+
+        struct pfq_dedup *q_dedup;   /* allocated on demand */
+        struct pfq_flow_table *q_flow;
 
         wait_queue_head_t q_waitqueue;
 
         pfq_kstat_t     q_stat;
 
+        struct sock *   q_sk;         /* owner, for the socket filter */
+
         int             q_active;
 
 } __attribute__((aligned(128)));
 
 
+/* private control block of the sk_buff, set in pfq_direct_receive */
+
+struct pfq_cb
+{
+        uint16_t mark;          /* class */
+        uint8_t  egress;        /* transmitted by the host */
+        uint8_t  direct;        /* soft rss: arguments of pfq_direct_receive */
+        uint16_t hw_queue;
+        int      if_index;
+};
+
+#define PFQ_CB(skb) ((struct pfq_cb *)(skb)->cb)
+
+
 struct pfq_sock
 {
         struct sock sk;
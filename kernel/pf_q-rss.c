@@ -0,0 +1,227 @@
+/***************************************************************
+ *                                                
+ * (C) 2011-12 Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+
+#include <pf_q-rss.h>
+#include <pf_q-priv.h>
+
+
+MODULE_LICENSE("GPL");
+
+
+#define Q_RSS_BUDGET    64      /* packets processed with bottom halves disabled */
+
+
+int pfq_rss_workers = 0;
+
+static struct pfq_rss_worker * pfq_rss_worker;
+
+
+/* symmetric hash of the ip addresses, both directions of a flow go to the same worker */
+
+static inline uint32_t
+pfq_rss_hash(const struct sk_buff *skb)
+{
+        int offset = skb_network_offset(skb);
+        __be16 proto = skb->protocol;
+        uint32_t hash = 0;
+
+        if (proto == __constant_htons(ETH_P_8021Q))
+        {
+                struct vlan_hdr _vh, *vh;
+                vh = skb_header_pointer(skb, offset, sizeof(_vh), &_vh);
+                if (vh == NULL)
+                        return 0;
+
+                proto   = vh->h_vlan_encapsulated_proto;
+                offset += VLAN_HLEN;
+        }
+
+        switch(proto)
+        {
+        case __constant_htons(ETH_P_IP): 
+            {
+                    __be32 _addr[2], *addr;
+                    addr = skb_header_pointer(skb, offset + offsetof(struct iphdr, saddr), sizeof(_addr), _addr);
+                    if (addr)
+                            hash = addr[0] ^ addr[1];
+            } break;
+
+        case __constant_htons(ETH_P_IPV6): 
+            {
+                    __be32 _addr[8], *addr;
+                    int n;
+                    addr = skb_header_pointer(skb, offset + offsetof(struct ipv6hdr, saddr), sizeof(_addr), _addr);
+                    if (addr)
+                            for(n = 0; n < 8; n++)
+                                    hash ^= addr[n];
+            } break;
+        }
+
+        hash ^= hash >> 16;
+        hash *= 0x45d9f3b;
+        hash ^= hash >> 16;
+        return hash;
+}
+
+
+void 
+pfq_rss_push(struct sk_buff *skb)
+{
+        struct pfq_rss_worker *w = &pfq_rss_worker[((uint64_t)pfq_rss_hash(skb) * pfq_rss_workers) >> 32];
+
+        /* xchg in push is a full barrier: pairs with the one in the worker */
+
+        mpsc_queue_push(&w->queue, skb);
+
+        if (atomic_read(&w->sleeping))
+                wake_up_process(w->task);
+}
+
+
+static int
+pfq_rss_thread(void *data)
+{
+        struct pfq_rss_worker *w = (struct pfq_rss_worker *)data;
+
+        while (!kthread_should_stop())
+        {
+                struct sk_buff *skb = NULL;
+                int n;
+
+                local_bh_disable();
+
+                for(n = 0; n < Q_RSS_BUDGET; n++)
+                {
+                        skb = mpsc_queue_pop(&w->queue);
+                        if (skb == NULL)
+                                break;
+
+                        pfq_receive(skb, PFQ_CB(skb)->if_index, PFQ_CB(skb)->hw_queue, PFQ_CB(skb)->direct);
+                }
+
+                local_bh_enable();
+
+                if (n)
+                {
+                        cond_resched();
+                        continue;
+                }
+
+                set_current_state(TASK_INTERRUPTIBLE);
+                atomic_set(&w->sleeping, 1);
+                smp_mb();
+
+                if (mpsc_queue_empty(&w->queue) && !kthread_should_stop())
+                        schedule();
+
+                __set_current_state(TASK_RUNNING);
+                atomic_set(&w->sleeping, 0);
+        }
+
+        return 0;
+}
+
+
+int 
+pfq_rss_init(int workers)
+{
+        int cpu, n = 0;
+
+        if (workers <= 0)
+                return 0;
+
+        workers = min(workers, (int)num_online_cpus());
+
+        pfq_rss_worker = kzalloc(workers * sizeof(struct pfq_rss_worker), GFP_KERNEL);
+        if (pfq_rss_worker == NULL)
+                return -ENOMEM;
+
+        for_each_online_cpu(cpu)
+        {
+                struct pfq_rss_worker *w = &pfq_rss_worker[n];
+
+                if (n == workers)
+                        break;
+
+                if (mpsc_queue_ctor(&w->queue) < 0)
+                        goto err;
+
+                w->cpu  = cpu;
+                w->task = kthread_create(pfq_rss_thread, w, "kpfq_rss/%d", cpu);
+                if (IS_ERR(w->task))
+                {
+                        printk(KERN_WARNING "[PF_Q] soft rss: could not create worker on cpu %d\n", cpu);
+                        w->task = NULL;
+                        mpsc_queue_dtor(&w->queue);
+                        goto err;
+                }
+
+                kthread_bind(w->task, cpu);
+                wake_up_process(w->task);
+                n++;
+        }
+
+        pfq_rss_workers = n;
+
+        printk(KERN_INFO "[PF_Q] soft rss: %d workers\n", n);
+        return 0;
+err:
+        pfq_rss_workers = n;
+        pfq_rss_exit();
+        return -ENOMEM;
+}
+
+
+/* to be called when no more packets are pushed */
+
+void 
+pfq_rss_exit(void)
+{
+        int n, workers = pfq_rss_workers;
+
+        if (pfq_rss_worker == NULL)
+                return;
+
+        pfq_rss_workers = 0;
+
+        for(n = 0; n < workers; n++)
+        {
+                kthread_stop(pfq_rss_worker[n].task);
+                mpsc_queue_dtor(&pfq_rss_worker[n].queue);
+        }
+
+        kfree(pfq_rss_worker);
+        pfq_rss_worker = NULL;
+}
@@ -0,0 +1,69 @@
+/***************************************************************
+ *                                                
+ * (C) 2011-12 Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#ifndef _PF_Q_RSS_H_
+#define _PF_Q_RSS_H_ 
+
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/sched.h>
+
+#include <mpsc-skbuff.h>
+
+/* software rss: the receiving cpu only hashes the packet and pushes it 
+ * to the worker selected by the hash; workers (one kthread per cpu) run 
+ * the rest of the receive path. Packets of the same flow are handled 
+ * by the same worker, in order. 
+ */
+
+struct pfq_rss_worker
+{
+    mpsc_queue_t            queue;
+    struct task_struct *    task;
+    atomic_t                sleeping;
+    int                     cpu;
+
+} __attribute__((aligned(128)));
+
+
+extern int  pfq_rss_workers;   /* 0 = disabled */
+
+extern int  pfq_rss_init(int workers);
+extern void pfq_rss_exit(void);
+
+extern void pfq_rss_push(struct sk_buff *skb);
+
+/* the receive path run by the workers (pf_q.c) */
+
+extern int  pfq_receive(struct sk_buff *skb, int index, int queue, bool direct);
+
+
+static inline
+bool pfq_rss_enabled(void)
+{
+    return pfq_rss_workers != 0;
+}
+
+#endif /* _PF_Q_RSS_H_ */
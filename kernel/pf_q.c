@@ -28,6 +28,7 @@
 #include <linux/moduleparam.h>
 #include <linux/semaphore.h>
 #include <linux/socket.h>  
+#include <linux/sockios.h>
 #include <linux/types.h>
 #include <linux/skbuff.h>
 #include <linux/highmem.h>
@@ -36,6 +37,7 @@
 #include <linux/poll.h>
 #include <linux/etherdevice.h>
 #include <linux/if_vlan.h>  // VLAN_ETH_HLEN
+#include <linux/filter.h>
 #include <net/sock.h>
 #ifdef CONFIG_INET
 #include <net/inet_common.h>
@@ -46,6 +48,9 @@
 
 #include <pf_q-priv.h>
 #include <pf_q-devmap.h>
+#include <pf_q-class.h>
+#include <pf_q-rss.h>
+#include <pf_q-netlink.h>
 #include <mpdb-queue.h>
 
 struct net_proto_family  pfq_family_ops;
@@ -57,8 +62,23 @@ static int direct_path  = 0;
 static int pipeline_len = 16;
 static int queue_slots  = 131072; // slots per queue
 static int cap_len      = 1514;
+static int dedup_slots  = 65536; // slots per dedup table
+static int soft_rss     = 0;     // software rss workers
 
 DEFINE_SEMAPHORE(loadbalance_sem);
+DEFINE_SEMAPHORE(egress_sem);
+
+/* direct path: the handlers capturing egress traffic (under egress_sem) */
+
+struct pfq_egress_hook
+{
+        struct list_head        list;
+        struct packet_type      pt;
+        int                     index;      /* Q_ANY_DEVICE: every device */
+        bool                    keep;
+};
+
+static LIST_HEAD(egress_hooks);
 
 static unsigned long long loadbalance_mask = 0;
 
@@ -75,16 +95,24 @@ module_param(direct_path,  int, 0644);
 module_param(pipeline_len, int, 0644);
 module_param(cap_len,      int, 0644);
 module_param(queue_slots,  int, 0644);
+module_param(dedup_slots,  int, 0644);
+module_param(soft_rss,     int, 0444);
 
 
 MODULE_PARM_DESC(direct_path, " Direct Path: 0 = classic, 1 = direct");
 MODULE_PARM_DESC(cap_len,     " Default capture length (bytes)");
 MODULE_PARM_DESC(pipeline_len," Pipeline length");
 MODULE_PARM_DESC(queue_slots, " Queue slots (default=131072)");
+MODULE_PARM_DESC(dedup_slots, " Dedup table slots (default=65536)");
+MODULE_PARM_DESC(soft_rss,    " Software RSS: number of worker cpus (0 = disabled)");
 
 /* atomic vector of pointers to pfq_opt */
 atomic_long_t pfq_vector[Q_MAX_ID]; 
 
+/* sockets being released: their id is still taken, but the control plane 
+ * must not bind them again (under global_sem) */
+static unsigned long pfq_closing;
+
 
 /* uhm okay, this is a legit form of static polymorphism */
 
@@ -137,24 +165,89 @@ void pfq_release_id(unsigned int id)
 }
 
 
-inline
-bool pfq_filter(const struct sk_buff *skb)
+/* run the BPF program attached with SO_ATTACH_FILTER, if any */
+
+static inline unsigned int
+pfq_run_filter(const struct sk_filter *filter, struct sk_buff *skb)
+{
+#if(LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0))
+        return bpf_prog_run_save_cb(filter->prog, skb);
+#elif(LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0))
+        return SK_RUN_FILTER(filter, skb);
+#elif(LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36))
+        return sk_run_filter(skb, filter->insns);
+#else
+        return sk_run_filter(skb, filter->insns, filter->len);
+#endif
+}
+
+
+static inline
+bool pfq_filter(struct sk_buff *skb, struct pfq_opt *pq)
 {             
-        /* TODO */
-        return true;
+        struct sk_filter *filter;
+        unsigned int res = 1;
+        int mac;
+
+        rcu_read_lock();
+
+        filter = rcu_dereference(pq->q_sk->sk_filter);
+        if (filter)
+        {
+                /* as af_packet, filters see the packet from the mac header */
+
+                mac = skb->data - skb_mac_header(skb);
+                if (mac > 0)
+                        skb_push(skb, mac);
+
+                res = pfq_run_filter(filter, skb);
+
+                if (mac > 0)
+                        skb_pull(skb, mac);
+        }
+
+        rcu_read_unlock();
+        return res != 0;
 }
 
 
 bool pfq_enqueue_skb(struct sk_buff *skb, struct pfq_opt *pq, bool clone)
 {
+        struct pfq_flow_table *ft;
+
         /* eventually filter the packet... */
 
-        if (!pfq_filter(skb))
+        if (!pfq_filter(skb, pq))
         {
                 sparse_inc(&pq->q_stat.drop);
                 return false;
         }
 
+        /* suppress duplicates (mirrored/SPAN traffic): a disabled socket 
+         * loses the packet below, it must not fill the dedup table */
+
+        if (pq->q_active && pfq_dedup_enabled(pq->q_dedup))
+        {
+                uint32_t digest;
+                if (pfq_dedup_digest(skb, &digest) && 
+                                pfq_dedup_check(pq->q_dedup, digest))
+                {
+                        sparse_inc(&pq->q_stat.dupl);
+                        return false;
+                }
+        }
+
+        /* per-flow accounting */
+
+        ft = pq->q_flow;
+        if (ft)
+        {
+                smp_read_barrier_depends();
+                pfq_flow_update(ft, skb);
+                if (!ft->capture)
+                        return false;
+        }
+
         /* enqueue the sk_buff: it's wait-free. */
 
         if (pq->q_active && mpdb_enqueue(pq, skb)) {
@@ -172,61 +265,36 @@ bool pfq_enqueue_skb(struct sk_buff *skb, struct pfq_opt *pq, bool clone)
 }
 
 
-/* pfq load balancer */
-
-unsigned long 
-pfq_load_balancer(unsigned long bm, const struct sk_buff *skb)
-{ 
-        int index[sizeof(unsigned long)<<3], i = 0;
-        unsigned long candidates = bm & loadbalance_mask;
-        unsigned long nolb = bm ^ candidates;
-        struct ethhdr *eth;
-        uint32_t hash;
-
-        eth = (struct ethhdr *)skb_mac_header(skb);
-        if (candidates == 0 || eth->h_proto != __constant_htons(ETH_P_IP))
-                return nolb;
-
-        while(candidates)
-        {
-                int zn = __builtin_ctzl(candidates);
-                index[i++] = zn;
-                candidates ^= (1<<zn);
-        }        
-        
-        hash = ip_hdr(skb)->saddr ^ ip_hdr(skb)->daddr;
-        hash = hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24);
-       
-        return nolb | ( 1 << index[hash % i] );
-}
-
-
 /* pfq skb handler */
 
 
 int 
-pfq_direct_receive(struct sk_buff *skb, int index, int queue, bool direct)
+pfq_receive(struct sk_buff *skb, int index, int queue, bool direct)
 {       
         unsigned long bm;
         int me = smp_processor_id();
         int q;
 
-        /* if required, timestamp this packet now */
+        /* get the clone/balancing bitmap */
 
-        if (atomic_read(&global.tstamp) && 
-                        skb->tstamp.tv64 == 0) {
-                __net_timestamp(skb);
-        }
+        bm =  PFQ_CB(skb)->egress ? pfq_devmap_egress_get(index) 
+                                  : pfq_devmap_get(index, queue);
 
-        /* get the clone/balancing bitmap */
+        /* vlan and mpls subscriptions */
 
-        bm =  pfq_devmap_get(index, queue);
+        bm = pfq_devmap_filter(bm, skb);
+
+        /* classify the packet, the class is stored in pfq_hdr.mark */
+
+        PFQ_CB(skb)->mark = pfq_class_get(skb);
+
+        bm = pfq_classmap_filter(bm, PFQ_CB(skb)->mark);
 
         /* load balancer among sockets */
 
         if (loadbalance_mask)
         {
-                bm = pfq_load_balancer(bm, skb);
+                bm = pfq_load_balancer(bm, (unsigned long)loadbalance_mask, skb);
         }
 
         /* send this packet to eligible sockets */
@@ -278,6 +346,41 @@ pfq_direct_receive(struct sk_buff *skb, int index, int queue, bool direct)
 }
 
 
+static int 
+pfq_capture(struct sk_buff *skb, int index, int queue, bool direct, bool egress)
+{       
+        /* if required, timestamp this packet now */
+
+        if (atomic_read(&global.tstamp) && 
+                        skb->tstamp.tv64 == 0) {
+                __net_timestamp(skb);
+        }
+
+        PFQ_CB(skb)->egress = egress;
+
+        /* software rss: hand the packet over to a worker */
+
+        if (pfq_rss_enabled())
+        {
+                PFQ_CB(skb)->direct   = direct;
+                PFQ_CB(skb)->hw_queue = queue;
+                PFQ_CB(skb)->if_index = index;
+
+                pfq_rss_push(skb);
+                return 0;
+        }
+
+        return pfq_receive(skb, index, queue, direct);
+}
+
+
+int 
+pfq_direct_receive(struct sk_buff *skb, int index, int queue, bool direct)
+{       
+        return pfq_capture(skb, index, queue, direct, false);
+}
+
+
 /* simple HANDLER */       
 
 int 
@@ -290,6 +393,16 @@ pfq_packet_rcv
 #endif
     )
 {
+        bool egress = skb->pkt_type == PACKET_OUTGOING;
+
+        /* in direct mode the handlers are registered for the egress traffic 
+           only: the packets received by their devices are dropped here */
+
+        if (direct_path && !egress) {
+                kfree_skb(skb);
+                return 0;
+        }
+
         if (skb_shared(skb)) {
                 struct sk_buff *nskb = skb_clone(skb, GFP_ATOMIC);
                 if (nskb == NULL) {
@@ -300,10 +413,260 @@ pfq_packet_rcv
                 skb = nskb;
         }
 
-        return pfq_direct_receive(skb, dev->ifindex, skb_get_rx_queue(skb), false);
+        if (egress)
+                return pfq_capture(skb, dev->ifindex, skb_get_queue_mapping(skb), false, true);
+
+        return pfq_capture(skb, dev->ifindex, skb_get_rx_queue(skb), false, false);
+}
+
+
+/* In direct mode the driver hands over the received packets, and packet 
+ * handlers are registered for the egress traffic only: one per device with 
+ * egress bindings (pt->dev set, the other devices do not see it), or a 
+ * single one for every device if some socket binds Q_ANY_DEVICE. Received 
+ * packets of those devices still go through the handler, to be dropped. 
+ */
+
+static struct pfq_egress_hook *
+pfq_egress_hook_find(int index)
+{
+        struct pfq_egress_hook *h;
+        list_for_each_entry(h, &egress_hooks, list)
+        {
+                if (h->index == index)
+                        return h;
+        }
+        return NULL;
+}
+
+
+static void
+pfq_egress_hook_del(struct pfq_egress_hook *h)
+{
+        dev_remove_pack(&h->pt);
+        list_del(&h->list);
+
+        printk(KERN_INFO "[PF_Q] egress handler removed (index:%d)\n", h->index);
+        kfree(h);
+}
+
+
+struct pfq_egress_want
+{
+        bool any;       /* some binding is for Q_ANY_DEVICE */
+        int  err;
+};
+
+
+static int
+pfq_egress_any(void *arg, int index, int queue, bool egress, unsigned long mask)
+{
+        struct pfq_egress_want *w = arg;
+        if (egress && index == Q_ANY_DEVICE)
+                w->any = true;
+        return 0;
+}
+
+
+/* pfq_devmap_dump callback: the hooks still bound are kept, the missing 
+ * ones registered */
+
+static int
+pfq_egress_want(void *arg, int index, int queue, bool egress, unsigned long mask)
+{
+        struct pfq_egress_want *w = arg;
+        struct pfq_egress_hook *h;
+        struct net_device *dev = NULL;
+
+        if (!egress || (w->any != (index == Q_ANY_DEVICE)))
+                return 0;
+
+        h = pfq_egress_hook_find(index);
+        if (h) {
+                h->keep = true;
+                return 0;
+        }
+
+        /* a device not there yet is hooked when it registers */
+
+        if (index != Q_ANY_DEVICE)
+        {
+#if(LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24))
+                dev = dev_get_by_index(&init_net, index);
+#else
+                dev = dev_get_by_index(index);
+#endif
+                if (dev == NULL)
+                        return 0;
+        }
+
+        h = kzalloc(sizeof(struct pfq_egress_hook), GFP_KERNEL);
+        if (h == NULL) {
+                if (dev)
+                        dev_put(dev);
+                w->err = -ENOMEM;
+                return 0;
+        }
+
+        h->index    = index;
+        h->keep     = true;
+        h->pt.type  = __constant_htons(ETH_P_ALL);
+        h->pt.func  = pfq_packet_rcv;
+        h->pt.dev   = dev;
+
+        dev_add_pack(&h->pt);
+        list_add(&h->list, &egress_hooks);
+
+        /* the hook is removed at NETDEV_UNREGISTER, no reference is held */
+        if (dev)
+                dev_put(dev);
+
+        printk(KERN_INFO "[PF_Q] egress handler registered (index:%d)\n", index);
+        return 0;
+}
+
+
+static void
+pfq_egress_handler_update(void)
+{
+        struct pfq_egress_want w = { false, 0 };
+        struct pfq_egress_hook *h, *n;
+
+        if (!direct_path)
+                return;
+
+        down(&egress_sem);
+
+        list_for_each_entry(h, &egress_hooks, list)
+                h->keep = false;
+
+        if (pfq_devmap_egress_enabled())
+        {
+                pfq_devmap_dump(pfq_egress_any, &w);
+                pfq_devmap_dump(pfq_egress_want, &w);
+        }
+
+        list_for_each_entry_safe(h, n, &egress_hooks, list)
+        {
+                if (!h->keep)
+                        pfq_egress_hook_del(h);
+        }
+
+        up(&egress_sem);
+
+        if (w.err)
+                printk(KERN_WARNING "[PF_Q] egress handler: out of memory\n");
+}
+
+
+/* the hooks follow the devices: dropped when a device goes away, added 
+ * when a device with egress bindings shows up */
+
+static int
+pfq_egress_netdev_event(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+#if(LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0))
+        struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+#else
+        struct net_device *dev = ptr;
+#endif
+        struct pfq_egress_hook *h;
+
+        switch(event)
+        {
+        case NETDEV_UNREGISTER:
+                down(&egress_sem);
+                h = pfq_egress_hook_find(dev->ifindex);
+                if (h && h->pt.dev == dev)
+                        pfq_egress_hook_del(h);
+                up(&egress_sem);
+                break;
+
+        case NETDEV_REGISTER:
+                pfq_egress_handler_update();
+                break;
+        }
+
+        return NOTIFY_DONE;
+}
+
+
+static struct notifier_block pfq_egress_notifier = 
+{
+        .notifier_call = pfq_egress_netdev_event,
+};
+
+
+
+/* control plane (pf_q-netlink.c) */
+
+unsigned long 
+pfq_ctrl_sockets(void)
+{
+        unsigned long mask = 0;
+        int n;
+        for(n = 0; n < Q_MAX_ID; n++)
+        {
+                if (atomic_long_read(&pfq_vector[n]))
+                        mask |= (1UL << n);
+        }
+        return mask & ~ACCESS_ONCE(pfq_closing);
+}
+
+
+unsigned long 
+pfq_ctrl_balance(void)
+{
+        return (unsigned long)loadbalance_mask;
 }
 
 
+struct pfq_ctrl_balance_arg
+{
+        unsigned long sockets;
+        unsigned long balance;
+};
+
+
+static void
+pfq_ctrl_balance_commit(void *arg)
+{
+        struct pfq_ctrl_balance_arg *lb = arg;
+        loadbalance_mask = (loadbalance_mask & ~(unsigned long long)lb->sockets) | lb->balance;
+}
+
+
+/* bindings and load balance mask are switched together: both semaphores are
+ * taken up front (global_sem first, then loadbalance_sem) and the sockets are
+ * validated under them, so that either the whole change is applied or none. */
+
+int 
+pfq_ctrl_apply(const struct pfq_devmap_binding *b, int n, unsigned long sockets, unsigned long balance)
+{
+        struct pfq_ctrl_balance_arg lb = { sockets, balance };
+        int ret;
+
+        if (down_interruptible(&global_sem) != 0)
+                return -EINTR;
+
+        if (down_interruptible(&loadbalance_sem) != 0) {
+                up(&global_sem);
+                return -EINTR;
+        }
+
+        if (sockets & ~pfq_ctrl_sockets())
+                ret = -ENOENT;
+        else
+                ret = pfq_devmap_apply(b, n, sockets, pfq_ctrl_balance_commit, &lb);
+
+        up(&loadbalance_sem);
+        up(&global_sem);
+
+        if (ret >= 0)
+                pfq_egress_handler_update();
+        return ret;
+}
+
 
 static int 
 pfq_ctor(struct pfq_opt *pq)
@@ -332,10 +695,11 @@ pfq_ctor(struct pfq_opt *pq)
         
         /* set q_slots and q_caplen default values */
         
-        pq->q_caplen    = cap_len;
-        pq->q_offset    = 0;
-        pq->q_slot_size = DBMP_QUEUE_SLOT_SIZE(cap_len);
-        pq->q_slots     = queue_slots;
+        pq->q_caplen      = cap_len;
+        pq->q_offset      = 0;
+        pq->q_hdr_version = 1;
+        pq->q_slot_size   = mpdb_slot_size(pq);
+        pq->q_slots       = queue_slots;
 
         /* disabled by default */
         pq->q_active = false;
@@ -347,6 +711,7 @@ pfq_ctor(struct pfq_opt *pq)
         sparse_set(0, &pq->q_stat.recv);
         sparse_set(0, &pq->q_stat.lost);
         sparse_set(0, &pq->q_stat.drop);
+        sparse_set(0, &pq->q_stat.dupl);
 
         return 0;
 }
@@ -358,8 +723,15 @@ pfq_dtor(struct pfq_opt *pq)
 #ifdef Q_DEBUG
         printk(KERN_INFO "[PF_Q] queue dtor\n");
 #endif
+        /* the id is free and configurable again, at once for pfq_ctrl_apply */
+
+        down(&global_sem);
+
+        pfq_closing &= ~(1UL << pq->q_id);
         pfq_release_id(pq->q_id); 
 
+        up(&global_sem);
+
         /* clean the loadbalance bit */
 
         down(&loadbalance_sem);
@@ -369,6 +741,12 @@ pfq_dtor(struct pfq_opt *pq)
         up(&loadbalance_sem);
 
         mpdb_queue_free(pq);
+
+        pfq_dedup_free(pq->q_dedup);
+        pq->q_dedup = NULL;
+
+        pfq_flow_table_free(pq->q_flow);
+        pq->q_flow = NULL;
 }
 
 
@@ -432,6 +810,9 @@ pfq_create(
                 goto ctor_err;
         }
 
+        /* the socket owns the filter attached with SO_ATTACH_FILTER */
+        pq->q_sk = sk;
+
 	smp_wmb();
 
         /* store the pq */
@@ -457,8 +838,22 @@ pfq_release(struct socket *sock)
         if(!pq)
                 return 0;
 
+        /* from now on the control plane leaves this socket alone: a binding 
+           applied after the drop would outlive it and steer packets to the 
+           next socket that takes this id */
+
+        down(&global_sem);
+        pfq_closing |= 1UL << pq->q_id;
+        up(&global_sem);
+
         /* remove this pq from demux matrix */
-        pfq_devmap_update(map_reset, Q_ANY_DEVICE, Q_ANY_QUEUE, pq->q_id);
+        if (pfq_devmap_drop(pq->q_id) < 0)
+                printk(KERN_WARNING "[PF_Q] id(%d): devmap not updated, bindings left\n", pq->q_id);
+        pfq_egress_handler_update();
+        pfq_vlanmap_update(map_reset, 0, Q_MAX_VLAN-1, pq->q_id);
+        pfq_mplsmap_update(map_reset, -1, pq->q_id);
+        pfq_classmap_update(map_reset, Q_CLASS_ANY, pq->q_id);
+        pfq_class_rule_remove(NULL, pq->q_id);
 
         pq->q_active = false;
 
@@ -468,6 +863,11 @@ pfq_release(struct socket *sock)
                 printk(KERN_INFO "[PF_Q] global.tstamp => %d\n", atomic_read(&global.tstamp));
         }
 
+        /* the devmap snapshots still referring to this socket are retired 
+           without waiting: wait here, once, for their readers */
+
+        synchronize_rcu();
+
         /* Convenient way to avoid a race condition,
          * without using rwmutexes that are very expensive 
          */
@@ -574,6 +974,7 @@ int pfq_getsockopt(struct socket *sock,
                     stat.recv = sparse_read(&pq->q_stat.recv);
                     stat.lost = sparse_read(&pq->q_stat.lost);
                     stat.drop = sparse_read(&pq->q_stat.drop);
+                    stat.dupl = sparse_read(&pq->q_stat.dupl);
 
                     if (copy_to_user(optval, &stat, sizeof(stat)))
                             return -EFAULT;
@@ -595,6 +996,32 @@ int pfq_getsockopt(struct socket *sock,
                             return -EFAULT;
             } break;
 
+        case SO_GET_FLOW_MEM: 
+            {
+                    size_t mem = pq->q_flow ? pq->q_flow->mem : 0;
+                    if (len != sizeof(mem))
+                            return -EINVAL;
+                    if (copy_to_user(optval, &mem, sizeof(mem)))
+                            return -EFAULT;
+            } break;
+
+        case SO_GET_HDR_VERSION: 
+            {
+                    if (len != sizeof(pq->q_hdr_version))
+                            return -EINVAL;
+                    if (copy_to_user(optval, &pq->q_hdr_version, sizeof(pq->q_hdr_version)))
+                            return -EFAULT;
+            } break;
+
+        case SO_GET_DEDUP: 
+            {
+                    int window = pq->q_dedup ? pq->q_dedup->window_ms : 0;
+                    if (len != sizeof(window))
+                            return -EINVAL;
+                    if (copy_to_user(optval, &window, sizeof(window)))
+                            return -EFAULT;
+            } break;
+
         default:
             return -EFAULT;
         }
@@ -682,24 +1109,46 @@ int pfq_setsockopt(struct socket *sock,
         case SO_ADD_DEVICE: 
             {
                     struct pfq_dev_queue dq;
+                    int err;
                     if (optlen != sizeof(struct pfq_dev_queue)) {
                             return -EINVAL;
                     }
                     if (copy_from_user(&dq, optval, optlen))
                             return -EFAULT;
 
-                    pfq_devmap_update(map_set, dq.if_index, dq.hw_queue, pq->q_id);
+                    err = pfq_devmap_update(map_set, dq.if_index, dq.hw_queue, pq->q_id);
+                    if (err < 0)
+                            return err;
             } break;
 
         case SO_REMOVE_DEVICE: 
             {
                     struct pfq_dev_queue dq;
+                    int err;
                     if (optlen != sizeof(struct pfq_dev_queue))
                             return -EINVAL;
                     if (copy_from_user(&dq, optval, optlen))
                             return -EFAULT;
 
-                    pfq_devmap_update(map_reset, dq.if_index, dq.hw_queue, pq->q_id);
+                    err = pfq_devmap_update(map_reset, dq.if_index, dq.hw_queue, pq->q_id);
+                    if (err < 0)
+                            return err;
+            } break;
+
+        case SO_EGRESS_DEVICE: 
+            {
+                    struct pfq_egress_dev ed;
+                    int err;
+                    if (optlen != sizeof(ed))
+                            return -EINVAL;
+                    if (copy_from_user(&ed, optval, optlen))
+                            return -EFAULT;
+
+                    err = pfq_devmap_egress_update(ed.enable ? map_set : map_reset, ed.if_index, pq->q_id);
+                    if (err < 0)
+                            return err;
+
+                    pfq_egress_handler_update();
             } break;
 
         case SO_TSTAMP_TYPE: 
@@ -724,11 +1173,29 @@ int pfq_setsockopt(struct socket *sock,
                             return -EINVAL;
                     if (copy_from_user(&pq->q_caplen, optval, optlen)) 
                             return -EFAULT;
-                    pq->q_slot_size = DBMP_QUEUE_SLOT_SIZE(pq->q_caplen);
+                    pq->q_slot_size = mpdb_slot_size(pq);
                     printk(KERN_INFO "[PF_Q] id:%d caplen:%lu -> slot_size:%lu\n", 
                                     pq->q_id, pq->q_caplen, pq->q_slot_size);
             } break;
 
+        case SO_HDR_VERSION: 
+            {
+                    int version;
+                    if (optlen != sizeof(version)) 
+                            return -EINVAL;
+                    if (copy_from_user(&version, optval, optlen)) 
+                            return -EFAULT;
+                    if (version != 1 && version != 2)
+                            return -EINVAL;
+                    if (pq->q_addr)
+                            return -EBUSY;
+
+                    pq->q_hdr_version = version;
+                    pq->q_slot_size   = mpdb_slot_size(pq);
+                    printk(KERN_INFO "[PF_Q] id:%d hdr_version:%d -> slot_size:%lu\n", 
+                                    pq->q_id, pq->q_hdr_version, pq->q_slot_size);
+            } break;
+
         case SO_OFFSET: 
             {
                     if (optlen != sizeof(pq->q_offset)) 
@@ -749,6 +1216,133 @@ int pfq_setsockopt(struct socket *sock,
                                     pq->q_id, pq->q_slots, pq->q_slot_size);
             } break;
 
+        case SO_DEDUP: 
+            {
+                    int window;
+                    if (optlen != sizeof(window)) 
+                            return -EINVAL;
+                    if (copy_from_user(&window, optval, optlen)) 
+                            return -EFAULT;
+                    if (window < 0)
+                            return -EINVAL;
+
+                    /* the table is released along with the socket */
+
+                    if (window && pq->q_dedup == NULL)
+                    {
+                            struct pfq_dedup *dd = pfq_dedup_alloc(dedup_slots);
+                            if (dd == NULL)
+                                    return -ENOMEM;
+                            dd->window = max_t(unsigned long, msecs_to_jiffies(window), 1);
+                            dd->window_ms = window;
+                            smp_wmb();
+                            pq->q_dedup = dd;
+                    }
+                    else if (pq->q_dedup)
+                    {
+                            pq->q_dedup->window = window ? max_t(unsigned long, msecs_to_jiffies(window), 1) : 0;
+                            pq->q_dedup->window_ms = window;
+                    }
+
+                    printk(KERN_INFO "[PF_Q] id:%d dedup window:%d msec\n", 
+                                    pq->q_id, window);
+            } break;
+
+        case SO_ADD_VLAN: 
+        case SO_REMOVE_VLAN: 
+            {
+                    struct pfq_vlan_range vr;
+                    if (optlen != sizeof(vr))
+                            return -EINVAL;
+                    if (copy_from_user(&vr, optval, optlen))
+                            return -EFAULT;
+                    if (vr.first < 0 || vr.last >= Q_MAX_VLAN || vr.first > vr.last)
+                            return -EINVAL;
+
+                    pfq_vlanmap_update(optname == SO_ADD_VLAN ? map_set : map_reset, vr.first, vr.last, pq->q_id);
+            } break;
+
+        case SO_ADD_MPLS: 
+        case SO_REMOVE_MPLS: 
+            {
+                    int label;
+                    if (optlen != sizeof(label))
+                            return -EINVAL;
+                    if (copy_from_user(&label, optval, optlen))
+                            return -EFAULT;
+                    if (label < 0 || label > 0xfffff)
+                            return -EINVAL;
+
+                    if (pfq_mplsmap_update(optname == SO_ADD_MPLS ? map_set : map_reset, label, pq->q_id) < 0)
+                            return -ENOSPC;
+            } break;
+
+        case SO_ADD_CLASS_RULE: 
+        case SO_REMOVE_CLASS_RULE: 
+            {
+                    struct pfq_class_rule r;
+                    int ret;
+
+                    if (optlen != sizeof(r))
+                            return -EINVAL;
+                    if (copy_from_user(&r, optval, optlen))
+                            return -EFAULT;
+
+                    if (r.class_id <= Q_CLASS_NONE || r.class_id >= Q_MAX_CLASS)
+                            return -EINVAL;
+                    if (r.proto != Q_CLASS_ANY && (r.proto < 0 || r.proto > 255))
+                            return -EINVAL;
+                    if (r.port_first == Q_CLASS_ANY) 
+                            r.port_last = Q_CLASS_ANY;
+                    else if (r.port_first < 0 || r.port_first > r.port_last || r.port_last > 65535)
+                            return -EINVAL;
+
+                    ret = optname == SO_ADD_CLASS_RULE ? pfq_class_rule_add(&r, pq->q_id) 
+                                                       : pfq_class_rule_remove(&r, pq->q_id);
+                    if (ret < 0)
+                            return ret;
+            } break;
+
+        case SO_ADD_CLASS: 
+        case SO_REMOVE_CLASS: 
+            {
+                    int class_id;
+                    if (optlen != sizeof(class_id))
+                            return -EINVAL;
+                    if (copy_from_user(&class_id, optval, optlen))
+                            return -EFAULT;
+                    if (class_id < 0 || class_id >= Q_MAX_CLASS)
+                            return -EINVAL;
+
+                    pfq_classmap_update(optname == SO_ADD_CLASS ? map_set : map_reset, class_id, pq->q_id);
+            } break;
+
+        case SO_FLOW_TABLE: 
+            {
+                    struct pfq_flow_opt fo;
+                    struct pfq_flow_table *ft;
+
+                    if (optlen != sizeof(fo)) 
+                            return -EINVAL;
+                    if (copy_from_user(&fo, optval, optlen)) 
+                            return -EFAULT;
+
+                    /* the table may be mapped by user-space: it is released 
+                     * along with the socket only */
+
+                    if (pq->q_flow)
+                            return -EBUSY;
+
+                    ft = pfq_flow_table_alloc(&fo);
+                    if (ft == NULL)
+                            return -EINVAL;
+
+                    smp_wmb();
+                    pq->q_flow = ft;
+
+                    printk(KERN_INFO "[PF_Q] id:%d flow table enabled\n", pq->q_id);
+            } break;
+
         default: 
             {
                     found = false; 
@@ -783,6 +1377,23 @@ static int pfq_mmap(struct file *file,
         unsigned long size = (unsigned long)(vma->vm_end - vma->vm_start);
         int ret;
 
+        /* the flow table is mapped read-only */
+
+        if (vma->vm_pgoff == (Q_FLOW_MMAP_OFFSET >> PAGE_SHIFT)) 
+        {
+                if (pq->q_flow == NULL)
+                        return -EINVAL;
+                if (vma->vm_flags & VM_WRITE)
+                        return -EPERM;
+                if (size > pq->q_flow->mem) {
+                        printk(KERN_INFO "[PF_Q] flow area too large\n");
+                        return -EINVAL;
+                }
+
+                vma->vm_flags &= ~VM_MAYWRITE;
+                return pfq_memory_mmap(vma, size, (char *)pq->q_flow->descr, VM_LOCKED);
+        }
+
         if(size % PAGE_SIZE) {
                 printk(KERN_INFO "[PF_Q] len not multiple of PAGE_SIZE\n");
                 return -EINVAL;
@@ -815,19 +1426,59 @@ unsigned int pfq_poll(struct file *file, struct socket *sock, poll_table * wait)
         if (q == NULL)
                 return mask;
 
+        /* always register: the flag may have been set by a previous poll 
+         * (e.g. timed out), in which case this one would never be woken up */
+
+        poll_wait(file, &pq->q_waitqueue, wait);
+
         if (mpdb_queue_len(pq) >= (pq->q_slots>>1)) {
                 q->poll_wait = 0; 
                 mask |= POLLIN | POLLRDNORM;
         }
-        else if (!q->poll_wait) {
+        else {
                 q->poll_wait = 1;
-                poll_wait(file, &pq->q_waitqueue, wait);
+                smp_mb();
+                if (mpdb_queue_len(pq) >= (pq->q_slots>>1))
+                        mask |= POLLIN | POLLRDNORM;
         }
 
         return mask;
 }
 
 
+static bool
+pfq_doorbell_rung(struct pfq_opt *pq, struct pfq_queue_descr *q)
+{
+        int door = q->doorbell;
+        return door == 0 || mpdb_queue_len(pq) >= door || q->disabled;
+}
+
+
+/* sleep until the producer rings the doorbell (see struct pfq_queue_descr) */
+
+static int
+pfq_doorbell_wait(struct socket *sock, long usec)
+{
+        struct pfq_opt *pq = pfq_sk(sock->sk)->opt;
+        struct pfq_queue_descr *q;
+        long timeout, ret;
+
+        if (pq == NULL || (q = (struct pfq_queue_descr *)pq->q_addr) == NULL)
+                return -EINVAL;
+
+        timeout = usec < 0 ? MAX_SCHEDULE_TIMEOUT : (long)usecs_to_jiffies(usec);
+
+        ret = wait_event_interruptible_timeout(pq->q_waitqueue, pfq_doorbell_rung(pq, q), timeout);
+
+        q->doorbell = 0;
+
+        if (ret < 0)
+                return ret;
+
+        return ret == 0 ? 0 : (int)mpdb_queue_len(pq);
+}
+
+
 static
 int 
 pfq_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg)
@@ -856,6 +1507,8 @@ pfq_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg)
         case SIOCSIFHWBROADCAST:
             return(inet_dgram_ops.ioctl(sock, cmd, arg));
 #endif
+        case Q_IOC_WAIT:
+            return pfq_doorbell_wait(sock, (long)arg);
         default:
             return -ENOIOCTLCMD;
         }
@@ -922,8 +1575,10 @@ void pfq_net_proto_family_ctor(void)
 static
 void register_device_handler(void)
 {
-        if (direct_path)
+        if (direct_path) {
+                register_netdevice_notifier(&pfq_egress_notifier);
                 return;
+        }
         pfq_prot_hook.func = pfq_packet_rcv;
         pfq_prot_hook.type = __constant_htons(ETH_P_ALL);
         dev_add_pack(&pfq_prot_hook);
@@ -933,8 +1588,17 @@ void register_device_handler(void)
 static
 void unregister_device_handler(void) 
 {
-        if (direct_path)
+        if (direct_path) {
+                struct pfq_egress_hook *h, *n;
+
+                unregister_netdevice_notifier(&pfq_egress_notifier);
+
+                down(&egress_sem);
+                list_for_each_entry_safe(h, n, &egress_hooks, list)
+                        pfq_egress_hook_del(h);
+                up(&egress_sem);
                 return;
+        }
         dev_remove_pack(&pfq_prot_hook); /* Remove protocol hook */
 }
 
@@ -956,6 +1620,18 @@ static int __init pfq_init_module(void)
         /* register the pfq socket */
         sock_register(&pfq_family_ops);
 
+        /* start the software rss workers */
+        if (pfq_rss_init(soft_rss) < 0)
+                printk(KERN_WARNING "[PF_Q] soft rss disabled\n");
+
+        /* the control plane is optional */
+        if (pfq_netlink_init() < 0)
+                printk(KERN_WARNING "[PF_Q] netlink control plane disabled\n");
+
+        /* the flow sweep timers follow cpu hotplug */
+        if (pfq_flow_init() < 0)
+                printk(KERN_WARNING "[PF_Q] flow table: cpu hotplug not tracked\n");
+
         /* finally register the basic device handler */
         register_device_handler();
 
@@ -970,12 +1646,28 @@ static void __exit pfq_exit_module(void)
         /* unregister the basic device handler */
         unregister_device_handler();
 
+        /* unregister the control plane */
+        pfq_netlink_exit();
+
+        /* stop the software rss workers */
+        synchronize_net();
+        pfq_rss_exit();
+
+        /* sockets are gone along with their flow tables */
+        pfq_flow_exit();
+
         /* unregister the pfq socket */
         sock_unregister(PF_Q);
 
         /* unregister the pfq protocol */
         proto_unregister(&pfq_proto);
 
+        /* drop the classification rules */
+        pfq_class_free();
+
+        /* drop the device map */
+        pfq_devmap_free();
+
         /* destroy pipeline queues */
         for(n=0; n < Q_MAX_CPU; n++) {
                 for(i=0 ; i< PFQ_PIPELINE_MAX_LEN; i++) {
@@ -1002,19 +1694,13 @@ pfq_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 {
         if (likely(pfq_direct_capture(skb)))
         {
-                int offset = 0;
-                if (skb->protocol == __constant_htons(ETH_P_802_3))
-                    offset = ETH_HLEN;
-                else if (skb->protocol == __constant_htons(ETH_P_8021Q))
-                    offset = VLAN_ETH_HLEN;
-
-                if(skb_linearize(skb) < 0)
-                {
-                        __kfree_skb(skb);
-                        return GRO_DROP;
-                }
+                /* fragmented skbs are captured as they are: the copy into the 
+                 * queue (skb_copy_bits) and the header parsers handle frags. 
+                 * As in netif_receive_skb, the network header is where 
+                 * eth_type_trans left skb->data (the vlan header, if tagged). 
+                 */
 
-                skb_set_network_header(skb, offset);
+                skb_reset_network_header(skb);
                 skb_reset_transport_header(skb);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)                
                 skb_reset_mac_len(skb);
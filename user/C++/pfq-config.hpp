@@ -0,0 +1,421 @@
+/***************************************************************
+   
+   Copyright (c) 2012, Nicola Bonelli 
+   All rights reserved. 
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions are met: 
+
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer. 
+   * Redistributions in binary form must reproduce the above copyright 
+     notice, this list of conditions and the following disclaimer in the 
+     documentation and/or other materials provided with the distribution. 
+   * Neither the name of University of Pisa nor the names of its contributors 
+     may be used to endorse or promote products derived from this software 
+     without specific prior written permission. 
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+   POSSIBILITY OF SUCH DAMAGE.
+ 
+ ***************************************************************/
+
+#ifndef _PFQ_CONFIG_HPP_
+#define _PFQ_CONFIG_HPP_ 
+
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include <pfq.hpp>
+
+#include <unistd.h>
+
+namespace net { 
+
+    /* control plane: a whole steering configuration (device/queue bindings,
+       egress bindings and load balancing of a set of sockets) applied by the
+       module as a single transaction, through the generic netlink family
+       Q_GENL_NAME. Requires CAP_NET_ADMIN. */
+
+    struct pfq_binding
+    {
+        int           if_index;
+        int           hw_queue;
+        bool          egress;
+        unsigned long mask;         // sockets 
+    };
+
+    struct pfq_state
+    {
+        unsigned long sockets;      // sockets in use
+        unsigned long balance;      // sockets taking part in load balancing
+        std::vector<pfq_binding> bindings;
+    };
+
+
+    namespace detail {
+
+        class genl_socket
+        {
+        public:
+
+            genl_socket()
+            : fd_(::socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC)), seq_(0), family_(0), buffer_(1 << 20)
+            {
+                if (fd_ == -1)
+                    throw pfq_error(errno, "PFQ: netlink socket");
+
+                sockaddr_nl addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.nl_family = AF_NETLINK;
+                if (::bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+                    ::close(fd_);
+                    throw pfq_error(errno, "PFQ: netlink bind");
+                }
+
+                family_ = resolve(Q_GENL_NAME);
+            }
+
+            ~genl_socket()
+            {
+                ::close(fd_);
+            }
+
+            genl_socket(const genl_socket &) = delete;
+            genl_socket& operator=(const genl_socket &) = delete;
+
+
+            /* message builder */
+
+            class message
+            {
+            public:
+                message(int type, int cmd, int version, int flags)
+                : data_(NLMSG_HDRLEN + GENL_HDRLEN, 0)
+                {
+                    auto h = hdr();
+                    h->nlmsg_type  = type;
+                    h->nlmsg_flags = NLM_F_REQUEST | flags;
+                    auto g = reinterpret_cast<genlmsghdr *>(NLMSG_DATA(h));
+                    g->cmd = cmd;
+                    g->version = version;
+                }
+
+                template <typename T>
+                void put(int type, const T &value)
+                {
+                    put(type, &value, sizeof(value));
+                }
+
+                void put(int type, const void *value, size_t len)
+                {
+                    size_t off = data_.size();
+                    data_.resize(off + NLA_ALIGN(NLA_HDRLEN + len), 0);
+                    auto a = reinterpret_cast<nlattr *>(&data_[off]);
+                    a->nla_type = type;
+                    a->nla_len  = NLA_HDRLEN + len;
+                    if (len)
+                        memcpy(a + 1, value, len);
+                }
+
+                size_t nest_start(int type)
+                {
+                    size_t off = data_.size();
+                    put(type, nullptr, 0);
+                    return off;
+                }
+
+                void nest_end(size_t off)
+                {
+                    reinterpret_cast<nlattr *>(&data_[off])->nla_type |= NLA_F_NESTED;
+                    reinterpret_cast<nlattr *>(&data_[off])->nla_len = data_.size() - off;
+                }
+
+                nlmsghdr *hdr()
+                {
+                    return reinterpret_cast<nlmsghdr *>(&data_[0]);
+                }
+
+                size_t size() const
+                {
+                    return data_.size();
+                }
+
+            private:
+                std::vector<char> data_;
+            };
+
+
+            message make(int cmd, int flags = 0) const
+            {
+                return message(family_, cmd, Q_GENL_VERSION, flags);
+            }
+
+
+            /* send the request and pass every reply (a genl message) to fun; 
+               returns when the request is acked or the reply is complete */
+
+            template <typename Fun>
+            void transact(message &msg, Fun fun)
+            {
+                auto h = msg.hdr();
+                h->nlmsg_len = msg.size();
+                h->nlmsg_seq = ++seq_;
+
+                sockaddr_nl kernel;
+                memset(&kernel, 0, sizeof(kernel));
+                kernel.nl_family = AF_NETLINK;
+
+                if (::sendto(fd_, h, msg.size(), 0, reinterpret_cast<sockaddr *>(&kernel), sizeof(kernel)) == -1)
+                    throw pfq_error(errno, "PFQ: netlink send");
+
+                bool ack = h->nlmsg_flags & NLM_F_ACK;
+
+                for(;;)
+                {
+                    ssize_t len = ::recv(fd_, &buffer_[0], buffer_.size(), 0);
+                    if (len < 0) {
+                        if (errno == EINTR)
+                            continue;
+                        throw pfq_error(errno, "PFQ: netlink recv");
+                    }
+
+                    for(auto r = reinterpret_cast<nlmsghdr *>(&buffer_[0]); NLMSG_OK(r, len); r = NLMSG_NEXT(r, len))
+                    {
+                        if (r->nlmsg_seq != seq_)
+                            continue;
+
+                        if (r->nlmsg_type == NLMSG_ERROR) {
+                            auto e = reinterpret_cast<nlmsgerr *>(NLMSG_DATA(r));
+                            if (e->error)
+                                throw pfq_error(-e->error, "PFQ: netlink request");
+                            return;
+                        }
+
+                        if (r->nlmsg_type == NLMSG_DONE)
+                            return;
+
+                        auto g = reinterpret_cast<genlmsghdr *>(NLMSG_DATA(r));
+                        fun(reinterpret_cast<nlattr *>(reinterpret_cast<char *>(g) + GENL_HDRLEN), 
+                            static_cast<int>(r->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN));
+
+                        if (!ack && !(r->nlmsg_flags & NLM_F_MULTI))
+                            return;
+                    }
+                }
+            }
+
+
+            /* attribute iteration */
+
+            template <typename Fun>
+            static void for_each(const nlattr *a, int len, Fun fun)
+            {
+                for(; len >= static_cast<int>(NLA_HDRLEN) && a->nla_len >= NLA_HDRLEN && a->nla_len <= len; 
+                      len -= NLA_ALIGN(a->nla_len), 
+                      a = reinterpret_cast<const nlattr *>(reinterpret_cast<const char *>(a) + NLA_ALIGN(a->nla_len)))
+                {
+                    fun(a->nla_type & NLA_TYPE_MASK, a + 1, static_cast<int>(a->nla_len - NLA_HDRLEN));
+                }
+            }
+
+            template <typename T>
+            static T get(const void *data)
+            {
+                T value;
+                memcpy(&value, data, sizeof(T));
+                return value;
+            }
+
+        private:
+
+            int resolve(const char *name)
+            {
+                message msg(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 1, 0);
+                msg.put(CTRL_ATTR_FAMILY_NAME, name, strlen(name) + 1);
+
+                int id = 0;
+                try 
+                {
+                    transact(msg, [&](const nlattr *a, int len) {
+                        for_each(a, len, [&](int type, const void *data, int) {
+                            if (type == CTRL_ATTR_FAMILY_ID)
+                                id = get<uint16_t>(data);
+                        });
+                    });
+                }
+                catch(pfq_error &e)
+                {
+                    ::close(fd_);
+                    throw pfq_error(e.code().value(), "PFQ: netlink family not found (module loaded?)");
+                }
+
+                return id;
+            }
+
+            int fd_;
+            uint32_t seq_;
+            int family_;
+            std::vector<char> buffer_;
+        };
+
+    } // namespace detail
+
+
+    class pfq_config
+    {
+    public:
+
+        pfq_config()
+        : sockets_(0), balance_(0), bindings_()
+        {}
+
+        /* the socket takes part in the transaction: its previous bindings 
+           are dropped even if no new binding is added */
+
+        pfq_config &
+        socket(int id)
+        {
+            if (id < 0 || id >= 64)
+                throw pfq_error("PFQ: bad socket id");
+            sockets_ |= 1UL << id;
+            return *this;
+        }
+
+        pfq_config &
+        add_device(int id, int index, int queue = Q_ANY_QUEUE)
+        {
+            socket(id);
+            bindings_.push_back(binding{ id, index, queue, false });
+            return *this;
+        }
+
+        pfq_config &
+        add_device(int id, const char *dev, int queue = Q_ANY_QUEUE)
+        {
+            return add_device(id, index_of(dev), queue);
+        }
+
+        pfq_config &
+        add_egress_device(int id, int index)
+        {
+            socket(id);
+            bindings_.push_back(binding{ id, index, Q_ANY_QUEUE, true });
+            return *this;
+        }
+
+        pfq_config &
+        add_egress_device(int id, const char *dev)
+        {
+            return add_egress_device(id, index_of(dev));
+        }
+
+        pfq_config &
+        load_balance(int id, bool value = true)
+        {
+            socket(id);
+            if (value)
+                balance_ |= 1UL << id;
+            else
+                balance_ &= ~(1UL << id);
+            return *this;
+        }
+
+        void
+        apply() const
+        {
+            detail::genl_socket nl;
+            auto msg = nl.make(Q_CMD_APPLY, NLM_F_ACK);
+
+            msg.put(Q_ATTR_SOCKETS, static_cast<uint64_t>(sockets_));
+            msg.put(Q_ATTR_BALANCE, static_cast<uint64_t>(balance_));
+
+            auto list = msg.nest_start(Q_ATTR_BINDINGS);
+            for(auto const &b : bindings_)
+            {
+                auto nest = msg.nest_start(Q_ATTR_BINDING);
+                msg.put(Q_BIND_ID, static_cast<uint32_t>(b.id));
+                msg.put(Q_BIND_IFINDEX, static_cast<int32_t>(b.index));
+                msg.put(Q_BIND_QUEUE, static_cast<int32_t>(b.queue));
+                if (b.egress)
+                    msg.put(Q_BIND_EGRESS, nullptr, 0);
+                msg.nest_end(nest);
+            }
+            msg.nest_end(list);
+
+            nl.transact(msg, [](const nlattr *, int) {});
+        }
+
+        static pfq_state
+        dump()
+        {
+            typedef detail::genl_socket nl_t;
+            
+            nl_t nl;
+            auto msg = nl.make(Q_CMD_DUMP);
+            pfq_state state { 0, 0, {} };
+
+            nl.transact(msg, [&](const nlattr *a, int len) {
+                nl_t::for_each(a, len, [&](int type, const void *data, int len) {
+                    switch(type)
+                    {
+                    case Q_ATTR_SOCKETS: state.sockets = nl_t::get<uint64_t>(data); break;
+                    case Q_ATTR_BALANCE: state.balance = nl_t::get<uint64_t>(data); break;
+                    case Q_ATTR_BINDINGS:
+                        nl_t::for_each(static_cast<const nlattr *>(data), len, [&](int, const void *data, int len) {
+                            pfq_binding b { Q_ANY_DEVICE, Q_ANY_QUEUE, false, 0 };
+                            nl_t::for_each(static_cast<const nlattr *>(data), len, [&](int type, const void *data, int) {
+                                switch(type)
+                                {
+                                case Q_BIND_IFINDEX: b.if_index = nl_t::get<int32_t>(data); break;
+                                case Q_BIND_QUEUE:   b.hw_queue = nl_t::get<int32_t>(data); break;
+                                case Q_BIND_EGRESS:  b.egress   = true; break;
+                                case Q_BIND_MASK:    b.mask     = nl_t::get<uint64_t>(data); break;
+                                }
+                            });
+                            state.bindings.push_back(b);
+                        });
+                        break;
+                    }
+                });
+            });
+
+            return state;
+        }
+
+    private:
+
+        static int
+        index_of(const char *dev)
+        {
+            unsigned int index = if_nametoindex(dev);
+            if (index == 0)
+                throw pfq_error(errno, "PFQ: unknown device");
+            return static_cast<int>(index);
+        }
+
+        struct binding
+        {
+            int  id;
+            int  index;
+            int  queue;
+            bool egress;
+        };
+
+        unsigned long        sockets_;
+        unsigned long        balance_;
+        std::vector<binding> bindings_;
+    };
+
+} // namespace net
+
+#endif /* _PFQ_CONFIG_HPP_ */
@@ -0,0 +1,653 @@
+/***************************************************************
+   
+   Copyright (c) 2012, Nicola Bonelli 
+   All rights reserved. 
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions are met: 
+
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer. 
+   * Redistributions in binary form must reproduce the above copyright 
+     notice, this list of conditions and the following disclaimer in the 
+     documentation and/or other materials provided with the distribution. 
+   * Neither the name of University of Pisa nor the names of its contributors 
+     may be used to endorse or promote products derived from this software 
+     without specific prior written permission. 
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+   POSSIBILITY OF SUCH DAMAGE.
+ 
+ ***************************************************************/
+
+#ifndef _PFQ_DECODE_HPP_
+#define _PFQ_DECODE_HPP_ 
+
+#include <pfq.hpp>
+
+#include <netinet/in.h>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PFQ_DECODE_X86 1
+#endif
+
+namespace net { 
+
+    //////////////////////////////////////////////////////////////////////
+    // bulk header decoder: a whole batch is decoded into columns (SoA), so 
+    // that analytics can run over arrays instead of chasing slots.
+    //
+    // The payload is expected to start at the ethernet header (offset 0).
+    // Ethernet/802.1Q + IPv4 + TCP/UDP/SCTP frames are decoded 8 (AVX2) or 4 
+    // (SSE4.1) at a time; QinQ, IPv6 and short tagged frames fall back to the 
+    // scalar decoder, which handles IPv6 extension headers too.
+
+    struct ip6_addr
+    {
+        uint8_t addr[16];
+    };
+
+
+    struct decoded_batch
+    {
+        static constexpr uint16_t no_offset = 0xffff;
+
+        void
+        resize(size_t n)
+        {
+            ethertype.resize(n);
+            vlan.resize(n);
+            proto.resize(n);
+            flags.resize(n);
+            l3_off.resize(n);
+            l4_off.resize(n);
+            src4.resize(n);
+            dst4.resize(n);
+            src6.resize(n);
+            dst6.resize(n);
+            sport.resize(n);
+            dport.resize(n);
+            mask.assign((n + 63) >> 6, 0);
+            size_ = n;
+        }
+
+        size_t
+        size() const
+        {
+            return size_;
+        }
+
+        /* the network header of the packet n has been decoded */
+        bool
+        valid(size_t n) const
+        {
+            return (mask[n >> 6] >> (n & 63)) & 1;
+        }
+
+        void
+        valid(size_t n, bool value)
+        {
+            if (value)
+                mask[n >> 6] |= 1ULL << (n & 63);
+            else
+                mask[n >> 6] &= ~(1ULL << (n & 63));
+        }
+
+        std::vector<uint16_t> ethertype;    // after the vlan tags, host order (0 if caplen < 14)
+        std::vector<uint16_t> vlan;         // outer vlan id, 0 if untagged
+        std::vector<uint8_t>  proto;        // ip protocol, or ipv6 next header after the extensions
+        std::vector<uint8_t>  flags;        // Q_HDR_F_VLAN, Q_HDR_F_IPV4, Q_HDR_F_IPV6, Q_HDR_F_TRUNC
+        std::vector<uint16_t> l3_off;       // offsets in the payload, no_offset if not decoded 
+        std::vector<uint16_t> l4_off;
+        std::vector<uint32_t> src4;         // network order, 0 if not ipv4
+        std::vector<uint32_t> dst4;
+        std::vector<ip6_addr> src6;         // zero if not ipv6
+        std::vector<ip6_addr> dst6;
+        std::vector<uint16_t> sport;        // host order, 0 if not available (fragments, short frames...)
+        std::vector<uint16_t> dport;
+        std::vector<uint64_t> mask;         // validity mask, a bit per packet
+
+    private:
+        size_t size_ = 0;
+    };
+
+
+    enum class decode_isa { scalar, sse4, avx2 };
+
+
+    namespace detail
+    {
+        static inline uint16_t
+        load_be16(const char *p)
+        {
+            return static_cast<uint16_t>(static_cast<uint8_t>(p[0]) << 8 | static_cast<uint8_t>(p[1]));
+        }
+
+        static inline void
+        wait_slot(const char *slot, int version)
+        {
+            if (version == 2) {
+                while (!reinterpret_cast<const volatile pfq_hdr_v2 *>(slot)->commit)
+                    cpu_relax();
+            }
+            else {
+                while (!reinterpret_cast<const volatile pfq_hdr *>(slot)->commit)
+                    cpu_relax();
+            }
+        }
+
+        static inline bool
+        has_ports(uint8_t proto)
+        {
+            return proto == IPPROTO_TCP || proto == IPPROTO_UDP || proto == IPPROTO_SCTP;
+        }
+
+        /* scalar decoder: a packet at a time */
+
+        static inline void
+        decode_one(const char *p, uint32_t caplen, uint32_t len, decoded_batch &out, size_t i)
+        {
+            uint16_t et = 0, vid = 0;
+            uint8_t  proto = 0, flags = caplen < len ? Q_HDR_F_TRUNC : 0;
+            uint16_t l3 = decoded_batch::no_offset, l4 = decoded_batch::no_offset;
+            uint16_t sport = 0, dport = 0;
+            uint32_t src4 = 0, dst4 = 0;
+            ip6_addr src6 = {{0}}, dst6 = {{0}};
+            bool ports = false;
+
+            uint32_t off = 14;
+
+            if (caplen >= off)
+            {
+                et = load_be16(p + 12);
+
+                for(int tags = 0; (et == ETH_P_8021Q || et == ETH_P_8021AD) && tags < 2 && caplen >= off + 4; tags++)
+                {
+                    if (tags == 0)
+                        vid = load_be16(p + off) & 0x0fff;
+                    flags |= Q_HDR_F_VLAN;
+                    et = load_be16(p + off + 2);
+                    off += 4;
+                }
+
+                const char *ip = p + off;
+
+                if (et == ETH_P_IP && caplen >= off + 20)
+                {
+                    uint32_t ihl = (ip[0] & 0x0f) << 2;
+                    if ((ip[0] & 0xf0) == 0x40 && ihl >= 20 && caplen >= off + ihl)
+                    {
+                        flags |= Q_HDR_F_IPV4;
+                        proto = ip[9];
+                        memcpy(&src4, ip + 12, 4);
+                        memcpy(&dst4, ip + 16, 4);
+                        l3 = off;
+                        l4 = off + ihl;
+                        ports = (load_be16(ip + 6) & 0x1fff) == 0;
+                    }
+                }
+                else if (et == ETH_P_IPV6 && caplen >= off + 40 && (ip[0] & 0xf0) == 0x60)
+                {
+                    uint32_t next = off + 40;
+
+                    flags |= Q_HDR_F_IPV6;
+                    proto = ip[6];
+                    memcpy(&src6, ip + 8, 16);
+                    memcpy(&dst6, ip + 24, 16);
+                    l3 = off;
+                    ports = true;
+
+                    /* skip the extension headers */
+
+                    for(int n = 0; n < 8 && (proto == IPPROTO_HOPOPTS || proto == IPPROTO_ROUTING || 
+                                             proto == IPPROTO_DSTOPTS || proto == IPPROTO_FRAGMENT || 
+                                             proto == IPPROTO_AH); n++)
+                    {
+                        if (caplen < next + 8) {
+                            ports = false;
+                            break;
+                        }
+
+                        const char *h = p + next;
+                        if (proto == IPPROTO_FRAGMENT) {
+                            if (load_be16(h + 2) & 0xfff8)
+                                ports = false;
+                            next += 8;
+                        }
+                        else if (proto == IPPROTO_AH)
+                            next += (static_cast<uint8_t>(h[1]) + 2) << 2;
+                        else
+                            next += (static_cast<uint8_t>(h[1]) + 1) << 3;
+
+                        proto = h[0];
+                    }
+
+                    if (next <= caplen && next < decoded_batch::no_offset)
+                        l4 = next;
+                    else 
+                        ports = false;
+                }
+
+                if (ports && has_ports(proto) && caplen >= static_cast<uint32_t>(l4) + 4)
+                {
+                    sport = load_be16(p + l4);
+                    dport = load_be16(p + l4 + 2);
+                }
+            }
+
+            out.ethertype[i] = et;
+            out.vlan[i]      = vid;
+            out.proto[i]     = proto;
+            out.flags[i]     = flags;
+            out.l3_off[i]    = l3;
+            out.l4_off[i]    = l4;
+            out.src4[i]      = src4;
+            out.dst4[i]      = dst4;
+            out.src6[i]      = src6;
+            out.dst6[i]      = dst6;
+            out.sport[i]     = sport;
+            out.dport[i]     = dport;
+            out.valid(i, l3 != decoded_batch::no_offset);
+        }
+
+        static inline void
+        decode_slot(const char *slot, int version, decoded_batch &out, size_t i)
+        {
+            uint32_t caplen, len;
+
+            wait_slot(slot, version);
+
+            if (version == 2) {
+                caplen = reinterpret_cast<const pfq_hdr_v2 *>(slot)->caplen;
+                len    = reinterpret_cast<const pfq_hdr_v2 *>(slot)->len;
+            }
+            else {
+                caplen = reinterpret_cast<const pfq_hdr *>(slot)->caplen;
+                len    = reinterpret_cast<const pfq_hdr *>(slot)->len;
+            }
+
+            decode_one(slot + hdr_size(version), caplen, len, out, i);
+        }
+
+        /* slots [first, n) with the scalar decoder */
+
+        static inline void
+        decode_scalar(const queue &many, decoded_batch &out, size_t first)
+        {
+            const char *base = static_cast<const char *>(many.data());
+            for(size_t i = first; i < many.size(); i++)
+                decode_slot(base + i * many.slot_size(), many.version(), out, i);
+        }
+
+#ifdef PFQ_DECODE_X86
+
+        /////////////////////////////// AVX2: 8 lanes, gathers
+
+        __attribute__((target("avx2"))) static inline __m256i
+        be16_avx2(__m256i x)
+        {
+            const __m256i ff = _mm256_set1_epi32(0xff);
+            return _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(x, ff), 8), 
+                                   _mm256_and_si256(_mm256_srli_epi32(x, 8), ff));
+        }
+
+        /* 32 bits at p + idx + off of the lanes in mask, as long as they are in the slot */
+
+        __attribute__((target("avx2"))) static inline __m256i
+        gather_avx2(const char *p, __m256i idx, __m256i off, __m256i mask, int cap)
+        {
+            mask = _mm256_and_si256(mask, _mm256_cmpgt_epi32(_mm256_set1_epi32(cap - 3), off));
+            return _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int *>(p), 
+                                               _mm256_add_epi32(idx, off), mask, 1);
+        }
+
+        __attribute__((target("avx2"))) static inline void
+        store16_avx2(uint16_t *dst, __m256i v)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), 
+                             _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+        }
+
+        __attribute__((target("avx2"))) static inline void
+        store8_avx2(uint8_t *dst, __m256i v)
+        {
+            __m128i w = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), _mm_packus_epi16(w, w));
+        }
+
+        __attribute__((target("avx2"))) static inline size_t
+        decode_avx2(const queue &many, decoded_batch &out)
+        {
+            const int version = many.version();
+            const int stride  = static_cast<int>(many.slot_size());
+            const int hdr     = static_cast<int>(hdr_size(version));
+            const int cap     = stride - hdr;
+            const char *base  = static_cast<const char *>(many.data());
+            const size_t n    = many.size();
+
+            const __m256i idx  = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i none = _mm256_set1_epi32(decoded_batch::no_offset);
+
+            size_t i = 0;
+
+            for(; i + 8 <= n; i += 8)
+            {
+                const char *slot = base + i * stride;
+                const char *p = slot + hdr;
+
+                for(int l = 0; l < 8; l++)
+                    wait_slot(slot + l * stride, version);
+
+                __m256i caplen, len;
+
+                if (version == 2) {
+                    caplen = _mm256_i32gather_epi32(reinterpret_cast<const int *>(slot), idx, 1);
+                    len    = _mm256_i32gather_epi32(reinterpret_cast<const int *>(slot + 4), idx, 1);
+                }
+                else {
+                    __m256i w = _mm256_i32gather_epi32(reinterpret_cast<const int *>(slot), idx, 1);
+                    caplen = _mm256_and_si256(w, _mm256_set1_epi32(0xffff));
+                    len    = _mm256_srli_epi32(w, 16);
+                }
+
+                /* ethernet, and one 802.1Q tag */
+
+                __m256i l2     = _mm256_cmpgt_epi32(caplen, _mm256_set1_epi32(13));
+                __m256i w      = gather_avx2(p, idx, _mm256_set1_epi32(12), l2, cap);
+                __m256i et     = _mm256_and_si256(be16_avx2(w), l2);
+                __m256i tagged = _mm256_and_si256(_mm256_cmpeq_epi32(et, _mm256_set1_epi32(ETH_P_8021Q)), 
+                                                  _mm256_cmpgt_epi32(caplen, _mm256_set1_epi32(17)));
+                __m256i vid    = _mm256_and_si256(_mm256_and_si256(be16_avx2(_mm256_srli_epi32(w, 16)), 
+                                                                   _mm256_set1_epi32(0x0fff)), tagged);
+
+                et = _mm256_blendv_epi8(et, be16_avx2(gather_avx2(p, idx, _mm256_set1_epi32(16), tagged, cap)), tagged);
+
+                __m256i l3 = _mm256_blendv_epi8(_mm256_set1_epi32(14), _mm256_set1_epi32(18), tagged);
+
+                /* QinQ, short tagged frames and IPv6 are left to the scalar decoder */
+
+                __m256i slow = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi32(et, _mm256_set1_epi32(ETH_P_8021Q)),
+                                                               _mm256_cmpeq_epi32(et, _mm256_set1_epi32(ETH_P_8021AD))),
+                                                               _mm256_cmpeq_epi32(et, _mm256_set1_epi32(ETH_P_IPV6)));
+                /* IPv4 */
+
+                __m256i ip4 = _mm256_and_si256(_mm256_cmpeq_epi32(et, _mm256_set1_epi32(ETH_P_IP)), 
+                                               _mm256_cmpgt_epi32(caplen, _mm256_add_epi32(l3, _mm256_set1_epi32(19))));
+
+                __m256i v0  = gather_avx2(p, idx, l3, ip4, cap);
+                __m256i ihl = _mm256_slli_epi32(_mm256_and_si256(v0, _mm256_set1_epi32(0x0f)), 2);
+                __m256i l4  = _mm256_add_epi32(l3, ihl);
+
+                ip4 = _mm256_and_si256(ip4, _mm256_cmpeq_epi32(_mm256_and_si256(v0, _mm256_set1_epi32(0xf0)), _mm256_set1_epi32(0x40)));
+                ip4 = _mm256_and_si256(ip4, _mm256_cmpgt_epi32(ihl, _mm256_set1_epi32(19)));
+                ip4 = _mm256_and_si256(ip4, _mm256_cmpgt_epi32(_mm256_add_epi32(caplen, _mm256_set1_epi32(1)), l4));
+
+                __m256i frag  = _mm256_and_si256(be16_avx2(_mm256_srli_epi32(gather_avx2(p, idx, _mm256_add_epi32(l3, _mm256_set1_epi32(4)), ip4, cap), 16)), 
+                                                 _mm256_set1_epi32(0x1fff));
+                __m256i proto = _mm256_and_si256(_mm256_srli_epi32(gather_avx2(p, idx, _mm256_add_epi32(l3, _mm256_set1_epi32(8)), ip4, cap), 8), 
+                                                 _mm256_set1_epi32(0xff));
+                __m256i src   = gather_avx2(p, idx, _mm256_add_epi32(l3, _mm256_set1_epi32(12)), ip4, cap);
+                __m256i dst   = gather_avx2(p, idx, _mm256_add_epi32(l3, _mm256_set1_epi32(16)), ip4, cap);
+
+                /* transport ports, first fragments only */
+
+                __m256i l4p = _mm256_and_si256(ip4, _mm256_cmpeq_epi32(frag, zero));
+                l4p = _mm256_and_si256(l4p, _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi32(proto, _mm256_set1_epi32(IPPROTO_TCP)), 
+                                                                            _mm256_cmpeq_epi32(proto, _mm256_set1_epi32(IPPROTO_UDP))), 
+                                                                            _mm256_cmpeq_epi32(proto, _mm256_set1_epi32(IPPROTO_SCTP))));
+                l4p = _mm256_and_si256(l4p, _mm256_cmpgt_epi32(caplen, _mm256_add_epi32(l4, _mm256_set1_epi32(3))));
+
+                __m256i ports = gather_avx2(p, idx, l4, l4p, cap);
+
+                __m256i flags = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(tagged, _mm256_set1_epi32(Q_HDR_F_VLAN)), 
+                                                                _mm256_and_si256(ip4, _mm256_set1_epi32(Q_HDR_F_IPV4))),
+                                                _mm256_and_si256(_mm256_cmpgt_epi32(len, caplen), _mm256_set1_epi32(Q_HDR_F_TRUNC)));
+
+                store16_avx2(&out.ethertype[i], et);
+                store16_avx2(&out.vlan[i], vid);
+                store8_avx2(&out.proto[i], proto);
+                store8_avx2(&out.flags[i], flags);
+                store16_avx2(&out.l3_off[i], _mm256_blendv_epi8(none, l3, ip4));
+                store16_avx2(&out.l4_off[i], _mm256_blendv_epi8(none, l4, ip4));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(&out.src4[i]), src);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(&out.dst4[i]), dst);
+                store16_avx2(&out.sport[i], be16_avx2(ports));
+                store16_avx2(&out.dport[i], be16_avx2(_mm256_srli_epi32(ports, 16)));
+                memset(&out.src6[i], 0, 8 * sizeof(ip6_addr));
+                memset(&out.dst6[i], 0, 8 * sizeof(ip6_addr));
+
+                out.mask[i >> 6] |= static_cast<uint64_t>(_mm256_movemask_ps(_mm256_castsi256_ps(ip4))) << (i & 63);
+
+                for(int bits = _mm256_movemask_ps(_mm256_castsi256_ps(slow)); bits; bits &= bits - 1)
+                {
+                    int l = __builtin_ctz(bits);
+                    decode_slot(slot + l * stride, version, out, i + l);
+                }
+            }
+
+            return i;
+        }
+
+        /////////////////////////////// SSE4.1: 4 lanes, scalar loads
+
+        __attribute__((target("sse4.1"))) static inline __m128i
+        be16_sse4(__m128i x)
+        {
+            const __m128i ff = _mm_set1_epi32(0xff);
+            return _mm_or_si128(_mm_slli_epi32(_mm_and_si128(x, ff), 8), 
+                                _mm_and_si128(_mm_srli_epi32(x, 8), ff));
+        }
+
+        __attribute__((target("sse4.1"))) static inline __m128i
+        gather_sse4(const char *p, int stride, __m128i off, __m128i mask, int cap)
+        {
+            alignas(16) int32_t o[4], m[4], r[4];
+
+            _mm_store_si128(reinterpret_cast<__m128i *>(o), off);
+            _mm_store_si128(reinterpret_cast<__m128i *>(m), mask);
+
+            for(int l = 0; l < 4; l++)
+            {
+                r[l] = 0;
+                if (m[l] && o[l] + 4 <= cap)
+                    memcpy(&r[l], p + l * stride + o[l], 4);
+            }
+
+            return _mm_load_si128(reinterpret_cast<const __m128i *>(r));
+        }
+
+        __attribute__((target("sse4.1"))) static inline void
+        store16_sse4(uint16_t *dst, __m128i v)
+        {
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), _mm_packus_epi32(v, v));
+        }
+
+        __attribute__((target("sse4.1"))) static inline void
+        store8_sse4(uint8_t *dst, __m128i v)
+        {
+            __m128i w = _mm_packus_epi32(v, v);
+            uint32_t x = _mm_cvtsi128_si32(_mm_packus_epi16(w, w));
+            memcpy(dst, &x, 4);
+        }
+
+        __attribute__((target("sse4.1"))) static inline size_t
+        decode_sse4(const queue &many, decoded_batch &out)
+        {
+            const int version = many.version();
+            const int stride  = static_cast<int>(many.slot_size());
+            const int hdr     = static_cast<int>(hdr_size(version));
+            const int cap     = stride - hdr;
+            const char *base  = static_cast<const char *>(many.data());
+            const size_t n    = many.size();
+
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i none = _mm_set1_epi32(decoded_batch::no_offset);
+
+            size_t i = 0;
+
+            for(; i + 4 <= n; i += 4)
+            {
+                const char *slot = base + i * stride;
+                const char *p = slot + hdr;
+
+                for(int l = 0; l < 4; l++)
+                    wait_slot(slot + l * stride, version);
+
+                __m128i caplen, len;
+
+                if (version == 2) {
+                    caplen = _mm_setr_epi32(reinterpret_cast<const pfq_hdr_v2 *>(slot)->caplen,
+                                            reinterpret_cast<const pfq_hdr_v2 *>(slot + stride)->caplen,
+                                            reinterpret_cast<const pfq_hdr_v2 *>(slot + 2 * stride)->caplen,
+                                            reinterpret_cast<const pfq_hdr_v2 *>(slot + 3 * stride)->caplen);
+                    len    = _mm_setr_epi32(reinterpret_cast<const pfq_hdr_v2 *>(slot)->len,
+                                            reinterpret_cast<const pfq_hdr_v2 *>(slot + stride)->len,
+                                            reinterpret_cast<const pfq_hdr_v2 *>(slot + 2 * stride)->len,
+                                            reinterpret_cast<const pfq_hdr_v2 *>(slot + 3 * stride)->len);
+                }
+                else {
+                    caplen = _mm_setr_epi32(reinterpret_cast<const pfq_hdr *>(slot)->caplen,
+                                            reinterpret_cast<const pfq_hdr *>(slot + stride)->caplen,
+                                            reinterpret_cast<const pfq_hdr *>(slot + 2 * stride)->caplen,
+                                            reinterpret_cast<const pfq_hdr *>(slot + 3 * stride)->caplen);
+                    len    = _mm_setr_epi32(reinterpret_cast<const pfq_hdr *>(slot)->len,
+                                            reinterpret_cast<const pfq_hdr *>(slot + stride)->len,
+                                            reinterpret_cast<const pfq_hdr *>(slot + 2 * stride)->len,
+                                            reinterpret_cast<const pfq_hdr *>(slot + 3 * stride)->len);
+                }
+
+                /* ethernet, and one 802.1Q tag */
+
+                __m128i l2     = _mm_cmpgt_epi32(caplen, _mm_set1_epi32(13));
+                __m128i w      = gather_sse4(p, stride, _mm_set1_epi32(12), l2, cap);
+                __m128i et     = _mm_and_si128(be16_sse4(w), l2);
+                __m128i tagged = _mm_and_si128(_mm_cmpeq_epi32(et, _mm_set1_epi32(ETH_P_8021Q)), 
+                                               _mm_cmpgt_epi32(caplen, _mm_set1_epi32(17)));
+                __m128i vid    = _mm_and_si128(_mm_and_si128(be16_sse4(_mm_srli_epi32(w, 16)), _mm_set1_epi32(0x0fff)), tagged);
+
+                et = _mm_blendv_epi8(et, be16_sse4(gather_sse4(p, stride, _mm_set1_epi32(16), tagged, cap)), tagged);
+
+                __m128i l3 = _mm_blendv_epi8(_mm_set1_epi32(14), _mm_set1_epi32(18), tagged);
+
+                /* QinQ, short tagged frames and IPv6 are left to the scalar decoder */
+
+                __m128i slow = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi32(et, _mm_set1_epi32(ETH_P_8021Q)),
+                                                         _mm_cmpeq_epi32(et, _mm_set1_epi32(ETH_P_8021AD))),
+                                                         _mm_cmpeq_epi32(et, _mm_set1_epi32(ETH_P_IPV6)));
+                /* IPv4 */
+
+                __m128i ip4 = _mm_and_si128(_mm_cmpeq_epi32(et, _mm_set1_epi32(ETH_P_IP)), 
+                                            _mm_cmpgt_epi32(caplen, _mm_add_epi32(l3, _mm_set1_epi32(19))));
+
+                __m128i v0  = gather_sse4(p, stride, l3, ip4, cap);
+                __m128i ihl = _mm_slli_epi32(_mm_and_si128(v0, _mm_set1_epi32(0x0f)), 2);
+                __m128i l4  = _mm_add_epi32(l3, ihl);
+
+                ip4 = _mm_and_si128(ip4, _mm_cmpeq_epi32(_mm_and_si128(v0, _mm_set1_epi32(0xf0)), _mm_set1_epi32(0x40)));
+                ip4 = _mm_and_si128(ip4, _mm_cmpgt_epi32(ihl, _mm_set1_epi32(19)));
+                ip4 = _mm_and_si128(ip4, _mm_cmpgt_epi32(_mm_add_epi32(caplen, _mm_set1_epi32(1)), l4));
+
+                __m128i frag  = _mm_and_si128(be16_sse4(_mm_srli_epi32(gather_sse4(p, stride, _mm_add_epi32(l3, _mm_set1_epi32(4)), ip4, cap), 16)), 
+                                              _mm_set1_epi32(0x1fff));
+                __m128i proto = _mm_and_si128(_mm_srli_epi32(gather_sse4(p, stride, _mm_add_epi32(l3, _mm_set1_epi32(8)), ip4, cap), 8), 
+                                              _mm_set1_epi32(0xff));
+                __m128i src   = gather_sse4(p, stride, _mm_add_epi32(l3, _mm_set1_epi32(12)), ip4, cap);
+                __m128i dst   = gather_sse4(p, stride, _mm_add_epi32(l3, _mm_set1_epi32(16)), ip4, cap);
+
+                /* transport ports, first fragments only */
+
+                __m128i l4p = _mm_and_si128(ip4, _mm_cmpeq_epi32(frag, zero));
+                l4p = _mm_and_si128(l4p, _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi32(proto, _mm_set1_epi32(IPPROTO_TCP)), 
+                                                                   _mm_cmpeq_epi32(proto, _mm_set1_epi32(IPPROTO_UDP))), 
+                                                                   _mm_cmpeq_epi32(proto, _mm_set1_epi32(IPPROTO_SCTP))));
+                l4p = _mm_and_si128(l4p, _mm_cmpgt_epi32(caplen, _mm_add_epi32(l4, _mm_set1_epi32(3))));
+
+                __m128i ports = gather_sse4(p, stride, l4, l4p, cap);
+
+                __m128i flags = _mm_or_si128(_mm_or_si128(_mm_and_si128(tagged, _mm_set1_epi32(Q_HDR_F_VLAN)), 
+                                                          _mm_and_si128(ip4, _mm_set1_epi32(Q_HDR_F_IPV4))),
+                                             _mm_and_si128(_mm_cmpgt_epi32(len, caplen), _mm_set1_epi32(Q_HDR_F_TRUNC)));
+
+                store16_sse4(&out.ethertype[i], et);
+                store16_sse4(&out.vlan[i], vid);
+                store8_sse4(&out.proto[i], proto);
+                store8_sse4(&out.flags[i], flags);
+                store16_sse4(&out.l3_off[i], _mm_blendv_epi8(none, l3, ip4));
+                store16_sse4(&out.l4_off[i], _mm_blendv_epi8(none, l4, ip4));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(&out.src4[i]), src);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(&out.dst4[i]), dst);
+                store16_sse4(&out.sport[i], be16_sse4(ports));
+                store16_sse4(&out.dport[i], be16_sse4(_mm_srli_epi32(ports, 16)));
+                memset(&out.src6[i], 0, 4 * sizeof(ip6_addr));
+                memset(&out.dst6[i], 0, 4 * sizeof(ip6_addr));
+
+                out.mask[i >> 6] |= static_cast<uint64_t>(_mm_movemask_ps(_mm_castsi128_ps(ip4))) << (i & 63);
+
+                for(int bits = _mm_movemask_ps(_mm_castsi128_ps(slow)); bits; bits &= bits - 1)
+                {
+                    int l = __builtin_ctz(bits);
+                    decode_slot(slot + l * stride, version, out, i + l);
+                }
+            }
+
+            return i;
+        }
+
+#endif
+    }
+
+
+    /* the widest kernel supported by this cpu, probed once */
+
+    inline decode_isa
+    best_decode_isa()
+    {
+#ifdef PFQ_DECODE_X86
+        static const decode_isa isa = __builtin_cpu_supports("avx2")   ? decode_isa::avx2 :
+                                      __builtin_cpu_supports("sse4.1") ? decode_isa::sse4 : decode_isa::scalar;
+        return isa;
+#else
+        return decode_isa::scalar;
+#endif
+    }
+
+
+    /* decode the batch into out (resized to many.size()) */
+
+    inline void
+    decode(const queue &many, decoded_batch &out, decode_isa isa = best_decode_isa())
+    {
+        size_t done = 0;
+
+        out.resize(many.size());
+
+        if (isa > best_decode_isa())
+            throw pfq_error("PFQ: decode: instruction set not supported by this cpu");
+
+#ifdef PFQ_DECODE_X86
+        if (isa == decode_isa::avx2)
+            done = detail::decode_avx2(many, out);
+        else if (isa == decode_isa::sse4)
+            done = detail::decode_sse4(many, out);
+#endif
+        detail::decode_scalar(many, out, done);
+    }
+
+} // namespace net
+
+#endif /* _PFQ_DECODE_HPP_ */
@@ -0,0 +1,350 @@
+/***************************************************************
+   
+   Copyright (c) 2012, Nicola Bonelli 
+   All rights reserved. 
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions are met: 
+
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer. 
+   * Redistributions in binary form must reproduce the above copyright 
+     notice, this list of conditions and the following disclaimer in the 
+     documentation and/or other materials provided with the distribution. 
+   * Neither the name of University of Pisa nor the names of its contributors 
+     may be used to endorse or promote products derived from this software 
+     without specific prior written permission. 
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+   POSSIBILITY OF SUCH DAMAGE.
+ 
+ ***************************************************************/
+
+#ifndef _PFQ_ENGINE_HPP_
+#define _PFQ_ENGINE_HPP_ 
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pfq.hpp>
+
+namespace net { 
+
+    /* binding of a capture thread: the device, the core the thread is 
+       pinned to and the hw queues of the device (none = any queue) */
+
+    struct capture_binding
+    {
+        std::string      dev;
+        int              core;
+        std::vector<int> queues;
+    };
+
+    /* parse "dev:core[:queue,queue...]" */
+
+    inline capture_binding
+    make_binding(const std::string &spec)
+    {
+        auto sc = spec.find(':');
+        if (sc == std::string::npos)
+            throw pfq_error(("PFQ: binding '" + spec + "': ':' not found").c_str());
+
+        capture_binding b { spec.substr(0, sc), -1, {} };
+
+        std::istringstream i(spec.substr(sc + 1));
+        if (!(i >> b.core) || b.core < 0)
+            throw pfq_error(("PFQ: binding '" + spec + "': bad core").c_str());
+
+        char sep; int q;
+        while (i >> sep >> q)
+            b.queues.push_back(q);
+
+        return b;
+    }
+
+    struct capture_options
+    {
+        size_t  caplen;
+        size_t  offset;
+        size_t  slots;
+        bool    balance;            // load balance among the sockets bound to the same queues
+        bool    tstamp;
+        long    timeout;            // read timeout (usec)
+        net::wait_policy policy;
+
+        capture_options()
+        : caplen(64), offset(0), slots(131072), balance(false), tstamp(false), timeout(100000), policy(net::wait_policy::block)
+        {}
+    };
+
+    struct capture_counters
+    {
+        uint64_t packets;
+        uint64_t batches;
+        uint64_t max_batch;
+    };
+
+
+    /* capture_engine: one socket and one pinned thread per binding, each 
+       running the handler on the batches read. The socket is opened and 
+       enabled by its thread once pinned, so that the queue memory is 
+       allocated on the node of the consumer. Counters are written by their 
+       thread only and read without locks. */
+
+    class capture_engine
+    {
+    public:
+
+        typedef std::function<void(size_t worker, queue &batch)> handler_type;
+
+        capture_engine(std::vector<capture_binding> bindings, handler_type handler, capture_options opt = capture_options())
+        : bindings_(std::move(bindings)), handler_(std::move(handler)), opt_(opt)
+        , workers_(bindings_.size()), threads_(), ready_(0), stop_(false), failed_(false), error_()
+        {}
+
+        ~capture_engine()
+        {
+            stop();
+        }
+
+        capture_engine(const capture_engine &) = delete;
+        capture_engine& operator=(const capture_engine &) = delete;
+
+
+        /* start the threads, returns when every socket is enabled. */
+
+        void
+        start()
+        {
+            if (!threads_.empty())
+                throw pfq_error("PFQ: capture engine already started");
+
+            stop_.store(false);
+            failed_.store(false);
+            ready_.store(0);
+            error_ = nullptr;
+
+            for(size_t n = 0; n < bindings_.size(); ++n)
+                threads_.emplace_back(&capture_engine::run, this, n);
+
+            while (ready_.load(std::memory_order_acquire) < bindings_.size())
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+            if (error_) {
+                stop();
+                std::rethrow_exception(error_);
+            }
+        }
+
+        void
+        stop()
+        {
+            stop_.store(true, std::memory_order_release);
+            for(auto &t : threads_)
+                t.join();
+            threads_.clear();
+        }
+
+        size_t
+        size() const
+        {
+            return bindings_.size();
+        }
+
+        const capture_binding &
+        binding(size_t n) const
+        {
+            return bindings_.at(n);
+        }
+
+        /* the socket of the thread n (valid once started) */
+
+        pfq &
+        socket(size_t n)
+        {
+            return worker_at(n).q;
+        }
+
+        capture_counters
+        counters(size_t n) const
+        {
+            auto &w = worker_at(n);
+            return capture_counters { w.packets.load(std::memory_order_relaxed), 
+                                      w.batches.load(std::memory_order_relaxed), 
+                                      w.max_batch.load(std::memory_order_relaxed) };
+        }
+
+        capture_counters
+        counters() const
+        {
+            capture_counters sum { 0, 0, 0 };
+            for(size_t n = 0; n < workers_.size(); ++n)
+            {
+                auto c = counters(n);
+                sum.packets  += c.packets;
+                sum.batches  += c.batches;
+                sum.max_batch = std::max(sum.max_batch, c.max_batch);
+            }
+            return sum;
+        }
+
+        pfq_stats
+        stats(size_t n) const
+        {
+            return worker_at(n).q.stats();
+        }
+
+        pfq_stats
+        stats() const
+        {
+            pfq_stats sum = {0, 0, 0, 0};
+            for(size_t n = 0; n < workers_.size(); ++n)
+                sum += stats(n);
+            return sum;
+        }
+
+    private:
+
+        struct worker
+        {
+            worker()
+            : q(), packets(0), batches(0), max_batch(0)
+            {}
+
+            static void *operator new(size_t size)
+            {
+                void *p;
+                if (::posix_memalign(&p, 128, size) != 0)
+                    throw std::bad_alloc();
+                return p;
+            }
+
+            static void operator delete(void *p)
+            {
+                ::free(p);
+            }
+
+            pfq q;
+            std::atomic<uint64_t> packets;
+            std::atomic<uint64_t> batches;
+            std::atomic<uint64_t> max_batch;
+
+        } __attribute__((aligned(128)));
+
+
+        const worker &
+        worker_at(size_t n) const
+        {
+            if (n >= workers_.size() || !workers_[n])
+                throw pfq_error("PFQ: capture engine: no such worker");
+            return *workers_[n];
+        }
+
+        worker &
+        worker_at(size_t n)
+        {
+            return const_cast<worker &>(static_cast<const capture_engine *>(this)->worker_at(n));
+        }
+
+        void
+        setup(size_t n)
+        {
+            auto const &b = bindings_[n];
+
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset); CPU_SET(b.core, &cpuset);
+            if (::pthread_setaffinity_np(::pthread_self(), sizeof(cpuset), &cpuset) != 0)
+                throw pfq_error("PFQ: capture engine: pthread_setaffinity_np");
+
+            /* allocated by the pinned thread: local node */
+
+            std::unique_ptr<worker> w(new worker);
+
+            w->q.open(opt_.caplen, opt_.offset, opt_.slots);
+
+            if (b.queues.empty())
+                w->q.add_device(b.dev.c_str());
+            for(int queue : b.queues)
+                w->q.add_device(b.dev.c_str(), queue);
+
+            w->q.load_balance(opt_.balance);
+            w->q.toggle_time_stamp(opt_.tstamp);
+            w->q.wait_policy(opt_.policy);
+            w->q.enable();
+
+            workers_[n] = std::move(w);
+        }
+
+        void
+        run(size_t n)
+        {
+            try
+            {
+                setup(n);
+            }
+            catch(...)
+            {
+                if (!failed_.exchange(true))
+                    error_ = std::current_exception();
+                stop_.store(true, std::memory_order_relaxed);
+            }
+
+            ready_.fetch_add(1, std::memory_order_release);
+
+            if (!workers_[n])
+                return;
+
+            auto &w = *workers_[n];
+
+            while (!stop_.load(std::memory_order_relaxed))
+            {
+                auto many = w.q.read(opt_.timeout);
+                if (many.empty())
+                    continue;
+
+                handler_(n, many);
+
+                w.packets.store(w.packets.load(std::memory_order_relaxed) + many.size(), std::memory_order_relaxed);
+                w.batches.store(w.batches.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                if (many.size() > w.max_batch.load(std::memory_order_relaxed))
+                    w.max_batch.store(many.size(), std::memory_order_relaxed);
+            }
+        }
+
+        std::vector<capture_binding>          bindings_;
+        handler_type                          handler_;
+        capture_options                       opt_;
+
+        std::vector<std::unique_ptr<worker>>  workers_;
+        std::vector<std::thread>              threads_;
+
+        std::atomic<size_t>                   ready_;
+        std::atomic<bool>                     stop_;
+        std::atomic<bool>                     failed_;
+        std::exception_ptr                    error_;     // first error of the setup
+    };
+
+} // namespace net
+
+#endif /* _PFQ_ENGINE_HPP_ */
@@ -0,0 +1,236 @@
+/***************************************************************
+   
+   Copyright (c) 2012, Nicola Bonelli 
+   All rights reserved. 
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions are met: 
+
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer. 
+   * Redistributions in binary form must reproduce the above copyright 
+     notice, this list of conditions and the following disclaimer in the 
+     documentation and/or other materials provided with the distribution. 
+   * Neither the name of University of Pisa nor the names of its contributors 
+     may be used to endorse or promote products derived from this software 
+     without specific prior written permission. 
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+   POSSIBILITY OF SUCH DAMAGE.
+ 
+ ***************************************************************/
+
+#ifndef _PFQ_MPDB_HPP_
+#define _PFQ_MPDB_HPP_ 
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <new>
+
+#include <pfq.hpp>
+
+namespace net { 
+
+    /* mpdb_queue: the multi-producer double buffer of the module in user 
+       memory, without the module. The producer side is mpdb_enqueue ported 
+       line by line (same atomics, same layout: a pfq_queue_descr followed 
+       by two buffers of slots); the consumer side is the one of pfq::read
+       (detail::mpdb_swap). It is meant to test and stress the protocol: 
+       enqueue() can be called by any number of threads, read() by one.
+
+       The producer does not ring: the consumer spins, as with the busy 
+       wait policy. Keep it in sync with kernel/mpdb-queue.c. */
+
+    class mpdb_queue
+    {
+    public:
+
+        mpdb_queue(size_t caplen, size_t slots, int version = 1)
+        : caplen_(caplen)
+        , slots_(slots)
+        , slot_size_(net::slot_size(caplen, version))
+        , version_(version)
+        , next_len_(0)
+        , addr_(nullptr)
+        {
+            if (slots == 0 || slots > 0x7fffffff)
+                throw pfq_error("PFQ: mpdb: bad number of slots");
+
+            if (version != 1 && version != 2)
+                throw pfq_error("PFQ: mpdb: bad header version");
+
+            if (version == 1 && caplen > 0xffff)
+                throw pfq_error("PFQ: mpdb: caplen too large for the version 1 header");
+
+            size_t size = this->mem_size();
+
+            void *p;
+            if (::posix_memalign(&p, 64, size) != 0)
+                throw std::bad_alloc();
+
+            memset(p, 0, size);
+            addr_ = static_cast<char *>(p);
+        }
+
+        ~mpdb_queue()
+        {
+            ::free(addr_);
+        }
+
+        mpdb_queue(const mpdb_queue &) = delete;
+        mpdb_queue& operator=(const mpdb_queue &) = delete;
+
+        size_t
+        caplen() const
+        {
+            return caplen_;
+        }
+
+        size_t
+        slots() const
+        {
+            return slots_;
+        }
+
+        size_t
+        slot_size() const
+        {
+            return slot_size_;
+        }
+
+        int
+        hdr_version() const
+        {
+            return version_;
+        }
+
+        size_t
+        mem_size() const
+        {
+            return Q_QUEUE_DESCR_SIZE(version_) + 2 * slots_ * slot_size_;
+        }
+
+        pfq_queue_descr *
+        descr() const
+        {
+            return reinterpret_cast<pfq_queue_descr *>(addr_);
+        }
+
+        /* producer: true if the packet is in the queue, false if lost (queue full) */
+
+        bool
+        enqueue(const void *pkt, size_t len, uint64_t tstamp = 0, int if_index = 0, int hw_queue = 0, int mark = 0)
+        {
+            pfq_queue_descr *queue_descr = this->descr();
+
+            if (queue_descr->disabled)
+                return false;
+
+            size_t bytes = std::min(len, caplen_);
+
+            int  data    = __sync_add_and_fetch(&queue_descr->data, 1);
+            size_t q_len = DBMP_QUEUE_LEN(data);
+            bool q_index = DBMP_QUEUE_INDEX(data);
+
+            if (q_len <= slots_)
+            {
+                char *p_slot = reinterpret_cast<char *>(queue_descr) + Q_QUEUE_DESCR_SIZE(version_) + q_index * slot_size_ * slots_ 
+                                + (q_len - 1) * slot_size_;
+
+                if (version_ == 2)
+                {
+                    auto p_hdr = reinterpret_cast<pfq_hdr_v2 *>(p_slot);
+
+                    memcpy(net::data(*p_hdr), pkt, bytes);
+
+                    p_hdr->len      = static_cast<uint32_t>(len);
+                    p_hdr->caplen   = static_cast<uint32_t>(bytes);
+                    p_hdr->if_index = static_cast<uint32_t>(if_index);
+                    p_hdr->rxhash   = 0;
+                    p_hdr->hw_queue = static_cast<uint16_t>(hw_queue);
+                    p_hdr->mark     = static_cast<uint16_t>(mark);
+                    p_hdr->tstamp   = tstamp;
+
+                    detail::set_layers(p_hdr, static_cast<const char *>(pkt), static_cast<uint32_t>(bytes));
+
+                    wmb();
+
+                    p_hdr->commit = 1;
+                }
+                else
+                {
+                    auto p_hdr = reinterpret_cast<pfq_hdr *>(p_slot);
+
+                    memcpy(p_hdr + 1, pkt, bytes);
+
+                    p_hdr->len      = static_cast<uint16_t>(std::min<size_t>(len, 0xffff));
+                    p_hdr->caplen   = static_cast<uint16_t>(bytes);
+                    p_hdr->if_index = static_cast<uint8_t>(if_index);
+                    p_hdr->hw_queue = static_cast<uint8_t>(hw_queue);
+                    p_hdr->mark     = static_cast<uint16_t>(mark);
+                    p_hdr->egress   = 0;
+                    p_hdr->tstamp.tv.sec  = static_cast<uint32_t>(tstamp / 1000000000ULL);
+                    p_hdr->tstamp.tv.nsec = static_cast<uint32_t>(tstamp % 1000000000ULL);
+
+                    wmb();
+
+                    static_cast<volatile pfq_hdr *>(p_hdr)->commit = 1;
+                }
+
+                return true;
+            }
+            else if (q_len == slots_ + 1)
+            {
+                queue_descr->disabled = 1;
+            }
+
+            return false;
+        }
+
+        /* consumer: as pfq::read with the busy wait policy. The batch is valid 
+           until the next read(); slots are to be waited for with ready(). */
+
+        queue
+        read(long int microseconds = -1)
+        {
+            pfq_queue_descr *q = this->descr();
+
+            if (DBMP_QUEUE_LEN(q->data) == 0 && microseconds != 0)
+            {
+                uint64_t deadline = microseconds < 0 ? UINT64_MAX : detail::now_ns() + static_cast<uint64_t>(microseconds) * 1000;
+
+                while (DBMP_QUEUE_LEN(q->data) == 0 && detail::now_ns() < deadline)
+                    cpu_relax();
+            }
+
+            int index = DBMP_QUEUE_INDEX(q->data);
+
+            next_len_ = detail::mpdb_swap(q, slots_, slot_size_, version_, next_len_);
+
+            return queue(addr_ + Q_QUEUE_DESCR_SIZE(version_) + index * slots_ * slot_size_, 
+                         slot_size_, next_len_, version_);
+        }
+
+    private:
+
+        size_t  caplen_;
+        size_t  slots_;
+        size_t  slot_size_;
+        int     version_;
+        size_t  next_len_;
+        char *  addr_;
+    };
+
+} // namespace net
+
+#endif /* _PFQ_MPDB_HPP_ */
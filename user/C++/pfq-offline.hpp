@@ -0,0 +1,623 @@
+/***************************************************************
+   
+   Copyright (c) 2012, Nicola Bonelli 
+   All rights reserved. 
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions are met: 
+
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer. 
+   * Redistributions in binary form must reproduce the above copyright 
+     notice, this list of conditions and the following disclaimer in the 
+     documentation and/or other materials provided with the distribution. 
+   * Neither the name of University of Pisa nor the names of its contributors 
+     may be used to endorse or promote products derived from this software 
+     without specific prior written permission. 
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+   POSSIBILITY OF SUCH DAMAGE.
+ 
+ ***************************************************************/
+
+#ifndef _PFQ_OFFLINE_HPP_
+#define _PFQ_OFFLINE_HPP_ 
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include <pfq.hpp>
+
+namespace net { 
+
+    /* pfq_offline: a pcap or pcapng file (memory mapped) or a memory image 
+       of one, replayed through the same read()/dispatch() and net::queue 
+       as a PFQ socket, without the module. Packets are copied into slots 
+       of caplen bytes, the header version is selectable; a batch is valid 
+       until the next read(). 
+
+       With pacing, packets are delivered no sooner than they were captured
+       (scaled by speed), so batches are as large as the traffic allows. 
+       At the end of the file read() returns empty batches, eof() is true. */
+
+    struct offline_options
+    {
+        size_t caplen;          // bytes copied per packet
+        size_t batch;           // packets per read()
+        int    hdr_version;
+        bool   pace;            // replay at the capture rate
+        double speed;           // pacing factor, 2.0 = twice as fast
+        bool   loop;            // rewind at the end of the file
+
+        offline_options()
+        : caplen(1514), batch(1024), hdr_version(1), pace(false), speed(1.0), loop(false)
+        {}
+    };
+
+
+    class pfq_offline
+    {
+        struct record
+        {
+            const char *data;
+            uint32_t caplen;
+            uint32_t len;
+            uint64_t tstamp;    // nanoseconds
+            uint32_t iface;
+            uint32_t hw_queue;
+            bool     egress;
+        };
+
+        enum class format { pcap, pcapng };
+
+    public:
+
+        pfq_offline(const std::string &file, offline_options opt = offline_options())
+        : opt_(opt), map_(nullptr), map_size_(0), buf_(nullptr), size_(0), pos_(0), first_(0)
+        , format_(format::pcap), swap_(false), nsec_(false), tsresol_(), slots_(nullptr)
+        , slot_size_(0), enabled_(false), recv_(0), pending_(false), pend_(), t0_(0), wall0_()
+        {
+            int fd = ::open(file.c_str(), O_RDONLY);
+            if (fd == -1)
+                throw pfq_error(errno, "PFQ: offline: open");
+
+            struct stat st;
+            if (::fstat(fd, &st) == -1) {
+                int e = errno; ::close(fd);
+                throw pfq_error(e, "PFQ: offline: fstat");
+            }
+
+            map_size_ = static_cast<size_t>(st.st_size);
+
+            if (map_size_) {
+                map_ = ::mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map_ == MAP_FAILED) {
+                    int e = errno; ::close(fd);
+                    map_ = nullptr;
+                    throw pfq_error(e, "PFQ: offline: mmap");
+                }
+                ::madvise(map_, map_size_, MADV_SEQUENTIAL);
+            }
+
+            ::close(fd);
+
+            try 
+            {
+                init(static_cast<const char *>(map_), map_size_);
+            }
+            catch(...)
+            {
+                release();
+                throw;
+            }
+        }
+
+        /* a pcap image in memory, not owned */
+
+        pfq_offline(const void *data, size_t size, offline_options opt = offline_options())
+        : opt_(opt), map_(nullptr), map_size_(0), buf_(nullptr), size_(0), pos_(0), first_(0)
+        , format_(format::pcap), swap_(false), nsec_(false), tsresol_(), slots_(nullptr)
+        , slot_size_(0), enabled_(false), recv_(0), pending_(false), pend_(), t0_(0), wall0_()
+        {
+            init(static_cast<const char *>(data), size);
+        }
+
+        ~pfq_offline()
+        {
+            release();
+        }
+
+        pfq_offline(const pfq_offline &) = delete;
+        pfq_offline& operator=(const pfq_offline &) = delete;
+
+        void 
+        enable()
+        {
+            enabled_ = true;
+        }
+
+        void 
+        disable()
+        {
+            enabled_ = false;
+        }
+
+        bool 
+        is_enabled() const
+        {
+            return enabled_;
+        }
+
+        size_t 
+        caplen() const
+        {
+            return opt_.caplen;
+        }
+
+        size_t 
+        slot_size() const
+        {
+            return slot_size_;
+        }
+
+        int 
+        hdr_version() const
+        {
+            return opt_.hdr_version;
+        }
+
+        bool
+        time_stamp() const
+        {
+            return true;
+        }
+
+        int
+        id() const
+        {
+            return -1;
+        }
+
+        int
+        fd() const
+        {
+            return -1;
+        }
+
+        bool
+        eof() const
+        {
+            return !pending_ && pos_ >= size_;
+        }
+
+        /* restart from the first packet */
+
+        void
+        rewind()
+        {
+            pos_ = first_;
+            pending_ = false;
+            t0_ = 0;
+        }
+
+        pfq_stats
+        stats() const
+        {
+            return pfq_stats{ recv_, 0, 0, 0 };
+        }
+
+        int 
+        poll(long int microseconds = -1)
+        {
+            (void)microseconds;
+            return eof() && !opt_.loop ? 0 : 1;
+        }
+
+        queue
+        read(long int microseconds = -1)
+        {
+            if (!enabled_)
+                throw pfq_error("PFQ: not enabled");
+
+            size_t n = 0;
+            char *slot = slots_;
+
+            while (n < opt_.batch)
+            {
+                if (!pending_)
+                {
+                    if (!next(pend_))
+                    {
+                        if (!opt_.loop || pos_ == first_ || (rewind(), !next(pend_)))
+                            break;
+                    }
+                    pending_ = true;
+                }
+
+                if (opt_.pace && !due(pend_.tstamp, n == 0 ? microseconds : 0))
+                    break;
+
+                fill(slot, pend_);
+                pending_ = false;
+                slot += slot_size_;
+                n++;
+            }
+
+            recv_ += n;
+            return queue(slots_, static_cast<uint32_t>(slot_size_), static_cast<uint32_t>(n), opt_.hdr_version);
+        }
+
+        template <size_t Ahead = 4, typename Fun>
+        size_t dispatch(Fun callback, long int microseconds = -1, char *user = nullptr)
+        {
+            return dispatch_<Ahead>(callback, microseconds, user, 
+                                    std::integral_constant<int, detail::callback_version<Fun>::value>());
+        }
+
+    private:
+
+        template <size_t Ahead, typename Fun>
+        size_t 
+        dispatch_(Fun &callback, long int microseconds, char *, std::integral_constant<int, 0>)
+        {
+            auto many = this->read(microseconds); 
+            if (!many.empty())
+                callback(static_cast<const queue &>(many));
+            return many.size();
+        }
+
+        template <size_t Ahead, typename Fun, int Version>
+        size_t 
+        dispatch_(Fun &callback, long int microseconds, char *user, std::integral_constant<int, Version>)
+        {
+            if (opt_.hdr_version != Version)
+                throw pfq_error("PFQ: dispatch: header version mismatch");
+
+            return net::dispatch<Ahead>(this->read(microseconds), callback, user);
+        }
+
+        void
+        init(const char *buf, size_t size)
+        {
+            if (opt_.batch == 0 || opt_.caplen == 0 || opt_.speed <= 0)
+                throw pfq_error("PFQ: offline: bad options");
+            if (opt_.hdr_version != 1 && opt_.hdr_version != 2)
+                throw pfq_error("PFQ: offline: bad header version");
+            if (opt_.hdr_version == 1 && opt_.caplen > 0xffff)
+                throw pfq_error("PFQ: offline: caplen too large for header version 1");
+
+            buf_  = buf;
+            size_ = size;
+
+            if (size_ < 4)
+                throw pfq_error("PFQ: offline: not a pcap file");
+
+            uint32_t magic = u32(buf_);
+
+            switch(magic)
+            {
+            case 0xa1b2c3d4: case 0xd4c3b2a1:
+            case 0xa1b23c4d: case 0x4d3cb2a1:
+                {
+                    if (size_ < 24)
+                        throw pfq_error("PFQ: offline: truncated pcap header");
+
+                    format_ = format::pcap;
+                    swap_   = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+                    nsec_   = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+                    pos_    = 24;
+                } break;
+            case 0x0a0d0d0a:
+                {
+                    format_ = format::pcapng;
+                    pos_    = 0;
+                } break;
+            default:
+                throw pfq_error("PFQ: offline: not a pcap file");
+            }
+
+            first_ = pos_;
+
+            slot_size_ = net::slot_size(opt_.caplen, opt_.hdr_version);
+
+            void *p;
+            if (::posix_memalign(&p, 64, slot_size_ * opt_.batch) != 0)
+                throw std::bad_alloc();
+            slots_ = static_cast<char *>(p);
+        }
+
+        void
+        release()
+        {
+            if (map_)
+                ::munmap(map_, map_size_);
+            map_ = nullptr;
+
+            ::free(slots_);
+            slots_ = nullptr;
+        }
+
+        uint32_t 
+        u32(const char *p) const
+        {
+            uint32_t x; memcpy(&x, p, 4);
+            return swap_ ? __builtin_bswap32(x) : x;
+        }
+
+        uint16_t 
+        u16(const char *p) const
+        {
+            uint16_t x; memcpy(&x, p, 2);
+            return swap_ ? __builtin_bswap16(x) : x;
+        }
+
+        /* the next packet record, false at the end of the data */
+
+        bool
+        next(record &r)
+        {
+            return format_ == format::pcap ? next_pcap(r) : next_pcapng(r);
+        }
+
+        bool
+        next_pcap(record &r)
+        {
+            if (pos_ + 16 > size_)
+                return false;
+
+            const char *h = buf_ + pos_;
+            uint32_t caplen = u32(h + 8);
+
+            if (pos_ + 16 + caplen > size_)
+                return false;
+
+            r.data     = h + 16;
+            r.caplen   = caplen;
+            r.len      = u32(h + 12);
+            r.tstamp   = static_cast<uint64_t>(u32(h)) * 1000000000ULL + u32(h + 4) * (nsec_ ? 1ULL : 1000ULL);
+            r.iface    = 0;
+            r.hw_queue = 0;
+            r.egress   = false;
+
+            pos_ += 16 + caplen;
+            return true;
+        }
+
+        bool
+        next_pcapng(record &r)
+        {
+            for(;;)
+            {
+                if (pos_ + 12 > size_)
+                    return false;
+
+                const char *b = buf_ + pos_;
+
+                if (u32(b) == 0x0a0d0d0a)   /* the same in either byte order */
+                {
+                    /* a new section: byte order and interfaces */
+
+                    uint32_t bom; memcpy(&bom, b + 8, 4);
+                    if (bom == 0x1a2b3c4d)
+                        swap_ = false;
+                    else if (bom == 0x4d3c2b1a)
+                        swap_ = true;
+                    else 
+                        return false;
+                    tsresol_.clear();
+                }
+
+                uint32_t type = u32(b);
+                uint32_t len  = u32(b + 4);
+
+                if (len < 12 || len % 4 || pos_ + len > size_)
+                    return false;
+
+                pos_ += len;
+
+                switch(type)
+                {
+                case 1: /* interface description */
+                    {
+                        uint8_t res = 6;
+                        const char *end = b + len - 4;
+                        for(const char *o = b + 16; end - o >= 4; )
+                        {
+                            uint16_t code = u16(o), olen = u16(o + 2);
+                            if (code == 0 || olen > end - o - 4)
+                                break;
+                            if (code == 9 && olen >= 1)
+                                res = static_cast<uint8_t>(o[4]);
+                            o += 4 + align<4>(olen);
+                        }
+                        tsresol_.push_back(res);
+                    } break;
+
+                case 6: /* enhanced packet */
+                    {
+                        if (len < 32)
+                            return false;
+
+                        /* checked before aligning: align<4> wraps near 2^32 */
+                        uint32_t caplen = u32(b + 20);
+                        if (caplen > len - 32)
+                            return false;
+
+                        r.data     = b + 28;
+                        r.caplen   = caplen;
+                        r.len      = u32(b + 24);
+                        r.iface    = u32(b + 8);
+                        r.tstamp   = to_nsec((static_cast<uint64_t>(u32(b + 12)) << 32) | u32(b + 16), r.iface);
+                        r.hw_queue = 0;
+                        r.egress   = false;
+
+                        const char *end = b + len - 4;
+                        for(const char *o = b + 28 + align<4>(caplen); end - o >= 4; )
+                        {
+                            uint16_t code = u16(o), olen = u16(o + 2);
+                            if (code == 0 || olen > end - o - 4)
+                                break;
+                            if (code == 2 && olen == 4)     // epb_flags
+                                r.egress = (u32(o + 4) & 3) == 2;
+                            if (code == 6 && olen >= 4)     // epb_queue
+                                r.hw_queue = u32(o + 4);
+                            o += 4 + align<4>(olen);
+                        }
+                        return true;
+                    }
+
+                case 3: /* simple packet: no timestamp */
+                    {
+                        if (len < 16)
+                            return false;
+
+                        r.data     = b + 12;
+                        r.len      = u32(b + 8);
+                        r.caplen   = std::min(r.len, len - 16);
+                        r.tstamp   = 0;
+                        r.iface    = 0;
+                        r.hw_queue = 0;
+                        r.egress   = false;
+                        return true;
+                    }
+                }
+            }
+        }
+
+        uint64_t
+        to_nsec(uint64_t ts, uint32_t iface) const
+        {
+            uint8_t res = iface < tsresol_.size() ? tsresol_[iface] : 6;
+            uint8_t exp = res & 0x7f;
+
+            if (res & 0x80) 
+                return exp >= 64 ? 0 : (ts >> exp) * 1000000000ULL + (((ts & ((1ULL << exp) - 1)) * 1000000000ULL) >> exp);
+
+            uint64_t scale = 1;
+            if (exp <= 9) {
+                for(int n = exp; n < 9; n++) scale *= 10;
+                return ts * scale;
+            }
+            for(int n = 9; n < exp && n < 19; n++) scale *= 10;
+            return ts / scale;
+        }
+
+        /* pacing: wait (up to microseconds) until the packet captured at tstamp is due */
+
+        bool
+        due(uint64_t tstamp, long int microseconds)
+        {
+            auto now = std::chrono::steady_clock::now();
+
+            if (t0_ == 0 || tstamp < t0_) {
+                t0_    = tstamp ? tstamp : 1;
+                wall0_ = now;
+                return true;
+            }
+
+            auto at = wall0_ + std::chrono::nanoseconds(static_cast<uint64_t>((tstamp - t0_) / opt_.speed));
+            if (at <= now)
+                return true;
+
+            if (microseconds == 0)
+                return false;
+
+            if (microseconds > 0)
+                at = std::min(at, now + std::chrono::microseconds(microseconds));
+
+            std::this_thread::sleep_until(at);
+            return std::chrono::steady_clock::now() >= wall0_ + std::chrono::nanoseconds(static_cast<uint64_t>((tstamp - t0_) / opt_.speed));
+        }
+
+        /* the packet into a slot, as the module would */
+
+        void
+        fill(char *slot, const record &r)
+        {
+            uint32_t caplen = std::min<uint32_t>(r.caplen, static_cast<uint32_t>(opt_.caplen));
+
+            if (opt_.hdr_version == 2)
+            {
+                auto h = reinterpret_cast<pfq_hdr_v2 *>(slot);
+                memset(h, 0, sizeof(*h));
+
+                h->caplen   = caplen;
+                h->len      = r.len;
+                h->if_index = r.iface;
+                h->tstamp   = r.tstamp;
+                h->hw_queue = static_cast<uint16_t>(r.hw_queue);
+
+                detail::set_layers(h, r.data, caplen);
+
+                if (r.egress)
+                    h->flags |= Q_HDR_F_EGRESS;
+
+                memcpy(slot + hdr_size(2), r.data, caplen);
+                h->commit = 1;
+            }
+            else
+            {
+                auto h = reinterpret_cast<pfq_hdr *>(slot);
+                memset(h, 0, sizeof(*h));
+
+                h->caplen   = static_cast<uint16_t>(caplen);
+                h->len      = static_cast<uint16_t>(std::min<uint32_t>(r.len, 0xffff));
+                h->egress   = r.egress;
+                h->if_index = static_cast<uint8_t>(r.iface);
+                h->hw_queue = static_cast<uint8_t>(r.hw_queue);
+                h->tstamp.tv.sec  = static_cast<uint32_t>(r.tstamp / 1000000000ULL);
+                h->tstamp.tv.nsec = static_cast<uint32_t>(r.tstamp % 1000000000ULL);
+
+                memcpy(h + 1, r.data, caplen);
+                h->commit = 1;
+            }
+        }
+
+        offline_options opt_;
+
+        void *      map_;
+        size_t      map_size_;
+
+        const char *buf_;
+        size_t      size_;
+        size_t      pos_;
+        size_t      first_;
+
+        format      format_;
+        bool        swap_;
+        bool        nsec_;
+        std::vector<uint8_t> tsresol_;     // pcapng, per interface
+
+        char *      slots_;
+        size_t      slot_size_;
+        bool        enabled_;
+        unsigned long recv_;
+
+        bool        pending_;              // pend_ read but not delivered yet (pacing)
+        record      pend_;
+
+        uint64_t    t0_;                   // pacing: first timestamp...
+        std::chrono::steady_clock::time_point wall0_;   // ...and when it was delivered
+    };
+
+} // namespace net
+
+#endif /* _PFQ_OFFLINE_HPP_ */
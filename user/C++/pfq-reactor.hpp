@@ -0,0 +1,375 @@
+/***************************************************************
+   
+   Copyright (c) 2012, Nicola Bonelli 
+   All rights reserved. 
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions are met: 
+
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer. 
+   * Redistributions in binary form must reproduce the above copyright 
+     notice, this list of conditions and the following disclaimer in the 
+     documentation and/or other materials provided with the distribution. 
+   * Neither the name of University of Pisa nor the names of its contributors 
+     may be used to endorse or promote products derived from this software 
+     without specific prior written permission. 
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+   POSSIBILITY OF SUCH DAMAGE.
+ 
+ ***************************************************************/
+
+#ifndef _PFQ_REACTOR_HPP_
+#define _PFQ_REACTOR_HPP_ 
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+
+#include <pfq.hpp>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define PFQ_COROUTINES 1
+#endif
+#endif
+
+namespace net { 
+
+    /* pfq_reactor: waits on many pfq sockets from one thread (epoll). A 
+       socket is ready when its queue reaches the poll watermark (half the 
+       slots); when the wait times out, the sockets with a non empty queue 
+       are handled as well, so that slow queues are drained too. 
+
+       Handlers may add or remove sockets (even their own) while running. 
+       A socket registered is followed when moved, and removed when closed 
+       or destroyed (see pfq::watch). */
+
+    class pfq_reactor
+    {
+    public:
+
+        typedef std::function<void(pfq &)> handler_type;
+
+        pfq_reactor()
+        : epfd_(::epoll_create1(EPOLL_CLOEXEC)), evfd_(-1), stop_(false), entries_(), zombies_()
+        {
+            if (epfd_ == -1)
+                throw pfq_error(errno, "PFQ: epoll_create");
+
+            evfd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (evfd_ == -1) {
+                ::close(epfd_);
+                throw pfq_error(errno, "PFQ: eventfd");
+            }
+
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = nullptr;
+            if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, evfd_, &ev) == -1) {
+                ::close(evfd_);
+                ::close(epfd_);
+                throw pfq_error(errno, "PFQ: epoll_ctl");
+            }
+        }
+
+        ~pfq_reactor()
+        {
+            for(auto &e : entries_)
+                e.second->q->unwatch(this);
+
+            ::close(evfd_);
+            ::close(epfd_);
+        }
+
+        pfq_reactor(const pfq_reactor &) = delete;
+        pfq_reactor& operator=(const pfq_reactor &) = delete;
+
+
+        void
+        add(pfq &q, handler_type handler)
+        {
+            if (q.fd() == -1)
+                throw pfq_error("PFQ: not open");
+
+            int fd = q.fd();
+
+            /* already registered: the handler is replaced and the socket re-armed */
+
+            auto it = entries_.find(fd);
+            if (it != entries_.end()) 
+            {
+                auto e = it->second.get();
+
+                if (e->q != &q) {
+                    e->q->unwatch(this);
+                    e->q = &q;
+                    this->watch(q);
+                }
+
+                e->handler = std::move(handler);
+                this->arm(fd, e);
+                return;
+            }
+
+            std::unique_ptr<entry> e(new entry(q, std::move(handler)));
+
+            this->arm(fd, e.get());
+            this->watch(q);
+
+            entries_.emplace(fd, std::move(e));
+        }
+
+        void
+        remove(pfq &q)
+        {
+            auto it = entries_.find(q.fd());
+            if (it == entries_.end() || it->second->q != &q)
+                throw pfq_error("PFQ: socket not registered");
+
+            q.unwatch(this);
+            this->detach(it);
+        }
+
+        size_t
+        size() const
+        {
+            return entries_.size();
+        }
+
+
+        /* wait up to timeout msec (-1 = infinite) and run the handlers of 
+           the ready sockets. Returns the number of handlers run. */
+
+        int
+        run_once(int timeout = -1)
+        {
+            epoll_event events[64];
+            int count = 0;
+
+            int n = ::epoll_wait(epfd_, events, 64, timeout);
+            if (n < 0) {
+                if (errno == EINTR)
+                    return 0;
+                throw pfq_error(errno, "PFQ: epoll_wait");
+            }
+
+            if (n == 0)
+            {
+                std::vector<entry *> pending;
+                for(auto &e : entries_)
+                {
+                    if (not_empty(*e.second->q))
+                        pending.push_back(e.second.get());
+                }
+                for(auto e : pending)
+                    count += dispatch(e);
+            }
+
+            for(int i = 0; i < n; i++)
+            {
+                if (events[i].data.ptr == nullptr) {
+                    uint64_t value;
+                    if (::read(evfd_, &value, sizeof(value)) < 0) {}
+                    continue;
+                }
+
+                count += dispatch(static_cast<entry *>(events[i].data.ptr));
+            }
+
+            zombies_.clear();
+            return count;
+        }
+
+        /* run until stop() is called (from a handler or another thread) */
+
+        void
+        run(int timeout = 100)
+        {
+            while (!stop_.exchange(false))
+                run_once(timeout);
+        }
+
+        void
+        stop()
+        {
+            stop_.store(true);
+            uint64_t one = 1;
+            if (::write(evfd_, &one, sizeof(one)) < 0) {}
+        }
+
+        static bool 
+        not_empty(const pfq &q)
+        {
+            auto descr = static_cast<const pfq_queue_descr *>(q.mem_addr());
+            return descr && DBMP_QUEUE_LEN(descr->data) != 0;
+        }
+
+#ifdef PFQ_COROUTINES
+
+        /* co_await reactor.next_batch(q): resumes the coroutine (from run_once) 
+           when q is ready, and yields the batch read from q. The socket is 
+           registered with no handler if needed. */
+
+        struct batch_awaiter
+        {
+            pfq_reactor &reactor;
+            pfq &q;
+
+            bool await_ready() const
+            {
+                return pfq_reactor::not_empty(q);
+            }
+
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                reactor.suspend(q, h);
+            }
+
+            queue await_resume()
+            {
+                return q.read(0);
+            }
+        };
+
+        batch_awaiter
+        next_batch(pfq &q)
+        {
+            return batch_awaiter{*this, q};
+        }
+
+#endif
+
+    private:
+
+        struct entry
+        {
+            entry(pfq &q_, handler_type h)
+            : q(&q_), handler(std::move(h))
+#ifdef PFQ_COROUTINES
+            , waiter()
+#endif
+            {}
+
+            pfq *        q;
+            handler_type handler;
+#ifdef PFQ_COROUTINES
+            std::coroutine_handle<> waiter;
+#endif
+        };
+
+        /* events = 0: the socket stays registered but is not polled (an entry 
+           with no handler and no coroutine waiting on it) */
+
+        void
+        arm(int fd, entry *e, uint32_t events = EPOLLIN)
+        {
+            epoll_event ev;
+            ev.events = events;
+            ev.data.ptr = e;
+
+            if (::epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) == -1 && 
+                (errno != ENOENT || ::epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == -1))
+                throw pfq_error(errno, "PFQ: epoll_ctl");
+        }
+
+        /* the entry follows the socket: moved to another pfq, or closed */
+
+        void
+        watch(pfq &q)
+        {
+            int fd = q.fd();
+
+            q.watch(this, [this, fd](pfq *p) {
+                auto it = entries_.find(fd);
+                if (it == entries_.end())
+                    return;
+                if (p)
+                    it->second->q = p;
+                else
+                    this->detach(it);
+            });
+        }
+
+        template <typename It>
+        void
+        detach(It it)
+        {
+            ::epoll_ctl(epfd_, EPOLL_CTL_DEL, it->first, nullptr);
+
+            /* events already collected may still refer to the entry; a coroutine 
+               waiting on it is not resumed (its frame belongs to the caller) */
+
+            it->second->q = nullptr;
+            zombies_.push_back(std::move(it->second));
+            entries_.erase(it);
+        }
+
+        int
+        dispatch(entry *e)
+        {
+            if (e->q == nullptr)
+                return 0;
+#ifdef PFQ_COROUTINES
+            if (e->waiter) {
+                auto h = e->waiter;
+                e->waiter = nullptr;
+
+                /* level triggered: with nobody to drain it, the queue would 
+                   wake up epoll_wait at once; suspend() re-arms it */
+                if (!e->handler)
+                    this->arm(e->q->fd(), e, 0);
+
+                h.resume();
+                return 1;
+            }
+#endif
+            if (!e->handler)
+                return 0;
+            e->handler(*e->q);
+            return 1;
+        }
+
+#ifdef PFQ_COROUTINES
+        void
+        suspend(pfq &q, std::coroutine_handle<> h)
+        {
+            auto it = entries_.find(q.fd());
+            if (it == entries_.end()) {
+                add(q, handler_type());
+                it = entries_.find(q.fd());
+            }
+            else if (!it->second->handler)
+                this->arm(q.fd(), it->second.get());
+
+            it->second->waiter = h;
+        }
+#endif
+
+        int epfd_;
+        int evfd_;
+        std::atomic<bool> stop_;
+
+        std::unordered_map<int, std::unique_ptr<entry>> entries_;
+        std::vector<std::unique_ptr<entry>> zombies_;
+    };
+
+} // namespace net
+
+#endif /* _PFQ_REACTOR_HPP_ */
@@ -0,0 +1,502 @@
+/***************************************************************
+   
+   Copyright (c) 2012, Nicola Bonelli 
+   All rights reserved. 
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions are met: 
+
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer. 
+   * Redistributions in binary form must reproduce the above copyright 
+     notice, this list of conditions and the following disclaimer in the 
+     documentation and/or other materials provided with the distribution. 
+   * Neither the name of University of Pisa nor the names of its contributors 
+     may be used to endorse or promote products derived from this software 
+     without specific prior written permission. 
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+   POSSIBILITY OF SUCH DAMAGE.
+ 
+ ***************************************************************/
+
+#ifndef _PFQ_RECORD_HPP_
+#define _PFQ_RECORD_HPP_ 
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pfq.hpp>
+
+namespace net { 
+
+    /* pcap_writer: turns batches into pcap or pcapng records, packed into 
+       large aligned blocks that a dedicated thread writes to disk (O_DIRECT 
+       when the file system supports it). Files are rotated by size and/or 
+       time at record boundaries. 
+
+       pcapng stores per packet the direction (epb_flags) and the hw queue 
+       (epb_queue); every capturing device gets its interface block, named 
+       after the device. Timestamps are in nanoseconds in both formats. */
+
+    enum class pcap_format { pcap, pcapng };
+
+    struct pcap_options
+    {
+        pcap_format format;
+        size_t      snaplen;
+        size_t      block_size;     // bytes, multiple of 4096
+        size_t      blocks;         // blocks in flight
+        uint64_t    rotate_size;    // bytes per file, 0 = no rotation
+        unsigned    rotate_time;    // seconds per file, 0 = no rotation
+        bool        direct;         // try O_DIRECT
+
+        pcap_options()
+        : format(pcap_format::pcapng), snaplen(65535), block_size(4 << 20), blocks(8)
+        , rotate_size(0), rotate_time(0), direct(true)
+        {}
+    };
+
+    struct pcap_stats
+    {
+        uint64_t packets;
+        uint64_t bytes;         // written to disk
+        uint64_t files;
+        uint64_t stalls;        // no free block: the capture waited for the disk
+    };
+
+
+    class pcap_writer
+    {
+        static constexpr size_t align_size = 4096;
+
+        struct block
+        {
+            char * data;
+            size_t len;
+            bool   new_file;
+        };
+
+    public:
+
+        pcap_writer(std::string path, pcap_options opt = pcap_options())
+        : path_(std::move(path)), opt_(opt), pool_(), free_(), full_(), mutex_(), cond_()
+        , cur_(), file_bytes_(0), file_start_(), file_index_(0), ifaces_(), packets_(0)
+        , fd_(-1), direct_(false), stats_{0, 0, 0, 0}, error_(), thread_()
+        {
+            if (opt_.block_size == 0 || opt_.block_size % align_size || opt_.blocks < 2)
+                throw pfq_error("PFQ: pcap_writer: bad block size");
+
+            for(size_t n = 0; n < opt_.blocks; ++n)
+            {
+                void *p;
+                if (::posix_memalign(&p, align_size, opt_.block_size) != 0) {
+                    release();
+                    throw std::bad_alloc();
+                }
+                pool_.push_back(static_cast<char *>(p));
+                free_.push_back(static_cast<char *>(p));
+            }
+
+            thread_ = std::thread(&pcap_writer::run, this);
+
+            start_file();
+        }
+
+        ~pcap_writer()
+        {
+            try { close(); } catch(...) {}
+            release();
+        }
+
+        pcap_writer(const pcap_writer &) = delete;
+        pcap_writer& operator=(const pcap_writer &) = delete;
+
+
+        /* append the packets of a batch (queue or compact_batch) */
+
+        template <typename Batch>
+        void 
+        write(const Batch &batch)
+        {
+            for(auto it = batch.begin(), it_e = batch.end(); it != it_e; ++it)
+            {
+                while (!it.ready())
+                    cpu_relax();
+
+                write(it.data(), it.caplen(), it.len(), it.tstamp(), it.if_index(), it.hw_queue(), it.egress());
+            }
+        }
+
+        void
+        write(const void *data, size_t caplen, size_t len, uint64_t tstamp, int if_index, int hw_queue, bool egress)
+        {
+            caplen = std::min(caplen, opt_.snaplen);
+
+            size_t rec = opt_.format == pcap_format::pcap ? 16 + caplen : 32 + align<4>(caplen) + 16 + 4;
+
+            if (rotate_due(rec))
+                rotate();
+
+            if (opt_.format == pcap_format::pcap)
+            {
+                uint32_t h[4] = { static_cast<uint32_t>(tstamp / 1000000000ULL), static_cast<uint32_t>(tstamp % 1000000000ULL),
+                                  static_cast<uint32_t>(caplen), static_cast<uint32_t>(len) };
+                put(h, sizeof(h));
+                put(data, caplen);
+            }
+            else
+            {
+                uint32_t iface = interface(if_index);
+                uint32_t h[7] = { 6, static_cast<uint32_t>(rec), iface, 
+                                  static_cast<uint32_t>(tstamp >> 32), static_cast<uint32_t>(tstamp), 
+                                  static_cast<uint32_t>(caplen), static_cast<uint32_t>(len) };
+                put(h, sizeof(h));
+                put(data, caplen);
+                pad(align<4>(caplen) - caplen);
+
+                uint32_t opts[5] = { 2 | (4 << 16), egress ? 2u : 1u,            // epb_flags: direction 
+                                     6 | (4 << 16), static_cast<uint32_t>(hw_queue),   // epb_queue
+                                     0 };                                        // opt_endofopt
+                put(opts, sizeof(opts));
+                put(&h[1], 4);
+            }
+
+            packets_.store(packets_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        /* flush the pending data and stop the writer thread */
+
+        void
+        close()
+        {
+            if (!thread_.joinable())
+                return;
+
+            submit(true);
+            submit_block(block{ nullptr, 0, false });
+            thread_.join();
+
+            if (error_)
+                std::rethrow_exception(error_);
+        }
+
+        pcap_stats
+        stats() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pcap_stats ret = stats_;
+            ret.packets = packets_.load(std::memory_order_relaxed);
+            return ret;
+        }
+
+    private:
+
+        /* producer side */
+
+        bool
+        rotate_due(size_t rec) const
+        {
+            if (opt_.rotate_size && file_bytes_ + rec > opt_.rotate_size && file_bytes_ > header_size())
+                return true;
+            /* the clock is read once every 1024 packets */
+            if (opt_.rotate_time && (packets_ & 1023) == 0 && 
+                std::chrono::steady_clock::now() - file_start_ >= std::chrono::seconds(opt_.rotate_time))
+                return true;
+            return false;
+        }
+
+        size_t
+        header_size() const
+        {
+            return opt_.format == pcap_format::pcap ? 24 : 28;
+        }
+
+        void
+        rotate()
+        {
+            submit(true);
+            start_file();
+        }
+
+        void
+        start_file()
+        {
+            cur_ = get_block();
+            cur_.new_file = true;
+            file_bytes_ = 0;
+            file_start_ = std::chrono::steady_clock::now();
+            ifaces_.clear();
+
+            if (opt_.format == pcap_format::pcap)
+            {
+                uint32_t h[6] = { 0xa1b23c4d, 2 | (4 << 16), 0, 0, static_cast<uint32_t>(opt_.snaplen), 1 /* ethernet */ };
+                put(h, sizeof(h));
+            }
+            else
+            {
+                /* section header block */
+                uint32_t h[7] = { 0x0a0d0d0a, 28, 0x1a2b3c4d, 1, 0xffffffff, 0xffffffff, 28 };
+                put(h, sizeof(h));
+            }
+        }
+
+        uint32_t
+        interface(int if_index)
+        {
+            auto it = ifaces_.find(if_index);
+            if (it != ifaces_.end())
+                return it->second;
+
+            uint32_t id = static_cast<uint32_t>(ifaces_.size());
+            ifaces_[if_index] = id;
+
+            /* interface description block: if_name, if_tsresol (nsec) */
+
+            char name[IF_NAMESIZE + 16] = { 0 };
+            if (::if_indextoname(static_cast<unsigned int>(if_index), name) == nullptr)
+                snprintf(name, sizeof(name), "ifindex%d", if_index);
+
+            size_t nlen = strlen(name);
+            uint32_t len = 16 + 4 + align<4>(nlen) + 4 + 4 + 4 + 4;
+
+            uint32_t h[4] = { 1, len, 1 /* ethernet */, static_cast<uint32_t>(opt_.snaplen) };
+            put(h, sizeof(h));
+
+            uint32_t opt_name = 2 | (static_cast<uint32_t>(nlen) << 16);
+            put(&opt_name, 4);
+            put(name, nlen);
+            pad(align<4>(nlen) - nlen);
+
+            uint32_t tail[4] = { 9 | (1 << 16), 9 /* 10^-9 */, 0, len };
+            put(tail, sizeof(tail));
+            return id;
+        }
+
+        void
+        pad(size_t n)
+        {
+            static const char zero[8] = { 0 };
+            put(zero, n);
+        }
+
+        void
+        put(const void *data, size_t n)
+        {
+            const char *p = static_cast<const char *>(data);
+            file_bytes_ += n;
+
+            while (n)
+            {
+                size_t room = opt_.block_size - cur_.len;
+                size_t len  = std::min(room, n);
+                memcpy(cur_.data + cur_.len, p, len);
+                cur_.len += len, p += len, n -= len;
+
+                if (cur_.len == opt_.block_size) {
+                    submit(false);
+                }
+            }
+        }
+
+        /* hand the current block to the writer; last: the file ends here */
+
+        void
+        submit(bool last)
+        {
+            submit_block(cur_);
+            cur_ = last ? block{ nullptr, 0, false } : get_block();
+        }
+
+        void
+        submit_block(block b)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                full_.push_back(b);
+            }
+            cond_.notify_all();
+        }
+
+        block
+        get_block()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (free_.empty())
+                stats_.stalls++;
+            cond_.wait(lock, [this] { return !free_.empty() || error_; });
+            if (error_)
+                std::rethrow_exception(error_);
+            char *p = free_.front();
+            free_.pop_front();
+            return block{ p, 0, false };
+        }
+
+
+        /* writer thread */
+
+        void
+        run()
+        {
+            for(;;)
+            {
+                block b;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cond_.wait(lock, [this] { return !full_.empty(); });
+                    b = full_.front();
+                    full_.pop_front();
+                }
+
+                if (b.data == nullptr)
+                    break;
+
+                try
+                {
+                    if (b.new_file)
+                        open_next();
+
+                    write_block(b);
+                }
+                catch(...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (!error_)
+                        error_ = std::current_exception();
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    free_.push_back(b.data);
+                }
+                cond_.notify_all();
+            }
+
+            if (fd_ != -1)
+                ::close(fd_);
+            fd_ = -1;
+        }
+
+        void
+        open_next()
+        {
+            if (fd_ != -1)
+                ::close(fd_);
+
+            std::string name = path_;
+            if (opt_.rotate_size || opt_.rotate_time)
+            {
+                char num[16];
+                snprintf(num, sizeof(num), ".%04u", file_index_++);
+                auto dot = name.rfind('.');
+                if (dot == std::string::npos || name.find('/', dot) != std::string::npos)
+                    name.append(num);
+                else
+                    name.insert(dot, num);
+            }
+
+            int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+            fd_ = opt_.direct ? ::open(name.c_str(), flags | O_DIRECT, 0644) : -1;
+            direct_ = fd_ != -1;
+            if (fd_ == -1)
+                fd_ = ::open(name.c_str(), flags, 0644);
+            if (fd_ == -1)
+                throw pfq_error(errno, "PFQ: pcap_writer: open");
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_.files++;
+        }
+
+        void
+        write_all(const char *p, size_t n)
+        {
+            while (n)
+            {
+                ssize_t r = ::write(fd_, p, n);
+                if (r < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    throw pfq_error(errno, "PFQ: pcap_writer: write");
+                }
+                p += r, n -= r;
+            }
+        }
+
+        void
+        write_block(const block &b)
+        {
+            size_t aligned = direct_ ? b.len & ~(align_size - 1) : b.len;
+
+            write_all(b.data, aligned);
+
+            /* the tail of a file is not aligned: leave O_DIRECT */
+            if (aligned != b.len)
+            {
+                ::fcntl(fd_, F_SETFL, ::fcntl(fd_, F_GETFL) & ~O_DIRECT);
+                direct_ = false;
+                write_all(b.data + aligned, b.len - aligned);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_.bytes += b.len;
+        }
+
+        void
+        release()
+        {
+            for(auto p : pool_)
+                ::free(p);
+            pool_.clear();
+        }
+
+        std::string               path_;
+        pcap_options              opt_;
+
+        std::vector<char *>       pool_;
+        std::deque<char *>        free_;
+        std::deque<block>         full_;
+        mutable std::mutex        mutex_;
+        std::condition_variable   cond_;
+
+        /* producer */
+        block                     cur_;
+        uint64_t                  file_bytes_;
+        std::chrono::steady_clock::time_point file_start_;
+        unsigned int              file_index_;
+        std::map<int, uint32_t>   ifaces_;
+        std::atomic<uint64_t>     packets_;
+
+        /* writer */
+        int                       fd_;
+        bool                      direct_;
+
+        pcap_stats                stats_;
+        std::exception_ptr        error_;
+        std::thread               thread_;
+    };
+
+} // namespace net
+
+#endif /* _PFQ_RECORD_HPP_ */
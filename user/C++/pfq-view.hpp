@@ -0,0 +1,395 @@
+/***************************************************************
+   
+   Copyright (c) 2012, Nicola Bonelli 
+   All rights reserved. 
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions are met: 
+
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer. 
+   * Redistributions in binary form must reproduce the above copyright 
+     notice, this list of conditions and the following disclaimer in the 
+     documentation and/or other materials provided with the distribution. 
+   * Neither the name of University of Pisa nor the names of its contributors 
+     may be used to endorse or promote products derived from this software 
+     without specific prior written permission. 
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+   POSSIBILITY OF SUCH DAMAGE.
+ 
+ ***************************************************************/
+
+#ifndef _PFQ_VIEW_HPP_
+#define _PFQ_VIEW_HPP_ 
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <tuple>
+#include <type_traits>
+
+namespace net { 
+
+    //////////////////////////////////////////////////////////////////////
+    // typed header views: 
+    //
+    //  view<eth, vlan, ipv4, udp> v(it);    // it: queue::const_iterator
+    //  if (v.valid()) 
+    //      count[v.get<udp>().dport()]++;
+    //
+    // The offset of a layer preceded by fixed-size layers only is a compile
+    // time constant; the others are computed once, when the view is built.
+    // Accessors are single (unaligned) loads, network fields are returned in
+    // host order, addresses in network order.
+
+    namespace detail
+    {
+        template <typename T>
+        inline T 
+        load(const char *p)
+        {
+            T x; memcpy(&x, p, sizeof(T)); return x;
+        }
+
+        inline uint16_t be16_at(const char *p) { return __builtin_bswap16(load<uint16_t>(p)); }
+        inline uint32_t be32_at(const char *p) { return __builtin_bswap32(load<uint32_t>(p)); }
+    }
+
+
+    namespace layer
+    {
+        // a layer has: 
+        //
+        //  fixed      true if its size does not depend on the packet
+        //  min_size   bytes to be captured before size() can be read
+        //  size(p)    size of the header at p, 0 if malformed 
+
+        struct eth
+        {
+            static constexpr bool   fixed    = true;
+            static constexpr size_t min_size = 14;
+            static size_t size(const char *) { return 14; }
+
+            const uint8_t *dst()  const { return reinterpret_cast<const uint8_t *>(p); }
+            const uint8_t *src()  const { return reinterpret_cast<const uint8_t *>(p + 6); }
+            uint16_t       type() const { return detail::be16_at(p + 12); }
+
+            const char *p;
+        };
+
+        struct vlan
+        {
+            static constexpr bool   fixed    = true;
+            static constexpr size_t min_size = 4;
+            static size_t size(const char *) { return 4; }
+
+            uint16_t tci()  const { return detail::be16_at(p); }
+            uint16_t id()   const { return tci() & 0x0fff; }
+            uint8_t  pcp()  const { return static_cast<uint8_t>(tci() >> 13); }
+            uint16_t type() const { return detail::be16_at(p + 2); }
+
+            const char *p;
+        };
+
+        struct ipv4
+        {
+            static constexpr bool   fixed    = false;
+            static constexpr size_t min_size = 20;
+            static size_t size(const char *p) 
+            { 
+                size_t ihl = (p[0] & 0x0f) << 2;
+                return (p[0] & 0xf0) == 0x40 && ihl >= 20 ? ihl : 0; 
+            }
+
+            uint8_t  version()  const { return static_cast<uint8_t>(p[0]) >> 4; }
+            uint8_t  ihl()      const { return p[0] & 0x0f; }
+            uint8_t  tos()      const { return static_cast<uint8_t>(p[1]); }
+            uint16_t length()   const { return detail::be16_at(p + 2); }
+            uint16_t id()       const { return detail::be16_at(p + 4); }
+            uint16_t frag_off() const { return detail::be16_at(p + 6) & 0x1fff; }
+            bool     more_fragments() const { return detail::be16_at(p + 6) & 0x2000; }
+            uint8_t  ttl()      const { return static_cast<uint8_t>(p[8]); }
+            uint8_t  protocol() const { return static_cast<uint8_t>(p[9]); }
+            uint16_t checksum() const { return detail::be16_at(p + 10); }
+            uint32_t src()      const { return detail::load<uint32_t>(p + 12); }
+            uint32_t dst()      const { return detail::load<uint32_t>(p + 16); }
+
+            const char *p;
+        };
+
+        struct ipv6
+        {
+            static constexpr bool   fixed    = true;
+            static constexpr size_t min_size = 40;
+            static size_t size(const char *p) { return (p[0] & 0xf0) == 0x60 ? 40 : 0; }
+
+            uint8_t  traffic_class()  const { return static_cast<uint8_t>(detail::be16_at(p) >> 4); }
+            uint32_t flow_label()     const { return detail::be32_at(p) & 0xfffff; }
+            uint16_t payload_length() const { return detail::be16_at(p + 4); }
+            uint8_t  next_header()    const { return static_cast<uint8_t>(p[6]); }
+            uint8_t  hop_limit()      const { return static_cast<uint8_t>(p[7]); }
+            const uint8_t *src()      const { return reinterpret_cast<const uint8_t *>(p + 8); }
+            const uint8_t *dst()      const { return reinterpret_cast<const uint8_t *>(p + 24); }
+
+            const char *p;
+        };
+
+        struct tcp
+        {
+            static constexpr bool   fixed    = false;
+            static constexpr size_t min_size = 20;
+            static size_t size(const char *p) 
+            { 
+                size_t doff = (static_cast<uint8_t>(p[12]) >> 4) << 2;
+                return doff >= 20 ? doff : 0; 
+            }
+
+            uint16_t sport()    const { return detail::be16_at(p); }
+            uint16_t dport()    const { return detail::be16_at(p + 2); }
+            uint32_t seq()      const { return detail::be32_at(p + 4); }
+            uint32_t ack_seq()  const { return detail::be32_at(p + 8); }
+            uint8_t  doff()     const { return static_cast<uint8_t>(p[12]) >> 4; }
+            uint8_t  flags()    const { return static_cast<uint8_t>(p[13]); }
+            uint16_t window()   const { return detail::be16_at(p + 14); }
+            uint16_t checksum() const { return detail::be16_at(p + 16); }
+
+            const char *p;
+        };
+
+        struct udp
+        {
+            static constexpr bool   fixed    = true;
+            static constexpr size_t min_size = 8;
+            static size_t size(const char *) { return 8; }
+
+            uint16_t sport()    const { return detail::be16_at(p); }
+            uint16_t dport()    const { return detail::be16_at(p + 2); }
+            uint16_t length()   const { return detail::be16_at(p + 4); }
+            uint16_t checksum() const { return detail::be16_at(p + 6); }
+
+            const char *p;
+        };
+
+
+        // link<Prev, Next>::check(prev): the header of Prev announces Next.
+        // Unknown pairs are accepted: specialize it for new protocols.
+
+        template <typename Prev, typename Next>
+        struct link
+        {
+            static bool check(const char *) { return true; }
+        };
+
+        template <typename Prev> 
+        struct link_by_type
+        {
+            template <uint16_t ...Ts>
+            static bool is(const char *p) 
+            { 
+                const uint16_t type = Prev{p}.type();
+                const uint16_t types[] = { Ts... };
+                for(auto t : types)
+                    if (t == type)
+                        return true;
+                return false;
+            }
+        };
+
+        template <> struct link<eth, vlan>   { static bool check(const char *p) { return link_by_type<eth>::is<0x8100, 0x88a8>(p); } };
+        template <> struct link<eth, ipv4>   { static bool check(const char *p) { return link_by_type<eth>::is<0x0800>(p); } };
+        template <> struct link<eth, ipv6>   { static bool check(const char *p) { return link_by_type<eth>::is<0x86dd>(p); } };
+        template <> struct link<vlan, vlan>  { static bool check(const char *p) { return link_by_type<vlan>::is<0x8100>(p); } };
+        template <> struct link<vlan, ipv4>  { static bool check(const char *p) { return link_by_type<vlan>::is<0x0800>(p); } };
+        template <> struct link<vlan, ipv6>  { static bool check(const char *p) { return link_by_type<vlan>::is<0x86dd>(p); } };
+
+        /* transport headers are only in the first fragment */
+
+        template <> struct link<ipv4, tcp>   { static bool check(const char *p) { return ipv4{p}.protocol() == 6  && ipv4{p}.frag_off() == 0; } };
+        template <> struct link<ipv4, udp>   { static bool check(const char *p) { return ipv4{p}.protocol() == 17 && ipv4{p}.frag_off() == 0; } };
+
+        /* no extension headers in between */
+
+        template <> struct link<ipv6, tcp>   { static bool check(const char *p) { return ipv6{p}.next_header() == 6; } };
+        template <> struct link<ipv6, udp>   { static bool check(const char *p) { return ipv6{p}.next_header() == 17; } };
+    }
+
+
+    namespace detail
+    {
+        /* the layers before K are all fixed: sum of their sizes */
+
+        template <size_t K, typename Layers> 
+        struct static_offset
+        {
+            typedef typename std::tuple_element<K-1, Layers>::type prev;
+
+            static constexpr bool   value  = prev::fixed && static_offset<K-1, Layers>::value;
+            static constexpr size_t offset = prev::min_size + static_offset<K-1, Layers>::offset;
+        };
+
+        template <typename Layers> 
+        struct static_offset<0, Layers>
+        {
+            static constexpr bool   value  = true;
+            static constexpr size_t offset = 0;
+        };
+
+        /* index of the first L in Ls */
+
+        template <typename L, typename ...Ls> struct index_of;
+
+        template <typename L, typename ...Ls> 
+        struct index_of<L, L, Ls...> : std::integral_constant<size_t, 0> {};
+
+        template <typename L, typename M, typename ...Ls> 
+        struct index_of<L, M, Ls...> : std::integral_constant<size_t, 1 + index_of<L, Ls...>::value> {};
+    }
+
+
+    template <typename ...Ls>
+    class view
+    {
+        static_assert(sizeof...(Ls) > 0, "view: no layers");
+
+        typedef std::tuple<Ls...> layers;
+
+        static constexpr size_t N = sizeof...(Ls);
+
+    public:
+
+        template <size_t K>
+        using layer_type = typename std::tuple_element<K, layers>::type;
+
+        /* the offset of layer K is known at compile time */
+
+        template <size_t K>
+        static constexpr bool 
+        is_static()
+        {
+            return detail::static_offset<K, layers>::value;
+        }
+
+        view(const void *data, size_t caplen)
+        : base_(static_cast<const char *>(data))
+        , caplen_(caplen)
+        , valid_(true)
+        , off_()
+        {
+            parse(std::integral_constant<size_t, 0>(), 0);
+        }
+
+        /* any queue iterator (data() and caplen()) */
+
+        template <typename Iter, typename = decltype(std::declval<Iter>().caplen())>
+        explicit view(const Iter &it)
+        : view(it.data(), it.caplen())
+        {}
+
+        /* all the layers are captured and each one announces the next */
+
+        bool 
+        valid() const
+        {
+            return valid_;
+        }
+
+        template <size_t K>
+        size_t 
+        offset() const
+        {
+            return is_static<K>() ? detail::static_offset<K, layers>::offset : off_[K];
+        }
+
+        /* bytes past the last layer */
+
+        size_t 
+        payload_offset() const
+        {
+            return off_[N];
+        }
+
+        const char *
+        payload() const
+        {
+            return base_ + off_[N];
+        }
+
+        template <size_t K>
+        layer_type<K> 
+        get() const
+        {
+            return layer_type<K>{ base_ + offset<K>() };
+        }
+
+        template <typename L>
+        L 
+        get() const
+        {
+            return get<detail::index_of<L, Ls...>::value>();
+        }
+
+    private:
+
+        void 
+        parse(std::integral_constant<size_t, N>, size_t off)
+        {
+            off_[N] = off;
+        }
+
+        template <size_t K>
+        void 
+        parse(std::integral_constant<size_t, K>, size_t off)
+        {
+            typedef layer_type<K> L;
+
+            off_[K] = off;
+
+            if (caplen_ < off + L::min_size) {
+                valid_ = false;
+                return;
+            }
+
+            size_t len = L::size(base_ + off);
+
+            if (len == 0 || caplen_ < off + len || !link_next<K>(base_ + off)) {
+                valid_ = false;
+                return;
+            }
+
+            parse(std::integral_constant<size_t, K+1>(), off + len);
+        }
+
+        template <size_t K>
+        typename std::enable_if<K + 1 == N, bool>::type 
+        link_next(const char *) const
+        {
+            return true;
+        }
+
+        template <size_t K>
+        typename std::enable_if<K + 1 < N, bool>::type 
+        link_next(const char *p) const
+        {
+            return layer::link<layer_type<K>, layer_type<K+1>>::check(p);
+        }
+
+        const char *base_;
+        size_t      caplen_;
+        bool        valid_;
+        std::array<size_t, N + 1> off_;
+    };
+
+} // namespace net
+
+#endif /* _PFQ_VIEW_HPP_ */
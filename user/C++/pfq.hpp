@@ -33,6 +33,7 @@
 #define _PFQ_HPP_ 
 
 #include <linux/if_ether.h>
+#include <linux/filter.h>
 #include <linux/pf_q.h>
 
 #include <sys/types.h>          /* See NOTES */
@@ -47,11 +48,17 @@
 #include <sstream>
 #include <stdexcept>
 #include <iterator>
+#include <algorithm>
 #include <cstring>
 #include <cassert>
 #include <cerrno>
 #include <cstdint>
+#include <ctime>
 #include <thread>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <type_traits>
 #include <system_error>
 
 #if __GNUC__ == 4 &&  __GNUC_MINOR__ < 6 
@@ -81,6 +88,41 @@ namespace net {
     static inline
     void rmb() { asm volatile ("": : :"memory"); }
 
+    /* spin-wait hint: lets the sibling hyperthread run and saves power */
+
+    static inline
+    void cpu_relax()
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        asm volatile ("pause": : :"memory");
+#else
+        asm volatile ("": : :"memory");
+#endif
+    }
+
+    namespace detail {
+
+        static inline
+        uint64_t now_ns()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+        }
+
+        /* member types of the iterators over frames (std::iterator is 
+           deprecated since C++17) */
+
+        struct frame_iterator
+        {
+            typedef std::forward_iterator_tag   iterator_category;
+            typedef pfq_hdr                     value_type;
+            typedef std::ptrdiff_t              difference_type;
+            typedef pfq_hdr *                   pointer;
+            typedef pfq_hdr &                   reference;
+        };
+    }
+
 
     class queue 
     {
@@ -88,19 +130,65 @@ namespace net {
          
         struct const_iterator;
 
-        /* simple forward iterator over frames */
-        struct iterator : public std::iterator<std::forward_iterator_tag, pfq_hdr>
+        /* header accessors, common to version 1 and 2 */
+        template <typename Iter>
+        struct slot_access
+        {
+            uint32_t caplen()   const { return v2() ? hdr2()->caplen   : hdr1()->caplen; }
+            uint32_t len()      const { return v2() ? hdr2()->len      : hdr1()->len; }
+            uint32_t if_index() const { return v2() ? hdr2()->if_index : hdr1()->if_index; }
+            uint16_t hw_queue() const { return v2() ? hdr2()->hw_queue : hdr1()->hw_queue; }
+            uint16_t mark()     const { return v2() ? hdr2()->mark     : hdr1()->mark; }
+            bool     egress()   const { return v2() ? (hdr2()->flags & Q_HDR_F_EGRESS) : hdr1()->egress; }
+
+            /* nanoseconds */
+            uint64_t tstamp()   const 
+            { 
+                return v2() ? hdr2()->tstamp 
+                            : static_cast<uint64_t>(hdr1()->tstamp.tv.sec) * 1000000000ULL + hdr1()->tstamp.tv.nsec; 
+            }
+
+            bool ready() const 
+            { 
+                return v2() ? hdr2()->commit 
+                            : static_cast<volatile const pfq_hdr *>(hdr1())->commit; 
+            }
+
+            const pfq_hdr_v2 *
+            hdr_v2() const
+            {
+                return hdr2();
+            }
+
+            /* the header, whatever its version */
+            const void *
+            slot() const
+            {
+                return static_cast<const Iter *>(this)->hdr_;
+            }
+
+        private:
+            bool v2() const                 { return static_cast<const Iter *>(this)->version_ == 2; }
+            const pfq_hdr    * hdr1() const { return static_cast<const Iter *>(this)->hdr_; }
+            const pfq_hdr_v2 * hdr2() const { return reinterpret_cast<const pfq_hdr_v2 *>(static_cast<const Iter *>(this)->hdr_); }
+        };
+
+        /* simple forward iterator over frames: operator* and operator-> give the 
+           version 1 header, use the accessors to handle both versions */
+        struct iterator : public detail::frame_iterator,
+                          public slot_access<iterator>
         {
             friend struct queue::const_iterator;
+            friend struct slot_access<iterator>;
 
-            iterator(pfq_hdr *h, size_t slot_size)
-            : hdr_(h), slot_size_(slot_size)
+            iterator(pfq_hdr *h, size_t slot_size, int version = 1)
+            : hdr_(h), slot_size_(slot_size), version_(version)
             {}
 
             ~iterator() = default;
             
             iterator(const iterator &other)
-            : hdr_(other.hdr_), slot_size_(other.slot_size_)
+            : hdr_(other.hdr_), slot_size_(other.slot_size_), version_(other.version_)
             {}
 
             iterator & 
@@ -134,6 +222,8 @@ namespace net {
             void *
             data() const
             {
+                if (version_ == 2)
+                    return reinterpret_cast<char *>(hdr_) + sizeof(pfq_hdr_v2) + Q_HDR_V2_PAD;
                 return hdr_+1;
             }
 
@@ -152,23 +242,30 @@ namespace net {
         private:
             pfq_hdr *hdr_;
             size_t   slot_size_;
+            int      version_;
         };
 
         /* simple forward const_iterator over frames */
-        struct const_iterator : public std::iterator<std::forward_iterator_tag, pfq_hdr>
+        struct const_iterator : public detail::frame_iterator,
+                                public slot_access<const_iterator>
         {
-            const_iterator(pfq_hdr *h, size_t slot_size)
-            : hdr_(h), slot_size_(slot_size)
+            friend struct slot_access<const_iterator>;
+
+            const_iterator(pfq_hdr *h, size_t slot_size, int version = 1)
+            : hdr_(h), slot_size_(slot_size), version_(version)
             {}
 
             const_iterator(const const_iterator &other)
-            : hdr_(other.hdr_), slot_size_(other.slot_size_)
+            : hdr_(other.hdr_), slot_size_(other.slot_size_), version_(other.version_)
             {}
 
             const_iterator(const queue::iterator &other)
-            : hdr_(other.hdr_), slot_size_(other.slot_size_)
+            : hdr_(other.hdr_), slot_size_(other.slot_size_), version_(other.version_)
             {}
 
+            const_iterator &
+            operator=(const const_iterator &other) = default;
+
             ~const_iterator() = default;
 
             const_iterator & 
@@ -202,6 +299,8 @@ namespace net {
             const void *
             data() const
             {
+                if (version_ == 2)
+                    return reinterpret_cast<const char *>(hdr_) + sizeof(pfq_hdr_v2) + Q_HDR_V2_PAD;
                 return hdr_+1;
             }
 
@@ -220,11 +319,12 @@ namespace net {
         private:
             pfq_hdr *hdr_;
             size_t   slot_size_;
+            int      version_;
         };
 
     public:
-        queue(void *addr, uint32_t slot_size, uint32_t queue_len)
-        : addr_(addr), slot_size_(slot_size), queue_len_(queue_len)
+        queue(void *addr, uint32_t slot_size, uint32_t queue_len, int version = 1)
+        : addr_(addr), slot_size_(slot_size), queue_len_(queue_len), version_(version)
         {}
 
         ~queue() = default;
@@ -248,6 +348,12 @@ namespace net {
             return slot_size_;
         }
 
+        int
+        version() const
+        {
+            return version_;
+        }
+
         const void *
         data() const
         {
@@ -257,46 +363,47 @@ namespace net {
         iterator
         begin()  
         {
-            return iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_);
+            return iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_, version_);
         }
 
         const_iterator
         begin() const  
         {
-            return const_iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_);
+            return const_iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_, version_);
         }
 
         iterator
         end()  
         {
             return iterator(reinterpret_cast<pfq_hdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_);
+                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, version_);
         }
 
         const_iterator
         end() const 
         {
             return const_iterator(reinterpret_cast<pfq_hdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_);
+                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, version_);
         }
 
         const_iterator
         cbegin() const
         {
-            return const_iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_);
+            return const_iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_, version_);
         }
 
         const_iterator
         cend() const 
         {
             return const_iterator(reinterpret_cast<pfq_hdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_);
+                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, version_);
         }
 
     private:
         void    *addr_;
         uint32_t slot_size_;
         uint32_t queue_len_;
+        int      version_;
     };
 
     static inline void * data(pfq_hdr &h)
@@ -308,6 +415,282 @@ namespace net {
         return &h + 1;
     }
 
+    static inline void * data(pfq_hdr_v2 &h)
+    {
+        return reinterpret_cast<char *>(&h + 1) + Q_HDR_V2_PAD;
+    }
+    static inline const void * data(const pfq_hdr_v2 &h)
+    {
+        return reinterpret_cast<const char *>(&h + 1) + Q_HDR_V2_PAD;
+    }
+
+    /* slot size for a given caplen and header version */
+
+    static inline size_t slot_size(size_t caplen, int version = 1)
+    {
+        return version == 2 ? align<64>(sizeof(pfq_hdr_v2) + Q_HDR_V2_PAD + caplen)
+                            : align<8>(sizeof(pfq_hdr) + caplen);
+    }
+
+    /* offset of the packet in a slot (or in a compact record) */
+
+    static inline size_t hdr_size(int version = 1)
+    {
+        return version == 2 ? sizeof(pfq_hdr_v2) + Q_HDR_V2_PAD : sizeof(pfq_hdr);
+    }
+
+    /* size of a compact record: header and captured bytes, 8 bytes aligned */
+
+    static inline size_t compact_size(size_t caplen, int version = 1)
+    {
+        return align<8>(hdr_size(version) + caplen);
+    }
+
+
+    /* compact_batch: packets stored back-to-back as compact records (see 
+       pfq::recv_compact). Records are variable-sized: forward iteration only. */
+
+    class compact_batch
+    {
+    public:
+
+        struct const_iterator : public detail::frame_iterator,
+                                public queue::slot_access<const_iterator>
+        {
+            friend struct queue::slot_access<const_iterator>;
+
+            const_iterator(const void *rec, int version)
+            : hdr_(static_cast<const pfq_hdr *>(rec)), version_(version)
+            {}
+
+            const_iterator & 
+            operator++()
+            {
+                hdr_ = reinterpret_cast<const pfq_hdr *>(
+                        reinterpret_cast<const char *>(hdr_) + size());
+                return *this;
+            }
+            
+            const_iterator 
+            operator++(int)
+            {
+                const_iterator ret(*this);
+                ++(*this);
+                return ret;
+            }
+
+            const pfq_hdr *
+            operator->() const
+            {
+                return hdr_;
+            }
+
+            const pfq_hdr &
+            operator*() const
+            {
+                return *hdr_;
+            }
+
+            const void *
+            data() const
+            {
+                return reinterpret_cast<const char *>(hdr_) + hdr_size(version_);
+            }
+
+            /* size of the record */
+            size_t
+            size() const
+            {
+                return compact_size(this->caplen(), version_);
+            }
+
+            bool 
+            operator==(const const_iterator &other) const
+            {
+                return hdr_ == other.hdr_;
+            }
+
+            bool
+            operator!=(const const_iterator &other) const
+            {
+                return !(*this == other);
+            }
+
+        private:
+            const pfq_hdr *hdr_;
+            int            version_;
+        };
+
+        typedef const_iterator iterator;
+
+        compact_batch(const void *addr, size_t bytes, size_t count, int version = 1)
+        : addr_(static_cast<const char *>(addr)), bytes_(bytes), count_(count), version_(version)
+        {}
+
+        size_t
+        size() const
+        {
+            return count_;
+        }
+
+        bool
+        empty() const
+        {
+            return count_ == 0;
+        }
+
+        /* bytes used in the buffer */
+        size_t
+        bytes() const
+        {
+            return bytes_;
+        }
+
+        int
+        version() const
+        {
+            return version_;
+        }
+
+        const void *
+        data() const
+        {
+            return addr_;
+        }
+
+        const_iterator
+        begin() const
+        {
+            return const_iterator(addr_, version_);
+        }
+
+        const_iterator
+        end() const
+        {
+            return const_iterator(addr_ + bytes_, version_);
+        }
+
+    private:
+        const char *addr_;
+        size_t      bytes_;
+        size_t      count_;
+        int         version_;
+    };
+
+    namespace detail
+    {
+        /* header version expected by a dispatch callback: 2 if it takes a pfq_hdr_v2 pointer, 
+           0 if it takes the whole batch (const queue &) */
+
+        template <typename Fun>
+        struct callback_version
+        {
+            template <typename F> 
+            static char test(decltype(std::declval<F>()(static_cast<char *>(nullptr), 
+                                                        static_cast<const pfq_hdr_v2 *>(nullptr), 
+                                                        static_cast<const char *>(nullptr))) *);
+            template <typename F> 
+            static long test(...);
+
+            template <typename F> 
+            static char test_batch(decltype(std::declval<F>()(std::declval<const queue &>())) *);
+            template <typename F> 
+            static long test_batch(...);
+
+            static constexpr int value = sizeof(test_batch<Fun>(nullptr)) == sizeof(char) ? 0 :
+                                         sizeof(test<Fun>(nullptr)) == sizeof(char) ? 2 : 1;
+        };
+    }
+
+
+    namespace detail
+    {
+        /* l3/l4 offsets and flags, as mpdb_set_layers (one vlan tag, no ipv6 extensions) */
+
+        inline void
+        set_layers(pfq_hdr_v2 *h, const char *p, uint32_t caplen)
+        {
+            uint8_t flags = h->caplen < h->len ? Q_HDR_F_TRUNC : 0;
+            int l3 = 14, l4 = -1;
+            uint16_t proto;
+
+            h->l3_off = Q_HDR_NO_OFFSET;
+            h->l4_off = Q_HDR_NO_OFFSET;
+
+            if (caplen < 14) {
+                h->flags = flags;
+                return;
+            }
+
+            proto = static_cast<uint16_t>(static_cast<uint8_t>(p[12]) << 8 | static_cast<uint8_t>(p[13]));
+
+            if (proto == ETH_P_8021Q && caplen >= 18) {
+                proto  = static_cast<uint16_t>(static_cast<uint8_t>(p[16]) << 8 | static_cast<uint8_t>(p[17]));
+                l3    += 4;
+                flags |= Q_HDR_F_VLAN;
+            }
+
+            switch(proto)
+            {
+            case ETH_P_IP:
+                if (static_cast<uint32_t>(l3) < caplen && (p[l3] & 0xf) >= 5)
+                    l4 = l3 + ((p[l3] & 0xf) << 2);
+                flags |= Q_HDR_F_IPV4;
+                break;
+            case ETH_P_IPV6:
+                l4 = l3 + 40;
+                flags |= Q_HDR_F_IPV6;
+                break;
+            default:
+                l3 = -1;
+            }
+
+            h->l3_off = l3 < 0 || l3 >= Q_HDR_NO_OFFSET ? Q_HDR_NO_OFFSET : l3;
+            h->l4_off = l4 < 0 || l4 >= Q_HDR_NO_OFFSET ? Q_HDR_NO_OFFSET : l4;
+            h->flags  = flags;
+        }
+
+
+        /* consumer side of the double buffer (the producer is mpdb_enqueue): 
+           the commit flags of the buffer returned by the previous swap are 
+           cleared, then the buffers are swapped and the producers start over 
+           on the cleared one. Returns the length of the buffer just released,
+           the one at the index read before the swap. */
+
+        inline size_t
+        mpdb_swap(pfq_queue_descr *q, size_t slots, size_t slot_size, int version, size_t next_len)
+        {
+            int index = DBMP_QUEUE_INDEX(q->data);
+
+            char * p = reinterpret_cast<char *>(q) + Q_QUEUE_DESCR_SIZE(version) + !index * slots * slot_size;
+            if (version == 2)
+            {
+                for(size_t i = 0; i < next_len; i++)
+                {
+                    reinterpret_cast<pfq_hdr_v2 *>(p)->commit = 0;
+                    p += slot_size;
+                }
+            }
+            else
+            {
+                for(size_t i = 0; i < next_len; i++)
+                {
+                    *reinterpret_cast<uint64_t *>(p) = 0; // h->commit = 0; (just a bit faster)
+                    p += slot_size;
+                }
+            }
+
+            wmb();
+
+            int data = __sync_lock_test_and_set(&q->data, (index ? 0UL : 0x80000000UL));
+            
+            q->disabled = 0;
+
+            return std::min(static_cast<size_t>(DBMP_QUEUE_LEN(data)), slots);
+        }
+    }
+
+
     //////////////////////////////////////////////////////////////////////
 
     class pfq_error : public std::system_error
@@ -326,6 +709,41 @@ namespace net {
         {}
     };
 
+
+    // per-packet dispatch over a batch: the slot Ahead positions further is
+    // prefetched while the current one is handed to the callback. The callback 
+    // is a template parameter, so lambdas and function objects are inlined.
+    // The batch must carry the header version the callback takes.
+
+    template <size_t Ahead = 4, typename Fun>
+    inline size_t
+    dispatch(const queue &many, Fun &&callback, char *user = nullptr)
+    {
+        typedef typename std::conditional<detail::callback_version<Fun>::value == 2, pfq_hdr_v2, pfq_hdr>::type hdr_type;
+
+        static_assert(detail::callback_version<Fun>::value != 0, "dispatch: batch callbacks take no per-packet iteration");
+
+        if (many.version() != detail::callback_version<Fun>::value)
+            throw pfq_error("PFQ: dispatch: header version mismatch");
+
+        const char *slot = static_cast<const char *>(many.data());
+        const char *end  = slot + many.size() * many.slot_size();
+        const size_t ahead = Ahead * many.slot_size();
+
+        for(auto it = many.begin(), it_e = many.end(); it != it_e; ++it, slot += many.slot_size())
+        {
+            if (Ahead && slot + ahead < end)
+                __builtin_prefetch(slot + ahead, 0, 3);
+
+            while (!it.ready())
+                cpu_relax();
+
+            callback(user, reinterpret_cast<const hdr_type *>(slot), static_cast<const char *>(it.data()));
+        }
+
+        return many.size();
+    }
+
     
     //////////////////////////////////////////////////////////////////////
     
@@ -343,6 +761,185 @@ namespace net {
 
     //////////////////////////////////////////////////////////////////////
 
+    /* read-only view of the in-kernel flow table */
+
+    class flow_table
+    {
+    public:
+
+        flow_table()
+        : addr_(nullptr), size_(0), tails_(), lost_(0)
+        {}
+
+        flow_table(int fd, size_t size)
+        : addr_(nullptr), size_(size), tails_(), lost_(0)
+        {
+            void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, Q_FLOW_MMAP_OFFSET);
+            if (addr == MAP_FAILED) 
+                throw pfq_error(errno, "PFQ: flow table mmap error");
+            
+            addr_ = static_cast<const pfq_flow_descr *>(addr);
+            tails_.resize(addr_->shards, 0);
+        }
+
+        ~flow_table()
+        {
+            if (addr_)
+                munmap(const_cast<pfq_flow_descr *>(addr_), size_);
+        }
+
+        /* flow_table is non copyable */
+        flow_table(const flow_table &) = delete;
+        flow_table& operator=(const flow_table &) = delete;
+
+        /* flow_table is moveable */
+        flow_table(flow_table &&other)
+        : addr_(other.addr_), size_(other.size_), tails_(std::move(other.tails_)), lost_(other.lost_)
+        {
+            other.addr_ = nullptr;
+        }
+
+        flow_table& 
+        operator=(flow_table &&other)
+        {
+            if (this != &other)
+            {
+                std::swap(addr_,  other.addr_);
+                std::swap(size_,  other.size_);
+                std::swap(tails_, other.tails_);
+                std::swap(lost_,  other.lost_);
+            }
+            return *this;
+        }
+
+        size_t
+        shards() const
+        {
+            return addr_ ? addr_->shards : 0;
+        }
+
+        /* flows exported before their timeout, because the table was full */
+        unsigned long 
+        evicted() const
+        {
+            unsigned long ret = 0;
+            for(size_t n = 0; n < shards(); n++)
+                ret += Q_FLOW_SHARD(addr_, n)->evicted;
+            return ret;
+        }
+
+        /* exported records overwritten before being read */
+        unsigned long
+        lost() const
+        {
+            return lost_;
+        }
+
+        /* invoke fun(const pfq_flow &) for a consistent copy of every active flow */
+        
+        template <typename Fun>
+        size_t for_each(Fun fun) const
+        {
+            size_t n = 0;
+            for(size_t s = 0; s < shards(); s++)
+            {
+                const pfq_flow *table = Q_FLOW_TABLE(addr_, s);
+                for(size_t i = 0; i < addr_->slots; i++)
+                {
+                    pfq_flow copy;
+                    for(;;)
+                    {
+                        uint32_t seq = table[i].seq;
+                        rmb();
+                        memcpy(&copy, &table[i], sizeof(copy));
+                        rmb();
+                        if (!(seq & 1) && seq == table[i].seq)
+                            break;
+                    }
+                    if (copy.version == 0) 
+                        continue;
+                    fun(static_cast<const pfq_flow &>(copy));
+                    n++;
+                }
+            }
+            return n;
+        }
+
+        /* invoke fun(const pfq_flow &) for every flow exported since the last call */
+
+        template <typename Fun>
+        size_t expired(Fun fun)
+        {
+            size_t n = 0;
+            for(size_t s = 0; s < shards(); s++)
+            {
+                const uint64_t ring_slots = addr_->ring_slots;
+                const pfq_flow *ring = Q_FLOW_RING(addr_, s);
+                uint64_t head = Q_FLOW_SHARD(addr_, s)->head;
+                uint64_t tail = tails_[s];
+
+                rmb();
+
+                if (head - tail > ring_slots) {
+                    lost_ += head - tail - ring_slots;
+                    tail = head - ring_slots;
+                }
+
+                for(; tail != head; ++tail)
+                {
+                    const pfq_flow &rec = ring[tail & (ring_slots-1)];
+                    pfq_flow copy;
+
+                    uint32_t seq = rec.seq;
+                    rmb();
+                    memcpy(&copy, &rec, sizeof(copy));
+                    rmb();
+
+                    if (seq != Q_FLOW_RING_SEQ(tail) || seq != rec.seq) {
+                        lost_++;
+                        continue;
+                    }
+
+                    fun(static_cast<const pfq_flow &>(copy));
+                    n++;
+                }
+
+                tails_[s] = head;
+            }
+            return n;
+        }
+
+    private:
+        const pfq_flow_descr *addr_;
+        size_t                size_;
+        std::vector<uint64_t> tails_;
+        unsigned long         lost_;
+    };
+
+    //////////////////////////////////////////////////////////////////////
+
+    /* how read() waits for packets when the queue is below the watermark:
+
+       block:    ppoll until the queue is half full (or the timeout expires).
+       busy:     spin (never enter the kernel) until the queue is not empty.
+       adaptive: spin until the queue is not empty for at most the current
+                 spin budget, then block. The budget doubles (up to the
+                 configured maximum) when spinning succeeds and halves when
+                 it does not.
+     */
+
+    enum class wait_policy { block, busy, adaptive };
+
+    struct wait_stats
+    {
+        uint64_t wait_ns;       // time spent in read() waiting for packets
+        uint64_t proc_ns;       // time spent between reads (processing)
+        uint64_t spins;         // waits satisfied by spinning 
+        uint64_t blocks;        // waits that entered the kernel
+    };
+
+    //////////////////////////////////////////////////////////////////////
+
     class pfq
     {
         struct pfq_data
@@ -356,8 +953,37 @@ namespace net {
             size_t queue_offset;
             size_t slot_size;
             size_t next_len;
+            int    hdr_version;
+
+            net::wait_policy policy;
+            uint64_t   spin_max;    // nsec
+            uint64_t   spin;        // nsec, adaptive budget
+            uint64_t   last;        // end of the last read (nsec)
+            net::wait_stats  wstats;
+            bool       doorbell;    // Q_IOC_WAIT supported
+
+            char *     pend_addr;   // recv_compact: next slot of the current batch
+            size_t     pend_left;   // recv_compact: slots left in the current batch
+
+            std::vector<std::pair<const void *, std::function<void(pfq *)>>> watchers;
         };
 
+        void
+        notify(pfq *p)
+        {
+            if (!pdata_)
+                return;
+
+            /* on close the hooks are dropped: they may unwatch while running */
+
+            auto w = pdata_->watchers;
+            if (p == nullptr)
+                pdata_->watchers.clear();
+
+            for(auto &h : w)
+                h.second(p);
+        }
+
         int fd_;
         
         std::unique_ptr<pfq_data> pdata_;
@@ -399,6 +1025,7 @@ namespace net {
         , pdata_(std::move(other.pdata_))
         {
             other.fd_ = -1;
+            this->notify(this);
         }
 
         /* move assignment operator */
@@ -408,9 +1035,13 @@ namespace net {
         {
             if (this != &other)
             {
+                this->close();
+
                 fd_    = other.fd_;
                 pdata_ = std::move(other.pdata_);
                 other.fd_ = -1;
+
+                this->notify(this);
             }
             return *this;
         }
@@ -422,9 +1053,39 @@ namespace net {
         {
             std::swap(fd_,    other.fd_);
             std::swap(pdata_, other.pdata_);
+
+            this->notify(this);
+            other.notify(&other);
         }                           
 
 
+        /* objects that keep a reference to the socket (pfq_reactor) follow its
+           lifetime: hook(p) when the socket is moved into the pfq p, hook(nullptr)
+           right before it is closed. One hook per owner. */
+
+        void
+        watch(const void *owner, std::function<void(pfq *)> hook)
+        {
+            if (fd_ == -1)
+                throw pfq_error("PFQ: not open");
+
+            this->unwatch(owner);
+            pdata_->watchers.emplace_back(owner, std::move(hook));
+        }
+
+        void
+        unwatch(const void *owner)
+        {
+            if (!pdata_)
+                return;
+
+            auto &w = pdata_->watchers;
+            w.erase(std::remove_if(w.begin(), w.end(), 
+                                   [=](const std::pair<const void *, std::function<void(pfq *)>> &h) { return h.first == owner; }), 
+                    w.end());
+        }
+
+
         void
         open(size_t caplen, size_t offset = 0, size_t slots = 131072)
         {
@@ -436,7 +1097,8 @@ namespace net {
                 throw pfq_error("PFQ: module not loaded");
             
             /* allocate pdata */
-            pdata_.reset(new pfq_data { -1, nullptr, 0, 0, 0, offset, 0, 0 });
+            pdata_.reset(new pfq_data { -1, nullptr, 0, 0, 0, offset, 0, 0, 1, 
+                                        net::wait_policy::block, 0, 0, 0, net::wait_stats { 0, 0, 0, 0 }, true, nullptr, 0, {} });
 
             /* get id */
             socklen_t size = sizeof(pdata_->id);
@@ -457,7 +1119,7 @@ namespace net {
             if (::setsockopt(fd_, PF_Q, SO_OFFSET, &offset, sizeof(offset)) == -1)
                 throw pfq_error(errno, "PFQ: SO_OFFSET");
             
-            pdata_->slot_size = align<8>(sizeof(pfq_hdr) + pdata_->queue_caplen);
+            pdata_->slot_size = net::slot_size(pdata_->queue_caplen, pdata_->hdr_version);
         }
 
 
@@ -466,6 +1128,8 @@ namespace net {
         {
             if (fd_ != -1)
             {
+                this->notify(nullptr);
+
                 if (pdata_ && pdata_->queue_addr)
                     this->disable();
                 
@@ -511,6 +1175,8 @@ namespace net {
             
             pdata_->queue_addr = nullptr;
             pdata_->queue_size = 0;
+            pdata_->pend_addr  = nullptr;
+            pdata_->pend_left  = 0;
             
             int one = 0;
             if(::setsockopt(fd_, PF_Q, SO_TOGGLE_QUEUE, &one, sizeof(one)) == -1)
@@ -570,7 +1236,8 @@ namespace net {
                 throw pfq_error(errno, "PFQ: SO_CAPLEN");
             }
 
-            pdata_->slot_size = align<8>(sizeof(pfq_hdr)+ value);
+            pdata_->queue_caplen = value;
+            pdata_->slot_size = net::slot_size(value, pdata_->hdr_version);
         }
 
         size_t 
@@ -604,6 +1271,123 @@ namespace net {
         }
 
 
+        void
+        hdr_version(int version)
+        {
+            if (is_enabled()) 
+                throw pfq_error("PFQ: enabled (header version could not be set)");
+
+            if (::setsockopt(fd_, PF_Q, SO_HDR_VERSION, &version, sizeof(version)) == -1)
+                throw pfq_error(errno, "PFQ: SO_HDR_VERSION");
+
+            pdata_->hdr_version = version;
+            pdata_->slot_size = net::slot_size(pdata_->queue_caplen, version);
+        }
+
+        int
+        hdr_version() const
+        {
+           int ret; socklen_t size = sizeof(ret);
+           if (::getsockopt(fd_, PF_Q, SO_GET_HDR_VERSION, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: SO_GET_HDR_VERSION");
+           return ret;
+        }
+
+
+        /* spin_usec: upper bound of the adaptive spin */
+
+        void
+        wait_policy(net::wait_policy policy, long int spin_usec = 100)
+        {
+            if (!pdata_)
+                throw pfq_error("PFQ: not open");
+            if (spin_usec < 0)
+                throw pfq_error("PFQ: bad spin time");
+
+            pdata_->policy   = policy;
+            pdata_->spin_max = static_cast<uint64_t>(spin_usec) * 1000;
+            pdata_->spin     = pdata_->spin_max;
+        }
+
+        net::wait_policy
+        wait_policy() const
+        {
+            if (!pdata_)
+                throw pfq_error("PFQ: not open");
+            return pdata_->policy;
+        }
+
+        net::wait_stats
+        wait_stats() const
+        {
+            if (!pdata_)
+                throw pfq_error("PFQ: not open");
+            return pdata_->wstats;
+        }
+
+
+        void 
+        dedup(int msec)
+        {
+            if (::setsockopt(fd_, PF_Q, SO_DEDUP, &msec, sizeof(msec)) == -1)
+                throw pfq_error(errno, "PFQ: SO_DEDUP");
+        }
+
+        int 
+        dedup() const
+        {
+           int ret; socklen_t size = sizeof(ret);
+           if (::getsockopt(fd_, PF_Q, SO_GET_DEDUP, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: SO_GET_DEDUP");
+           return ret;
+        }
+
+
+        /* classic BPF, run by the kernel before the packet is enqueued */
+
+        void
+        attach_filter(const struct sock_fprog &prog)
+        {
+            if (::setsockopt(fd_, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1)
+                throw pfq_error(errno, "PFQ: SO_ATTACH_FILTER");
+        }
+
+        void
+        detach_filter()
+        {
+            int dummy = 0;
+            if (::setsockopt(fd_, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy)) == -1)
+                throw pfq_error(errno, "PFQ: SO_DETACH_FILTER");
+        }
+
+
+        void 
+        flow_table(unsigned int slots, unsigned int ring_slots, unsigned int timeout_msec, bool capture = true)
+        {
+            struct pfq_flow_opt fo = { slots, ring_slots, timeout_msec, capture };
+            if (::setsockopt(fd_, PF_Q, SO_FLOW_TABLE, &fo, sizeof(fo)) == -1)
+                throw pfq_error(errno, "PFQ: SO_FLOW_TABLE");
+        }
+
+        size_t
+        flow_mem() const
+        {
+            size_t mem; socklen_t size = sizeof(mem);
+            if (::getsockopt(fd_, PF_Q, SO_GET_FLOW_MEM, &mem, &size) == -1)
+                throw pfq_error(errno, "PFQ: SO_GET_FLOW_MEM");
+            return mem;
+        }
+
+        net::flow_table
+        flows() const
+        {
+            size_t mem = this->flow_mem();
+            if (mem == 0)
+                throw pfq_error("PFQ: flow table not enabled");
+            return net::flow_table(fd_, mem);
+        }
+
+
         void 
         slots(size_t value) 
         {             
@@ -654,6 +1438,11 @@ namespace net {
             add_device(index, queue);
         }                              
 
+        /* removes exactly the binding (index, queue) added before: any_queue is 
+           a binding of its own, not every queue of the device, and a queue is 
+           not removed from an any_queue binding. Throws (ENOENT) if the socket 
+           has no such binding. */
+
         void 
         remove_device(int index, int queue = any_queue)
         {
@@ -671,6 +1460,100 @@ namespace net {
             remove_device(index, queue);
         }  
 
+        void
+        add_egress_device(int index)
+        {
+            struct pfq_egress_dev ed = { index, 1 };
+            if (::setsockopt(fd_, PF_Q, SO_EGRESS_DEVICE, &ed, sizeof(ed)) == -1)
+                throw pfq_error(errno, "PFQ: SO_EGRESS_DEVICE");
+        }
+
+        void 
+        add_egress_device(const char *dev)
+        {
+            auto index = ifindex(this->fd(), dev);
+            if (index == -1)
+                throw pfq_error("PFQ: device not found");
+            add_egress_device(index);
+        }                              
+
+        void
+        remove_egress_device(int index)
+        {
+            struct pfq_egress_dev ed = { index, 0 };
+            if (::setsockopt(fd_, PF_Q, SO_EGRESS_DEVICE, &ed, sizeof(ed)) == -1)
+                throw pfq_error(errno, "PFQ: SO_EGRESS_DEVICE");
+        }
+
+        void 
+        remove_egress_device(const char *dev)
+        {
+            auto index = ifindex(this->fd(), dev);
+            if (index == -1)
+                throw pfq_error("PFQ: device not found");
+            remove_egress_device(index);
+        }                              
+
+        void
+        add_vlan(int first, int last = -1)
+        {
+            struct pfq_vlan_range vr = { first, last == -1 ? first : last };
+            if (::setsockopt(fd_, PF_Q, SO_ADD_VLAN, &vr, sizeof(vr)) == -1)
+                throw pfq_error(errno, "PFQ: SO_ADD_VLAN");
+        }
+
+        void
+        remove_vlan(int first, int last = -1)
+        {
+            struct pfq_vlan_range vr = { first, last == -1 ? first : last };
+            if (::setsockopt(fd_, PF_Q, SO_REMOVE_VLAN, &vr, sizeof(vr)) == -1)
+                throw pfq_error(errno, "PFQ: SO_REMOVE_VLAN");
+        }
+
+        void
+        add_mpls_label(int label)
+        {
+            if (::setsockopt(fd_, PF_Q, SO_ADD_MPLS, &label, sizeof(label)) == -1)
+                throw pfq_error(errno, "PFQ: SO_ADD_MPLS");
+        }
+
+        void
+        remove_mpls_label(int label)
+        {
+            if (::setsockopt(fd_, PF_Q, SO_REMOVE_MPLS, &label, sizeof(label)) == -1)
+                throw pfq_error(errno, "PFQ: SO_REMOVE_MPLS");
+        }
+
+        void
+        add_class_rule(int class_id, int proto, int port_first = Q_CLASS_ANY, int port_last = Q_CLASS_ANY)
+        {
+            struct pfq_class_rule r = { class_id, proto, port_first, port_last == Q_CLASS_ANY ? port_first : port_last };
+            if (::setsockopt(fd_, PF_Q, SO_ADD_CLASS_RULE, &r, sizeof(r)) == -1)
+                throw pfq_error(errno, "PFQ: SO_ADD_CLASS_RULE");
+        }
+
+        void
+        remove_class_rule(int class_id, int proto, int port_first = Q_CLASS_ANY, int port_last = Q_CLASS_ANY)
+        {
+            struct pfq_class_rule r = { class_id, proto, port_first, port_last == Q_CLASS_ANY ? port_first : port_last };
+            if (::setsockopt(fd_, PF_Q, SO_REMOVE_CLASS_RULE, &r, sizeof(r)) == -1)
+                throw pfq_error(errno, "PFQ: SO_REMOVE_CLASS_RULE");
+        }
+
+        void
+        add_class(int class_id)
+        {
+            if (::setsockopt(fd_, PF_Q, SO_ADD_CLASS, &class_id, sizeof(class_id)) == -1)
+                throw pfq_error(errno, "PFQ: SO_ADD_CLASS");
+        }
+
+        void
+        remove_class(int class_id)
+        {
+            if (::setsockopt(fd_, PF_Q, SO_REMOVE_CLASS, &class_id, sizeof(class_id)) == -1)
+                throw pfq_error(errno, "PFQ: SO_REMOVE_CLASS");
+        }
+
         // unsigned long 
         // owners(int index, int queue) const
         // {
@@ -715,37 +1598,37 @@ namespace net {
                 throw pfq_error("PFQ: not enabled");
 
             struct pfq_queue_descr * q = static_cast<struct pfq_queue_descr *>(pdata_->queue_addr);
+
+            pdata_->pend_left = 0;
             
             int data =  q->data;               
             int index  = DBMP_QUEUE_INDEX(data);
             
             size_t q_size = pdata_->queue_slots * pdata_->slot_size;
 
-            //  watermark for polling...
-            
-            if( DBMP_QUEUE_LEN(data) < (pdata_->queue_slots >> 1) ) {
-                this->poll(microseconds);
-            }
+            uint64_t start = detail::now_ns();
+            if (pdata_->last)
+                pdata_->wstats.proc_ns += start - pdata_->last;
 
-            // clean the next buffer...
+            //  watermark for waiting...
             
-            char * p = static_cast<char *>(pdata_->queue_addr) + sizeof(pfq_queue_descr) + !index * q_size;
-            for(unsigned int i = 0; i < pdata_->next_len; i++)
-            {
-                *reinterpret_cast<uint64_t *>(p) = 0; // h->commit = 0; (just a bit faster)
-                p += pdata_->slot_size;
+            if (pdata_->policy == net::wait_policy::block) {
+                if (DBMP_QUEUE_LEN(data) < (pdata_->queue_slots >> 1)) {
+                    this->doorbell_wait(q, pdata_->queue_slots >> 1, microseconds);
+                    pdata_->wstats.blocks++;
+                }
+            }
+            else if (DBMP_QUEUE_LEN(data) == 0) {
+                this->wait(q, start, microseconds);
             }
 
-            wmb();
-
-            data = __sync_lock_test_and_set(&q->data, (index ? 0UL : 0x80000000UL));
-            
-            q->disabled = 0;
+            pdata_->next_len = detail::mpdb_swap(q, pdata_->queue_slots, pdata_->slot_size, pdata_->hdr_version, pdata_->next_len);
 
-            pdata_->next_len =  std::min(static_cast<size_t>(DBMP_QUEUE_LEN(data)), pdata_->queue_slots);
+            pdata_->last = detail::now_ns();
+            pdata_->wstats.wait_ns += pdata_->last - start;
 
-            return queue(static_cast<char *>(pdata_->queue_addr) + sizeof(pfq_queue_descr) + index * q_size, 
-                         pdata_->slot_size, pdata_->next_len);
+            return queue(static_cast<char *>(pdata_->queue_addr) + Q_QUEUE_DESCR_SIZE(pdata_->hdr_version) + index * q_size, 
+                         pdata_->slot_size, pdata_->next_len, pdata_->hdr_version);
         }
         
         queue
@@ -760,31 +1643,172 @@ namespace net {
                 throw pfq_error("PFQ: buffer too small");
 
             memcpy(buff.first, this_queue.data(), this_queue.slot_size() * this_queue.size());
-            return queue(buff.first, this_queue.slot_size(), this_queue.size());
+            return queue(buff.first, this_queue.slot_size(), this_queue.size(), this_queue.version());
         }
 
-        // typedef void (*pfq_handler)(char *user, const struct pfq_hdr *h, const char *data); 
+        /* copy the packets into buff as compact records (header and captured 
+           bytes only). The packets that do not fit are kept for the next call; 
+           a new batch is read only when the current one is over. */
 
-        template <typename Fun>
+        compact_batch
+        recv_compact(const mutable_buffer &buff, long int microseconds = -1)
+        {
+            if (fd_ == -1)
+                throw pfq_error("PFQ: not open");
+
+            if (!pdata_->queue_addr)
+                throw pfq_error("PFQ: not enabled");
+
+            if (pdata_->pend_left == 0)
+            {
+                auto this_queue = this->read(microseconds);
+                pdata_->pend_addr = static_cast<char *>(const_cast<void *>(this_queue.data()));
+                pdata_->pend_left = this_queue.size();
+            }
+
+            int    version = pdata_->hdr_version;
+            size_t hlen    = hdr_size(version);
+            char * out     = buff.first;
+            size_t count   = 0;
+
+            queue::const_iterator it(reinterpret_cast<pfq_hdr *>(pdata_->pend_addr), pdata_->slot_size, version);
+
+            for(; pdata_->pend_left != 0; ++it)
+            {
+                while (!it.ready())
+                    cpu_relax();
+
+                size_t rec = compact_size(it.caplen(), version);
+
+                if (static_cast<size_t>(out - buff.first) + rec > buff.second)
+                {
+                    if (count == 0)
+                        throw pfq_error("PFQ: buffer too small");
+                    break;
+                }
+
+                memcpy(out, it.slot(), hlen + it.caplen());
+                out += rec;
+                count++;
+
+                pdata_->pend_addr += pdata_->slot_size;
+                pdata_->pend_left--;
+            }
+
+            return compact_batch(buff.first, out - buff.first, count, version);
+        }
+
+        // typedef void (*pfq_handler)(char *user, const struct pfq_hdr *h, const char *data); 
+        // typedef void (*pfq_handler_v2)(char *user, const struct pfq_hdr_v2 *h, const char *data); 
+        //
+        // the header version taken by the callback must match the one of the socket.
+        //
+        // a callback taking a (const queue &) gets the whole batch instead: the 
+        // slots are to be waited for with the iterator ready().
+        //
+        // the overload is picked at compile time from the signature of the callback.
+
+        template <size_t Ahead = 4, typename Fun>
         size_t dispatch(Fun callback, long int microseconds = -1, char *user = nullptr)
+        {
+            return dispatch_<Ahead>(callback, microseconds, user, 
+                                    std::integral_constant<int, detail::callback_version<Fun>::value>());
+        }
+
+    private:
+
+        template <size_t Ahead, typename Fun>
+        size_t 
+        dispatch_(Fun &callback, long int microseconds, char *, std::integral_constant<int, 0>)
         {
             auto many = this->read(microseconds); 
-            int n = 0;
+            if (!many.empty())
+                callback(static_cast<const queue &>(many));
+            return many.size();
+        }
 
-            auto it = many.begin(),
-                 it_e = many.end();
-            
-            for(; it != it_e; ++it)
+        template <size_t Ahead, typename Fun, int Version>
+        size_t 
+        dispatch_(Fun &callback, long int microseconds, char *user, std::integral_constant<int, Version>)
+        {
+            if (pdata_ && pdata_->hdr_version != Version)
+                throw pfq_error("PFQ: dispatch: header version mismatch");
+
+            return net::dispatch<Ahead>(this->read(microseconds), callback, user);
+        }
+
+        /* spin (and possibly block) until the queue is not empty */
+
+        void
+        wait(pfq_queue_descr *q, uint64_t start, long int microseconds)
+        {
+            uint64_t deadline = microseconds < 0 ? UINT64_MAX : start + static_cast<uint64_t>(microseconds) * 1000;
+            uint64_t limit = deadline;
+
+            if (pdata_->policy == net::wait_policy::adaptive)
+                limit = std::min(deadline, start + pdata_->spin);
+
+            uint64_t now = start;
+            for(;;)
             {
-                while (!it->commit)
-                    std::this_thread::yield();
+                if (DBMP_QUEUE_LEN(q->data) != 0) {
+                    pdata_->wstats.spins++;
+                    if (pdata_->policy == net::wait_policy::adaptive)
+                        pdata_->spin = std::min(pdata_->spin * 2 + 1000, pdata_->spin_max);
+                    return;
+                }
+
+                if ((now = detail::now_ns()) >= limit)
+                    break;
 
-                callback(user, &*it, reinterpret_cast<const char *>(it.data()));
-                n++;
+                cpu_relax();
+            }
+
+            if (pdata_->policy == net::wait_policy::adaptive && now < deadline)
+            {
+                pdata_->spin /= 2;
+                pdata_->wstats.blocks++;
+                this->doorbell_wait(q, 1, microseconds < 0 ? -1 : static_cast<long int>((deadline - now) / 1000));
+            }
+        }
+
+        /* sleep in the kernel until the queue holds len packets (see pfq_queue_descr) */
+
+        void
+        doorbell_wait(pfq_queue_descr *q, size_t len, long int microseconds)
+        {
+            if (!pdata_->doorbell) {
+                this->poll(microseconds);
+                return;
+            }
+
+            q->doorbell = static_cast<int>(len);
+            __sync_synchronize();
+
+            if (DBMP_QUEUE_LEN(q->data) >= len) {
+                q->doorbell = 0;
+                return;
+            }
+
+            if (::ioctl(fd_, Q_IOC_WAIT, microseconds) < 0)
+            {
+                q->doorbell = 0;
+
+                if (errno == EINTR)
+                    return;
+
+                if (errno == ENOTTY) {      // module without doorbell
+                    pdata_->doorbell = false;
+                    this->poll(microseconds);
+                    return;
+                }
+
+                throw pfq_error(errno, "PFQ: Q_IOC_WAIT");
             }
-            return n;
         }
 
+    public:
+
         pfq_stats
         stats() const
         {
@@ -832,7 +1856,7 @@ namespace net {
     typename std::basic_ostream<CharT, Traits> &
     operator<<(std::basic_ostream<CharT,Traits> &out, const pfq_stats& rhs)
     {
-        return out << rhs.recv << ' ' << rhs.lost << ' ' << rhs.drop;
+        return out << rhs.recv << ' ' << rhs.lost << ' ' << rhs.drop << ' ' << rhs.dupl;
     }
 
     inline pfq_stats&
@@ -841,6 +1865,7 @@ namespace net {
         lhs.recv += rhs.recv;
         lhs.lost += rhs.lost;
         lhs.drop += rhs.drop;
+        lhs.dupl += rhs.dupl;
         return lhs;
     }
     
@@ -850,6 +1875,7 @@ namespace net {
         lhs.recv -= rhs.recv;
         lhs.lost -= rhs.lost;
         lhs.drop -= rhs.drop;
+        lhs.dupl -= rhs.dupl;
         return lhs;
     }
 
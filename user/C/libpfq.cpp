@@ -33,8 +33,12 @@
 #include <exception>
 
 #include <pfq.hpp>
+#include <pfq-reactor.hpp>
+
+#include <pfq-types.h>
 
 typedef void (*pfq_handler)(char *user, const struct pfq_hdr *h, const char *data); 
+typedef void (*pfq_handler_v2)(char *user, const struct pfq_hdr_v2 *h, const char *data); 
 
 struct pfq_t : public net::pfq
 {
@@ -58,6 +62,24 @@ struct pfq_t : public net::pfq
 };
 
 
+struct pfq_reactor_t : public net::pfq_reactor
+{
+    pfq_reactor_t()
+    : net::pfq_reactor()
+    , err(nullptr)
+    {}
+
+    ~pfq_reactor_t()
+    {
+        ::free(err);
+    }
+
+    mutable char *err;
+};
+
+typedef void (*pfq_ready_handler)(char *user, pfq_t *q);
+
+
 template <typename Q, typename Fun>
 auto firewall(int *ok, Q *q, Fun fun)
 -> decltype(fun())
@@ -163,6 +185,36 @@ extern "C" {
         return firewall(ok, q, [&]() { return q->offset(); }); 
     }
 
+    void pfq_set_hdr_version(pfq_t *q, int version, int *ok)
+    {
+        firewall(ok, q, [&]() { q->hdr_version(version); }); 
+    }
+
+    int pfq_get_hdr_version(pfq_t const *q, int *ok)
+    {
+        return firewall(ok, q, [&]() { return q->hdr_version(); }); 
+    }
+
+    void pfq_set_dedup(pfq_t *q, int msec, int *ok)
+    {
+        firewall(ok, q, [&]() { q->dedup(msec); }); 
+    }
+
+    int pfq_get_dedup(pfq_t const *q, int *ok)
+    {
+        return firewall(ok, q, [&]() { return q->dedup(); }); 
+    }
+
+    void pfq_set_flow_table(pfq_t *q, unsigned int slots, unsigned int ring_slots, unsigned int timeout_msec, int capture, int *ok)
+    {
+        firewall(ok, q, [&]() { q->flow_table(slots, ring_slots, timeout_msec, capture); }); 
+    }
+
+    size_t pfq_get_flow_mem(pfq_t const *q, int *ok)
+    {
+        return firewall(ok, q, [&]() { return q->flow_mem(); }); 
+    }
+
     void pfq_set_slots(pfq_t *q, size_t value, int *ok)
     {
         firewall(ok, q, [&]() { q->slots(value); }); 
@@ -198,11 +250,99 @@ extern "C" {
         firewall(ok, q, [&]() { q->remove_device(dev,queue); }); 
     }
 
+    void pfq_add_egress_device_by_index(pfq_t *q, int index, int *ok)
+    {
+        firewall(ok, q, [&]() { q->add_egress_device(index); });
+    }
+
+    void pfq_add_egress_device_by_name(pfq_t *q, const char *dev, int *ok)
+    {
+        firewall(ok, q, [&]() { q->add_egress_device(dev); });
+    }
+
+    void pfq_remove_egress_device_by_index(pfq_t *q, int index, int *ok)
+    {
+        firewall(ok, q, [&]() { q->remove_egress_device(index); });
+    }
+
+    void pfq_remove_egress_device_by_name(pfq_t *q, const char *dev, int *ok)
+    {
+        firewall(ok, q, [&]() { q->remove_egress_device(dev); });
+    }
+
+    void pfq_add_vlan(pfq_t *q, int first, int last, int *ok)
+    {
+        firewall(ok, q, [&]() { q->add_vlan(first, last); });
+    }
+
+    void pfq_remove_vlan(pfq_t *q, int first, int last, int *ok)
+    {
+        firewall(ok, q, [&]() { q->remove_vlan(first, last); });
+    }
+
+    void pfq_add_mpls_label(pfq_t *q, int label, int *ok)
+    {
+        firewall(ok, q, [&]() { q->add_mpls_label(label); });
+    }
+
+    void pfq_remove_mpls_label(pfq_t *q, int label, int *ok)
+    {
+        firewall(ok, q, [&]() { q->remove_mpls_label(label); });
+    }
+
+    void pfq_add_class_rule(pfq_t *q, int class_id, int proto, int port_first, int port_last, int *ok)
+    {
+        firewall(ok, q, [&]() { q->add_class_rule(class_id, proto, port_first, port_last); });
+    }
+
+    void pfq_remove_class_rule(pfq_t *q, int class_id, int proto, int port_first, int port_last, int *ok)
+    {
+        firewall(ok, q, [&]() { q->remove_class_rule(class_id, proto, port_first, port_last); });
+    }
+
+    void pfq_add_class(pfq_t *q, int class_id, int *ok)
+    {
+        firewall(ok, q, [&]() { q->add_class(class_id); });
+    }
+
+    void pfq_remove_class(pfq_t *q, int class_id, int *ok)
+    {
+        firewall(ok, q, [&]() { q->remove_class(class_id); });
+    }
+
     int pfq_poll(pfq_t *q, long int usec, int *ok)
     {
         return firewall(ok, q, [&]() { return q->poll(usec); }); 
     }
 
+    void pfq_set_wait_policy(pfq_t *q, int policy, long int spin_usec, int *ok)
+    {
+        firewall(ok, q, [&]() { 
+            if (policy < 0 || policy > static_cast<int>(net::wait_policy::adaptive))
+                throw net::pfq_error("PFQ: bad wait policy");
+            q->wait_policy(static_cast<net::wait_policy>(policy), spin_usec); 
+        });
+    }
+
+    int pfq_get_wait_policy(pfq_t const *q, int *ok)
+    {
+        return firewall(ok, q, [&]() { return static_cast<int>(q->wait_policy()); });
+    }
+
+    struct pfq_wait_stats
+    pfq_get_wait_stats(pfq_t const *q, int *ok)
+    {
+        return firewall(ok, q, [&]() { 
+            auto ws = q->wait_stats();
+            struct pfq_wait_stats s;
+            s.wait_ns = ws.wait_ns;
+            s.proc_ns = ws.proc_ns;
+            s.spins   = ws.spins;
+            s.blocks  = ws.blocks;
+            return s;
+        });
+    }
+
     int pfq_id(pfq_t const *q, int *ok)
     {
         return firewall(ok, q, [&]() { return q->id(); });
@@ -223,4 +363,73 @@ extern "C" {
     {
         return firewall(ok, q, [&]() { return q->dispatch(callback, 100000, user); });
     }
+
+    int pfq_dispatch_v2(pfq_t *q, pfq_handler_v2 callback, char *user, int *ok)
+    {
+        return firewall(ok, q, [&]() { return q->dispatch(callback, 100000, user); });
+    }
+
+    struct pfq_batch pfq_read(pfq_t *q, long int usec, int *ok)
+    {
+        return firewall(ok, q, [&]() { 
+            auto many = q->read(usec);
+            struct pfq_batch b;
+            b.addr      = static_cast<const char *>(many.data());
+            b.len       = many.size();
+            b.slot_size = many.slot_size();
+            b.version   = many.version();
+            return b;
+        });
+    }
+
+    int pfq_dispatch_batch(pfq_t *q, pfq_batch_handler callback, long int usec, char *user, int *ok)
+    {
+        struct pfq_batch b = pfq_read(q, usec, ok);
+        if (*ok && b.len)
+            callback(user, &b);
+        return static_cast<int>(b.len);
+    }
+
+    /* reactor */
+
+    pfq_reactor_t *pfq_reactor_open(void)
+    try
+    {
+        return new pfq_reactor_t;
+    }
+    catch(std::exception &e)
+    {
+        ::free(__error); __error = strdup(e.what());
+        return nullptr;
+    }
+
+    void pfq_reactor_close(pfq_reactor_t *r)
+    {
+        delete r;
+    }
+
+    const char *pfq_reactor_error(pfq_reactor_t *r)
+    {
+        return r ? r->err : __error;
+    }
+
+    void pfq_reactor_add(pfq_reactor_t *r, pfq_t *q, pfq_ready_handler handler, char *user, int *ok)
+    {
+        firewall(ok, r, [&]() { r->add(*q, [=](net::pfq &) { handler(user, q); }); });
+    }
+
+    void pfq_reactor_remove(pfq_reactor_t *r, pfq_t *q, int *ok)
+    {
+        firewall(ok, r, [&]() { r->remove(*q); });
+    }
+
+    int pfq_reactor_run_once(pfq_reactor_t *r, int msec, int *ok)
+    {
+        return firewall(ok, r, [&]() { return r->run_once(msec); });
+    }
+
+    void pfq_reactor_stop(pfq_reactor_t *r)
+    {
+        r->stop();
+    }
 }
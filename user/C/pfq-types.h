@@ -0,0 +1,61 @@
+/***************************************************************
+   
+   Copyright (c) 2012, Nicola Bonelli 
+   All rights reserved. 
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions are met: 
+
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer. 
+   * Redistributions in binary form must reproduce the above copyright 
+     notice, this list of conditions and the following disclaimer in the 
+     documentation and/or other materials provided with the distribution. 
+   * Neither the name of University of Pisa nor the names of its contributors 
+     may be used to endorse or promote products derived from this software 
+     without specific prior written permission. 
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+   POSSIBILITY OF SUCH DAMAGE.
+ 
+ ***************************************************************/
+
+/* plain C types of the pfq C API, shared by pfq.h and libpfq */
+
+#ifndef _PFQ_TYPES_H_
+#define _PFQ_TYPES_H_ 
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pfq_wait_stats
+{
+    uint64_t wait_ns;       /* time spent waiting for packets */
+    uint64_t proc_ns;       /* time spent between reads (processing) */
+    uint64_t spins;         /* waits satisfied by spinning */
+    uint64_t blocks;        /* waits that entered the kernel */
+};
+
+/* a batch of packets returned by pfq_read: the slots stay valid until 
+   the next pfq_read (or dispatch) on the same socket. */
+
+struct pfq_batch
+{
+    const char *addr;       /* first slot */
+    size_t      len;        /* number of packets */
+    size_t      slot_size;
+    int         version;    /* header version of the slots (1 or 2) */
+};
+
+typedef void (*pfq_batch_handler)(char *user, const struct pfq_batch *b);
+
+#endif /* _PFQ_TYPES_H_ */
@@ -33,13 +33,95 @@
 #define _PFQ_H_ 
 
 #include <stddef.h>
+#include <stdint.h>
 #include <linux/pf_q.h>
 
+#include <pfq-types.h>
+
 /* placeholder type for pfq descriptor */
 
 typedef void * pfq_t;
 
+typedef void * pfq_reactor_t;
+
 typedef void (*pfq_handler)(char *user, const struct pfq_hdr *h, const char *data); 
+typedef void (*pfq_handler_v2)(char *user, const struct pfq_hdr_v2 *h, const char *data); 
+
+/* wait policies of pfq_dispatch (see net::wait_policy) */
+
+#define PFQ_WAIT_BLOCK      0
+#define PFQ_WAIT_BUSY       1
+#define PFQ_WAIT_ADAPTIVE   2
+
+/* inline iteration: 
+
+   const char *it;
+   pfq_batch_for_each(it, &b) {
+       while (!pfq_slot_ready(&b, it)) ; 
+       ... pfq_slot_hdr(it), pfq_slot_data(&b, it) ...
+   }
+ */
+
+static inline const char *
+pfq_batch_begin(const struct pfq_batch *b)
+{
+    return b->addr;
+}
+
+static inline const char *
+pfq_batch_end(const struct pfq_batch *b)
+{
+    return b->addr + b->len * b->slot_size;
+}
+
+static inline const char *
+pfq_batch_next(const struct pfq_batch *b, const char *it)
+{
+    return it + b->slot_size;
+}
+
+static inline const char *
+pfq_batch_at(const struct pfq_batch *b, size_t n)
+{
+    return b->addr + n * b->slot_size;
+}
+
+#define pfq_batch_for_each(it, b) \
+    for((it) = pfq_batch_begin(b); (it) != pfq_batch_end(b); (it) = pfq_batch_next(b, it))
+
+static inline const struct pfq_hdr *
+pfq_slot_hdr(const char *it)
+{
+    return (const struct pfq_hdr *)it;
+}
+
+static inline const struct pfq_hdr_v2 *
+pfq_slot_hdr_v2(const char *it)
+{
+    return (const struct pfq_hdr_v2 *)it;
+}
+
+static inline const char *
+pfq_slot_data(const struct pfq_batch *b, const char *it)
+{
+    return b->version == 2 ? it + sizeof(struct pfq_hdr_v2) + Q_HDR_V2_PAD 
+                           : it + sizeof(struct pfq_hdr);
+}
+
+static inline uint32_t
+pfq_slot_caplen(const struct pfq_batch *b, const char *it)
+{
+    return b->version == 2 ? pfq_slot_hdr_v2(it)->caplen : pfq_slot_hdr(it)->caplen;
+}
+
+/* the slot is written by the kernel: spin until it is committed */
+
+static inline int
+pfq_slot_ready(const struct pfq_batch *b, const char *it)
+{
+    return b->version == 2 ? pfq_slot_hdr_v2(it)->commit 
+                           : ((volatile const struct pfq_hdr *)it)->commit;
+}
 
 extern pfq_t pfq_open(size_t calpen, size_t offset, size_t slots);
 extern void  pfq_close(pfq_t *);
@@ -57,6 +139,12 @@ extern void pfq_set_caplen(pfq_t *q, size_t value, int *ok);
 extern size_t pfq_get_caplen(pfq_t const *q, int *ok);
 extern void pfq_set_offset(pfq_t *q, size_t value, int *ok);
 extern size_t pfq_get_offset(pfq_t const *q, int *ok);
+extern void pfq_set_hdr_version(pfq_t *q, int version, int *ok);
+extern int pfq_get_hdr_version(pfq_t const *q, int *ok);
+extern void pfq_set_dedup(pfq_t *q, int msec, int *ok);
+extern int pfq_get_dedup(pfq_t const *q, int *ok);
+extern void pfq_set_flow_table(pfq_t *q, unsigned int slots, unsigned int ring_slots, unsigned int timeout_msec, int capture, int *ok);
+extern size_t pfq_get_flow_mem(pfq_t const *q, int *ok);
 extern void pfq_set_slots(pfq_t *q, size_t value, int *ok);
 extern size_t pfq_get_slots(pfq_t const *q, int *ok);
 extern size_t pfq_get_slot_size(pfq_t const *q, int *ok);
@@ -64,12 +152,46 @@ extern void pfq_add_device_by_index(pfq_t *q, int index, int queue, int *ok);
 extern void pfq_add_device_by_name(pfq_t *q, const char *dev, int queue,int *ok);
 extern void pfq_remove_device_by_index(pfq_t *q, int index, int queue, int *ok);
 extern void pfq_remove_device_by_name(pfq_t *q, const char *dev, int queue, int *ok);
+extern void pfq_add_egress_device_by_index(pfq_t *q, int index, int *ok);
+extern void pfq_add_egress_device_by_name(pfq_t *q, const char *dev, int *ok);
+extern void pfq_remove_egress_device_by_index(pfq_t *q, int index, int *ok);
+extern void pfq_remove_egress_device_by_name(pfq_t *q, const char *dev, int *ok);
+extern void pfq_add_vlan(pfq_t *q, int first, int last, int *ok);
+extern void pfq_remove_vlan(pfq_t *q, int first, int last, int *ok);
+extern void pfq_add_mpls_label(pfq_t *q, int label, int *ok);
+extern void pfq_remove_mpls_label(pfq_t *q, int label, int *ok);
+extern void pfq_add_class_rule(pfq_t *q, int class_id, int proto, int port_first, int port_last, int *ok);
+extern void pfq_remove_class_rule(pfq_t *q, int class_id, int proto, int port_first, int port_last, int *ok);
+extern void pfq_add_class(pfq_t *q, int class_id, int *ok);
+extern void pfq_remove_class(pfq_t *q, int class_id, int *ok);
 extern int pfq_poll(pfq_t *q, long int usec, int *ok);
+extern void pfq_set_wait_policy(pfq_t *q, int policy, long int spin_usec, int *ok);
+extern int pfq_get_wait_policy(pfq_t const *q, int *ok);
+extern struct pfq_wait_stats pfq_get_wait_stats(pfq_t const *q, int *ok);
 extern int pfq_id(pfq_t const *q, int *ok);
 extern int pfq_fd(pfq_t const *q);
 
 extern struct pfq_stats pfq_get_stats(pfq_t const *q, int *ok);
 
 extern int pfq_dispatch(pfq_t *q, pfq_handler callback, char *user, int *ok);
+extern int pfq_dispatch_v2(pfq_t *q, pfq_handler_v2 callback, char *user, int *ok);
+
+/* usec < 0 waits forever, 0 does not wait */
+
+extern struct pfq_batch pfq_read(pfq_t *q, long int usec, int *ok);
+extern int pfq_dispatch_batch(pfq_t *q, pfq_batch_handler callback, long int usec, char *user, int *ok);
+
+/* reactor: waits on many sockets from one thread (see net::pfq_reactor) */
+
+typedef void (*pfq_ready_handler)(char *user, pfq_t *q);
+
+extern pfq_reactor_t *pfq_reactor_open(void);
+extern void pfq_reactor_close(pfq_reactor_t *r);
+extern const char *pfq_reactor_error(pfq_reactor_t *r);
+
+extern void pfq_reactor_add(pfq_reactor_t *r, pfq_t *q, pfq_ready_handler handler, char *user, int *ok);
+extern void pfq_reactor_remove(pfq_reactor_t *r, pfq_t *q, int *ok);
+extern int  pfq_reactor_run_once(pfq_reactor_t *r, int msec, int *ok);
+extern void pfq_reactor_stop(pfq_reactor_t *r);
 
 #endif /* _PFQ_H_ */
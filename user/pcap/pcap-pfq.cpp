@@ -0,0 +1,672 @@
+/***************************************************************
+   
+   Copyright (c) 2012, Nicola Bonelli 
+   All rights reserved. 
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions are met: 
+
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer. 
+   * Redistributions in binary form must reproduce the above copyright 
+     notice, this list of conditions and the following disclaimer in the 
+     documentation and/or other materials provided with the distribution. 
+   * Neither the name of University of Pisa nor the names of its contributors 
+     may be used to endorse or promote products derived from this software 
+     without specific prior written permission. 
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+   POSSIBILITY OF SUCH DAMAGE.
+ 
+ ***************************************************************/
+
+/*
+ * libpcap-pfq: the subset of the libpcap API used by most capture
+ * applications, implemented on top of net::pfq.
+ *
+ * pcap_dispatch hands over a whole PFQ batch at a time, pcap_next_ex walks
+ * the same batch one packet per call. Filters are compiled by the system
+ * libpcap (loaded on demand) and attached to the PFQ socket, so that the
+ * kernel drops the packets before they are copied into the queue; should
+ * the kernel reject the program, it is run in user-space instead.
+ */
+
+#include <pcap.h>
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <exception>
+
+#include <pfq.hpp>
+
+
+static_assert(sizeof(struct bpf_insn) == sizeof(struct sock_filter), "bpf_insn and sock_filter layouts differ");
+
+
+namespace
+{
+    /* the BPF compiler is borrowed from the system libpcap: it is loaded with
+     * deep binding so that its symbols never resolve back into this library. */
+
+    struct libpcap
+    {
+        typedef pcap_t *(*open_dead_t)(int, int);
+        typedef int     (*compile_t)(pcap_t *, struct bpf_program *, const char *, int, bpf_u_int32);
+        typedef void    (*freecode_t)(struct bpf_program *);
+        typedef void    (*close_t)(pcap_t *);
+        typedef char *  (*geterr_t)(pcap_t *);
+        typedef u_int   (*filter_t)(const struct bpf_insn *, const u_char *, u_int, u_int);
+
+        libpcap()
+        : handle(nullptr)
+        , open_dead(nullptr)
+        , compile(nullptr)
+        , freecode(nullptr)
+        , close(nullptr)
+        , geterr(nullptr)
+        , filter(nullptr)
+        {
+            const char *names[] = { "libpcap.so.1", "libpcap.so.0.8", "libpcap.so" };
+
+            for(auto name : names)
+            {
+                if ((handle = ::dlopen(name, RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND)))
+                    break;
+            }
+
+            if (!handle)
+                return;
+
+            open_dead = sym<open_dead_t>("pcap_open_dead");
+            compile   = sym<compile_t>("pcap_compile");
+            freecode  = sym<freecode_t>("pcap_freecode");
+            close     = sym<close_t>("pcap_close");
+            geterr    = sym<geterr_t>("pcap_geterr");
+            filter    = sym<filter_t>("bpf_filter");
+        }
+
+        bool
+        ok() const
+        {
+            return open_dead && compile && freecode && close && geterr;
+        }
+
+        template <typename T>
+        T sym(const char *name)
+        {
+            return reinterpret_cast<T>(::dlsym(handle, name));
+        }
+
+        void *      handle;
+        open_dead_t open_dead;
+        compile_t   compile;
+        freecode_t  freecode;
+        close_t     close;
+        geterr_t    geterr;
+        filter_t    filter;
+    };
+
+
+    libpcap &
+    system_libpcap()
+    {
+        static libpcap lib;
+        return lib;
+    }
+}
+
+
+/* the queue is sized on the capture buffer (pcap_set_buffer_size), as the
+ * ring of libpcap: the slots of both halves of the double buffer fit into
+ * it. The snaplen is capped, 262144 (the default of tcpdump) would make
+ * every slot larger than any frame. */
+
+static const int    max_snaplen    = 65535;
+static const size_t default_buffer = 64 << 20;
+static const size_t min_slots      = 64;
+static const size_t max_slots      = 131072;
+
+
+struct pcap
+{
+    pcap(const char *dev)
+    : q()
+    , it(nullptr, 0)
+    , it_e(nullptr, 0)
+    , device(dev ? dev : "any")
+    , snaplen(65535)
+    , timeout(-1)
+    , buffer_size(default_buffer)
+    , promisc(false)
+    , promisc_fd(-1)
+    , nonblock(false)
+    , activated(false)
+    , brk(false)
+    , ufilter()
+    , dead(nullptr)
+    , hdr()
+    {
+        errbuf[0] = '\0';
+    }
+
+    net::pfq q;
+
+    net::queue::const_iterator it, it_e;    // the batch being consumed
+
+    std::string device;
+    int  snaplen;
+    long int timeout;                       // microseconds, -1 blocks
+    size_t buffer_size;                     // bytes, both halves of the queue
+    bool promisc;
+    int  promisc_fd;                        // holds the PACKET_MR_PROMISC membership
+    bool nonblock;
+    bool activated;
+
+    volatile bool brk;
+
+    std::vector<struct bpf_insn> ufilter;   // user-space filter, when the kernel refuses it
+    pcap_t *dead;                           // system libpcap handle, for the compiler
+
+    struct pcap_pkthdr hdr;
+    char errbuf[PCAP_ERRBUF_SIZE];
+};
+
+
+namespace
+{
+    template <typename Fun>
+    int firewall(pcap_t *p, int err, Fun fun)
+    {
+        try
+        {
+            return fun();
+        }
+        catch(std::exception &e)
+        {
+            snprintf(p->errbuf, PCAP_ERRBUF_SIZE, "%s", e.what());
+        }
+        return err;
+    }
+
+
+    /* promiscuous mode as a PACKET_MR_PROMISC membership: the kernel counts
+     * the references to the device, and drops ours when the returned socket
+     * is closed (or the process dies). The socket (protocol 0) receives
+     * nothing. */
+
+    int
+    promisc_on(const char *dev)
+    {
+        struct packet_mreq mr;
+        memset(&mr, 0, sizeof(mr));
+
+        mr.mr_ifindex = ::if_nametoindex(dev);
+        mr.mr_type    = PACKET_MR_PROMISC;
+
+        if (mr.mr_ifindex == 0)
+            throw net::pfq_error(errno, "libpcap-pfq: promisc");
+
+        int fd = ::socket(AF_PACKET, SOCK_RAW, 0);
+        if (fd == -1)
+            throw net::pfq_error(errno, "libpcap-pfq: promisc");
+
+        if (::setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) == -1)
+        {
+            int err = errno;
+            ::close(fd);
+            throw net::pfq_error(err, "libpcap-pfq: PACKET_MR_PROMISC");
+        }
+
+        return fd;
+    }
+
+
+    /* pcap_breakloop was called: the request is consumed */
+
+    bool
+    broken(pcap_t *p)
+    {
+        if (!p->brk)
+            return false;
+        p->brk = false;
+        return true;
+    }
+
+
+    /* fetch a new batch once the current one is exhausted; false on timeout */
+
+    bool
+    fill(pcap_t *p)
+    {
+        if (p->it != p->it_e)
+            return true;
+
+        auto many = p->q.read(p->nonblock ? 0 : p->timeout);
+
+        p->it   = many.begin();
+        p->it_e = many.end();
+
+        return p->it != p->it_e;
+    }
+
+
+    /* the packet under the iterator, or nullptr if the user-space filter rejects it */
+
+    const u_char *
+    take(pcap_t *p, struct pcap_pkthdr *h)
+    {
+        auto &it = p->it;
+
+        while (!it.ready())
+            net::cpu_relax();
+
+        auto ts = it.tstamp();
+
+        h->ts.tv_sec  = ts / 1000000000;
+        h->ts.tv_usec = (ts % 1000000000) / 1000;
+        h->caplen     = it.caplen();
+        h->len        = it.len();
+
+        auto data = static_cast<const u_char *>(it.data());
+
+        ++it;
+
+        if (!p->ufilter.empty())
+        {
+            u_int snap = system_libpcap().filter(p->ufilter.data(), data, h->len, h->caplen);
+            if (snap == 0)
+                return nullptr;
+            if (snap < h->caplen)
+                h->caplen = snap;
+        }
+
+        return data;
+    }
+}
+
+
+extern "C" {
+
+
+pcap_t *
+pcap_create(const char *source, char *errbuf)
+{
+    auto p = new (std::nothrow) pcap(source);
+    if (!p)
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "libpcap-pfq: out of memory");
+    return p;
+}
+
+
+int
+pcap_set_snaplen(pcap_t *p, int snaplen)
+{
+    if (p->activated)
+        return PCAP_ERROR_ACTIVATED;
+    p->snaplen = snaplen;
+    return 0;
+}
+
+
+int
+pcap_set_promisc(pcap_t *p, int promisc)
+{
+    if (p->activated)
+        return PCAP_ERROR_ACTIVATED;
+    p->promisc = promisc;
+    return 0;
+}
+
+
+int
+pcap_set_timeout(pcap_t *p, int to_ms)
+{
+    if (p->activated)
+        return PCAP_ERROR_ACTIVATED;
+    p->timeout = to_ms > 0 ? to_ms * 1000L : -1;
+    return 0;
+}
+
+
+int
+pcap_set_buffer_size(pcap_t *p, int buffer_size)
+{
+    if (p->activated)
+        return PCAP_ERROR_ACTIVATED;
+    if (buffer_size > 0)
+        p->buffer_size = buffer_size;
+    return 0;
+}
+
+
+int
+pcap_activate(pcap_t *p)
+{
+    if (p->activated)
+        return PCAP_ERROR_ACTIVATED;
+
+    return firewall(p, PCAP_ERROR, [&]() -> int {
+
+        if (p->snaplen <= 0 || p->snaplen > max_snaplen)
+            p->snaplen = max_snaplen;
+
+        size_t slots = p->buffer_size / (2 * net::slot_size(p->snaplen));
+
+        p->q.open(p->snaplen, 0, std::min(std::max(slots, min_slots), max_slots));
+        p->q.toggle_time_stamp(true);
+
+        if (p->device == "any")
+            p->q.add_device(Q_ANY_DEVICE);
+        else
+            p->q.add_device(p->device.c_str());
+
+        if (p->promisc && p->device != "any")
+            p->promisc_fd = promisc_on(p->device.c_str());
+
+        p->q.enable();
+        p->activated = true;
+        return 0;
+    });
+}
+
+
+pcap_t *
+pcap_open_live(const char *device, int snaplen, int promisc, int to_ms, char *errbuf)
+{
+    auto p = pcap_create(device, errbuf);
+    if (!p)
+        return nullptr;
+
+    pcap_set_snaplen(p, snaplen);
+    pcap_set_promisc(p, promisc);
+    pcap_set_timeout(p, to_ms);
+
+    if (pcap_activate(p) != 0)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", p->errbuf);
+        pcap_close(p);
+        return nullptr;
+    }
+
+    return p;
+}
+
+
+void
+pcap_close(pcap_t *p)
+{
+    if (p->promisc_fd != -1)
+        ::close(p->promisc_fd);
+
+    if (p->dead)
+        system_libpcap().close(p->dead);
+
+    delete p;
+}
+
+
+/* one PFQ batch (or what is left of it) per call. pcap_breakloop is honoured
+ * before waiting for a batch, after an empty one and between packets. */
+
+int
+pcap_dispatch(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
+{
+    return firewall(p, PCAP_ERROR, [&]() -> int {
+
+        if (broken(p))
+            return PCAP_ERROR_BREAK;
+
+        if (!fill(p))
+            return broken(p) ? PCAP_ERROR_BREAK : 0;
+
+        int n = 0;
+
+        while (p->it != p->it_e && (cnt <= 0 || n < cnt))
+        {
+            if (broken(p))
+                return PCAP_ERROR_BREAK;
+
+            struct pcap_pkthdr h;
+            if (auto data = take(p, &h))
+            {
+                callback(user, &h, data);
+                n++;
+            }
+        }
+
+        return n;
+    });
+}
+
+
+int
+pcap_loop(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
+{
+    int n = 0;
+
+    for(;;)
+    {
+        int ret = pcap_dispatch(p, cnt > 0 ? cnt - n : -1, callback, user);
+        if (ret < 0)
+            return ret;
+
+        n += ret;
+        if (cnt > 0 && n >= cnt)
+            return 0;
+    }
+}
+
+
+int
+pcap_next_ex(pcap_t *p, struct pcap_pkthdr **h, const u_char **data)
+{
+    return firewall(p, PCAP_ERROR, [&]() -> int {
+
+        if (!fill(p))
+            return 0;
+
+        while (p->it != p->it_e)
+        {
+            if (auto ptr = take(p, &p->hdr))
+            {
+                *h    = &p->hdr;
+                *data = ptr;
+                return 1;
+            }
+        }
+
+        return 0;
+    });
+}
+
+
+const u_char *
+pcap_next(pcap_t *p, struct pcap_pkthdr *h)
+{
+    struct pcap_pkthdr *hdr;
+    const u_char *data;
+
+    if (pcap_next_ex(p, &hdr, &data) != 1)
+        return nullptr;
+
+    *h = *hdr;
+    return data;
+}
+
+
+void
+pcap_breakloop(pcap_t *p)
+{
+    p->brk = true;
+}
+
+
+int
+pcap_compile(pcap_t *p, struct bpf_program *fp, const char *str, int optimize, bpf_u_int32 netmask)
+{
+    auto &lib = system_libpcap();
+
+    if (!lib.ok())
+    {
+        snprintf(p->errbuf, PCAP_ERRBUF_SIZE, "libpcap-pfq: system libpcap not found, cannot compile filters");
+        return PCAP_ERROR;
+    }
+
+    if (!p->dead && !(p->dead = lib.open_dead(DLT_EN10MB, p->snaplen)))
+    {
+        snprintf(p->errbuf, PCAP_ERRBUF_SIZE, "libpcap-pfq: pcap_open_dead failed");
+        return PCAP_ERROR;
+    }
+
+    if (lib.compile(p->dead, fp, str, optimize, netmask) < 0)
+    {
+        snprintf(p->errbuf, PCAP_ERRBUF_SIZE, "%s", lib.geterr(p->dead));
+        return PCAP_ERROR;
+    }
+
+    return 0;
+}
+
+
+void
+pcap_freecode(struct bpf_program *fp)
+{
+    auto &lib = system_libpcap();
+    if (lib.freecode)
+        lib.freecode(fp);
+}
+
+
+int
+pcap_setfilter(pcap_t *p, struct bpf_program *fp)
+{
+    return firewall(p, PCAP_ERROR, [&]() -> int {
+
+        struct sock_fprog prog = { static_cast<unsigned short>(fp->bf_len),
+                                   reinterpret_cast<struct sock_filter *>(fp->bf_insns) };
+
+        /* packets of the current batch were selected by the previous filter */
+
+        p->it = p->it_e;
+
+        try
+        {
+            if (fp->bf_len > USHRT_MAX)
+                throw net::pfq_error(EINVAL, "PFQ: filter too long");
+
+            p->q.attach_filter(prog);
+            p->ufilter.clear();
+            return 0;
+        }
+        catch(net::pfq_error &)
+        {
+            if (!system_libpcap().filter)
+                throw;
+        }
+
+        try { p->q.detach_filter(); } catch(net::pfq_error &) {}
+
+        p->ufilter.assign(fp->bf_insns, fp->bf_insns + fp->bf_len);
+        return 0;
+    });
+}
+
+
+int
+pcap_stats(pcap_t *p, struct pcap_stat *ps)
+{
+    return firewall(p, PCAP_ERROR, [&]() -> int {
+
+        auto s = p->q.stats();
+
+        ps->ps_recv   = s.recv + s.lost;
+        ps->ps_drop   = s.lost;
+        ps->ps_ifdrop = 0;
+        return 0;
+    });
+}
+
+
+int
+pcap_setnonblock(pcap_t *p, int nonblock, char *)
+{
+    p->nonblock = nonblock;
+    return 0;
+}
+
+
+int
+pcap_getnonblock(pcap_t *p, char *)
+{
+    return p->nonblock;
+}
+
+
+int
+pcap_datalink(pcap_t *)
+{
+    return DLT_EN10MB;
+}
+
+
+int
+pcap_snapshot(pcap_t *p)
+{
+    return p->snaplen;
+}
+
+
+int
+pcap_fileno(pcap_t *p)
+{
+    return p->q.fd();
+}
+
+
+int
+pcap_get_selectable_fd(pcap_t *p)
+{
+    return p->q.fd();
+}
+
+
+char *
+pcap_geterr(pcap_t *p)
+{
+    return p->errbuf;
+}
+
+
+void
+pcap_perror(pcap_t *p, const char *prefix)
+{
+    fprintf(stderr, "%s: %s\n", prefix, p->errbuf);
+}
+
+
+const char *
+pcap_lib_version()
+{
+    return "libpcap-pfq (PFQ batch shim)";
+}
+
+
+} // extern "C"
@@ -0,0 +1,115 @@
+/***************************************************************
+ *                                                
+ * (C) 2011 - Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *            Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ ****************************************************************/
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+
+#include <x86intrin.h>
+
+#include <pfq.hpp>
+
+// cycles per packet of the dispatch flavours over a synthetic batch, 
+// large enough not to fit in the last level cache (no module required).
+
+using namespace net;
+
+namespace opt {
+
+    size_t caplen = 128;
+    size_t slots  = 262144;
+    size_t loops  = 20;
+}
+
+static uint64_t sum;
+
+/* the handler of today's C binding: an out of line function called through a pointer */
+
+__attribute__((noinline))
+void handler(char *, const pfq_hdr *h, const char *data)
+{
+    sum += h->caplen + *reinterpret_cast<const uint16_t *>(data + 12) 
+                     + *reinterpret_cast<const uint32_t *>(data + 26);
+}
+
+
+template <typename Fun>
+double cycles_per_packet(const queue &many, Fun fun)
+{
+    fun(many);  // warm up: page faults, TLB
+
+    uint64_t start = __rdtsc();
+
+    for(size_t n = 0; n < opt::loops; n++)
+        fun(many);
+
+    return static_cast<double>(__rdtsc() - start) / (opt::loops * many.size());
+}
+
+
+int
+main(int argc, char *argv[])
+try
+{
+    if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+        throw std::runtime_error(std::string("usage: ").append(argv[0]).append(" [caplen] [slots] [loops]"));
+
+    if (argc > 1) opt::caplen = std::atoi(argv[1]);
+    if (argc > 2) opt::slots  = std::atoi(argv[2]);
+    if (argc > 3) opt::loops  = std::atoi(argv[3]);
+
+    size_t size = slot_size(opt::caplen);
+
+    std::vector<char> mem(opt::slots * size);
+
+    for(size_t i = 0; i < opt::slots; i++)
+    {
+        auto h = reinterpret_cast<pfq_hdr *>(&mem[i * size]);
+        h->caplen = opt::caplen;
+        h->len    = opt::caplen;
+        h->commit = 1;
+    }
+
+    queue many(mem.data(), size, opt::slots);
+
+    auto inlined = [](char *, const pfq_hdr *h, const char *data) {
+        sum += h->caplen + *reinterpret_cast<const uint16_t *>(data + 12) 
+                         + *reinterpret_cast<const uint32_t *>(data + 26);
+    };
+
+    std::cout << "slots: " << opt::slots << " slot_size: " << size << " loops: " << opt::loops << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+
+    std::cout << "function pointer, no prefetch  : " 
+              << cycles_per_packet(many, [](const queue &q) { dispatch<0>(q, &handler); }) << " cycles/pkt" << std::endl;
+
+    std::cout << "inlined, no prefetch           : " 
+              << cycles_per_packet(many, [&](const queue &q) { dispatch<0>(q, inlined); }) << " cycles/pkt" << std::endl;
+
+    std::cout << "inlined, prefetch 2 ahead      : " 
+              << cycles_per_packet(many, [&](const queue &q) { dispatch<2>(q, inlined); }) << " cycles/pkt" << std::endl;
+
+    std::cout << "inlined, prefetch 4 ahead      : " 
+              << cycles_per_packet(many, [&](const queue &q) { dispatch<4>(q, inlined); }) << " cycles/pkt" << std::endl;
+
+    std::cout << "inlined, prefetch 8 ahead      : " 
+              << cycles_per_packet(many, [&](const queue &q) { dispatch<8>(q, inlined); }) << " cycles/pkt" << std::endl;
+
+    std::cout << "inlined, prefetch 16 ahead     : " 
+              << cycles_per_packet(many, [&](const queue &q) { dispatch<16>(q, inlined); }) << " cycles/pkt" << std::endl;
+
+    std::cout << "(checksum " << sum << ")" << std::endl;
+    return 0;
+}
+catch(std::exception &e)
+{
+    std::cerr << e.what() << std::endl;
+    return -1;
+}
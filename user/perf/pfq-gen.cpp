@@ -0,0 +1,464 @@
+/***************************************************************
+ *
+ * (C) 2011 - Nicola Bonelli <nicola.bonelli@cnit.it>
+ *            Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ ****************************************************************/
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <poll.h>
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <cerrno>
+#include <system_error>
+
+#include "pfq-gen.hpp"
+
+// local traffic generator: udp/ipv4 frames at a given rate, size mix and
+// number of flows, transmitted on a device (a veth end, a dummy device...)
+// through the AF_PACKET tx ring (TPACKET_V2), a batch per send(). The
+// offered load is published for pfq-n-counters (see pfq-gen.hpp).
+
+namespace opt {
+
+    std::string dev;
+    double   rate    = 0;        // pps, 0 = as fast as possible
+    size_t   flows   = 1;
+    size_t   batch   = 64;       // frames per send()
+    size_t   frames  = 4096;     // tx ring
+    double   seconds = 0;        // 0 = until interrupted
+    uint64_t count   = 0;        // 0 = unlimited
+    bool     bypass  = false;    // PACKET_QDISC_BYPASS
+    std::vector<size_t> sizes = { 60 };
+}
+
+static std::atomic_bool stop(false);
+
+static const size_t frame_size = 2048;
+static const size_t block_size = 1 << 16;
+
+
+void usage(const char *name)
+{
+    throw std::runtime_error(std::string("usage: ")
+        .append(name)
+        .append(" [-h|--help] [-r pps[k|M]] [-s size,size...|imix] [-f flows] [-b batch] [-R ring_frames] [-t seconds] [-n count] [--bypass] dev"));
+}
+
+
+/* rates with a k/M suffix */
+
+double parse_rate(const char *s)
+{
+    char *end;
+    double r = std::strtod(s, &end);
+    if (*end == 'k' || *end == 'K')
+        r *= 1e3;
+    else if (*end == 'm' || *end == 'M')
+        r *= 1e6;
+    else if (*end != '\0')
+        throw std::runtime_error(std::string("bad rate: ").append(s));
+    return r;
+}
+
+
+/* frame sizes (without fcs): a list repeated in order, or the simple imix
+   (7 x 64, 4 x 594, 1 x 1518 bytes on the wire) interleaved */
+
+std::vector<size_t> parse_sizes(const std::string &s)
+{
+    if (s == "imix")
+        return { 60, 590, 60, 1514, 60, 590, 60, 590, 60, 60, 590, 60 };
+
+    std::vector<size_t> ret;
+    std::istringstream in(s);
+    std::string tok;
+    while (std::getline(in, tok, ','))
+    {
+        size_t n = std::atoi(tok.c_str());
+        if (n < 60 || n > 1514)
+            throw std::runtime_error("frame size out of range [60,1514]: " + tok);
+        ret.push_back(n);
+    }
+    if (ret.empty())
+        throw std::runtime_error("no frame size");
+    return ret;
+}
+
+
+static inline uint16_t
+ip_checksum(const uint8_t *p, size_t len)
+{
+    uint32_t sum = 0;
+    for(size_t i = 0; i < len; i += 2)
+        sum += (p[i] << 8) | p[i+1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return static_cast<uint16_t>(~sum);
+}
+
+
+/* udp/ipv4 frame of the given flow: flows differ by source address and port */
+
+size_t build_frame(uint8_t *p, size_t size, const uint8_t *mac, uint32_t flow)
+{
+    memset(p, 0, size);
+
+    memset(p, 0xff, 6);
+    memcpy(p + 6, mac, 6);
+    p[12] = 0x08; p[13] = 0x00;
+
+    uint8_t *ip = p + 14;
+    uint16_t ip_len = static_cast<uint16_t>(size - 14);
+    uint32_t saddr = htonl(0x0a000001 + flow);      // 10.0.0.1 + flow
+    uint32_t daddr = htonl(0x0a640001);             // 10.100.0.1
+
+    ip[0] = 0x45;
+    ip[2] = ip_len >> 8; ip[3] = ip_len & 0xff;
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    memcpy(ip + 12, &saddr, 4);
+    memcpy(ip + 16, &daddr, 4);
+    uint16_t csum = ip_checksum(ip, 20);
+    ip[10] = csum >> 8; ip[11] = csum & 0xff;
+
+    uint8_t *udp = ip + 20;
+    uint16_t sport = static_cast<uint16_t>(1024 + flow % 64000), udp_len = static_cast<uint16_t>(ip_len - 20);
+    udp[0] = sport >> 8; udp[1] = sport & 0xff;
+    udp[2] = 0; udp[3] = 9;                         // discard
+    udp[4] = udp_len >> 8; udp[5] = udp_len & 0xff;
+
+    return size;
+}
+
+
+class tx_ring
+{
+public:
+
+    tx_ring(const std::string &dev, size_t frames, bool bypass)
+    : fd_(-1), ring_(nullptr), size_(0), frames_(0), cur_(0), ifindex_(0), mac_()
+    {
+        fd_ = ::socket(AF_PACKET, SOCK_RAW, 0);     // no protocol: nothing is received
+        if (fd_ < 0)
+            throw std::system_error(errno, std::generic_category(), "socket (root or CAP_NET_RAW required)");
+
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        dev.copy(ifr.ifr_name, IFNAMSIZ - 1);
+
+        if (::ioctl(fd_, SIOCGIFINDEX, &ifr) < 0)
+            throw std::system_error(errno, std::generic_category(), "SIOCGIFINDEX " + dev);
+        ifindex_ = ifr.ifr_ifindex;
+
+        if (::ioctl(fd_, SIOCGIFHWADDR, &ifr) < 0)
+            throw std::system_error(errno, std::generic_category(), "SIOCGIFHWADDR " + dev);
+        memcpy(mac_, ifr.ifr_hwaddr.sa_data, 6);
+
+        int version = TPACKET_V2;
+        if (::setsockopt(fd_, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+            throw std::system_error(errno, std::generic_category(), "PACKET_VERSION");
+
+#ifdef PACKET_QDISC_BYPASS
+        int one = 1;
+        if (bypass && ::setsockopt(fd_, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one)) < 0)
+            std::cerr << "PACKET_QDISC_BYPASS not supported" << std::endl;
+#else
+        if (bypass)
+            std::cerr << "PACKET_QDISC_BYPASS not supported" << std::endl;
+#endif
+
+        struct tpacket_req req;
+        req.tp_frame_size = frame_size;
+        req.tp_block_size = block_size;
+        req.tp_block_nr   = (frames * frame_size + block_size - 1) / block_size;
+        req.tp_frame_nr   = req.tp_block_nr * (block_size / frame_size);
+
+        if (::setsockopt(fd_, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+            throw std::system_error(errno, std::generic_category(), "PACKET_TX_RING");
+
+        frames_ = req.tp_frame_nr;
+        size_   = static_cast<size_t>(req.tp_block_nr) * block_size;
+
+        ring_ = static_cast<char *>(::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0));
+        if (ring_ == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "mmap");
+
+        struct sockaddr_ll addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sll_family  = AF_PACKET;
+        addr.sll_ifindex = ifindex_;
+
+        if (::bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+            throw std::system_error(errno, std::generic_category(), "bind " + dev);
+    }
+
+    ~tx_ring()
+    {
+        if (ring_ && ring_ != MAP_FAILED)
+            ::munmap(ring_, size_);
+        if (fd_ != -1)
+            ::close(fd_);
+    }
+
+    tx_ring(const tx_ring &) = delete;
+    tx_ring& operator=(const tx_ring &) = delete;
+
+    const uint8_t *
+    mac() const
+    {
+        return mac_;
+    }
+
+    size_t
+    frames() const
+    {
+        return frames_;
+    }
+
+    /* the next free frame, nullptr if the ring is full (frames still in flight).
+       A frame rejected by the kernel is accounted in rejected. */
+
+    tpacket2_hdr *
+    next(uint64_t &rejected)
+    {
+        auto hdr = reinterpret_cast<tpacket2_hdr *>(ring_ + cur_ * frame_size);
+
+        switch(static_cast<volatile tpacket2_hdr *>(hdr)->tp_status)
+        {
+        case TP_STATUS_AVAILABLE:
+            return hdr;
+        case TP_STATUS_WRONG_FORMAT:
+            rejected++;
+            hdr->tp_status = TP_STATUS_AVAILABLE;
+            return hdr;
+        default:
+            return nullptr;
+        }
+    }
+
+    static uint8_t *
+    data(tpacket2_hdr *hdr)
+    {
+        return reinterpret_cast<uint8_t *>(hdr) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+    }
+
+    void
+    commit(tpacket2_hdr *hdr, size_t len)
+    {
+        hdr->tp_len = static_cast<uint32_t>(len);
+        __sync_synchronize();
+        hdr->tp_status = TP_STATUS_SEND_REQUEST;
+        cur_ = (cur_ + 1) % frames_;
+    }
+
+    /* transmit the frames committed so far */
+
+    void
+    flush()
+    {
+        if (::send(fd_, nullptr, 0, 0) < 0 && errno != ENOBUFS && errno != EAGAIN && errno != EINTR)
+            throw std::system_error(errno, std::generic_category(), "send");
+    }
+
+    /* wait for some frame in flight to be released */
+
+    void
+    wait()
+    {
+        struct pollfd p = { fd_, POLLOUT, 0 };
+        ::poll(&p, 1, 1);
+    }
+
+private:
+    int     fd_;
+    char *  ring_;
+    size_t  size_;
+    size_t  frames_;
+    size_t  cur_;
+    int     ifindex_;
+    uint8_t mac_[6];
+};
+
+
+int
+main(int argc, char *argv[])
+try
+{
+    if (argc < 2)
+        usage(argv[0]);
+
+    for(int i = 1; i < argc; ++i)
+    {
+        auto next = [&]() -> const char * {
+            if (++i == argc)
+                usage(argv[0]);
+            return argv[i];
+        };
+
+        if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--rate") == 0) {
+            opt::rate = parse_rate(next());
+            continue;
+        }
+        if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--size") == 0) {
+            opt::sizes = parse_sizes(next());
+            continue;
+        }
+        if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--flows") == 0) {
+            opt::flows = std::max(1, std::atoi(next()));
+            continue;
+        }
+        if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) {
+            opt::batch = std::max(1, std::atoi(next()));
+            continue;
+        }
+        if (strcmp(argv[i], "-R") == 0 || strcmp(argv[i], "--ring") == 0) {
+            opt::frames = std::max(32, std::atoi(next()));
+            continue;
+        }
+        if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--seconds") == 0) {
+            opt::seconds = std::atof(next());
+            continue;
+        }
+        if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--count") == 0) {
+            opt::count = std::strtoull(next(), nullptr, 10);
+            continue;
+        }
+        if (strcmp(argv[i], "--bypass") == 0) {
+            opt::bypass = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+            usage(argv[0]);
+
+        if (!opt::dev.empty())
+            usage(argv[0]);
+        opt::dev = argv[i];
+    }
+
+    if (opt::dev.empty())
+        usage(argv[0]);
+
+    tx_ring ring(opt::dev, opt::frames, opt::bypass);
+
+    opt::batch = std::min(opt::batch, ring.frames());
+
+    std::cout << "dev: " << opt::dev << " rate: " << (opt::rate ? std::to_string(static_cast<uint64_t>(opt::rate)) + " pps" : "max")
+              << " flows: " << opt::flows << " batch: " << opt::batch << " ring: " << ring.frames() << " frames" << std::endl;
+    std::cout << "sizes:";
+    for(auto s : opt::sizes)
+        std::cout << ' ' << s;
+    std::cout << std::endl;
+
+    /* the segment is withdrawn on any exit: end of run, signal (the loop
+       stops) or error */
+
+    std::unique_ptr<gen::offered_load, void (*)(gen::offered_load *)> load(gen::publish(opt::dev), gen::withdraw);
+
+    std::signal(SIGINT,  [](int) { stop = true; });
+    std::signal(SIGTERM, [](int) { stop = true; });
+
+    uint64_t sent = 0, bytes = 0, rejected = 0, pkt = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    auto report = start + std::chrono::seconds(1);
+    uint64_t last_sent = 0, last_bytes = 0;
+
+    while (!stop)
+    {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - start).count();
+
+        if (opt::seconds && elapsed >= opt::seconds)
+            break;
+        if (opt::count && pkt >= opt::count)
+            break;
+
+        if (now >= report)
+        {
+            std::cout << "sent: " << (sent - last_sent) << " pkt/sec "
+                      << std::fixed << std::setprecision(1) << (bytes - last_bytes) * 8 / 1e6 << " Mbps"
+                      << " rejected: " << rejected << std::endl;
+
+            last_sent = sent, last_bytes = bytes;
+            report += std::chrono::seconds(1);
+        }
+
+        /* frames due at this time */
+
+        uint64_t due = opt::batch;
+        if (opt::rate)
+        {
+            uint64_t target = static_cast<uint64_t>(opt::rate * elapsed);
+            due = target > pkt ? std::min<uint64_t>(target - pkt, opt::batch) : 0;
+            if (due == 0)
+            {
+                double gap = (pkt + 1 - opt::rate * elapsed) / opt::rate;
+                if (gap > 100e-6)
+                    std::this_thread::sleep_for(std::chrono::microseconds(static_cast<long>(gap * 1e6) - 50));
+                continue;
+            }
+        }
+
+        if (opt::count)
+            due = std::min<uint64_t>(due, opt::count - pkt);
+
+        uint64_t n = 0;
+        for(; n < due; n++, pkt++)
+        {
+            auto hdr = ring.next(rejected);
+            if (hdr == nullptr)
+                break;
+
+            size_t size = opt::sizes[pkt % opt::sizes.size()];
+            ring.commit(hdr, build_frame(tx_ring::data(hdr), size, ring.mac(), static_cast<uint32_t>(pkt % opt::flows)));
+            bytes += size;
+        }
+
+        if (n)
+            ring.flush();
+        else
+            ring.wait();
+
+        sent += n;
+
+        load->packets = sent - rejected;
+        load->bytes   = bytes;
+        load->dropped = rejected;
+    }
+
+    ring.flush();
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    load->packets = sent - rejected;
+    load->dropped = rejected;
+    load.reset();
+
+    std::cout << "total: " << (sent - rejected) << " packets, " << bytes << " bytes, " << rejected << " rejected in "
+              << std::fixed << std::setprecision(2) << elapsed << " sec ("
+              << (sent - rejected) / elapsed << " pkt/sec)" << std::endl;
+    return 0;
+}
+catch(std::exception &e)
+{
+    std::cerr << e.what() << std::endl;
+    return 1;
+}
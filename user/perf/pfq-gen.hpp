@@ -0,0 +1,132 @@
+/***************************************************************
+ *
+ * (C) 2011 - Nicola Bonelli <nicola.bonelli@cnit.it>
+ *            Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ ****************************************************************/
+
+#ifndef _PFQ_GEN_HPP_
+#define _PFQ_GEN_HPP_
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+/* offered load: pfq-gen publishes its counters in a shared memory segment
+   (/dev/shm/pfq-gen), so that pfq-n-counters can report the capture loss
+   against what was actually transmitted. A single writer, the counters
+   are read without locking. The writer removes the segment when it exits;
+   a reader tells a generator that was killed by its pid. */
+
+namespace gen {
+
+    static const char * const shm_name = "/pfq-gen";
+    static const uint32_t shm_magic = 0x70666730;    // "pfg0"
+
+    struct offered_load
+    {
+        uint32_t            magic;
+        volatile uint32_t   running;    // 0 once pfq-gen exits
+        volatile int32_t    pid;        // of the writer
+        volatile uint64_t   packets;    // transmitted (accepted by the device)
+        volatile uint64_t   bytes;
+        volatile uint64_t   dropped;    // rejected by the tx ring/device
+        char                ifname[16];
+    };
+
+
+    /* writer side: the segment is created (or reset) */
+
+    static inline offered_load *
+    publish(const std::string &ifname)
+    {
+        int fd = ::shm_open(shm_name, O_CREAT | O_RDWR, 0644);
+        if (fd < 0)
+            throw std::runtime_error("shm_open");
+
+        if (::ftruncate(fd, sizeof(offered_load)) < 0) {
+            ::close(fd);
+            throw std::runtime_error("ftruncate");
+        }
+
+        void *p = ::mmap(nullptr, sizeof(offered_load), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            throw std::runtime_error("mmap");
+
+        auto load = static_cast<offered_load *>(p);
+        load->running = 0;
+        __sync_synchronize();
+        load->magic   = shm_magic;
+        load->pid     = static_cast<int32_t>(::getpid());
+        load->packets = 0;
+        load->bytes   = 0;
+        load->dropped = 0;
+        ifname.copy(load->ifname, sizeof(load->ifname) - 1);
+        load->ifname[std::min(ifname.size(), sizeof(load->ifname) - 1)] = '\0';
+        __sync_synchronize();
+        load->running = 1;
+        return load;
+    }
+
+
+    /* writer side: the counters are final, the name is removed (readers
+       still attached keep their mapping) */
+
+    static inline void
+    withdraw(offered_load *load)
+    {
+        load->running = 0;
+        __sync_synchronize();
+        ::munmap(load, sizeof(offered_load));
+        ::shm_unlink(shm_name);
+    }
+
+
+    /* reader side: nullptr if no generator has published its counters */
+
+    static inline const offered_load *
+    attach()
+    {
+        int fd = ::shm_open(shm_name, O_RDONLY, 0);
+        if (fd < 0)
+            return nullptr;
+
+        void *p = ::mmap(nullptr, sizeof(offered_load), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return nullptr;
+
+        auto load = static_cast<const offered_load *>(p);
+        if (load->magic != shm_magic) {
+            ::munmap(p, sizeof(offered_load));
+            return nullptr;
+        }
+        return load;
+    }
+
+    static inline void
+    detach(const offered_load *load)
+    {
+        ::munmap(const_cast<offered_load *>(load), sizeof(offered_load));
+    }
+
+
+    /* the writer is still transmitting: not stopped, nor killed */
+
+    static inline bool
+    alive(const offered_load *load)
+    {
+        return load->running && (::kill(load->pid, 0) == 0 || errno == EPERM);
+    }
+
+} // namespace gen
+
+#endif /* _PFQ_GEN_HPP_ */
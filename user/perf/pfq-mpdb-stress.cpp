@@ -0,0 +1,299 @@
+/***************************************************************
+ *
+ * (C) 2011 - Nicola Bonelli <nicola.bonelli@cnit.it>
+ *            Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ ****************************************************************/
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+
+#include <pfq-mpdb.hpp>
+
+// N producer threads (the mpdb_enqueue of the module, in user space) against
+// the consumer of pfq::read, on a mpdb_queue: no module required. Reports
+// the throughput, the packets lost and the violations of the protocol:
+//
+//  uncommitted: a slot of a batch not committed within the timeout
+//  stale:       a slot delivered again: committed, with the data of a batch 
+//               already consumed (its commit flag was not cleared)
+//  torn:        a slot committed with a header or payload not its own
+//  order:       packets of a producer duplicated or out of order
+//  missing:     packets enqueued but never delivered (torn swap)
+//  overflow:    batches longer than the queue
+
+using namespace net;
+
+namespace opt {
+
+    size_t producers = 3;
+    size_t seconds   = 5;
+    size_t slots     = 4096;
+    size_t caplen    = 128;
+    int    version   = 1;
+
+    const uint64_t commit_timeout = 1000000000ULL;   // nsec
+}
+
+
+/* one cache line per producer: new[] honours the alignment */
+
+struct alignas(64) producer_stats
+{
+    uint64_t sent;
+    uint64_t lost;
+
+    static void *operator new[](size_t size)
+    {
+        void *p;
+        if (::posix_memalign(&p, 64, size) != 0)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    static void operator delete[](void *p)
+    {
+        ::free(p);
+    }
+};
+
+
+struct violations
+{
+    uint64_t uncommitted;
+    uint64_t stale;
+    uint64_t torn;
+    uint64_t order;
+    uint64_t missing;
+    uint64_t overflow;
+
+    uint64_t total() const
+    {
+        return uncommitted + stale + torn + order + missing + overflow;
+    }
+};
+
+
+/* packet: [producer:4][seq:8][fill...], the length depends on the sequence.
+   A consumed slot gets the producer consumed_id, which no producer writes: 
+   seen again, the slot was handed back before being written. */
+
+static const uint32_t consumed_id = 0xffffffff;
+
+static inline size_t
+packet_len(uint64_t seq)
+{
+    return 60 + seq % 200;
+}
+
+static inline uint8_t
+fill_byte(uint32_t id, uint64_t seq)
+{
+    return static_cast<uint8_t>(id * 31 + seq);
+}
+
+
+void producer(mpdb_queue &q, uint32_t id, std::atomic<bool> &stop, producer_stats &stats)
+{
+    char pkt[1514];
+
+    for(uint64_t seq = 0; !stop.load(std::memory_order_relaxed); seq++)
+    {
+        size_t len = packet_len(seq);
+
+        memcpy(pkt, &id, sizeof(id));
+        memcpy(pkt + 4, &seq, sizeof(seq));
+        memset(pkt + 12, fill_byte(id, seq), len - 12);
+
+        if (q.enqueue(pkt, len, seq, id))
+            stats.sent++;
+        else
+            stats.lost++;
+    }
+}
+
+
+struct consumer
+{
+    consumer(mpdb_queue &q, size_t producers)
+    : q_(q), next_(producers, 0), recv_(producers, 0), delivered_(0), batches_(0), max_wait_(0), err_()
+    {}
+
+    /* returns the length of the batch */
+
+    size_t
+    read(long int microseconds)
+    {
+        auto many = q_.read(microseconds);
+
+        if (many.size() > q_.slots())
+            err_.overflow++;
+
+        batches_++;
+
+        for(auto it = many.begin(); it != many.end(); ++it)
+        {
+            if (!it.ready())
+            {
+                uint64_t start = detail::now_ns(), now = start;
+                while (!it.ready() && (now = detail::now_ns()) - start < opt::commit_timeout)
+                    cpu_relax();
+
+                max_wait_ = std::max(max_wait_, now - start);
+
+                if (!it.ready()) {
+                    err_.uncommitted++;
+                    continue;
+                }
+            }
+            rmb();
+
+            this->check(it);
+
+            memcpy(it.data(), &consumed_id, sizeof(consumed_id));
+        }
+
+        return many.size();
+    }
+
+    void
+    check(queue::const_iterator it)
+    {
+        const char *pkt = static_cast<const char *>(it.data());
+
+        uint32_t id; uint64_t seq;
+        memcpy(&id, pkt, sizeof(id));
+        memcpy(&seq, pkt + 4, sizeof(seq));
+
+        delivered_++;
+
+        if (id == consumed_id) {
+            err_.stale++;
+            return;
+        }
+
+        if (id >= next_.size()) {
+            err_.torn++;
+            return;
+        }
+
+        size_t len = packet_len(seq);
+
+        bool torn = it.len() != std::min<size_t>(len, 0xffff) || it.caplen() != std::min(len, q_.caplen()) || it.if_index() != (id & 0xff);
+
+        uint8_t fill = fill_byte(id, seq);
+        for(size_t n = 12; n < it.caplen() && !torn; n++)
+            torn = static_cast<uint8_t>(pkt[n]) != fill;
+
+        if (torn) {
+            err_.torn++;
+            return;
+        }
+
+        if (seq < next_[id])
+            err_.order++;
+
+        next_[id] = seq + 1;
+        recv_[id]++;
+    }
+
+    mpdb_queue &q_;
+
+    std::vector<uint64_t> next_;
+    std::vector<uint64_t> recv_;
+
+    uint64_t delivered_;
+    uint64_t batches_;
+    uint64_t max_wait_;
+
+    violations err_;
+};
+
+
+int
+main(int argc, char *argv[])
+try
+{
+    if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+        throw std::runtime_error(std::string("usage: ").append(argv[0]).append(" [producers] [seconds] [slots] [caplen] [version]"));
+
+    if (argc > 1) opt::producers = std::atoi(argv[1]);
+    if (argc > 2) opt::seconds   = std::atoi(argv[2]);
+    if (argc > 3) opt::slots     = std::atoi(argv[3]);
+    if (argc > 4) opt::caplen    = std::atoi(argv[4]);
+    if (argc > 5) opt::version   = std::atoi(argv[5]);
+
+    if (opt::caplen < 12)
+        throw std::runtime_error("caplen too small (12 bytes at least)");
+
+    mpdb_queue q(opt::caplen, opt::slots, opt::version);
+
+    std::cout << "producers: " << opt::producers << " slots: " << opt::slots << " caplen: " << opt::caplen
+              << " slot_size: " << q.slot_size() << " hdr_version: " << opt::version << std::endl;
+
+    std::atomic<bool> stop(false);
+    std::unique_ptr<producer_stats[]> stats(new producer_stats[opt::producers]());
+    std::vector<std::thread> threads;
+
+    consumer cons(q, opt::producers);
+
+    auto start = std::chrono::steady_clock::now();
+    auto end   = start + std::chrono::seconds(opt::seconds);
+
+    for(size_t n = 0; n < opt::producers; n++)
+    {
+        threads.emplace_back(producer, std::ref(q), static_cast<uint32_t>(n), std::ref(stop), std::ref(stats[n]));
+    }
+
+    while (std::chrono::steady_clock::now() < end)
+        cons.read(1000);
+
+    stop = true;
+
+    for(auto &t : threads)
+        t.join();
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // drain: the first empty batch may follow the last non-empty one...
+
+    while (cons.read(0) || cons.read(0))
+    { }
+
+    uint64_t sent = 0, lost = 0;
+
+    for(size_t n = 0; n < opt::producers; n++)
+    {
+        sent += stats[n].sent;
+        lost += stats[n].lost;
+
+        if (cons.recv_[n] < stats[n].sent)
+            cons.err_.missing += stats[n].sent - cons.recv_[n];
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "offered:     " << (sent + lost) / elapsed / 1e6 << " Mpps" << std::endl;
+    std::cout << "delivered:   " << cons.delivered_ / elapsed / 1e6 << " Mpps (" << cons.delivered_ << " packets, "
+              << cons.batches_ << " batches)" << std::endl;
+    std::cout << "lost:        " << lost << " (" << (sent + lost ? 100.0 * lost / (sent + lost) : 0.0) << "%)" << std::endl;
+    std::cout << "commit wait: " << cons.max_wait_ / 1000 << " usec max" << std::endl;
+
+    std::cout << "violations:  uncommitted " << cons.err_.uncommitted << ", stale " << cons.err_.stale << ", torn " << cons.err_.torn
+              << ", order " << cons.err_.order << ", missing " << cons.err_.missing
+              << ", overflow " << cons.err_.overflow << std::endl;
+
+    return cons.err_.total() ? 1 : 0;
+}
+catch(std::exception &e)
+{
+    std::cerr << e.what() << std::endl;
+    return 2;
+}
@@ -5,9 +5,8 @@
  *
  ****************************************************************/
 
-#include <affinity.hpp>
-
 #include <iostream>
+#include <iomanip>
 #include <fstream>
 #include <sstream>
 
@@ -16,27 +15,24 @@
 #include <cstring>
 #include <vector>
 #include <algorithm>
+#include <functional>
 #include <iterator>
 #include <atomic>
 #include <cmath>
 #include <tuple>
 
 #include <pfq.hpp>
+#include <pfq-engine.hpp>
+
+#include "pfq-gen.hpp"
 
 
 namespace opt {
 
-    int sleep_microseconds;
-    bool enable_balance = false;
-    size_t caplen = 64;
-    size_t offset = 0;
-    size_t slots  = 131072;
     static const int seconds = 600;
 }
 
 
-typedef std::tuple<std::string, int, std::vector<int>> binding_type;
-
 using namespace net;
 
 namespace vt100
@@ -53,127 +49,6 @@ namespace vt100
 }
 
 
-binding_type 
-binding_parser(const char *arg)
-{
-    int core, q; char sep;
-    std::vector<int> queues;
-
-    auto sc = std::find(arg, arg+strlen(arg), ':');
-    if (sc == arg + strlen(arg)) {
-        std::string err("'");
-        err.append(arg)
-           .append("' option error: ':' not found");
-        throw std::runtime_error(err);
-    }
-
-    std::string dev(arg, sc);
-
-    std::istringstream i(std::string(sc+1, arg+strlen(arg)));  
-
-    if(!(i >> core))
-        throw std::runtime_error("arg: parse error");
-
-    while((i >> sep >> q))
-        queues.push_back(q);
-    
-    return std::make_tuple(dev, core, queues);
-}
-
-namespace test
-{
-    struct ctx
-    {
-        ctx(const char *d, const std::vector<int> & q)
-        : m_dev(d), m_queues(q), m_stop(false), m_pfq(opt::caplen, opt::offset, opt::slots), m_read()
-        {
-            std::for_each(m_queues.begin(), m_queues.end(),[&](int q) {
-                          std::cout << "setting dev: " << d << "@" << q << std::endl;       
-                    m_pfq.add_device(d, q);
-                });
-            
-            m_pfq.load_balance(opt::enable_balance);
- 
-            m_pfq.toggle_time_stamp(false);
-            
-            m_pfq.enable();
-
-            std::cout << "cxt: queue_slots: " << m_pfq.slots() << " pfq_id:" << m_pfq.id() << std::endl;
-        }
-        
-        ctx(const ctx &) = delete;
-        ctx& operator=(const ctx &) = delete;
-
-        ctx(ctx && other)
-        : m_dev(other.m_dev), m_queues(other.m_queues), m_stop(other.m_stop.load()), 
-          m_pfq(std::move(other.m_pfq)), m_read()
-        {
-        }
-
-        ctx& operator=(ctx &&other)
-        {
-            m_dev = other.m_dev;
-            m_queues = other.m_queues;
-            m_stop.store(other.m_stop.load());
-            m_pfq = std::move(other.m_pfq);
-
-            other.m_pfq = pfq();
-            return *this;
-        }
-
-        void operator()() 
-        {
-            for(;;)
-            {
-                auto many = m_pfq.read(opt::sleep_microseconds);
-
-                m_read += many.size();
-
-                m_batch = std::max(m_batch, many.size());
-
-                if (m_stop.load(std::memory_order_relaxed))
-                    return;
-            }
-        }
-
-        void stop()
-        {
-            m_stop.store(true, std::memory_order_release);
-        }
-
-        pfq_stats
-        stats() const
-        {
-            return m_pfq.stats();
-        }
-
-        unsigned long long 
-        read() const
-        {
-            return m_read;
-        }
-
-        size_t 
-        batch() const
-        {
-            return m_batch;
-        }
-
-    private:
-        const char *m_dev;
-        std::vector<int> m_queues;
-
-        std::atomic_bool m_stop;
-        
-        pfq m_pfq;        
-
-        unsigned long long m_read;
-        size_t m_batch;
-
-    } __attribute__((aligned(128)));
-}
-
-
 unsigned int hardware_concurrency()
 {
     auto proc = []() {
@@ -200,10 +75,8 @@ try
     if (argc < 2)
         usage(argv[0]);
 
-    std::vector<std::thread> vt;
-    std::vector<test::ctx> ctx;
-
-    std::vector<binding_type> vbinding;
+    capture_options options;
+    std::vector<capture_binding> vbinding;
 
     // load vbinding vector:
     for(int i = 1; i < argc; ++i)
@@ -211,7 +84,7 @@ try
         if ( strcmp(argv[i], "-b") == 0 ||
              strcmp(argv[i], "--balance") == 0) {
             std::cout << "Balancing: ON" << std::endl;
-            opt::enable_balance = true;
+            options.balance = true;
             continue;
         }
 
@@ -223,7 +96,7 @@ try
                 throw std::runtime_error("caplen missing");
             }
 
-            opt::caplen = std::atoi(argv[i]);
+            options.caplen = std::atoi(argv[i]);
             continue;
         }
 
@@ -235,7 +108,7 @@ try
                 throw std::runtime_error("offset missing");
             }
 
-            opt::offset = std::atoi(argv[i]);
+            options.offset = std::atoi(argv[i]);
             continue;
         }
 
@@ -247,7 +120,7 @@ try
                 throw std::runtime_error("slots missing");
             }
 
-            opt::slots = std::atoi(argv[i]);
+            options.slots = std::atoi(argv[i]);
             continue;
         }
 
@@ -255,40 +128,42 @@ try
              strcmp(argv[i], "--help") == 0)
             usage(argv[0]);
 
-        vbinding.push_back(binding_parser(argv[i]));
+        vbinding.push_back(make_binding(argv[i]));
     }
     
-    std::cout << "Caplen: " << opt::caplen << std::endl;
-    std::cout << "Slots : " << opt::slots << std::endl;
+    std::cout << "Caplen: " << options.caplen << std::endl;
+    std::cout << "Slots : " << options.slots << std::endl;
+
+    options.timeout = 30000 * vbinding.size();
+    std::cout << "poll timeout " << options.timeout << " usec" << std::endl;
 
-    // create threads' context:
-    //
-    for(unsigned int i = 0; i < vbinding.size(); ++i)
+    for(auto const &b : vbinding)
     {
-        std::cout << "pushing a context: " << std::get<0>(vbinding[i]) << ' ' << std::get<1>(vbinding[i]) << std::endl;
-        ctx.push_back(test::ctx(std::get<0>(vbinding[i]).c_str(), std::get<2>(vbinding[i])));        
+        std::cout << "thread on core " << b.core << " -> " << b.dev << " queues [";
+        std::copy(b.queues.begin(), b.queues.end(), std::ostream_iterator<int>(std::cout, " "));
+        std::cout << "]\n";
     }
 
-    opt::sleep_microseconds = 30000 * ctx.size();
-    std::cout << "poll timeout " << opt::sleep_microseconds << " usec" << std::endl;
+    // packets are only counted:
+    
+    capture_engine engine(vbinding, [](size_t, queue &) {}, options);
 
-    // create threads:
+    engine.start();
 
-    int i = 0;
-    std::for_each(vbinding.begin(), vbinding.end(), [&](const binding_type &b) {
-                  std::thread t(std::ref(ctx[i++]));
-                  std::cout << "thread on core " << std::get<1>(b) << " -> queues [";
+    unsigned long long sum, old = 0;
+    pfq_stats sum_stats, old_stats = {0,0,0,0};
 
-                  std::copy(std::get<2>(b).begin(), std::get<2>(b).end(),
-                            std::ostream_iterator<int>(std::cout, " "));
-                  std::cout << "]\n";
+    // offered load, if pfq-gen is running on this host:
 
-                  extra::set_affinity(t, std::get<1>(b));
-                  vt.push_back(std::move(t));
-                  });
+    const gen::offered_load *load = gen::attach();
+    uint64_t offered_old = 0, offered_base = 0, capture_base = 0;
 
-    unsigned long long sum, old = 0;
-    pfq_stats sum_stats, old_stats = {0,0,0};
+    auto load_reset = [&]() {
+        offered_old = offered_base = load->packets;
+        capture_base = engine.counters().packets;
+    };
+    if (load)
+        load_reset();
 
     std::cout << "----------- capture started ------------\n";
 
@@ -297,53 +172,71 @@ try
     {
         std::this_thread::sleep_for(std::chrono::seconds(1));
         
-        sum = 0;
-        sum_stats = {0,0,0};
+        sum = engine.counters().packets;
+        sum_stats = engine.stats();
 
-        std::for_each(ctx.begin(), ctx.end(), [&](const test::ctx &c) {
-                        sum += c.read();
-                        sum_stats += c.stats();
-                      });
-    
-        std::cout << "recv: ";
-        std::for_each(ctx.begin(), ctx.end(), [&](const test::ctx &c) {
-            std::cout << c.stats().recv << ' ';
-        });
-        std::cout << " -> " << sum_stats.recv << std::endl;
-
-        std::cout << "lost: ";
-        std::for_each(ctx.begin(), ctx.end(), [&](const test::ctx &c) {
-            std::cout << c.stats().lost << ' ';
-        });
-        std::cout << " -> " << sum_stats.lost << std::endl;
-
-        std::cout << "drop: ";
-        std::for_each(ctx.begin(), ctx.end(), [&](const test::ctx &c) {
-            std::cout << c.stats().drop << ' ';
-        });
-        std::cout << " -> " << sum_stats.drop << std::endl;
+        auto print = [&](const char *name, std::function<unsigned long(size_t)> field, unsigned long total) {
+            std::cout << name << ": ";
+            for(size_t n = 0; n < engine.size(); ++n)
+                std::cout << field(n) << ' ';
+            std::cout << " -> " << total << std::endl;
+        };
+
+        print("recv", [&](size_t n) { return engine.stats(n).recv; }, sum_stats.recv);
+        print("lost", [&](size_t n) { return engine.stats(n).lost; }, sum_stats.lost);
+        print("drop", [&](size_t n) { return engine.stats(n).drop; }, sum_stats.drop);
+        print("dupl", [&](size_t n) { return engine.stats(n).dupl; }, sum_stats.dupl);
 
         std::cout << "max_batch: ";
-        std::for_each(ctx.begin(), ctx.end(), [&](const test::ctx &c) {
-            std::cout << c.batch() << ' ';
-        });
+        for(size_t n = 0; n < engine.size(); ++n)
+            std::cout << engine.counters(n).max_batch << ' ';
         std::cout << std::endl;
 
         auto end = std::chrono::system_clock::now();
 
-        // std::cout << "capture: " << 
-        //     1000000 * (static_cast<long double>(sum-old)/
-        //     static_cast<long double>(static_cast<std::chrono::microseconds>(end-begin).count())) << " pkt/sec"  << std::endl;   
-        
         std::cout << "capture: " << vt100::BOLD << (sum-old) << vt100::RESET << " pkt/sec" << std::endl; 
 
+        if (!load && (load = gen::attach()))
+            load_reset();
+        else if (load && !gen::alive(load))
+        {
+            /* a generator started since publishes a new segment */
+            auto fresh = gen::attach();
+            if (fresh && gen::alive(fresh)) {
+                gen::detach(load);
+                load = fresh;
+                load_reset();
+            }
+            else if (fresh)
+                gen::detach(fresh);
+        }
+
+        if (load)
+        {
+            uint64_t offered = load->packets;
+            if (offered < offered_old)  // pfq-gen restarted
+                load_reset(), offered = load->packets;
+
+            uint64_t tot_offered = offered - offered_base, tot_capture = sum - capture_base;
+
+            std::cout << "offered: " << (offered - offered_old) << " pkt/sec on " << load->ifname 
+                      << (gen::alive(load) ? "" : " (stopped)") << ", loss: " 
+                      << (tot_offered > tot_capture ? tot_offered - tot_capture : 0) << " of " << tot_offered 
+                      << " (" << std::fixed << std::setprecision(3) 
+                      << (tot_offered > tot_capture ? 100.0 * (tot_offered - tot_capture) / tot_offered : 0.0) << "%)" 
+                      << std::defaultfloat << std::endl;
+
+            offered_old = offered;
+        }
+
         old = sum, begin = end;
         old_stats = sum_stats;
     }
 
-    std::for_each(ctx.begin(), ctx.end(), std::mem_fn(&test::ctx::stop));
-    std::for_each(vt.begin(), vt.end(), std::mem_fn(&std::thread::join));
+    if (load)
+        gen::detach(load);
 
+    engine.stop();
     return 0;
 }
 catch(std::exception &e)
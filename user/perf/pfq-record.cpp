@@ -0,0 +1,145 @@
+/***************************************************************
+ *                                                
+ * (C) 2011 - Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *            Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ ****************************************************************/
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <atomic>
+
+#include <pfq.hpp>
+#include <pfq-record.hpp>
+
+
+using namespace net;
+
+namespace opt {
+
+    size_t caplen = 1514;
+    size_t slots  = 131072;
+    std::string file;
+}
+
+static std::atomic_bool stop(false);
+
+void usage(const char *name)
+{
+    throw std::runtime_error(std::string("usage: ")
+        .append(name)
+        .append(" [-h|--help] [-c caplen] [-s slots] [-p|--pcap] [-C size(MB)] [-G seconds] [--no-direct] -w file dev[:queue,queue...]..."));
+}
+
+
+int
+main(int argc, char *argv[])
+try
+{
+    if (argc < 2)
+        usage(argv[0]);
+
+    pcap_options options;
+    std::vector<std::string> devs;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        auto next = [&]() -> const char * {
+            if (++i == argc)
+                usage(argv[0]);
+            return argv[i];
+        };
+
+        if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--caplen") == 0) {
+            opt::caplen = std::atoi(next());
+            continue;
+        }
+        if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--slots") == 0) {
+            opt::slots = std::atoi(next());
+            continue;
+        }
+        if (strcmp(argv[i], "-w") == 0) {
+            opt::file = next();
+            continue;
+        }
+        if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--pcap") == 0) {
+            options.format = pcap_format::pcap;
+            continue;
+        }
+        if (strcmp(argv[i], "-C") == 0) {
+            options.rotate_size = std::strtoull(next(), nullptr, 10) << 20;
+            continue;
+        }
+        if (strcmp(argv[i], "-G") == 0) {
+            options.rotate_time = std::atoi(next());
+            continue;
+        }
+        if (strcmp(argv[i], "--no-direct") == 0) {
+            options.direct = false;
+            continue;
+        }
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+            usage(argv[0]);
+
+        devs.push_back(argv[i]);
+    }
+
+    if (opt::file.empty() || devs.empty())
+        usage(argv[0]);
+
+    options.snaplen = opt::caplen;
+
+    pfq q(opt::caplen, 0, opt::slots);
+
+    /* version 2 headers: the full ifindex (v1 keeps the low 8 bits only) */
+    q.hdr_version(2);
+
+    for(auto const &d : devs)
+    {
+        auto sc = d.find(':');
+        if (sc == std::string::npos) {
+            q.add_device(d.c_str());
+            continue;
+        }
+
+        std::string dev = d.substr(0, sc);
+        std::istringstream in(d.substr(sc + 1));
+        int queue; char sep = ',';
+        while (sep == ',' && in >> queue) {
+            q.add_device(dev.c_str(), queue);
+            in >> sep;
+        }
+    }
+
+    q.toggle_time_stamp(true);
+    q.enable();
+
+    pcap_writer writer(opt::file, options);
+
+    signal(SIGINT,  [](int) { stop.store(true); });
+    signal(SIGTERM, [](int) { stop.store(true); });
+
+    std::cout << "recording to " << opt::file << " (caplen " << opt::caplen << ")..." << std::endl;
+
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        writer.write(q.read(100000));
+    }
+
+    writer.close();
+
+    auto s = writer.stats();
+    auto k = q.stats();
+
+    std::cout << "packets: " << s.packets << ", bytes: " << s.bytes << ", files: " << s.files 
+              << ", stalls: " << s.stalls << ", lost: " << k.lost << ", drop: " << k.drop << std::endl;
+    return 0;
+}
+catch(std::exception &e)
+{
+    std::cerr << e.what() << std::endl;
+    return 1;
+}
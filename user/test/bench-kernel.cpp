@@ -0,0 +1,171 @@
+// hot paths of the module built in user space (see kstub/): the kernel
+// headers are included as they are, pf_q-priv.h (sockets, queues) is left out.
+
+#include <kstub.h>
+
+#define _PF_Q_TYPES_H_
+
+#include <sparse-counter.h>
+#include <pf_q-global.h>
+#include <pf_q-devmap.h>
+
+#include <vector>
+#include <random>
+
+#include "yats.hpp"
+
+using namespace yats;
+
+struct pfq_global_t global;
+
+
+namespace
+{
+    /* a devmap snapshot laid out as pfq_devmap_build does: devices with
+       queue tables, hashed by ifindex */
+
+    struct devmap_image
+    {
+        devmap_image(int devices, unsigned int queues)
+        {
+            unsigned int buckets = 16;
+            while (buckets < static_cast<unsigned int>(devices))
+                buckets <<= 1;
+
+            size_t devsize = sizeof(pfq_devmap_dev) + queues * sizeof(unsigned long);
+
+            mem.resize(sizeof(pfq_devmap) + buckets * sizeof(pfq_devmap_dev *) + devices * devsize);
+
+            map = reinterpret_cast<pfq_devmap *>(mem.data());
+            map->bits = __builtin_ctz(buckets);
+            map->any_queue[0] = 1UL << 63;
+
+            char *ptr = reinterpret_cast<char *>(&map->bucket[buckets]);
+
+            for(int n = 0; n < devices; n++, ptr += devsize)
+            {
+                auto dev = reinterpret_cast<pfq_devmap_dev *>(ptr);
+                dev->ifindex = n + 1;
+                dev->queues  = queues;
+                for(unsigned int q = 0; q < queues; q++)
+                    dev->queue[q] = 1UL << ((n + q) % 62);
+
+                u32 h = hash_32(dev->ifindex, map->bits);
+                dev->next = map->bucket[h];
+                map->bucket[h] = dev;
+            }
+        }
+
+        std::vector<char> mem;
+        pfq_devmap *map;
+    };
+
+
+    /* ipv4 frames as received: data points past the mac header */
+
+    struct skb_image
+    {
+        skb_image(size_t count, uint16_t proto = ETH_P_IP)
+        : frame(count * 64), skb(count)
+        {
+            std::mt19937 gen(0);
+
+            for(size_t n = 0; n < count; n++)
+            {
+                unsigned char *p = &frame[n * 64];
+
+                p[12] = proto >> 8;
+                p[13] = proto & 0xff;
+                p[14] = 0x45;
+
+                uint32_t addr[2] = { static_cast<uint32_t>(gen()), static_cast<uint32_t>(gen()) };
+                memcpy(p + 14 + 12, addr, sizeof(addr));
+
+                skb[n].head = p;
+                skb[n].data = p + ETH_HLEN;
+                skb[n].len  = 64 - ETH_HLEN;
+                skb[n].mac_header = 0;
+            }
+        }
+
+        std::vector<unsigned char> frame;
+        std::vector<sk_buff> skb;
+    };
+}
+
+
+Context(kernel)
+{
+    Test(load_balancer)
+    {
+        skb_image ip(64), arp(1, ETH_P_ARP);
+
+        const unsigned long mask = 0xf0;
+
+        for(auto &skb : ip.skb)
+        {
+            unsigned long bm = pfq_load_balancer(0xff, mask, &skb);
+
+            Assert(bm & ~mask, is_equal_to(0x0fUL));
+            Assert(__builtin_popcountl(bm & mask), is_equal_to(1));
+        }
+
+        Assert(pfq_load_balancer(0xff, mask, &arp.skb[0]), is_equal_to(0x0fUL));
+    }
+
+
+    Test(devmap_lookup)
+    {
+        devmap_image img(8, 4);
+
+        Assert(pfq_devmap_lookup(img.map, 1, 0), is_equal_to((1UL << 63) | 1UL));
+        Assert(pfq_devmap_lookup(img.map, 3, 2), is_equal_to(1UL << 4));
+        Assert(pfq_devmap_lookup(img.map, 42, 1), is_equal_to(0UL));
+        Assert(pfq_devmap_lookup(nullptr, 1, 0), is_equal_to(0UL));
+    }
+
+
+    Benchmark(sparse_counter)
+    {
+        static sparse_counter_t counter;
+
+        Measure("inc", [&] { sparse_inc(&counter); });
+        Measure("read", [&] { keep(sparse_read(&counter)); });
+    }
+
+
+    Benchmark(devmap_lookup)
+    {
+        devmap_image img(64, 16);
+
+        std::vector<std::pair<int,int>> keys(1024);
+        std::mt19937 gen(0);
+        for(auto &k : keys)
+            k = std::make_pair(static_cast<int>(gen() % 80), static_cast<int>(gen() % 16));
+
+        size_t n = 0;
+        Measure([&] {
+            auto &k = keys[n++ & 1023];
+            keep(pfq_devmap_lookup(img.map, k.first, k.second));
+        });
+
+        global.devmap.map = img.map;
+
+        Measure("devmap_get", [&] {
+            auto &k = keys[n++ & 1023];
+            keep(pfq_devmap_get(k.first, k.second));
+        });
+
+        global.devmap.map = nullptr;
+    }
+
+
+    Benchmark(load_balancer)
+    {
+        skb_image ip(1024);
+
+        size_t n = 0;
+        Measure("4 sockets", [&] { keep(pfq_load_balancer(0xff, 0xf0, &ip.skb[n++ & 1023])); });
+        Measure("64 sockets", [&] { keep(pfq_load_balancer(~0UL, ~0UL, &ip.skb[n++ & 1023])); });
+    }
+}
@@ -0,0 +1,130 @@
+// hot paths of the user library over a synthetic batch (no module required):
+// benchmarks of bench-kernel.cpp are linked in the same suite.
+
+#include <pfq.hpp>
+#include <pfq-decode.hpp>
+
+#include "yats.hpp"
+
+using namespace yats;
+using namespace net;
+
+namespace
+{
+    /* a batch of committed udp frames, larger than the L2 cache */
+
+    struct batch_image
+    {
+        batch_image(size_t slots, size_t caplen, int version)
+        : size(slot_size(caplen, version)), mem(slots * size)
+        {
+            for(size_t n = 0; n < slots; n++)
+            {
+                char *slot = &mem[n * size];
+                char *p = slot + hdr_size(version);
+
+                const uint8_t frame[] = { 0,1,2,3,4,5, 6,7,8,9,10,11, 0x08,0x00,
+                                          0x45,0,0,28, 0,0,0,0, 64,17,0,0, 10,0,0,1, 10,0,0,2, 0,53,0,53, 0,8,0,0 };
+                memcpy(p, frame, std::min(sizeof(frame), caplen));
+
+                if (version == 2) {
+                    auto h = reinterpret_cast<pfq_hdr_v2 *>(slot);
+                    h->caplen = h->len = caplen;
+                    h->l3_off = 14;
+                    h->l4_off = 34;
+                    h->flags  = Q_HDR_F_IPV4;
+                    h->commit = 1;
+                }
+                else {
+                    auto h = reinterpret_cast<pfq_hdr *>(slot);
+                    h->caplen = h->len = caplen;
+                    h->commit = 1;
+                }
+            }
+        }
+
+        queue
+        many(int version) 
+        {
+            return queue(mem.data(), size, mem.size() / size, version);
+        }
+
+        size_t size;
+        std::vector<char> mem;
+    };
+}
+
+
+Context(user)
+{
+    Benchmark(iterator)
+    {
+        BenchmarkRepeat(20);
+        BenchmarkItems(16384);
+
+        batch_image v1(16384, 128, 1), v2(16384, 128, 2);
+
+        auto traverse = [](const queue &many) {
+            uint64_t sum = 0;
+            for(auto it = many.begin(); it != many.end(); ++it)
+            {
+                while (!it.ready())
+                    cpu_relax();
+                sum += it.caplen() + *static_cast<const uint8_t *>(it.data());
+            }
+            keep(sum);
+        };
+
+        auto q1 = v1.many(1), q2 = v2.many(2);
+
+        Measure("v1", [&] { traverse(q1); });
+        Measure("v2", [&] { traverse(q2); });
+    }
+
+
+    Benchmark(dispatch)
+    {
+        BenchmarkRepeat(20);
+        BenchmarkItems(16384);
+
+        batch_image v1(16384, 128, 1), v2(16384, 128, 2);
+        auto q1 = v1.many(1), q2 = v2.many(2);
+
+        uint64_t sum = 0;
+
+        Measure("v1", [&] { 
+            dispatch(q1, [&](char *, const pfq_hdr *h, const char *data) { 
+                sum += h->caplen + static_cast<uint8_t>(data[23]); 
+            });
+        });
+
+        Measure("v2", [&] { 
+            dispatch(q2, [&](char *, const pfq_hdr_v2 *h, const char *data) { 
+                sum += h->caplen + static_cast<uint8_t>(data[h->l4_off + 3]); 
+            });
+        });
+
+        keep(sum);
+    }
+
+
+    Benchmark(decode)
+    {
+        BenchmarkRepeat(20);
+        BenchmarkItems(16384);
+
+        batch_image v1(16384, 128, 1);
+        auto q1 = v1.many(1);
+
+        decoded_batch out;
+
+        Measure("scalar", [&] { decode(q1, out, decode_isa::scalar); });
+        Measure("best", [&] { decode(q1, out, best_decode_isa()); });
+    }
+}
+
+
+int main()
+{
+    return yats::run();
+}
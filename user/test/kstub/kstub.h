@@ -0,0 +1,127 @@
+/***************************************************************
+ *                                                
+ * (C) 2011-12 Nicola Bonelli <nicola.bonelli@cnit.it>   
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+#ifndef _PFQ_KSTUB_H_
+#define _PFQ_KSTUB_H_ 
+
+/* the few kernel types and helpers used by the pure functions of the 
+   receive path (sparse counters, devmap lookup, load balancer), so that 
+   they can be built and measured in user space as they are. The headers 
+   under linux/ just include this one. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <linux/types.h>
+
+#ifndef __KERNEL__
+#define __KERNEL__
+#endif
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef struct { int counter; } atomic_t;
+
+#define __rcu
+#define likely(x)       __builtin_expect(!!(x),1)
+#define unlikely(x)     __builtin_expect(!!(x),0)
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define __constant_htons(x) ((__be16)((((x) & 0xff) << 8) | (((x) >> 8) & 0xff)))
+#else
+#define __constant_htons(x) ((__be16)(x))
+#endif
+
+/* list, semaphore */
+
+struct list_head { struct list_head *next, *prev; };
+struct semaphore;
+
+/* rcu: a single reader */
+
+#define rcu_read_lock()         do {} while(0)
+#define rcu_read_unlock()       do {} while(0)
+#define rcu_dereference(p)      (p)
+#define rcu_access_pointer(p)   (p)
+
+struct rcu_head { struct rcu_head *next; void (*func)(struct rcu_head *); };
+
+/* smp: the cpu is kstub_cpu */
+
+static int kstub_cpu;
+
+static inline int  get_cpu(void) { return kstub_cpu; }
+static inline void put_cpu(void) { }
+static inline int  smp_processor_id(void) { return kstub_cpu; }
+
+/* hash (as in linux/hash.h, before 4.7) */
+
+#define GOLDEN_RATIO_PRIME_32 0x9e370001UL
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+    u32 hash = val * GOLDEN_RATIO_PRIME_32;
+    return hash >> (32 - bits);
+}
+
+/* sk_buff: linear buffers only */
+
+struct net_device;
+
+struct sk_buff 
+{
+    unsigned int        len;
+    unsigned char *     head;
+    unsigned char *     data;
+    u16                 mac_header;
+    u16                 network_header;
+    __be16              protocol;
+    struct net_device * dev;
+};
+
+static inline unsigned char *skb_mac_header(const struct sk_buff *skb)
+{
+    return skb->head + skb->mac_header;
+}
+
+static inline void *__skb_header_pointer(const struct sk_buff *skb, int offset, int len, void *buffer)
+{
+    (void)buffer;
+    if ((int)skb->len - offset >= len)
+        return skb->data + offset;
+    return NULL;
+}
+
+#ifdef __cplusplus
+/* no implicit conversion from void * in C++ */
+#define skb_header_pointer(skb, offset, len, buffer) \
+    ((__typeof__(&*(buffer)))__skb_header_pointer(skb, offset, len, buffer))
+#else
+#define skb_header_pointer __skb_header_pointer
+#endif
+
+#endif /* _PFQ_KSTUB_H_ */
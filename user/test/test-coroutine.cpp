@@ -0,0 +1,159 @@
+// pfq_reactor::next_batch: C++20 coroutines (built with -std=c++20 when available)
+
+#include <pfq.hpp>
+#include <pfq-reactor.hpp>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <chrono>
+
+#include "yats.hpp"
+
+using namespace yats;
+using namespace net;
+
+#ifdef PFQ_COROUTINES
+
+namespace
+{
+    /* eager coroutine, destroyed with the task */
+
+    struct task
+    {
+        struct promise_type
+        {
+            task get_return_object() { return task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+            std::suspend_never  initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+
+        explicit task(std::coroutine_handle<promise_type> h_)
+        : h(h_)
+        {}
+
+        task(const task &) = delete;
+        task& operator=(const task &) = delete;
+
+        ~task()
+        {
+            if (h)
+                h.destroy();
+        }
+
+        bool done() const
+        {
+            return h.done();
+        }
+
+        std::coroutine_handle<promise_type> h;
+    };
+
+
+    task
+    capture(pfq_reactor &r, pfq &q, size_t &batches, size_t &packets)
+    {
+        while (packets == 0)
+        {
+            auto many = co_await r.next_batch(q);
+            batches++;
+            packets += many.size();
+        }
+    }
+
+
+    void
+    send_udp(int count)
+    {
+        int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(9);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        char msg[32] = { 0 };
+        for(int i = 0; i < count; i++)
+            ::sendto(fd, msg, sizeof(msg), 0, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+
+        ::close(fd);
+    }
+}
+
+
+Context(coroutine)
+{
+    Test(next_batch)
+    {
+        pfq_reactor r;
+        pfq x(64);
+
+        x.add_device("lo");
+        x.enable();
+
+        size_t batches = 0, packets = 0;
+
+        task t = capture(r, x, batches, packets);
+
+        // nothing captured yet: the coroutine waits on the reactor
+
+        Assert(t.done(), is_equal_to(false));
+        Assert(r.size(), is_equal_to(1UL));
+
+        Assert(r.run_once(10), is_equal_to(0));
+        Assert(batches, is_equal_to(0UL));
+
+        // resumed from the timeout path, once the queue is not empty
+
+        send_udp(8);
+
+        for(int n = 0; n < 100 && !t.done(); n++)
+            r.run_once(10);
+
+        Assert(t.done(), is_equal_to(true));
+        Assert(packets, is_greater(0UL));
+
+        // nobody waits on the socket any more: a non empty queue does not 
+        // wake the reactor up, run_once waits for the whole timeout
+
+        send_udp(8);
+
+        auto start = std::chrono::steady_clock::now();
+        Assert(r.run_once(50), is_equal_to(0));
+        Assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(40), is_true());
+    }
+
+
+    Test(close_while_waiting)
+    {
+        pfq_reactor r;
+        pfq x(64);
+
+        x.enable();
+
+        size_t batches = 0, packets = 0;
+
+        task t = capture(r, x, batches, packets);
+        Assert(t.done(), is_equal_to(false));
+
+        // the waiter is dropped with the socket, never resumed
+
+        x.close();
+        Assert(r.size(), is_equal_to(0UL));
+
+        Assert(r.run_once(10), is_equal_to(0));
+        Assert(t.done(), is_equal_to(false));
+        Assert(batches, is_equal_to(0UL));
+    }
+}
+
+#endif
+
+
+int main()
+{
+    return yats::run();
+}
@@ -81,6 +81,23 @@ main(int argc, char *argv[])
                 }
         }
 
+        /* the same, a batch at a time */
+
+        for(n = 0; n < 100; n++) {
+                const char *it;
+                struct pfq_batch b = pfq_read(p, 100000, &ok);
+                if (!ok) {
+                        printf("error: %s\n", pfq_error(p));
+                        continue;
+                }
+
+                pfq_batch_for_each(it, &b) {
+                        while (!pfq_slot_ready(&b, it))
+                                ;
+                        dispatch(NULL, pfq_slot_hdr(it), pfq_slot_data(&b, it));
+                }
+        }
+
         struct pfq_stats s = pfq_get_stats(p, &ok);
         if (!ok) {
                 printf("error: %s\n", pfq_error(p));
@@ -0,0 +1,130 @@
+// libpcap-pfq: the program is linked against the shim, not the system libpcap.
+
+#include <pcap.h>
+
+#include <thread>
+#include <chrono>
+
+#include "yats.hpp"
+
+using namespace yats;
+
+namespace
+{
+    void count(u_char *user, const struct pcap_pkthdr *, const u_char *)
+    {
+        ++*reinterpret_cast<int *>(user);
+    }
+}
+
+
+Context(libpcap_pfq)
+{
+    Test(create_close)
+    {
+        char errbuf[PCAP_ERRBUF_SIZE];
+
+        pcap_t *p = pcap_create("lo", errbuf);
+        Assert(p != nullptr, is_true());
+
+        Assert(pcap_set_snaplen(p, 128), is_equal_to(0));
+        Assert(pcap_set_buffer_size(p, 1 << 20), is_equal_to(0));
+        Assert(pcap_set_timeout(p, 10), is_equal_to(0));
+        Assert(pcap_snapshot(p), is_equal_to(128));
+
+        pcap_close(p);
+    }
+
+
+    Test(activate)
+    {
+        char errbuf[PCAP_ERRBUF_SIZE];
+
+        pcap_t *p = pcap_create("lo", errbuf);
+
+        pcap_set_snaplen(p, 262144);
+        pcap_set_promisc(p, 1);
+
+        Assert(pcap_activate(p), is_equal_to(0));
+
+        // the snaplen is capped, the queue sized on the buffer
+
+        Assert(pcap_snapshot(p), is_equal_to(65535));
+        Assert(pcap_fileno(p), is_not_equal_to(-1));
+
+        Assert(pcap_activate(p), is_equal_to(PCAP_ERROR_ACTIVATED));
+        Assert(pcap_set_snaplen(p, 64), is_equal_to(PCAP_ERROR_ACTIVATED));
+        Assert(pcap_set_buffer_size(p, 1 << 20), is_equal_to(PCAP_ERROR_ACTIVATED));
+
+        pcap_close(p);
+    }
+
+
+    Test(activate_error)
+    {
+        char errbuf[PCAP_ERRBUF_SIZE];
+
+        Assert(pcap_open_live("nonexistent0", 64, 0, 10, errbuf) == nullptr, is_true());
+        Assert(errbuf[0] != '\0', is_true());
+    }
+
+
+    Test(dispatch)
+    {
+        char errbuf[PCAP_ERRBUF_SIZE];
+
+        pcap_t *p = pcap_open_live("lo", 64, 0, 10, errbuf);
+        Assert(p != nullptr, is_true());
+
+        int n = 0;
+        Assert(pcap_dispatch(p, -1, count, reinterpret_cast<u_char *>(&n)), is_greater_equal(0));
+
+        pcap_setnonblock(p, 1, errbuf);
+        Assert(pcap_getnonblock(p, errbuf), is_equal_to(1));
+        Assert(pcap_dispatch(p, -1, count, reinterpret_cast<u_char *>(&n)), is_greater_equal(0));
+
+        struct pcap_stat s;
+        Assert(pcap_stats(p, &s), is_equal_to(0));
+
+        pcap_close(p);
+    }
+
+
+    Test(breakloop)
+    {
+        char errbuf[PCAP_ERRBUF_SIZE];
+
+        pcap_t *p = pcap_open_live("lo", 64, 0, 10, errbuf);
+        Assert(p != nullptr, is_true());
+
+        int n = 0;
+
+        // requested before the call: nothing is read
+
+        pcap_breakloop(p);
+        Assert(pcap_dispatch(p, -1, count, reinterpret_cast<u_char *>(&n)), is_equal_to(PCAP_ERROR_BREAK));
+
+        // the request is consumed
+
+        Assert(pcap_dispatch(p, -1, count, reinterpret_cast<u_char *>(&n)), is_greater_equal(0));
+
+        // an idle loop ends after the next empty batch
+
+        std::thread t([p] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            pcap_breakloop(p);
+        });
+
+        Assert(pcap_loop(p, -1, count, reinterpret_cast<u_char *>(&n)), is_equal_to(PCAP_ERROR_BREAK));
+        t.join();
+
+        pcap_close(p);
+    }
+}
+
+
+int
+main()
+{
+    return yats::run();
+}
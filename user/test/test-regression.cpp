@@ -1,4 +1,12 @@
 #include <pfq.hpp>
+#include <pfq-config.hpp>
+#include <pfq-reactor.hpp>
+#include <pfq-engine.hpp>
+#include <pfq-record.hpp>
+#include <pfq-decode.hpp>
+#include <pfq-view.hpp>
+#include <pfq-offline.hpp>
+#include <pfq-mpdb.hpp>
 
 #include "yats.hpp"
 
@@ -161,6 +169,67 @@ Context(PFQ)
     }
 
 
+    Test(dedup)
+    {
+        pfq x;
+        AssertThrow(x.dedup(10));
+        AssertThrow(x.dedup());
+
+        x.open(64);
+        Assert(x.dedup(), is_equal_to(0));
+
+        x.dedup(10);
+        Assert(x.dedup(), is_equal_to(10));
+
+        // returned as given, not rounded to jiffies
+
+        x.dedup(7);
+        Assert(x.dedup(), is_equal_to(7));
+
+        x.dedup(0);
+        Assert(x.dedup(), is_equal_to(0));
+        
+        AssertThrow(x.dedup(-1));
+    }
+
+
+    Test(socket_filter)
+    {
+        struct sock_filter drop_all[] = { { BPF_RET | BPF_K, 0, 0, 0 } };
+        struct sock_fprog prog = { 1, drop_all };
+
+        pfq x;
+        AssertThrow(x.attach_filter(prog));
+
+        x.open(64);
+        x.attach_filter(prog);
+        x.detach_filter();
+
+        AssertThrow(x.detach_filter());
+    }
+
+
+    Test(flow_table)
+    {
+        pfq x;
+        AssertThrow(x.flow_table(1024, 256, 1000));
+        
+        x.open(64);
+        AssertThrow(x.flows());
+        AssertThrow(x.flow_table(0, 256, 1000));
+        AssertThrow(x.flow_table(1000, 256, 1000));
+
+        x.flow_table(1024, 256, 1000, false);
+        
+        auto f = x.flows();
+        Assert(f.shards(), is_not_equal_to(0));
+        Assert(f.expired([](const pfq_flow &) {}), is_equal_to(0));
+        Assert(f.lost(), is_equal_to(0));
+
+        AssertThrow(x.flow_table(1024, 256, 1000));
+    }
+
+
     Test(slots)
     {
         pfq x;
@@ -192,6 +261,706 @@ Context(PFQ)
     }
 
 
+    Test(wait_policy)
+    {
+        pfq x;
+        AssertThrow(x.wait_policy(wait_policy::busy));
+        AssertThrow(x.wait_stats());
+
+        x.open(64);
+
+        Assert(x.wait_policy() == wait_policy::block, is_true());
+        AssertThrow(x.wait_policy(wait_policy::adaptive, -1));
+
+        x.wait_policy(wait_policy::adaptive, 50);
+        Assert(x.wait_policy() == wait_policy::adaptive, is_true());
+
+        x.enable();
+
+        auto t = x.read(10000);
+        Assert(t.size(), is_equal_to(0UL));
+
+        auto s = x.wait_stats();
+        Assert(s.wait_ns, is_greater_equal(10000000UL));
+        Assert(s.spins + s.blocks, is_equal_to(1UL));
+
+        x.wait_policy(wait_policy::busy);
+        x.read(1000);
+        x.read(1000);
+
+        s = x.wait_stats();
+        Assert(s.proc_ns, is_not_equal_to(0UL));
+    }
+
+
+    Test(doorbell)
+    {
+        pfq x(64);
+        x.enable();
+
+        auto q = static_cast<const pfq_queue_descr *>(x.mem_addr());
+        Assert(static_cast<int>(q->doorbell), is_equal_to(0));
+
+        Assert(x.read(10000).empty());
+
+        Assert(static_cast<int>(q->doorbell), is_equal_to(0));
+        Assert(x.wait_stats().wait_ns, is_greater_equal(10000000UL));
+    }
+
+
+    Test(reactor)
+    {
+        pfq x(64), y(64), z;
+        pfq_reactor r;
+
+        int n = 0;
+        AssertThrow(r.add(z, [&](pfq &) { n++; }));
+
+        x.enable();
+        y.enable();
+
+        r.add(x, [&](pfq &q) { q.read(0); n++; });
+        r.add(y, [&](pfq &q) { q.read(0); n++; });
+        Assert(r.size(), is_equal_to(2UL));
+
+        Assert(r.run_once(10), is_equal_to(0));
+        Assert(n, is_equal_to(0));
+
+        r.remove(y);
+        AssertThrow(r.remove(y));
+        Assert(r.size(), is_equal_to(1UL));
+
+        std::thread t([&] { r.stop(); });
+        r.run(1000);
+        t.join();
+
+        // added again: the handler is replaced
+
+        r.add(x, [&](pfq &) { n += 10; });
+        Assert(r.size(), is_equal_to(1UL));
+
+        // the entry follows the socket when moved, and goes away when closed
+
+        pfq w(std::move(x));
+        Assert(r.size(), is_equal_to(1UL));
+        AssertThrow(r.remove(x));
+
+        r.remove(w);
+        r.add(w, [&](pfq &) { n++; });
+        r.add(y, [&](pfq &) { n++; });
+        Assert(r.size(), is_equal_to(2UL));
+
+        w.close();
+        Assert(r.size(), is_equal_to(1UL));
+
+        {
+            pfq v(64);
+            v.enable();
+            r.add(v, [&](pfq &) { n++; });
+            Assert(r.size(), is_equal_to(2UL));
+        }
+
+        Assert(r.size(), is_equal_to(1UL));
+        Assert(r.run_once(10), is_equal_to(0));
+    }
+
+
+    Test(capture_engine)
+    {
+        auto b = make_binding("eth0:1:0,2,3");
+        Assert(b.dev, is_equal_to(std::string("eth0")));
+        Assert(b.core, is_equal_to(1));
+        Assert(b.queues.size(), is_equal_to(3UL));
+        Assert(make_binding("eth0:2").queues.empty());
+
+        AssertThrow(make_binding("eth0"));
+        AssertThrow(make_binding("eth0:x"));
+
+        capture_engine e({ make_binding("lo:0"), make_binding("lo:0:0") }, [](size_t, queue &) {});
+        AssertThrow(e.stats());
+
+        e.start();
+        Assert(e.size(), is_equal_to(2UL));
+        Assert(e.socket(0).is_enabled());
+        Assert(e.socket(1).is_enabled());
+        Assert(e.counters().packets, is_equal_to(0UL));
+        AssertThrow(e.start());
+
+        e.stop();
+
+        capture_engine u({ make_binding("unknown:0") }, [](size_t, queue &) {});
+        AssertThrow(u.start());
+    }
+
+
+    Test(recv_compact)
+    {
+        Assert(compact_size(60), is_equal_to(80UL));
+        Assert(compact_size(60, 2), is_equal_to(96UL));
+
+        // two records: 60 and 13 bytes captured
+        
+        std::vector<char> buf(256, 0);
+        reinterpret_cast<pfq_hdr *>(&buf[0])->caplen = 60;
+        reinterpret_cast<pfq_hdr *>(&buf[80])->caplen = 13;
+
+        compact_batch c(&buf[0], 80 + compact_size(13), 2);
+        Assert(std::distance(c.begin(), c.end()), is_equal_to(2));
+        Assert(c.begin().size(), is_equal_to(80UL));
+        Assert(static_cast<const char *>(c.begin().data()), is_equal_to(static_cast<const char *>(&buf[sizeof(pfq_hdr)])));
+
+        pfq x(64);
+        std::vector<char> out(4096);
+
+        AssertThrow(x.recv_compact(mutable_buffer(&out[0], out.size()), 1000));
+
+        x.enable();
+
+        auto b = x.recv_compact(mutable_buffer(&out[0], out.size()), 1000);
+        Assert(b.empty());
+        Assert(b.bytes(), is_equal_to(0UL));
+
+        // the pending batch does not survive the queue
+
+        x.disable();
+        AssertThrow(x.recv_compact(mutable_buffer(&out[0], out.size()), 1000));
+    }
+
+
+    Test(pcap_writer)
+    {
+        pcap_options opt;
+        opt.block_size = 1000;
+        AssertThrow(pcap_writer("/tmp/test-pfq.pcapng", opt));
+
+        opt.block_size = 4096;
+        opt.rotate_size = 16384;
+
+        char pkt[128] = { 0 };
+
+        pcap_writer w("/tmp/test-pfq.pcapng", opt);
+        for(int i = 0; i < 1000; i++)
+            w.write(pkt, sizeof(pkt), 1500, i * 1000ULL, 1, 0, false);
+        w.close();
+
+        auto s = w.stats();
+        Assert(s.packets, is_equal_to(1000UL));
+        Assert(s.files, is_greater(1UL));
+        Assert(s.bytes, is_greater(1000UL * sizeof(pkt)));
+
+        for(unsigned int n = 0; n < s.files; n++)
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "/tmp/test-pfq.%04u.pcapng", n);
+            Assert(::unlink(name), is_equal_to(0));
+        }
+
+        /* read back: section header, one interface block per device (an 
+           ifindex beyond 8 bits too), the packets with their options */
+
+        char a[60], b[13];
+        for(size_t n = 0; n < sizeof(a); n++) a[n] = static_cast<char>(n);
+        for(size_t n = 0; n < sizeof(b); n++) b[n] = static_cast<char>(0xa0 + n);
+
+        {
+            pcap_writer r("/tmp/test-pfq-read.pcapng");
+            r.write(a, sizeof(a), sizeof(a), 1000000000123ULL, 1, 2, false);
+            r.write(b, sizeof(b), 1500, 7ULL, 70000, 0, true);
+            r.write(b, sizeof(b), sizeof(b), 8ULL, 1, 1, false);
+        }
+
+        std::vector<char> file;
+        {
+            FILE *f = fopen("/tmp/test-pfq-read.pcapng", "rb");
+            Assert(f != nullptr, is_true());
+            char buf[4096]; size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+                file.insert(file.end(), buf, buf + n);
+            fclose(f);
+        }
+        Assert(::unlink("/tmp/test-pfq-read.pcapng"), is_equal_to(0));
+
+        std::vector<std::vector<uint32_t>> blocks;
+        for(size_t off = 0; off + 8 <= file.size(); )
+        {
+            uint32_t len;
+            memcpy(&len, &file[off + 4], 4);
+            Assert(len % 4, is_equal_to(0U));
+            Assert(off + len <= file.size(), is_true());
+            blocks.emplace_back(len / 4);
+            memcpy(blocks.back().data(), &file[off], len);
+            Assert(blocks.back().back(), is_equal_to(len));
+            off += len;
+        }
+
+        Assert(blocks.size(), is_equal_to(6UL));
+        Assert(blocks[0][0], is_equal_to(0x0a0d0d0aU));
+        Assert(blocks[0][2], is_equal_to(0x1a2b3c4dU));
+
+        Assert(blocks[1][0], is_equal_to(1U));
+        Assert(blocks[3][0], is_equal_to(1U));
+        Assert(std::string(reinterpret_cast<const char *>(&blocks[3][5]), blocks[3][4] >> 16), is_equal_to(std::string("ifindex70000")));
+
+        auto epb = [&](const std::vector<uint32_t> &blk, uint32_t iface, uint64_t ts, const char *data, uint32_t caplen, uint32_t len, uint32_t flags, uint32_t queue)
+        {
+            Assert(blk[0], is_equal_to(6U));
+            Assert(blk[2], is_equal_to(iface));
+            Assert((static_cast<uint64_t>(blk[3]) << 32) | blk[4], is_equal_to(ts));
+            Assert(blk[5], is_equal_to(caplen));
+            Assert(blk[6], is_equal_to(len));
+            Assert(memcmp(&blk[7], data, caplen), is_equal_to(0));
+
+            size_t o = 7 + (caplen + 3) / 4;
+            Assert(blk[o],     is_equal_to(2U | (4U << 16)));
+            Assert(blk[o + 1], is_equal_to(flags));
+            Assert(blk[o + 2], is_equal_to(6U | (4U << 16)));
+            Assert(blk[o + 3], is_equal_to(queue));
+        };
+
+        epb(blocks[2], 0, 1000000000123ULL, a, sizeof(a), sizeof(a), 1, 2);
+        epb(blocks[4], 1, 7, b, sizeof(b), 1500, 2, 0);
+        epb(blocks[5], 0, 8, b, sizeof(b), sizeof(b), 1, 1);
+    }
+
+
+    Test(offline)
+    {
+        /* a pcap image: 10 udp frames, 20 msec apart */
+
+        std::vector<char> img;
+        auto put = [&](uint32_t x) { img.insert(img.end(), reinterpret_cast<char *>(&x), reinterpret_cast<char *>(&x) + 4); };
+
+        put(0xa1b2c3d4); put(2 | (4 << 16)); put(0); put(0); put(65535); put(1);
+
+        for(uint32_t i = 0; i < 10; i++)
+        {
+            const uint8_t frame[] = { 0,1,2,3,4,5, 6,7,8,9,10,11, 0x08,0x00,
+                                      0x45,0,0,28, 0,0,0,0, 64,17,0,0, 10,0,0,1, 10,0,0,2, 0,53,0,static_cast<uint8_t>(i), 0,8,0,0 };
+            put(100); put(i * 20000); put(sizeof(frame)); put(sizeof(frame) + 10);
+            img.insert(img.end(), frame, frame + sizeof(frame));
+        }
+
+        offline_options opt;
+        opt.batch = 4;
+
+        pfq_offline x(img.data(), img.size(), opt);
+        AssertThrow(x.read());
+
+        x.enable();
+        Assert(x.read().size(), is_equal_to(4UL));
+        Assert(x.read().size(), is_equal_to(4UL));
+
+        auto many = x.read();
+        Assert(many.size(), is_equal_to(2UL));
+        Assert(many.begin().len(), is_equal_to(52U));
+        Assert(many.begin().tstamp(), is_equal_to(100 * 1000000000ULL + 8 * 20000000ULL));
+
+        Assert(x.read().empty(), is_true());
+        Assert(x.eof(), is_true());
+        Assert(x.stats().recv, is_equal_to(10UL));
+
+        /* header version 2 and dispatch, looping over the file */
+
+        opt.hdr_version = 2;
+        opt.loop = true;
+        opt.caplen = 40;
+
+        pfq_offline y(img.data(), img.size(), opt);
+        y.enable();
+
+        int ports = 0;
+        for(int n = 0; n < 5; n++)
+            y.dispatch([&](char *, const pfq_hdr_v2 *h, const char *data) { 
+                Assert(h->l4_off, is_equal_to(34));
+                Assert(h->flags, is_equal_to(Q_HDR_F_IPV4 | Q_HDR_F_TRUNC));
+                ports += static_cast<uint8_t>(data[h->l4_off + 3]); 
+            });
+
+        Assert(ports, is_equal_to(2 * 45));
+        AssertThrow(y.dispatch([](char *, const pfq_hdr *, const char *) {}));
+
+        /* pacing: 180 msec of traffic */
+
+        opt.loop = false;
+        opt.pace = true;
+        opt.speed = 2.0;
+
+        pfq_offline z(img.data(), img.size(), opt);
+        z.enable();
+
+        auto start = std::chrono::steady_clock::now();
+        size_t count = 0;
+        while (!z.eof())
+            count += z.read().size();
+
+        Assert(count, is_equal_to(10UL));
+        Assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(90), is_true());
+
+        /* pcapng, from pcap_writer */
+
+        {
+            pcap_writer w("/tmp/test-pfq-offline.pcapng");
+            w.write(img.data() + 24 + 16, 42, 52, 5000000001ULL, 1, 3, true);
+        }
+
+        pfq_offline ng("/tmp/test-pfq-offline.pcapng");
+        ng.enable();
+
+        auto one = ng.read();
+        Assert(one.size(), is_equal_to(1UL));
+        Assert(one.begin().tstamp(), is_equal_to(5000000001ULL));
+        Assert(one.begin().hw_queue(), is_equal_to(3));
+        Assert(one.begin().egress(), is_true());
+        Assert(ng.read().empty(), is_true());
+
+        Assert(::unlink("/tmp/test-pfq-offline.pcapng"), is_equal_to(0));
+        AssertThrow(pfq_offline("/tmp/test-pfq-offline.pcapng"));
+
+        /* malformed pcapng: a caplen that wraps when aligned, an option 
+           longer than its block */
+
+        std::vector<char> bad;
+        auto put_bad = [&](uint32_t x) { bad.insert(bad.end(), reinterpret_cast<char *>(&x), reinterpret_cast<char *>(&x) + 4); };
+
+        put_bad(0x0a0d0d0a); put_bad(28); put_bad(0x1a2b3c4d); put_bad(1); put_bad(0xffffffff); put_bad(0xffffffff); put_bad(28);
+        put_bad(1); put_bad(20); put_bad(1); put_bad(65535); put_bad(20);
+        put_bad(6); put_bad(32); put_bad(0); put_bad(0); put_bad(0); put_bad(0xfffffffd); put_bad(60); put_bad(32);
+
+        pfq_offline wrap(bad.data(), bad.size());
+        wrap.enable();
+        Assert(wrap.read().empty(), is_true());
+
+        bad.resize(bad.size() - 32);
+        put_bad(6); put_bad(44); put_bad(0); put_bad(0); put_bad(0); put_bad(4); put_bad(60); put_bad(0x01020304);
+        put_bad(2 | (0xfff0 << 16)); put_bad(2); put_bad(44);
+
+        pfq_offline opt_len(bad.data(), bad.size());
+        opt_len.enable();
+        auto pkt = opt_len.read();
+        Assert(pkt.size(), is_equal_to(1UL));
+        Assert(pkt.begin().caplen(), is_equal_to(4U));
+        Assert(pkt.begin().egress(), is_equal_to(false));
+    }
+
+
+    Test(mpdb)
+    {
+        AssertThrow(mpdb_queue(64, 0));
+        AssertThrow(mpdb_queue(64, 16, 3));
+
+        /* single thread: the queue fills, the swap restarts the producers */
+
+        mpdb_queue q(64, 4);
+        char pkt[100] = { 1, 2, 3 };
+
+        for(int n = 0; n < 4; n++)
+            Assert(q.enqueue(pkt, 100), is_true());
+        Assert(q.enqueue(pkt, 100), is_false());
+        Assert(q.descr()->disabled == 1, is_true());
+
+        auto many = q.read(0);
+        Assert(many.size(), is_equal_to(4UL));
+        Assert(many.begin().ready(), is_true());
+        Assert(many.begin().caplen(), is_equal_to(64U));
+        Assert(many.begin().len(), is_equal_to(100U));
+        Assert(q.descr()->disabled == 0, is_true());
+
+        Assert(q.enqueue(pkt, 10), is_true());
+        Assert(q.read(0).size(), is_equal_to(1UL));
+        Assert(q.read(0).empty(), is_true());
+
+        /* the first slot: right after the descriptor with v1, a cache line with v2 */
+
+        mpdb_queue q1(64, 4, 1), q2(64, 4, 2);
+
+        Assert(static_cast<const char *>(q1.read(0).data()) - reinterpret_cast<const char *>(q1.descr()), is_equal_to(16L));
+        Assert(static_cast<const char *>(q2.read(0).data()) - reinterpret_cast<const char *>(q2.descr()), is_equal_to(64L));
+
+        /* the timestamp reads back the same from either header version */
+
+        Assert(q1.enqueue(pkt, 10, 5000000123ULL), is_true());
+        Assert(q2.enqueue(pkt, 10, 5000000123ULL), is_true());
+        Assert(q1.read(0).begin().tstamp(), is_equal_to(5000000123ULL));
+        Assert(q2.read(0).begin().tstamp(), is_equal_to(5000000123ULL));
+
+        /* after a read, the buffer the producers start over on has every 
+           commit flag cleared (v2: the slots start a cache line in) */
+
+        for(int round = 0; round < 3; round++)
+        {
+            for(int n = 0; n < 4; n++)
+                Assert(q2.enqueue(pkt, 10), is_true());
+
+            auto released = q2.read(0);
+            Assert(released.size(), is_equal_to(4UL));
+
+            const char *base = reinterpret_cast<const char *>(q2.descr()) + Q_QUEUE_DESCR_SIZE(2);
+            const char *next = static_cast<const char *>(released.data()) == base ? base + 4 * q2.slot_size() : base;
+
+            for(int n = 0; n < 4; n++)
+                Assert(static_cast<int>(reinterpret_cast<const pfq_hdr_v2 *>(next + n * q2.slot_size())->commit), is_equal_to(0));
+        }
+
+        /* producers against the consumer: per-producer order, no packet lost
+           without the producer knowing (v2, small queue: many swaps) */
+
+        mpdb_queue mq(32, 64, 2);
+
+        const uint32_t producers = 3, count = 100000;
+        uint64_t sent[producers] = { 0 };
+        std::atomic<uint32_t> finished(0);
+        std::vector<std::thread> ths;
+
+        for(uint32_t id = 0; id < producers; id++)
+            ths.emplace_back([&, id]() {
+                for(uint32_t seq = 0; seq < count; seq++)
+                {
+                    uint32_t p[2] = { id, seq };
+                    if (mq.enqueue(p, sizeof(p)))
+                        sent[id]++;
+                }
+                finished++;
+            });
+
+        uint64_t recv[producers] = { 0 }, next[producers] = { 0 };
+        bool order = true;
+
+        auto consume = [&](long int usec) {
+            auto b = mq.read(usec);
+            for(auto it = b.begin(); it != b.end(); ++it)
+            {
+                while (!it.ready())
+                    cpu_relax();
+
+                auto p = static_cast<const uint32_t *>(it.data());
+                if (p[0] >= producers || p[1] < next[p[0]]) {
+                    order = false;
+                    continue;
+                }
+                next[p[0]] = p[1] + 1;
+                recv[p[0]]++;
+            }
+            return b.size();
+        };
+
+        while (finished < producers)
+            consume(1000);
+
+        for(auto &t : ths)
+            t.join();
+
+        while (consume(0) || consume(0))
+        { }
+
+        Assert(order, is_true());
+        for(uint32_t id = 0; id < producers; id++)
+            Assert(recv[id], is_equal_to(sent[id]));
+    }
+
+
+    Test(hdr_version)
+    {
+        pfq x;
+        AssertThrow(x.hdr_version(2));
+        AssertThrow(x.hdr_version());
+
+        x.open(64);
+
+        Assert(x.hdr_version(), is_equal_to(1));
+        Assert(sizeof(pfq_hdr_v2), is_equal_to(32));
+
+        x.hdr_version(2);
+        Assert(x.hdr_version(), is_equal_to(2));
+        Assert(x.slot_size(), is_equal_to(128));
+        
+        AssertThrow(x.hdr_version(3));
+
+        x.enable();
+
+        AssertThrow(x.hdr_version(1));
+        AssertThrow(x.dispatch([](char *, const pfq_hdr *, const char *) {}));
+
+        x.disable();
+
+        x.hdr_version(1);
+        Assert(x.slot_size(), is_equal_to(80));
+    }
+
+
+    Test(dispatch)
+    {
+        std::vector<char> mem(8 * net::slot_size(64));
+        for(int i = 0; i < 8; i++)
+        {
+            auto h = reinterpret_cast<pfq_hdr *>(&mem[i * net::slot_size(64)]);
+            h->caplen = i;
+            h->commit = 1;
+        }
+
+        net::queue many(mem.data(), net::slot_size(64), 8);
+
+        int sum = 0;
+        Assert(net::dispatch(many, [&](char *, const pfq_hdr *h, const char *) { sum += h->caplen; }), is_equal_to(8UL));
+        Assert(sum, is_equal_to(28));
+        Assert(net::dispatch<0>(many, [&](char *, const pfq_hdr *h, const char *) { sum -= h->caplen; }), is_equal_to(8UL));
+        Assert(sum, is_equal_to(0));
+
+        /* the callback header must match the batch */
+        AssertThrow(net::dispatch(many, [](char *, const pfq_hdr_v2 *, const char *) {}));
+
+        pfq x(64);
+        x.enable();
+
+        size_t batches = 0;
+        Assert(x.dispatch([&](const net::queue &) { batches++; }, 1000), is_equal_to(0UL));
+        Assert(batches, is_equal_to(0UL));
+        Assert(x.dispatch<8>([](char *, const pfq_hdr *, const char *) {}, 1000), is_equal_to(0UL));
+    }
+
+
+    Test(decode)
+    {
+        auto frame = [](std::vector<uint8_t> bytes, std::vector<uint8_t> &&l3) {
+            bytes.insert(bytes.end(), l3.begin(), l3.end());
+            bytes.resize(std::max<size_t>(bytes.size(), 60));
+            return bytes;
+        };
+
+        const std::vector<uint8_t> mac(12, 0x02);
+        auto eth = [&](std::initializer_list<uint8_t> tags_and_type) {
+            std::vector<uint8_t> h(mac);
+            h.insert(h.end(), tags_and_type);
+            return h;
+        };
+
+        std::vector<uint8_t> tcp4 = { 0x45, 0, 0, 40, 0, 0, 0x40, 0, 64, 6, 0, 0, 10, 0, 0, 1, 10, 0, 0, 2, 0x30, 0x39, 0, 80 };
+        std::vector<uint8_t> udp4 = { 0x45, 0, 0, 28, 0, 0, 0, 0, 64, 17, 0, 0, 192, 168, 1, 1, 192, 168, 1, 2, 0, 53, 0x13, 0x88 };
+        std::vector<uint8_t> frg4 = { 0x45, 0, 0, 28, 0, 0, 0, 10, 64, 17, 0, 0, 192, 168, 1, 1, 192, 168, 1, 2, 0, 53, 0x13, 0x88 };
+        std::vector<uint8_t> udp6(40 + 8 + 4, 0);
+        udp6[0] = 0x60; udp6[6] = 0 /* hop-by-hop */; udp6[8] = 0x20; udp6[39] = 1; 
+        udp6[40] = 17; udp6[41] = 0; udp6[48] = 0x04; udp6[49] = 0xd2; udp6[51] = 7;
+
+        std::vector<std::vector<uint8_t>> frames = {
+            frame(eth({0x08, 0x00}), std::vector<uint8_t>(tcp4)),
+            frame(eth({0x81, 0x00, 0x00, 0x2a, 0x08, 0x00}), std::vector<uint8_t>(udp4)),
+            frame(eth({0x86, 0xdd}), std::vector<uint8_t>(udp6)),
+            frame(eth({0x08, 0x06}), std::vector<uint8_t>(28, 0)),
+            frame(eth({0x08, 0x00}), std::vector<uint8_t>(frg4)),
+            frame(eth({0x88, 0xa8, 0x00, 0x05, 0x81, 0x00, 0x00, 0x07, 0x08, 0x00}), std::vector<uint8_t>(tcp4)),
+        };
+
+        const size_t n = 27, caplen = 128;
+        std::vector<char> mem(n * net::slot_size(caplen));
+
+        for(size_t i = 0; i < n; i++)
+        {
+            auto &f = frames[i % frames.size()];
+            auto h = reinterpret_cast<pfq_hdr *>(&mem[i * net::slot_size(caplen)]);
+            h->caplen = i == n - 1 ? 30 : f.size();     // the last one is truncated in the ip header
+            h->len    = f.size();
+            h->commit = 1;
+            memcpy(h + 1, f.data(), f.size());
+        }
+
+        net::queue many(mem.data(), net::slot_size(caplen), n);
+        net::decoded_batch ref;
+        net::decode(many, ref, net::decode_isa::scalar);
+
+        Assert(ref.size(), is_equal_to(n));
+
+        Assert(ref.ethertype[0], is_equal_to(ETH_P_IP));
+        Assert(ref.valid(0), is_true());
+        Assert(ref.proto[0] == IPPROTO_TCP, is_true());
+        Assert(ref.sport[0], is_equal_to(12345));
+        Assert(ref.dport[0], is_equal_to(80));
+        Assert(ref.l4_off[0], is_equal_to(34));
+        Assert(ref.src4[0], is_equal_to(inet_addr("10.0.0.1")));
+
+        Assert(ref.vlan[1], is_equal_to(42));
+        Assert(ref.flags[1], is_equal_to(Q_HDR_F_VLAN | Q_HDR_F_IPV4));
+        Assert(ref.dport[1], is_equal_to(5000));
+
+        Assert(ref.flags[2], is_equal_to(Q_HDR_F_IPV6));
+        Assert(ref.proto[2] == IPPROTO_UDP, is_true());
+        Assert(ref.sport[2], is_equal_to(1234));
+        Assert(ref.dport[2], is_equal_to(7));
+        Assert(ref.l4_off[2], is_equal_to(14 + 40 + 8));
+        Assert(ref.dst6[2].addr[15], is_equal_to(1));
+
+        Assert(ref.ethertype[3], is_equal_to(ETH_P_ARP));
+        Assert(ref.valid(3), is_equal_to(false));
+
+        Assert(ref.valid(4), is_true());
+        Assert(ref.sport[4], is_equal_to(0));
+
+        Assert(ref.vlan[5], is_equal_to(5));
+        Assert(ref.l3_off[5], is_equal_to(22));
+        Assert(ref.dport[5], is_equal_to(80));
+
+        Assert(ref.valid(n - 1), is_equal_to(false));
+        Assert(ref.flags[n - 1], is_equal_to(Q_HDR_F_TRUNC));
+
+        /* every kernel supported by this cpu agrees with the scalar decoder */
+
+        for(auto isa : { net::decode_isa::sse4, net::decode_isa::avx2 })
+        {
+            if (isa > net::best_decode_isa())
+                continue;
+
+            net::decoded_batch out;
+            net::decode(many, out, isa);
+
+            Assert(out.ethertype == ref.ethertype, is_true());
+            Assert(out.vlan   == ref.vlan, is_true());
+            Assert(out.proto  == ref.proto, is_true());
+            Assert(out.flags  == ref.flags, is_true());
+            Assert(out.l3_off == ref.l3_off, is_true());
+            Assert(out.l4_off == ref.l4_off, is_true());
+            Assert(out.src4   == ref.src4, is_true());
+            Assert(out.dst4   == ref.dst4, is_true());
+            Assert(out.sport  == ref.sport, is_true());
+            Assert(out.dport  == ref.dport, is_true());
+            Assert(out.mask   == ref.mask, is_true());
+            Assert(memcmp(out.dst6.data(), ref.dst6.data(), n * sizeof(net::ip6_addr)), is_equal_to(0));
+        }
+    }
+
+
+    Test(view)
+    {
+        using namespace net::layer;
+
+        static_assert(view<eth, vlan, ipv4, udp>::is_static<2>(), "ipv4 offset not static");
+        static_assert(!view<eth, vlan, ipv4, udp>::is_static<3>(), "udp offset static");
+
+        const uint8_t frame[] = { 
+            0,1,2,3,4,5, 6,7,8,9,10,11, 0x81,0x00, 0x20,0x2a, 0x08,0x00,                  // eth, vlan 42 pcp 1
+            0x46,0,0,36, 0,1, 0,0, 64,17,0,0, 10,0,0,1, 10,0,0,2, 1,1,0,0,                // ipv4 with 4 bytes of options
+            0x30,0x39, 0x00,0x35, 0,12, 0,0,                                              // udp 12345 -> 53
+            0xde,0xad,0xbe,0xef };
+
+        view<eth, vlan, ipv4, udp> v(frame, sizeof(frame));
+
+        Assert(v.valid(), is_true());
+        Assert(v.get<eth>().src()[0], is_equal_to(6));
+        Assert(v.get<vlan>().id(), is_equal_to(42));
+        Assert(v.get<vlan>().pcp(), is_equal_to(1));
+        Assert(v.get<ipv4>().ihl(), is_equal_to(6));
+        Assert(v.get<ipv4>().src(), is_equal_to(inet_addr("10.0.0.1")));
+        Assert(v.offset<3>(), is_equal_to(18UL + 24));
+        Assert(v.get<3>().sport(), is_equal_to(12345));
+        Assert(v.get<udp>().dport(), is_equal_to(53));
+        Assert(v.payload_offset(), is_equal_to(sizeof(frame) - 4));
+        Assert(static_cast<uint8_t>(*v.payload()), is_equal_to(0xde));
+
+        Assert((view<eth, vlan, ipv4, udp>(frame, 40).valid()), is_equal_to(false));   // short
+        Assert((view<eth, ipv4>(frame, sizeof(frame)).valid()), is_equal_to(false));    // tagged
+        Assert((view<eth, vlan, ipv4, tcp>(frame, sizeof(frame)).valid()), is_equal_to(false));
+        Assert((view<eth, vlan, ipv6>(frame, sizeof(frame)).valid()), is_equal_to(false));
+        Assert((view<eth, vlan>(frame, sizeof(frame)).valid()), is_true());
+    }
+
+
     Test(add_device)
     {
         pfq x;
@@ -201,6 +970,11 @@ Context(PFQ)
     
         AssertThrow(x.add_device("unknown"));
         x.add_device("eth0");
+
+        x.add_device(4097);
+        x.add_device(4097, 3);
+        AssertThrow(x.add_device(1, 64));
+        AssertThrow(x.add_device(-2));
     }
     
 
@@ -212,7 +986,191 @@ Context(PFQ)
         x.open(64);
         
         AssertThrow(x.remove_device("unknown"));
-        x.remove_device("eth0");
+
+        // a binding the socket does not have
+
+        AssertThrow(x.remove_device("lo"));
+        x.add_device("lo");
+        AssertThrow(x.remove_device("lo", 0));
+        x.remove_device("lo");
+        AssertThrow(x.remove_device("lo"));
+
+        // (dev, any queue) is a binding of its own: the queues bound one by one stay
+
+        x.add_device("lo", 0);
+        x.add_device("lo", 1);
+        x.add_device("lo");
+        x.remove_device("lo");
+
+        int queues = 0, any = 0;
+        for(auto const &b : pfq_config::dump().bindings)
+        {
+            if (b.egress || !(b.mask & (1UL << x.id())))
+                continue;
+            if (b.hw_queue == pfq::any_queue)
+                any++;
+            else
+                queues++;
+        }
+
+        Assert(any, is_equal_to(0));
+        Assert(queues, is_equal_to(2));
+
+        x.remove_device("lo", 0);
+        x.remove_device("lo", 1);
+    }
+
+
+    Test(egress_device)
+    {
+        pfq x;
+        AssertThrow(x.add_egress_device("eth0"));
+
+        x.open(64);
+
+        AssertThrow(x.add_egress_device("unknown"));
+        x.add_egress_device("eth0");
+        x.add_egress_device(pfq::any_device);
+
+        x.remove_egress_device("eth0");
+        x.remove_egress_device(pfq::any_device);
+    }
+
+
+    Test(netlink_config)
+    {
+        pfq x(64), y(64);
+        
+        pfq_config()
+            .add_device(x.id(), "eth0")
+            .add_device(y.id(), "eth0", 0)
+            .add_egress_device(y.id(), pfq::any_device)
+            .load_balance(x.id())
+            .apply();
+
+        auto s = pfq_config::dump();
+
+        Assert(s.sockets & (1UL << x.id()), is_not_equal_to(0UL));
+        Assert(s.balance & (1UL << x.id()), is_not_equal_to(0UL));
+        Assert(s.balance & (1UL << y.id()), is_equal_to(0UL));
+
+        int n = 0;
+        for(auto const &b : s.bindings)
+        {
+            if (b.mask & (1UL << y.id()))
+                n++;
+        }
+        Assert(n, is_equal_to(2));
+
+        AssertThrow(pfq_config().add_device(x.id(), pfq::any_device, 64).apply());
+        AssertThrow(pfq_config().add_egress_device(x.id(), "unknown"));
+
+        // drop every binding of x and y
+        
+        pfq_config().socket(x.id()).socket(y.id()).apply();
+
+        s = pfq_config::dump();
+        for(auto const &b : s.bindings)
+        {
+            Assert(b.mask & ((1UL << x.id())|(1UL << y.id())), is_equal_to(0UL));
+        }
+        Assert(s.balance & (1UL << x.id()), is_equal_to(0UL));
+    }
+
+
+    Test(vlan)
+    {
+        pfq x;
+        AssertThrow(x.add_vlan(10));
+
+        x.open(64);
+
+        x.add_vlan(10);
+        x.add_vlan(100, 200);
+        x.add_vlan(0);
+
+        AssertThrow(x.add_vlan(4096));
+        AssertThrow(x.add_vlan(200, 100));
+
+        x.remove_vlan(100, 200);
+        x.remove_vlan(0, 4095);
+    }
+
+
+    Test(mpls_label)
+    {
+        pfq x;
+        AssertThrow(x.add_mpls_label(16));
+
+        x.open(64);
+
+        x.add_mpls_label(16);
+        x.add_mpls_label(0xfffff);
+
+        AssertThrow(x.add_mpls_label(-1));
+        AssertThrow(x.add_mpls_label(0x100000));
+
+        x.remove_mpls_label(16);
+        x.remove_mpls_label(0xfffff);
+
+        // the slots of the labels no longer subscribed are recycled
+
+        const int max_mpls = 256;   // Q_MAX_MPLS, the size of the table
+
+        for(int l = 0; l < 4 * max_mpls; l++)
+        {
+            x.add_mpls_label(l);
+            x.remove_mpls_label(l);
+        }
+
+        for(int l = 0; l < max_mpls; l++)
+            x.add_mpls_label(1000 + l);
+
+        AssertThrow(x.add_mpls_label(42));
+
+        x.remove_mpls_label(1000);
+        x.add_mpls_label(42);
+    }
+
+
+    Test(class_rule)
+    {
+        pfq x;
+        AssertThrow(x.add_class_rule(1, IPPROTO_UDP, 53));
+
+        x.open(64);
+
+        x.add_class_rule(1, IPPROTO_UDP, 53);
+        x.add_class_rule(2, IPPROTO_TCP, 80);
+        x.add_class_rule(3, Q_CLASS_ANY, 1024, 65535);
+        x.add_class_rule(4, Q_CLASS_ANY);
+
+        AssertThrow(x.add_class_rule(1, IPPROTO_UDP, 53));
+        AssertThrow(x.add_class_rule(0, IPPROTO_UDP));
+        AssertThrow(x.add_class_rule(Q_MAX_CLASS, IPPROTO_UDP));
+        AssertThrow(x.add_class_rule(5, 256));
+        AssertThrow(x.add_class_rule(5, IPPROTO_TCP, 100, 10));
+
+        x.remove_class_rule(1, IPPROTO_UDP, 53);
+        AssertThrow(x.remove_class_rule(1, IPPROTO_UDP, 53));
+    }
+
+
+    Test(class)
+    {
+        pfq x;
+        AssertThrow(x.add_class(1));
+
+        x.open(64);
+
+        x.add_class(1);
+        x.add_class(Q_CLASS_NONE);
+
+        AssertThrow(x.add_class(-1));
+        AssertThrow(x.add_class(Q_MAX_CLASS));
+
+        x.remove_class(1);
+        x.remove_class(Q_CLASS_NONE);
     }
 
 
@@ -250,6 +1208,7 @@ Context(PFQ)
         Assert(s.recv, is_equal_to(0));
         Assert(s.lost, is_equal_to(0));
         Assert(s.drop, is_equal_to(0));
+        Assert(s.dupl, is_equal_to(0));
     }
 }
 
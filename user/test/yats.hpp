@@ -31,6 +31,9 @@
 #include <vector>
 #include <memory>
 #include <map>
+#include <iomanip>
+#include <cstdint>
+#include <ctime>
 
 #ifdef __GNUC__
 #include <cxxabi.h>
@@ -259,6 +262,161 @@ namespace yats
         return cxa_demangle(typeid(t).name());
     }
     
+    ///////////////////// benchmark ///////////////////////////
+
+    /* cycle counter: the tsc on x86 (serialized by lfence), nanoseconds elsewhere */
+
+    static inline uint64_t
+    cycles()
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        uint32_t lo, hi;
+        asm volatile ("lfence; rdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+        return (static_cast<uint64_t>(hi) << 32) | lo;
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+    /* keep a value the compiler would otherwise optimize away */
+
+    template <typename T>
+    inline void
+    keep(const T &value)
+    {
+        asm volatile ("" : : "g"(&value) : "memory");
+    }
+
+    /* benchmark: the function is run in samples of the same number of iterations, 
+       calibrated after the warmup so that a sample lasts min_cycles at least. 
+       The report is in cycles per iteration (or per item): min, percentiles 
+       and max over the samples. */
+
+    struct benchmark
+    {
+        benchmark(const std::string &ctx, const std::string &name)
+        : ctx_(ctx), name_(name), repeat_(100), warmup_(1000), min_cycles_(200000), iterations_(0), items_(1)
+        {}
+
+        benchmark &
+        repeat(size_t n)
+        {
+            repeat_ = std::max<size_t>(n, 1);
+            return *this;
+        }
+
+        benchmark &
+        warmup(size_t n)
+        {
+            warmup_ = n;
+            return *this;
+        }
+
+        /* a fixed number of iterations per sample (0 = calibrated) */
+
+        benchmark &
+        iterations(size_t n)
+        {
+            iterations_ = n;
+            return *this;
+        }
+
+        /* items processed per iteration (e.g. packets of a batch): the report 
+           is per item */
+
+        benchmark &
+        items(size_t n)
+        {
+            items_ = std::max<size_t>(n, 1);
+            return *this;
+        }
+
+        template <typename Fn>
+        void
+        measure(Fn fun)
+        {
+            measure("", fun);
+        }
+
+        template <typename Fn>
+        void
+        measure(const char *label, Fn fun)
+        {
+            for(size_t i = 0; i < warmup_; i++)
+                fun();
+
+            size_t n = iterations_;
+            if (n == 0)
+            {
+                for(n = 1; n < (1UL << 30); n <<= 1)
+                {
+                    if (run(fun, n) >= min_cycles_)
+                        break;
+                }
+            }
+
+            std::vector<double> sample(repeat_);
+            for(auto &s : sample)
+                s = static_cast<double>(run(fun, n)) / (n * items_);
+
+            report(label, n, sample);
+        }
+
+    private:
+
+        template <typename Fn>
+        static uint64_t
+        run(Fn &fun, size_t n)
+        {
+            uint64_t start = cycles();
+            for(size_t i = 0; i < n; i++)
+            {
+                fun();
+                asm volatile ("" : : : "memory");   // one iteration at a time
+            }
+            return cycles() - start;
+        }
+
+        void
+        report(const char *label, size_t n, std::vector<double> &sample) const
+        {
+            std::sort(sample.begin(), sample.end());
+
+            auto pct = [&](double p) { 
+                return sample[std::min(sample.size() - 1, static_cast<size_t>(p * sample.size()))]; 
+            };
+
+            double mean = 0;
+            for(auto s : sample)
+                mean += s;
+            mean /= sample.size();
+
+            std::ostringstream out;
+            out << "Context " << ctx_ << ": Benchmark(" << name_ << ")";
+            if (*label)
+                out << " " << label;
+
+            std::cout << std::left << std::setw(56) << out.str() << std::right << std::fixed << std::setprecision(1)
+                      << " min " << std::setw(8) << sample.front()
+                      << " p50 " << std::setw(8) << pct(0.50)
+                      << " p90 " << std::setw(8) << pct(0.90)
+                      << " p99 " << std::setw(8) << pct(0.99)
+                      << " max " << std::setw(8) << sample.back()
+                      << " mean " << std::setw(8) << mean
+                      << " (cycles" << (items_ > 1 ? "/item" : "") << ", " << sample.size() << " x " << n << ")" << std::endl;
+        }
+
+        std::string ctx_;
+        std::string name_;
+        size_t      repeat_;
+        size_t      warmup_;
+        uint64_t    min_cycles_;
+        size_t      iterations_;
+        size_t      items_;
+    };
+
     struct context
     {
         typedef std::function<void()> task;
@@ -267,6 +425,7 @@ namespace yats
         std::vector<task> setup_;
         std::vector<task> teardown_;
         std::vector<std::pair<task,std::string>> task_list_;
+        std::vector<std::pair<std::function<void(benchmark &)>,std::string>> bench_list_;
         
         static std::map<std::string, context> &
         instance()
@@ -276,11 +435,11 @@ namespace yats
         }
         
         context(const std::string &n)
-        : name_(n), setup_(), teardown_(), task_list_()
+        : name_(n), setup_(), teardown_(), task_list_(), bench_list_()
         {}
     };
 
-    static int run()
+    static inline int run()
     {
         size_t tot_task = 0;
         for(auto& task : context::instance())
@@ -288,8 +447,17 @@ namespace yats
             tot_task += task.second.task_list_.size();
         }
 
+        size_t tot_bench = 0;
+        for(auto& task : context::instance())
+        {
+            tot_bench += task.second.bench_list_.size();
+        }
+
         unsigned int n = 0;
-        std::cout << "Running " << tot_task << " tests in " << context::instance().size() << " contexts." << std::endl;
+        std::cout << "Running " << tot_task << " tests";
+        if (tot_bench)
+            std::cout << " and " << tot_bench << " benchmarks";
+        std::cout << " in " << context::instance().size() << " contexts." << std::endl;
 
         // iterate over contexts:        
         for(auto& c : context::instance()) 
@@ -318,14 +486,33 @@ namespace yats
                 }
             }
             
+            // run benchmarks...
+            for(auto& b : c.second.bench_list_)
+            {
+                try
+                {
+                    benchmark bench(c.first, b.second);
+                    b.first(bench);
+                    n++;
+                }
+                catch(yats_error &e)
+                {
+                    std::cerr << e.what() << std::endl;
+                }
+                catch(std::exception &e)
+                {
+                    std::cerr << "Context " << c.first << ": Benchmark(" << b.second << ")\n -> Unexpected exception: '" << e.what() << "' error." << std::endl;
+                }
+            }
+
             // run teardown:
             std::for_each( std::begin(c.second.teardown_), 
                            std::end(c.second.teardown_), 
                            std::mem_fn(&context::task::operator()));
         }
 
-        std::cerr << tot_task - n << " tests failed." << std::endl;
-        return n == tot_task ? EXIT_SUCCESS : EXIT_FAILURE;
+        std::cerr << tot_task + tot_bench - n << " tests failed." << std::endl;
+        return n == tot_task + tot_bench ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
     struct task_register
@@ -352,6 +539,12 @@ namespace yats
                 throw yats_error("task_register");
             }
         }
+
+        task_register(void (*fun)(const char *, benchmark &), const char * ctx, const char *name)
+        {
+            auto i = context::instance().insert(std::make_pair(ctx, context(ctx)));
+            i.first->second.bench_list_.push_back(std::make_pair(std::bind(fun, name, _1), name));
+        }
     };
 
     // For use in __is_convertible_simple.
@@ -370,6 +563,12 @@ namespace yats
         enum { value = sizeof(test<T>(0)) == sizeof(__one) };
     };
 
+    static inline std::string
+    pretty_value(bool v)
+    {
+        return v ? "(true)" : "(false)";
+    }
+
     template <typename T>
     typename std::enable_if<std::is_integral<T>::value, std::string>::type
     pretty_value(const T &v)
@@ -526,6 +725,19 @@ void test_ ## name(const char *); \
 yats::task_register hook_ ## name(test_ ## name, task_register::type::test, _context_name, #name); \
 void test_ ## name(const char *_name)
 
+/* a benchmark is a test whose body measures one or more functions: 
+   Measure([&] { ... }), or Measure("label", [&] { ... }) */
+
+#define Benchmark(name) \
+void bench_ ## name(const char *, yats::benchmark &); \
+yats::task_register bench_hook_ ## name(bench_ ## name, _context_name, #name); \
+void bench_ ## name(const char *_name __attribute__((unused)), yats::benchmark &_bench)
+
+#define Measure(...)           _bench.measure(__VA_ARGS__)
+#define BenchmarkRepeat(n)     _bench.repeat(n)
+#define BenchmarkIterations(n) _bench.iterations(n)
+#define BenchmarkItems(n)      _bench.items(n)
+
 #define Setup(name) \
 void setup_ ## name(const char *); \
 yats::task_register fixture_ ## name(setup_ ## name, task_register::type::setup, _context_name); \